@@ -20,6 +20,7 @@
 
 #include "config.h"
 
+#include <errno.h>
 #include <locale.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -262,6 +263,60 @@ GLNX_DEFINE_CLEANUP_FUNCTION (void *, flatpak_local_free_write_archive, archive_
 GLNX_DEFINE_CLEANUP_FUNCTION (void *, flatpak_local_free_archive_entry, archive_entry_free)
 #define free_archive_entry __attribute__((cleanup (flatpak_local_free_archive_entry)))
 
+/* The archive is written in blocks of this size, rather than the
+ * libarchive default of 10k, to keep the number of writes down */
+#define OCI_WRITE_BLOCK_SIZE (1024 * 1024)
+
+/* Buffer size used when copying files from the repo */
+#define OCI_COPY_BUFFER_SIZE (256 * 1024)
+
+/* Writes the archive to a stream, and checksums the data as it is
+ * written so we don't have to read back the whole file afterwards */
+typedef struct
+{
+  GOutputStream *out;
+  GChecksum     *checksum;
+  GCancellable  *cancellable;
+} OciWriter;
+
+static ssize_t
+oci_writer_write (struct archive *a,
+                  void           *client_data,
+                  const void     *buff,
+                  size_t          length)
+{
+  OciWriter *writer = client_data;
+  g_autoptr(GError) local_error = NULL;
+  gsize bytes_written;
+
+  if (!g_output_stream_write_all (writer->out, buff, length, &bytes_written,
+                                  writer->cancellable, &local_error))
+    {
+      archive_set_error (a, EIO, "%s", local_error->message);
+      return -1;
+    }
+
+  g_checksum_update (writer->checksum, buff, length);
+
+  return length;
+}
+
+static int
+oci_writer_close (struct archive *a,
+                  void           *client_data)
+{
+  OciWriter *writer = client_data;
+  g_autoptr(GError) local_error = NULL;
+
+  if (!g_output_stream_close (writer->out, writer->cancellable, &local_error))
+    {
+      archive_set_error (a, EIO, "%s", local_error->message);
+      return ARCHIVE_FATAL;
+    }
+
+  return ARCHIVE_OK;
+}
+
 
 typedef struct
 {
@@ -542,7 +597,7 @@ add_file (struct archive                 *a,
           GError                        **error)
 {
   free_archive_entry struct archive_entry *entry = new_entry (a, name, opts);
-  guint8 buf[8192];
+  g_autofree guint8 *buf = g_malloc (OCI_COPY_BUFFER_SIZE);
   g_autoptr(GInputStream) file_in = NULL;
   g_autoptr(GFileInfo) file_info = NULL;
   const char *checksum;
@@ -564,7 +619,7 @@ add_file (struct archive                 *a,
   while (TRUE)
     {
       ssize_t r;
-      gssize bytes_read = g_input_stream_read (file_in, buf, sizeof (buf),
+      gssize bytes_read = g_input_stream_read (file_in, buf, OCI_COPY_BUFFER_SIZE,
                                                cancellable, error);
       if (bytes_read < 0)
         return FALSE;
@@ -749,6 +804,9 @@ build_oci (OstreeRepo *repo, GFile *file,
                "This version of flatpak is not compiled with libarchive support");
   return FALSE;
 #else
+  g_autoptr(GOutputStream) out = NULL;
+  g_autoptr(GChecksum) checksum = g_checksum_new (G_CHECKSUM_SHA256);
+  OciWriter writer = { 0, };
   free_write_archive struct archive *a = NULL;
   OstreeRepoExportArchiveOptions opts = { 0, };
   g_autoptr(GFile) root = NULL;
@@ -781,7 +839,21 @@ build_oci (OstreeRepo *repo, GFile *file,
   if (archive_write_add_filter_none (a) != ARCHIVE_OK)
     return propagate_libarchive_error (error, a);
 
-  if (archive_write_open_filename (a, gs_file_get_path_cached (file)) != ARCHIVE_OK)
+  if (archive_write_set_bytes_per_block (a, OCI_WRITE_BLOCK_SIZE) != ARCHIVE_OK ||
+      archive_write_set_bytes_in_last_block (a, 1) != ARCHIVE_OK)
+    return propagate_libarchive_error (error, a);
+
+  out = (GOutputStream *) g_file_replace (file, NULL, FALSE,
+                                          G_FILE_CREATE_REPLACE_DESTINATION,
+                                          cancellable, error);
+  if (out == NULL)
+    return FALSE;
+
+  writer.out = out;
+  writer.checksum = checksum;
+  writer.cancellable = cancellable;
+
+  if (archive_write_open (a, &writer, NULL, oci_writer_write, oci_writer_close) != ARCHIVE_OK)
     return propagate_libarchive_error (error, a);
 
   opts.timestamp_secs = ostree_commit_get_timestamp (commit_data);
@@ -873,6 +945,9 @@ build_oci (OstreeRepo *repo, GFile *file,
   if (archive_write_close (a) != ARCHIVE_OK)
     return propagate_libarchive_error (error, a);
 
+  g_print ("Wrote %s, sha256:%s\n", gs_file_get_path_cached (file),
+           g_checksum_get_string (checksum));
+
   g_print ("WARNING: the oci format produced by flatpak is experimental and unstable.\n"
            "Don't use this for anything but experiments for now\n");
 
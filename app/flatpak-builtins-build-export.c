@@ -216,6 +216,394 @@ add_file_to_mtree (GFile             *file,
   return TRUE;
 }
 
+/* Instead of ostree_repo_write_directory_to_mtree(), which reads,
+ * checksums and compresses one file at a time, we walk the tree once
+ * and write the content objects from a pool of worker threads. The
+ * mtree is only modified from the main thread.
+ *
+ * We also keep a cache in the build directory that maps each exported
+ * path to the stat data it had and its checksum. Files whose stat data
+ * is unchanged since the last export, and whose object is in the repo,
+ * are not read at all.
+ */
+
+#define EXPORT_CACHE_NAME ".flatpak-export-cache"
+#define EXPORT_CACHE_GVARIANT_FORMAT G_VARIANT_TYPE ("a{s(ss)}")
+
+#define EXPORT_QUERY_ATTRIBUTES \
+  OSTREE_GIO_FAST_QUERYINFO "," \
+  G_FILE_ATTRIBUTE_UNIX_DEVICE "," \
+  G_FILE_ATTRIBUTE_TIME_MODIFIED "," G_FILE_ATTRIBUTE_TIME_MODIFIED_USEC "," \
+  G_FILE_ATTRIBUTE_TIME_CHANGED "," G_FILE_ATTRIBUTE_TIME_CHANGED_USEC
+
+typedef struct
+{
+  OstreeMutableTree *mtree;
+  char              *name;
+  char              *path;
+  GFile             *file;
+  GFileInfo         *file_info;
+  char              *stat_key;
+  char              *checksum;
+} ExportFile;
+
+typedef struct
+{
+  OstreeRepo  *repo;
+  CommitData  *commit_data;
+  GThreadPool *pool;
+  GPtrArray   *files;     /* ExportFile */
+  GHashTable  *old_cache; /* path -> (stat key, checksum) */
+  GMutex       lock;
+  GError      *error;
+  guint        n_reused;
+} ExportWriter;
+
+static void
+export_file_free (ExportFile *export_file)
+{
+  g_object_unref (export_file->mtree);
+  g_free (export_file->name);
+  g_free (export_file->path);
+  g_object_unref (export_file->file);
+  g_object_unref (export_file->file_info);
+  g_free (export_file->stat_key);
+  g_free (export_file->checksum);
+  g_free (export_file);
+}
+
+/* Anything that changes when the file is modified. ctime can't be set
+   from userspace, so this also catches tools that preserve the mtime. */
+static char *
+get_stat_key (GFileInfo *file_info)
+{
+  return g_strdup_printf ("%u:%" G_GUINT64_FORMAT ":%" G_GUINT64_FORMAT ":%" G_GUINT64_FORMAT
+                          ".%u:%" G_GUINT64_FORMAT ".%u:%o",
+                          g_file_info_get_attribute_uint32 (file_info, G_FILE_ATTRIBUTE_UNIX_DEVICE),
+                          g_file_info_get_attribute_uint64 (file_info, G_FILE_ATTRIBUTE_UNIX_INODE),
+                          g_file_info_get_attribute_uint64 (file_info, G_FILE_ATTRIBUTE_STANDARD_SIZE),
+                          g_file_info_get_attribute_uint64 (file_info, G_FILE_ATTRIBUTE_TIME_MODIFIED),
+                          g_file_info_get_attribute_uint32 (file_info, G_FILE_ATTRIBUTE_TIME_MODIFIED_USEC),
+                          g_file_info_get_attribute_uint64 (file_info, G_FILE_ATTRIBUTE_TIME_CHANGED),
+                          g_file_info_get_attribute_uint32 (file_info, G_FILE_ATTRIBUTE_TIME_CHANGED_USEC),
+                          g_file_info_get_attribute_uint32 (file_info, "unix::mode"));
+}
+
+static GHashTable *
+load_export_cache (GFile *base)
+{
+  g_autoptr(GFile) cache_file = g_file_get_child (base, EXPORT_CACHE_NAME);
+  g_autoptr(GHashTable) cache = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                       g_free, (GDestroyNotify) g_strfreev);
+  g_autofree char *data = NULL;
+  gsize size;
+  g_autoptr(GVariant) v = NULL;
+  GVariantIter iter;
+  const char *path, *stat_key, *checksum;
+
+  if (!g_file_load_contents (cache_file, NULL, &data, &size, NULL, NULL))
+    return g_steal_pointer (&cache);
+
+  v = g_variant_ref_sink (g_variant_new_from_data (EXPORT_CACHE_GVARIANT_FORMAT,
+                                                   data, size, FALSE, NULL, NULL));
+  g_variant_iter_init (&iter, v);
+  while (g_variant_iter_next (&iter, "{&s(&s&s)}", &path, &stat_key, &checksum))
+    {
+      char **entry = g_new0 (char *, 3);
+      entry[0] = g_strdup (stat_key);
+      entry[1] = g_strdup (checksum);
+      g_hash_table_insert (cache, g_strdup (path), entry);
+    }
+
+  return g_steal_pointer (&cache);
+}
+
+/* This is just a cache, so failing to save it is not an error */
+static void
+save_export_cache (ExportWriter *writer,
+                   GFile        *base)
+{
+  g_autoptr(GFile) cache_file = g_file_get_child (base, EXPORT_CACHE_NAME);
+  g_autoptr(GError) local_error = NULL;
+  GVariantBuilder builder;
+  g_autoptr(GVariant) v = NULL;
+  int i;
+
+  g_variant_builder_init (&builder, EXPORT_CACHE_GVARIANT_FORMAT);
+  for (i = 0; i < writer->files->len; i++)
+    {
+      ExportFile *export_file = g_ptr_array_index (writer->files, i);
+      g_variant_builder_add (&builder, "{s(ss)}", export_file->path,
+                             export_file->stat_key, export_file->checksum);
+    }
+  v = g_variant_ref_sink (g_variant_builder_end (&builder));
+
+  if (!flatpak_variant_save (cache_file, v, NULL, &local_error))
+    g_debug ("Failed to save export cache: %s", local_error->message);
+}
+
+static void
+export_file_job (gpointer data,
+                 gpointer user_data)
+{
+  ExportFile *export_file = data;
+  ExportWriter *writer = user_data;
+  g_autoptr(GInputStream) raw_input = NULL;
+  g_autoptr(GInputStream) input = NULL;
+  g_autofree guchar *csum = NULL;
+  g_autoptr(GError) local_error = NULL;
+  guint64 length;
+
+  g_mutex_lock (&writer->lock);
+  if (writer->error != NULL)
+    {
+      g_mutex_unlock (&writer->lock);
+      return;
+    }
+  g_mutex_unlock (&writer->lock);
+
+  if (g_file_info_get_file_type (export_file->file_info) == G_FILE_TYPE_REGULAR)
+    {
+      raw_input = (GInputStream *) g_file_read (export_file->file, NULL, &local_error);
+      if (raw_input == NULL)
+        goto out;
+    }
+
+  if (!ostree_raw_file_to_content_stream (raw_input, export_file->file_info, NULL,
+                                          &input, &length, NULL, &local_error))
+    goto out;
+
+  if (!ostree_repo_write_content (writer->repo, NULL, input, length,
+                                  &csum, NULL, &local_error))
+    goto out;
+
+  export_file->checksum = ostree_checksum_from_bytes (csum);
+
+out:
+  if (local_error)
+    {
+      g_mutex_lock (&writer->lock);
+      if (writer->error == NULL)
+        {
+          g_prefix_error (&local_error, "While exporting %s: ", export_file->path);
+          writer->error = g_steal_pointer (&local_error);
+        }
+      g_mutex_unlock (&writer->lock);
+    }
+}
+
+static gboolean
+export_writer_add_file (ExportWriter      *writer,
+                        OstreeMutableTree *mtree,
+                        GFile             *file,
+                        GFileInfo         *file_info,
+                        const char        *path,
+                        GError           **error)
+{
+  ExportFile *export_file;
+  char **cached;
+
+  export_file = g_new0 (ExportFile, 1);
+  export_file->mtree = g_object_ref (mtree);
+  export_file->name = g_strdup (g_file_info_get_name (file_info));
+  export_file->path = g_strdup (path);
+  export_file->file = g_object_ref (file);
+  export_file->file_info = g_object_ref (file_info);
+  export_file->stat_key = get_stat_key (file_info);
+  g_ptr_array_add (writer->files, export_file);
+
+  cached = g_hash_table_lookup (writer->old_cache, path);
+  if (cached != NULL &&
+      strcmp (cached[0], export_file->stat_key) == 0)
+    {
+      gboolean have_object = FALSE;
+
+      if (!ostree_repo_has_object (writer->repo, OSTREE_OBJECT_TYPE_FILE, cached[1],
+                                   &have_object, NULL, error))
+        return FALSE;
+
+      if (have_object)
+        {
+          export_file->checksum = g_strdup (cached[1]);
+          writer->n_reused++;
+          return TRUE;
+        }
+    }
+
+  g_thread_pool_push (writer->pool, export_file, NULL);
+  return TRUE;
+}
+
+static gboolean
+export_writer_add_dir (ExportWriter      *writer,
+                       OstreeMutableTree *mtree,
+                       GFile             *dir,
+                       GFileInfo         *dir_info,
+                       const char        *path,
+                       const char        *cache_prefix,
+                       GCancellable      *cancellable,
+                       GError           **error)
+{
+  g_autoptr(GFileEnumerator) dir_enum = NULL;
+  g_autoptr(GVariant) dirmeta = NULL;
+  g_autofree guchar *csum = NULL;
+  g_autofree char *checksum = NULL;
+
+  dirmeta = ostree_create_directory_metadata (dir_info, NULL);
+  if (!ostree_repo_write_metadata (writer->repo, OSTREE_OBJECT_TYPE_DIR_META, NULL,
+                                   dirmeta, &csum, cancellable, error))
+    return FALSE;
+
+  checksum = ostree_checksum_from_bytes (csum);
+  ostree_mutable_tree_set_metadata_checksum (mtree, checksum);
+
+  dir_enum = g_file_enumerate_children (dir, EXPORT_QUERY_ATTRIBUTES,
+                                        G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                        cancellable, error);
+  if (dir_enum == NULL)
+    return FALSE;
+
+  while (TRUE)
+    {
+      GFileInfo *child_info;
+      GFile *child;
+      const char *name;
+      g_autofree char *child_path = NULL;
+      g_autofree char *cache_path = NULL;
+
+      if (!gs_file_enumerator_iterate (dir_enum, &child_info, &child, cancellable, error))
+        return FALSE;
+      if (child_info == NULL)
+        break;
+
+      name = g_file_info_get_name (child_info);
+      child_path = g_build_filename (path, name, NULL);
+
+      if (commit_filter (writer->repo, child_path, child_info,
+                         writer->commit_data) == OSTREE_REPO_COMMIT_FILTER_SKIP)
+        continue;
+
+      cache_path = g_strconcat (cache_prefix, child_path, NULL);
+
+      switch (g_file_info_get_file_type (child_info))
+        {
+        case G_FILE_TYPE_DIRECTORY:
+          {
+            g_autoptr(OstreeMutableTree) child_mtree = NULL;
+
+            if (!ostree_mutable_tree_ensure_dir (mtree, name, &child_mtree, error))
+              return FALSE;
+
+            if (!export_writer_add_dir (writer, child_mtree, child, child_info,
+                                        child_path, cache_prefix, cancellable, error))
+              return FALSE;
+          }
+          break;
+
+        case G_FILE_TYPE_REGULAR:
+        case G_FILE_TYPE_SYMBOLIC_LINK:
+          if (!export_writer_add_file (writer, mtree, child, child_info, cache_path, error))
+            return FALSE;
+          break;
+
+        default:
+          return flatpak_fail (error, "Unsupported file type for %s", cache_path);
+        }
+    }
+
+  return TRUE;
+}
+
+/* Like ostree_repo_write_directory_to_mtree(), but the content objects are
+ * only written once export_writer_finish() is called */
+static gboolean
+export_writer_add_root (ExportWriter      *writer,
+                        OstreeMutableTree *mtree,
+                        GFile             *dir,
+                        const char        *cache_prefix,
+                        GCancellable      *cancellable,
+                        GError           **error)
+{
+  g_autoptr(GFileInfo) dir_info = NULL;
+
+  dir_info = g_file_query_info (dir, EXPORT_QUERY_ATTRIBUTES,
+                                G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                cancellable, error);
+  if (dir_info == NULL)
+    return FALSE;
+
+  commit_filter (writer->repo, "/", dir_info, writer->commit_data);
+
+  return export_writer_add_dir (writer, mtree, dir, dir_info, "/", cache_prefix,
+                                cancellable, error);
+}
+
+static ExportWriter *
+export_writer_new (OstreeRepo *repo,
+                   CommitData *commit_data,
+                   GFile      *base)
+{
+  ExportWriter *writer = g_new0 (ExportWriter, 1);
+
+  writer->repo = g_object_ref (repo);
+  writer->commit_data = commit_data;
+  writer->files = g_ptr_array_new_with_free_func ((GDestroyNotify) export_file_free);
+  writer->old_cache = load_export_cache (base);
+  g_mutex_init (&writer->lock);
+  writer->pool = g_thread_pool_new (export_file_job, writer,
+                                    g_get_num_processors (), FALSE, NULL);
+
+  return writer;
+}
+
+static void
+export_writer_free (ExportWriter *writer)
+{
+  if (writer->pool)
+    g_thread_pool_free (writer->pool, TRUE, TRUE);
+  g_object_unref (writer->repo);
+  g_ptr_array_unref (writer->files);
+  g_hash_table_unref (writer->old_cache);
+  g_mutex_clear (&writer->lock);
+  g_clear_error (&writer->error);
+  g_free (writer);
+}
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (ExportWriter, export_writer_free)
+
+/* Waits for all content objects to be written and adds them to their mtrees */
+static gboolean
+export_writer_finish (ExportWriter *writer,
+                      GFile        *base,
+                      GError      **error)
+{
+  int i;
+
+  g_thread_pool_free (writer->pool, FALSE, TRUE);
+  writer->pool = NULL;
+
+  if (writer->error)
+    {
+      g_propagate_error (error, g_steal_pointer (&writer->error));
+      return FALSE;
+    }
+
+  for (i = 0; i < writer->files->len; i++)
+    {
+      ExportFile *export_file = g_ptr_array_index (writer->files, i);
+
+      if (!ostree_mutable_tree_replace_file (export_file->mtree, export_file->name,
+                                             export_file->checksum, error))
+        return FALSE;
+    }
+
+  g_debug ("Reused %u of %u file checksums", writer->n_reused, writer->files->len);
+
+  save_export_cache (writer, base);
+
+  return TRUE;
+}
+
 gboolean
 flatpak_builtin_build_export (int argc, char **argv, GCancellable *cancellable, GError **error)
 {
@@ -248,7 +636,7 @@ flatpak_builtin_build_export (int argc, char **argv, GCancellable *cancellable,
   g_autofree char *subject = NULL;
   g_autofree char *body = NULL;
   OstreeRepoTransactionStats stats;
-  g_autoptr(OstreeRepoCommitModifier) modifier = NULL;
+  g_autoptr(ExportWriter) writer = NULL;
   CommitData commit_data = {0};
 
   context = g_option_context_new ("LOCATION DIRECTORY [BRANCH] - Create a repository from a build directory");
@@ -358,14 +746,13 @@ flatpak_builtin_build_export (int argc, char **argv, GCancellable *cancellable,
   if (!ostree_mutable_tree_ensure_dir (mtree, "files", &files_mtree, error))
     goto out;
 
-  modifier = ostree_repo_commit_modifier_new (OSTREE_REPO_COMMIT_MODIFIER_FLAGS_SKIP_XATTRS,
-                                              (OstreeRepoCommitFilter) commit_filter, &commit_data, NULL);
+  writer = export_writer_new (repo, &commit_data, base);
 
   if (opt_runtime)
     {
       commit_data.exclude = (const char **) opt_exclude;
       commit_data.include = (const char **) opt_include;
-      if (!ostree_repo_write_directory_to_mtree (repo, usr, files_mtree, modifier, cancellable, error))
+      if (!export_writer_add_root (writer, files_mtree, usr, "files", cancellable, error))
         goto out;
       commit_data.exclude = NULL;
       commit_data.include = NULL;
@@ -374,7 +761,7 @@ flatpak_builtin_build_export (int argc, char **argv, GCancellable *cancellable,
     {
       commit_data.exclude = (const char **) opt_exclude;
       commit_data.include = (const char **) opt_include;
-      if (!ostree_repo_write_directory_to_mtree (repo, files, files_mtree, modifier, cancellable, error))
+      if (!export_writer_add_root (writer, files_mtree, files, "files", cancellable, error))
         goto out;
       commit_data.exclude = NULL;
       commit_data.include = NULL;
@@ -382,10 +769,13 @@ flatpak_builtin_build_export (int argc, char **argv, GCancellable *cancellable,
       if (!ostree_mutable_tree_ensure_dir (mtree, "export", &export_mtree, error))
         goto out;
 
-      if (!ostree_repo_write_directory_to_mtree (repo, export, export_mtree, modifier, cancellable, error))
+      if (!export_writer_add_root (writer, export_mtree, export, "export", cancellable, error))
         goto out;
     }
 
+  if (!export_writer_finish (writer, base, error))
+    goto out;
+
   if (!add_file_to_mtree (metadata, "metadata", repo, mtree, cancellable, error))
     goto out;
 
@@ -457,6 +847,9 @@ flatpak_builtin_build_export (int argc, char **argv, GCancellable *cancellable,
   ret = TRUE;
 
 out:
+  /* Make sure no worker is still writing before we abort */
+  g_clear_pointer (&writer, export_writer_free);
+
   if (repo)
     ostree_repo_abort_transaction (repo, cancellable, NULL);
 
@@ -169,7 +169,7 @@ flatpak_builtin_build (int argc, char **argv, GCancellable *cancellable, GError
             "--bind", gs_file_get_path_cached (app_files), "/app",
             NULL);
 
-  if (!flatpak_run_setup_base_argv (argv_array, NULL, runtime_files, NULL, runtime_ref_parts[2], FLATPAK_RUN_FLAG_DEVEL, error))
+  if (!flatpak_run_setup_base_argv (argv_array, NULL, runtime_files, NULL, runtime_ref_parts[2], NULL, FLATPAK_RUN_FLAG_DEVEL, error))
     return FALSE;
 
   /* After setup_base to avoid conflicts with /var symlinks */
@@ -34,6 +34,7 @@
 #include "flatpak-utils.h"
 #include "flatpak-dbus.h"
 #include "flatpak-run.h"
+#include "flatpak-sandbox.h"
 
 
 static GOptionEntry options[] = {
@@ -81,6 +82,33 @@ write_file (const char *path, const char *content)
   return res;
 }
 
+static gboolean
+read_proc_file (int         proc_fd,
+                const char *name,
+                char      **out_contents,
+                gsize      *out_len,
+                GError    **error)
+{
+  glnx_fd_close int fd = -1;
+  g_autoptr(GBytes) bytes = NULL;
+  gsize len;
+
+  fd = openat (proc_fd, name, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    {
+      glnx_set_error_from_errno (error);
+      return FALSE;
+    }
+
+  bytes = glnx_fd_readall_bytes (fd, NULL, error);
+  if (bytes == NULL)
+    return FALSE;
+
+  *out_contents = g_bytes_unref_to_data (g_steal_pointer (&bytes), &len);
+  *out_len = len;
+  return TRUE;
+}
+
 static uid_t uid;
 static gid_t gid;
 
@@ -131,9 +159,10 @@ flatpak_builtin_enter (int           argc,
   ssize_t pid_ns_len;
   char self_ns[256];
   ssize_t self_ns_len;
-  char *pid_s;
+  const char *pid_s;
   int pid, i;
-  g_autofree char *environment_path = NULL;
+  glnx_fd_close int proc_fd = -1;
+  g_autofree char *proc_path = NULL;
   g_autoptr(GPtrArray) argv_array = NULL;
   g_autoptr(GPtrArray) envp_array = NULL;
   g_autofree char *environment = NULL;
@@ -147,7 +176,7 @@ flatpak_builtin_enter (int           argc,
   uid = getuid ();
   gid = getgid ();
 
-  context = g_option_context_new ("MONITORPID [COMMAND [args...]] - Run a command inside a running sandbox");
+  context = g_option_context_new ("SANDBOX [COMMAND [args...]] - Run a command inside a running sandbox");
 
   rest_argc = 0;
   for (i = 1; i < argc; i++)
@@ -170,26 +199,45 @@ flatpak_builtin_enter (int           argc,
 
   if (rest_argc < 2)
     {
-      usage_error (context, "MONITORPID and COMMAND must be specified", error);
+      usage_error (context, "SANDBOX and COMMAND must be specified", error);
       return FALSE;
     }
 
   pid_s = argv[rest_argv_start];
 
-  pid = atoi (pid_s);
+  /* SANDBOX is either a pid in the sandbox, or the instance id or app
+     id of a sandbox in the registry */
+  if (pid_s[strspn (pid_s, "0123456789")] == 0)
+    {
+      pid = atoi (pid_s);
+    }
+  else
+    {
+      g_autoptr(FlatpakSandbox) sandbox = flatpak_sandbox_lookup (pid_s, error);
+
+      if (sandbox == NULL)
+        return FALSE;
+
+      pid = flatpak_sandbox_get_child_pid (sandbox);
+    }
+
   if (pid <= 0)
     return flatpak_fail (error, "Invalid pid %s\n", pid_s);
 
-  environment_path = g_strdup_printf ("/proc/%d/environ", pid);
-  if (!g_file_get_contents (environment_path, &environment, &environment_len, error))
+  /* Keep /proc/PID open, so everything below is read from the same process */
+  proc_path = g_strdup_printf ("/proc/%d", pid);
+  if (!glnx_opendirat (AT_FDCWD, proc_path, TRUE, &proc_fd, error))
+    return FALSE;
+
+  if (!read_proc_file (proc_fd, "environ", &environment, &environment_len, error))
     return FALSE;
 
   for (i = 0; i < G_N_ELEMENTS (ns_name); i++)
     {
-      g_autofree char *path = g_strdup_printf ("/proc/%d/ns/%s", pid, ns_name[i]);
+      g_autofree char *path = g_strdup_printf ("ns/%s", ns_name[i]);
       g_autofree char *self_path = g_strdup_printf ("/proc/self/ns/%s", ns_name[i]);
 
-      pid_ns_len = readlink (path, pid_ns, sizeof (pid_ns) - 1);
+      pid_ns_len = readlinkat (proc_fd, path, pid_ns, sizeof (pid_ns) - 1);
       if (pid_ns_len <= 0)
         return flatpak_fail (error, "Invalid %s namespace for pid %d\n", ns_name[i], pid);
       pid_ns[pid_ns_len] = 0;
@@ -206,7 +254,7 @@ flatpak_builtin_enter (int           argc,
         }
       else
         {
-          ns_fd[i] = open (path, O_RDONLY);
+          ns_fd[i] = openat (proc_fd, path, O_RDONLY | O_CLOEXEC);
           if (ns_fd[i] == -1)
             return flatpak_fail (error, "Can't open %s namespace: %s", ns_name[i], strerror (errno));
         }
@@ -0,0 +1,111 @@
+/*
+ * Copyright © 2016 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <locale.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "libgsystem.h"
+#include "libglnx/libglnx.h"
+
+#include "flatpak-builtins.h"
+#include "flatpak-utils.h"
+#include "flatpak-sandbox.h"
+
+static gboolean opt_show_details;
+
+static GOptionEntry options[] = {
+  { "show-details", 'd', 0, G_OPTION_ARG_NONE, &opt_show_details, "Show resource usage and launch details", NULL },
+  { NULL }
+};
+
+static void
+add_usage_column (FlatpakTablePrinter *printer,
+                  gboolean             valid,
+                  const char          *text)
+{
+  flatpak_table_printer_add_column (printer, valid ? text : "-");
+}
+
+gboolean
+flatpak_builtin_ps (int argc, char **argv, GCancellable *cancellable, GError **error)
+{
+  g_autoptr(GOptionContext) context = NULL;
+  g_autoptr(GPtrArray) sandboxes = NULL;
+  FlatpakTablePrinter *printer;
+  int i;
+
+  context = g_option_context_new (" - List running applications");
+
+  if (!flatpak_option_context_parse (context, options, &argc, &argv, FLATPAK_BUILTIN_FLAG_NO_DIR, NULL, cancellable, error))
+    return FALSE;
+
+  if (argc > 1)
+    return usage_error (context, "Too many arguments", error);
+
+  sandboxes = flatpak_sandbox_list ();
+
+  printer = flatpak_table_printer_new ();
+
+  for (i = 0; i < sandboxes->len; i++)
+    {
+      FlatpakSandbox *sandbox = g_ptr_array_index (sandboxes, i);
+      g_autofree char *pid = g_strdup_printf ("%d", sandbox->pid);
+
+      flatpak_table_printer_add_column (printer, sandbox->id);
+      flatpak_table_printer_add_column (printer, pid);
+      flatpak_table_printer_add_column (printer, sandbox->app);
+
+      if (opt_show_details)
+        {
+          FlatpakSandboxUsage usage;
+          g_autoptr(GDateTime) launched = g_date_time_new_from_unix_local (sandbox->launch_time);
+          g_autofree char *launch_time = g_date_time_format (launched, "%F %T");
+          g_autofree char *cpu = NULL;
+          g_autofree char *memory = NULL;
+          g_autofree char *io_read = NULL;
+          g_autofree char *io_write = NULL;
+
+          flatpak_sandbox_get_usage (sandbox, &usage);
+
+          cpu = g_strdup_printf ("%" G_GUINT64_FORMAT ".%02us",
+                                 usage.cpu_usec / G_USEC_PER_SEC,
+                                 (guint) (usage.cpu_usec % G_USEC_PER_SEC) / 10000);
+          memory = g_format_size (usage.memory_bytes);
+          io_read = g_format_size (usage.io_read_bytes);
+          io_write = g_format_size (usage.io_write_bytes);
+
+          flatpak_table_printer_add_column (printer, sandbox->runtime_ref);
+          flatpak_table_printer_add_column (printer, sandbox->scope ? sandbox->scope : "-");
+          flatpak_table_printer_add_column (printer, launch_time);
+          add_usage_column (printer, usage.has_cpu, cpu);
+          add_usage_column (printer, usage.has_memory, memory);
+          add_usage_column (printer, usage.has_io, io_read);
+          add_usage_column (printer, usage.has_io, io_write);
+        }
+
+      flatpak_table_printer_finish_row (printer);
+    }
+
+  flatpak_table_printer_print (printer);
+  flatpak_table_printer_free (printer);
+
+  return TRUE;
+}
@@ -37,17 +37,344 @@ static char **opt_gpg_key_ids;
 static gboolean opt_prune;
 static gboolean opt_generate_deltas;
 static gint opt_prune_depth = -1;
+static double opt_delta_max_ratio = 1.0;
 
 static GOptionEntry options[] = {
   { "title", 0, 0, G_OPTION_ARG_STRING, &opt_title, "A nice name to use for this repository", "TITLE" },
   { "gpg-sign", 0, 0, G_OPTION_ARG_STRING_ARRAY, &opt_gpg_key_ids, "GPG Key ID to sign the summary with", "KEY-ID"},
   { "gpg-homedir", 0, 0, G_OPTION_ARG_STRING, &opt_gpg_homedir, "GPG Homedir to use when looking for keyrings", "HOMEDIR"},
   { "generate-static-deltas", 0, 0, G_OPTION_ARG_NONE, &opt_generate_deltas, "Generate delta files", NULL },
+  { "static-delta-max-ratio", 0, 0, G_OPTION_ARG_DOUBLE, &opt_delta_max_ratio, "Drop from-parent deltas larger than RATIO times the from-empty delta (default: 1.0)", "RATIO" },
   { "prune", 0, 0, G_OPTION_ARG_NONE, &opt_prune, "Prune unused objects", NULL },
   { "prune-depth", 0, 0, G_OPTION_ARG_INT, &opt_prune_depth, "Only traverse DEPTH parents for each commit (default: -1=infinite)", "DEPTH" },
   { NULL }
 };
 
+typedef struct
+{
+  OstreeRepo   *repo;
+  const char   *ref;
+  const char   *commit;
+  char         *parent;
+  gboolean      need_from_empty;
+  gboolean      need_from_parent;
+  double        dropped_ratio; /* Set if the from-parent delta was dropped */
+  GVariant     *params;
+  GCancellable *cancellable;
+  GError       *error;
+} DeltaJob;
+
+static void
+delta_job_free (DeltaJob *job)
+{
+  g_free (job->parent);
+  g_clear_error (&job->error);
+  g_free (job);
+}
+
+/* This is the modified base64 that ostree uses for delta names */
+static char *
+checksum_to_b64 (const char *checksum)
+{
+  g_autofree guchar *bytes = ostree_checksum_to_bytes (checksum);
+  char *b64 = g_base64_encode (bytes, OSTREE_SHA256_DIGEST_LEN);
+  char *p;
+
+  for (p = b64; *p != 0; p++)
+    {
+      if (*p == '=')
+        {
+          *p = 0;
+          break;
+        }
+      if (*p == '/')
+        *p = '_';
+    }
+
+  return b64;
+}
+
+static GFile *
+get_delta_dir (OstreeRepo *repo,
+               const char *from,
+               const char *to)
+{
+  g_autofree char *to_b64 = checksum_to_b64 (to);
+  g_autofree char *relpath = NULL;
+
+  if (from != NULL)
+    {
+      g_autofree char *from_b64 = checksum_to_b64 (from);
+      relpath = g_strdup_printf ("deltas/%.2s/%s-%s", from_b64, from_b64 + 2, to_b64);
+    }
+  else
+    relpath = g_strdup_printf ("deltas/%.2s/%s", to_b64, to_b64 + 2);
+
+  return g_file_resolve_relative_path (ostree_repo_get_path (repo), relpath);
+}
+
+static gboolean
+get_delta_size (OstreeRepo   *repo,
+                const char   *from,
+                const char   *to,
+                guint64      *out_size,
+                GCancellable *cancellable,
+                GError      **error)
+{
+  g_autoptr(GFile) dir = get_delta_dir (repo, from, to);
+  g_autoptr(GFileEnumerator) dir_enum = NULL;
+  guint64 size = 0;
+
+  dir_enum = g_file_enumerate_children (dir, G_FILE_ATTRIBUTE_STANDARD_SIZE,
+                                        G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                        cancellable, error);
+  if (dir_enum == NULL)
+    return FALSE;
+
+  while (TRUE)
+    {
+      GFileInfo *child_info;
+
+      if (!gs_file_enumerator_iterate (dir_enum, &child_info, NULL, cancellable, error))
+        return FALSE;
+      if (child_info == NULL)
+        break;
+
+      size += g_file_info_get_size (child_info);
+    }
+
+  *out_size = size;
+  return TRUE;
+}
+
+static void
+delta_job_run (gpointer data,
+               gpointer user_data)
+{
+  DeltaJob *job = data;
+  guint64 from_empty_size, from_parent_size;
+
+  if (job->need_from_empty)
+    {
+      g_print ("Generating from-empty delta for %s (%s)\n", job->ref, job->commit);
+      if (!ostree_repo_static_delta_generate (job->repo, OSTREE_STATIC_DELTA_GENERATE_OPT_MAJOR,
+                                              NULL, job->commit, NULL,
+                                              job->params,
+                                              job->cancellable, &job->error))
+        return;
+    }
+
+  if (!job->need_from_parent)
+    return;
+
+  g_print ("Generating from-parent delta for %s (%s-%s)\n", job->ref, job->parent, job->commit);
+  if (!ostree_repo_static_delta_generate (job->repo, OSTREE_STATIC_DELTA_GENERATE_OPT_MAJOR,
+                                          job->parent, job->commit, NULL,
+                                          job->params,
+                                          job->cancellable, &job->error))
+    return;
+
+  /* A from-parent delta that is about as large as the full commit
+     is not worth keeping, clients can use the from-empty one */
+  if (!get_delta_size (job->repo, NULL, job->commit, &from_empty_size,
+                       job->cancellable, &job->error) ||
+      !get_delta_size (job->repo, job->parent, job->commit, &from_parent_size,
+                       job->cancellable, &job->error))
+    return;
+
+  if (from_parent_size > from_empty_size * opt_delta_max_ratio)
+    {
+      g_autoptr(GFile) dir = get_delta_dir (job->repo, job->parent, job->commit);
+
+      g_print ("Dropping from-parent delta for %s, it is larger than the from-empty delta\n", job->ref);
+      if (!gs_shutil_rm_rf (dir, job->cancellable, &job->error))
+        return;
+
+      job->dropped_ratio = (double) from_parent_size / MAX (from_empty_size, 1);
+    }
+}
+
+/* The from-parent deltas we dropped for being too large are recorded
+   in the repo, with their size relative to the from-empty delta, so
+   that we don't generate them again on every run. They are only
+   retried if the max ratio is raised above the recorded one. */
+#define DROPPED_DELTAS_NAME ".flatpak-dropped-deltas"
+#define DROPPED_DELTAS_GVARIANT_FORMAT G_VARIANT_TYPE ("a{sd}")
+
+static GHashTable *
+load_dropped_deltas (OstreeRepo *repo)
+{
+  g_autoptr(GFile) file = g_file_get_child (ostree_repo_get_path (repo), DROPPED_DELTAS_NAME);
+  g_autoptr(GHashTable) dropped = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                         g_free, g_free);
+  g_autofree char *data = NULL;
+  gsize size;
+  g_autoptr(GVariant) v = NULL;
+  GVariantIter iter;
+  const char *name;
+  double ratio;
+
+  if (!g_file_load_contents (file, NULL, &data, &size, NULL, NULL))
+    return g_steal_pointer (&dropped);
+
+  v = g_variant_ref_sink (g_variant_new_from_data (DROPPED_DELTAS_GVARIANT_FORMAT,
+                                                   data, size, FALSE, NULL, NULL));
+  g_variant_iter_init (&iter, v);
+  while (g_variant_iter_next (&iter, "{&sd}", &name, &ratio))
+    g_hash_table_insert (dropped, g_strdup (name), g_memdup (&ratio, sizeof (ratio)));
+
+  return g_steal_pointer (&dropped);
+}
+
+static gboolean
+save_dropped_deltas (OstreeRepo   *repo,
+                     GHashTable   *dropped,
+                     GCancellable *cancellable,
+                     GError      **error)
+{
+  g_autoptr(GFile) file = g_file_get_child (ostree_repo_get_path (repo), DROPPED_DELTAS_NAME);
+  GVariantBuilder builder;
+  g_autoptr(GVariant) v = NULL;
+  GHashTableIter iter;
+  gpointer key, value;
+
+  g_variant_builder_init (&builder, DROPPED_DELTAS_GVARIANT_FORMAT);
+  g_hash_table_iter_init (&iter, dropped);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    g_variant_builder_add (&builder, "{sd}", (const char *) key, *(double *) value);
+  v = g_variant_ref_sink (g_variant_builder_end (&builder));
+
+  return flatpak_variant_save (file, v, cancellable, error);
+}
+
+/* Generates from-empty and from-parent deltas for all refs that don't
+   have them yet. This has to happen before the summary is regenerated,
+   as ostree lists all the deltas in the summary. */
+static gboolean
+generate_all_deltas (OstreeRepo   *repo,
+                     GCancellable *cancellable,
+                     GError      **error)
+{
+  g_autoptr(GHashTable) all_refs = NULL;
+  g_autoptr(GHashTable) all_deltas_hash = NULL;
+  g_autoptr(GHashTable) old_dropped = NULL;
+  g_autoptr(GHashTable) dropped = NULL;
+  g_autoptr(GPtrArray) all_deltas = NULL;
+  g_autoptr(GPtrArray) jobs = NULL;
+  g_autoptr(GVariant) params = NULL;
+  GVariantBuilder parambuilder;
+  GThreadPool *pool;
+  GHashTableIter iter;
+  gpointer key, value;
+  int i;
+
+  g_variant_builder_init (&parambuilder, G_VARIANT_TYPE ("a{sv}"));
+  /* Fall back for 1 meg files */
+  g_variant_builder_add (&parambuilder, "{sv}",
+                         "min-fallback-size", g_variant_new_uint32 (1));
+  params = g_variant_ref_sink (g_variant_builder_end (&parambuilder));
+
+  if (!ostree_repo_list_static_delta_names (repo, &all_deltas,
+                                            cancellable, error))
+    return FALSE;
+
+  all_deltas_hash = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  for (i = 0; i < all_deltas->len; i++)
+    g_hash_table_add (all_deltas_hash, g_strdup (g_ptr_array_index (all_deltas, i)));
+
+  old_dropped = load_dropped_deltas (repo);
+  dropped = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+
+  if (!ostree_repo_list_refs (repo, NULL, &all_refs,
+                              cancellable, error))
+    return FALSE;
+
+  jobs = g_ptr_array_new_with_free_func ((GDestroyNotify) delta_job_free);
+
+  g_hash_table_iter_init (&iter, all_refs);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      const char *ref = key;
+      const char *commit = value;
+      g_autoptr(GVariant) variant = NULL;
+      g_autoptr(GVariant) parent_variant = NULL;
+      g_autofree char *parent_commit = NULL;
+      DeltaJob *job;
+
+      if (!ostree_repo_load_variant (repo, OSTREE_OBJECT_TYPE_COMMIT, commit,
+                                     &variant, error))
+        return FALSE;
+
+      job = g_new0 (DeltaJob, 1);
+      job->repo = repo;
+      job->ref = ref;
+      job->commit = commit;
+      job->params = params;
+      job->cancellable = cancellable;
+
+      job->need_from_empty = !g_hash_table_contains (all_deltas_hash, commit);
+      /* Mark this one as wanted, so refs pointing at the same commit
+         don't queue it again */
+      g_hash_table_add (all_deltas_hash, g_strdup (commit));
+
+      parent_commit = ostree_commit_get_parent (variant);
+      if (parent_commit != NULL &&
+          ostree_repo_load_variant_if_exists (repo, OSTREE_OBJECT_TYPE_COMMIT, parent_commit,
+                                              &parent_variant, NULL) &&
+          parent_variant != NULL)
+        {
+          g_autofree char *from_parent = g_strdup_printf ("%s-%s", parent_commit, commit);
+          double *dropped_ratio = g_hash_table_lookup (old_dropped, from_parent);
+
+          job->parent = g_steal_pointer (&parent_commit);
+
+          if (dropped_ratio != NULL && *dropped_ratio > opt_delta_max_ratio)
+            {
+              /* Still too large, remember that for next time */
+              g_hash_table_insert (dropped, g_strdup (from_parent),
+                                   g_memdup (dropped_ratio, sizeof (double)));
+            }
+          else
+            {
+              job->need_from_parent = !g_hash_table_contains (all_deltas_hash, from_parent);
+            }
+
+          g_hash_table_add (all_deltas_hash, g_steal_pointer (&from_parent));
+        }
+
+      if (job->need_from_empty || job->need_from_parent)
+        g_ptr_array_add (jobs, job);
+      else
+        delta_job_free (job);
+    }
+
+  /* Generating deltas is CPU bound, so run one job per processor */
+  pool = g_thread_pool_new (delta_job_run, NULL,
+                            MAX (g_get_num_processors (), 1), FALSE, NULL);
+  for (i = 0; i < jobs->len; i++)
+    g_thread_pool_push (pool, g_ptr_array_index (jobs, i), NULL);
+  g_thread_pool_free (pool, FALSE, TRUE);
+
+  for (i = 0; i < jobs->len; i++)
+    {
+      DeltaJob *job = g_ptr_array_index (jobs, i);
+
+      if (job->error)
+        {
+          g_propagate_error (error, g_steal_pointer (&job->error));
+          return FALSE;
+        }
+
+      if (job->dropped_ratio > 0)
+        g_hash_table_insert (dropped,
+                             g_strdup_printf ("%s-%s", job->parent, job->commit),
+                             g_memdup (&job->dropped_ratio, sizeof (double)));
+    }
+
+  /* Entries for refs that have moved on are not saved again */
+  return save_dropped_deltas (repo, dropped, cancellable, error);
+}
+
 gboolean
 flatpak_builtin_build_update_repo (int argc, char **argv,
                                    GCancellable *cancellable, GError **error)
@@ -92,99 +419,9 @@ flatpak_builtin_build_update_repo (int argc, char **argv,
         }
     }
 
-  if (opt_generate_deltas)
-    {
-      g_autoptr(GHashTable) all_refs = NULL;
-      g_autoptr(GHashTable) all_deltas_hash = NULL;
-      g_autoptr(GPtrArray) all_deltas = NULL;
-      int i;
-      GHashTableIter iter;
-      gpointer key, value;
-      g_autoptr(GVariantBuilder) parambuilder = NULL;
-      g_autoptr(GVariant) params = NULL;
-
-      parambuilder = g_variant_builder_new (G_VARIANT_TYPE ("a{sv}"));
-      /* Fall back for 1 meg files */
-      g_variant_builder_add (parambuilder, "{sv}",
-                             "min-fallback-size", g_variant_new_uint32 (1));
-      g_variant_builder_add (parambuilder, "{sv}", "verbose",
-                             g_variant_new_boolean (TRUE));
-      params = g_variant_ref_sink (g_variant_builder_end (parambuilder));
-
-      if (!ostree_repo_list_static_delta_names (repo, &all_deltas,
-                                                cancellable, error))
-        return FALSE;
-
-      all_deltas_hash = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
-      for (i = 0; i < all_deltas->len; i++)
-        {
-          g_print ("adding %s\n", (char *) g_ptr_array_index (all_deltas, i));
-          g_hash_table_insert (all_deltas_hash,
-                               g_strdup (g_ptr_array_index (all_deltas, i)),
-                               NULL);
-        }
-
-      if (!ostree_repo_list_refs (repo, NULL, &all_refs,
-                                  cancellable, error))
-        return FALSE;
-
-      g_hash_table_iter_init (&iter, all_refs);
-      while (g_hash_table_iter_next (&iter, &key, &value))
-        {
-          const char *ref = key;
-          const char *commit = value;
-          const char *from_parent = NULL;
-          g_autoptr(GVariant) variant = NULL;
-          g_autoptr(GVariant) parent_variant = NULL;
-          g_autofree char *parent_commit = NULL;
-
-          if (!ostree_repo_load_variant (repo, OSTREE_OBJECT_TYPE_COMMIT, commit,
-                                         &variant, NULL))
-            return FALSE;
-
-          parent_commit = ostree_commit_get_parent (variant);
-
-          if (parent_commit != NULL)
-            ostree_repo_load_variant (repo, OSTREE_OBJECT_TYPE_COMMIT, parent_commit,
-                                      &parent_variant, NULL);
-
-
-          /* From empty */
-          g_print ("looking for %s\n", commit);
-          if (!g_hash_table_contains (all_deltas_hash, commit))
-            {
-              g_print ("Generating from-empty delta for %s (%s)\n", ref, commit);
-              if (!ostree_repo_static_delta_generate (repo, OSTREE_STATIC_DELTA_GENERATE_OPT_MAJOR,
-                                                      NULL, commit, NULL,
-                                                      params,
-                                                      cancellable, error))
-                return FALSE;
-            }
-
-          /* Mark this one as wanted */
-          g_hash_table_insert (all_deltas_hash, g_strdup (commit), GINT_TO_POINTER (1));
-
-          /* From parent */
-          if (parent_variant != NULL)
-            {
-              from_parent = g_strdup_printf ("%s-%s", parent_commit, commit);
-
-
-              if (!g_hash_table_contains (all_deltas_hash, from_parent))
-                {
-                  g_print ("Generating from-parent delta for %s (%s)\n", ref, from_parent);
-                  if (!ostree_repo_static_delta_generate (repo, OSTREE_STATIC_DELTA_GENERATE_OPT_MAJOR,
-                                                          parent_commit, commit, NULL,
-                                                          params,
-                                                          cancellable, error))
-                    return FALSE;
-                }
-
-              /* Mark this one as wanted */
-              g_hash_table_insert (all_deltas_hash, g_strdup (from_parent), GINT_TO_POINTER (1));
-            }
-        }
-    }
+  if (opt_generate_deltas &&
+      !generate_all_deltas (repo, cancellable, error))
+    return FALSE;
 
   g_print ("Updating summary\n");
   if (!flatpak_repo_update (repo, (const char **) opt_gpg_key_ids, opt_gpg_homedir, cancellable, error))
@@ -124,6 +124,7 @@ flatpak_builtin_update (int           argc,
   const char *name = NULL;
   const char *branch = NULL;
   const char *arch = NULL;
+  gboolean ret = FALSE;
   int i;
 
   context = g_option_context_new ("[NAME [BRANCH]] - Update an application or runtime");
@@ -150,6 +151,8 @@ flatpak_builtin_update (int           argc,
   if (opt_appstream)
     return update_appstream (dir, name, cancellable, error);
 
+  flatpak_dir_begin_update_batch (dir);
+
   if (branch == NULL || name == NULL)
     {
       if (opt_app)
@@ -159,13 +162,13 @@ flatpak_builtin_update (int           argc,
           if (!flatpak_dir_list_refs (dir, "app", &refs,
                                       cancellable,
                                       error))
-            return FALSE;
+            goto out;
 
           for (i = 0; refs != NULL && refs[i] != NULL; i++)
             {
               g_auto(GStrv) parts = flatpak_decompose_ref (refs[i], error);
               if (parts == NULL)
-                return FALSE;
+                goto out;
 
               if (name != NULL && strcmp (parts[1], name) != 0)
                 continue;
@@ -182,7 +185,7 @@ flatpak_builtin_update (int           argc,
                               TRUE, FALSE,
                               cancellable,
                               error))
-                return FALSE;
+                goto out;
             }
         }
 
@@ -193,13 +196,13 @@ flatpak_builtin_update (int           argc,
           if (!flatpak_dir_list_refs (dir, "runtime", &refs,
                                       cancellable,
                                       error))
-            return FALSE;
+            goto out;
 
           for (i = 0; refs != NULL && refs[i] != NULL; i++)
             {
               g_auto(GStrv) parts = flatpak_decompose_ref (refs[i], error);
               if (parts == NULL)
-                return FALSE;
+                goto out;
 
               if (name != NULL && strcmp (parts[1], name) != 0)
                 continue;
@@ -215,7 +218,7 @@ flatpak_builtin_update (int           argc,
                               FALSE, TRUE,
                               cancellable,
                               error))
-                return FALSE;
+                goto out;
             }
         }
 
@@ -229,10 +232,18 @@ flatpak_builtin_update (int           argc,
                       opt_app, opt_runtime,
                       cancellable,
                       error))
-        return FALSE;
+        goto out;
     }
 
+  ret = TRUE;
+
+out:
+  /* Deploy whatever was pulled before any failure, and report the
+     first error */
+  if (!flatpak_dir_end_update_batch (dir, cancellable, ret ? error : NULL))
+    ret = FALSE;
+
   flatpak_dir_cleanup_removed (dir, cancellable, NULL);
 
-  return TRUE;
+  return ret;
 }
@@ -62,6 +62,7 @@ BUILTINPROTO (list);
 BUILTINPROTO (info);
 BUILTINPROTO (run);
 BUILTINPROTO (enter);
+BUILTINPROTO (ps);
 BUILTINPROTO (build_init);
 BUILTINPROTO (build);
 BUILTINPROTO (build_finish);
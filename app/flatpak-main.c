@@ -62,6 +62,7 @@ static FlatpakCommand commands[] = {
   { "export-file", flatpak_builtin_export_file, "Grant an application access to a specific file" },
   { "make-current", flatpak_builtin_make_current_app, "Specify default version to run" },
   { "enter", flatpak_builtin_enter, "Enter the namespace of a running application" },
+  { "ps", flatpak_builtin_ps, "List running applications" },
 
   { "\n Manage remote repositories" },
   { "remote-add", flatpak_builtin_add_remote, "Add a new remote repository (by URL)" },
@@ -48,6 +48,7 @@ struct BuilderCache
   char       *last_parent;
   OstreeRepo *repo;
   gboolean    disabled;
+  GHashTable *file_checksums;
 };
 
 typedef struct
@@ -68,6 +69,61 @@ enum {
 #define OSTREE_GIO_FAST_QUERYINFO ("standard::name,standard::type,standard::size,standard::is-symlink,standard::symlink-target," \
                                    "unix::device,unix::inode,unix::mode,unix::uid,unix::gid,unix::rdev")
 
+#define BUILDER_CACHE_FILE_QUERYINFO (OSTREE_GIO_FAST_QUERYINFO ",time::modified,time::modified-usec,time::changed,time::changed-usec")
+
+/* The identity of a file in the app dir. If none of these change
+ * the file content and metadata are assumed to be unchanged, so we
+ * can reuse the ostree checksum computed earlier. */
+typedef struct
+{
+  guint64 dev;
+  guint64 ino;
+  guint64 size;
+  guint64 mtime;
+  guint64 ctime;
+  guint32 mtime_usec;
+  guint32 ctime_usec;
+} BuilderFileId;
+
+static void
+builder_file_id_init (BuilderFileId *id,
+                      GFileInfo     *info)
+{
+  memset (id, 0, sizeof (BuilderFileId));
+  id->dev = g_file_info_get_attribute_uint32 (info, "unix::device");
+  id->ino = g_file_info_get_attribute_uint64 (info, "unix::inode");
+  id->size = g_file_info_get_size (info);
+  id->mtime = g_file_info_get_attribute_uint64 (info, "time::modified");
+  id->mtime_usec = g_file_info_get_attribute_uint32 (info, "time::modified-usec");
+  id->ctime = g_file_info_get_attribute_uint64 (info, "time::changed");
+  id->ctime_usec = g_file_info_get_attribute_uint32 (info, "time::changed-usec");
+}
+
+static guint
+builder_file_id_hash (gconstpointer v)
+{
+  const BuilderFileId *id = v;
+
+  return (guint) (id->ino ^ (id->ino >> 32) ^ id->dev ^ id->size ^ id->mtime_usec ^ id->ctime_usec);
+}
+
+static gboolean
+builder_file_id_equal (gconstpointer v1,
+                       gconstpointer v2)
+{
+  const BuilderFileId *a = v1;
+  const BuilderFileId *b = v2;
+
+  return
+    a->dev == b->dev &&
+    a->ino == b->ino &&
+    a->size == b->size &&
+    a->mtime == b->mtime &&
+    a->mtime_usec == b->mtime_usec &&
+    a->ctime == b->ctime &&
+    a->ctime_usec == b->ctime_usec;
+}
+
 static void
 builder_cache_finalize (GObject *object)
 {
@@ -80,6 +136,7 @@ builder_cache_finalize (GObject *object)
   g_free (self->last_parent);
   if (self->unused_stages)
     g_hash_table_unref (self->unused_stages);
+  g_hash_table_unref (self->file_checksums);
 
   G_OBJECT_CLASS (builder_cache_parent_class)->finalize (object);
 }
@@ -175,6 +232,9 @@ static void
 builder_cache_init (BuilderCache *self)
 {
   self->checksum = g_checksum_new (G_CHECKSUM_SHA256);
+  self->file_checksums = g_hash_table_new_full (builder_file_id_hash,
+                                                builder_file_id_equal,
+                                                g_free, g_free);
 }
 
 BuilderCache *
@@ -267,6 +327,416 @@ builder_cache_get_current (BuilderCache *self)
   return g_strdup (g_checksum_get_string (copy));
 }
 
+static const char *
+builder_cache_lookup_file_checksum (BuilderCache *self,
+                                    GFileInfo    *info)
+{
+  BuilderFileId id;
+
+  builder_file_id_init (&id, info);
+  return g_hash_table_lookup (self->file_checksums, &id);
+}
+
+static void
+builder_cache_remember_file_checksum (BuilderCache *self,
+                                      GFileInfo    *info,
+                                      const char   *checksum)
+{
+  BuilderFileId *id = g_new (BuilderFileId, 1);
+
+  builder_file_id_init (id, info);
+  g_hash_table_replace (self->file_checksums, id, g_strdup (checksum));
+}
+
+/* Computes the ostree content checksum of a file in the app dir,
+ * reusing the checksum from an earlier stage if the file is
+ * unchanged. If @write is TRUE the content is also written to the
+ * repo (which needs a transaction) unless it is already there. */
+static gboolean
+builder_cache_checksum_file (BuilderCache *self,
+                             GFile        *file,
+                             GFileInfo    *info,
+                             gboolean      write,
+                             char        **out_checksum,
+                             GCancellable *cancellable,
+                             GError      **error)
+{
+  g_autoptr(GInputStream) file_input = NULL;
+  g_autofree guchar *csum = NULL;
+  g_autofree char *checksum = NULL;
+  GFileType type = g_file_info_get_file_type (info);
+  const char *cached;
+
+  if (type != G_FILE_TYPE_REGULAR && type != G_FILE_TYPE_SYMBOLIC_LINK)
+    {
+      g_autofree char *path = g_file_get_path (file);
+      return flatpak_fail (error, "Unsupported file type for %s", path);
+    }
+
+  cached = builder_cache_lookup_file_checksum (self, info);
+  if (cached != NULL)
+    {
+      gboolean have_object = TRUE;
+
+      if (write &&
+          !ostree_repo_has_object (self->repo, OSTREE_OBJECT_TYPE_FILE, cached,
+                                   &have_object, cancellable, error))
+        return FALSE;
+
+      if (have_object)
+        {
+          *out_checksum = g_strdup (cached);
+          return TRUE;
+        }
+    }
+
+  if (type == G_FILE_TYPE_REGULAR)
+    {
+      file_input = (GInputStream *) g_file_read (file, cancellable, error);
+      if (file_input == NULL)
+        return FALSE;
+    }
+
+  if (write)
+    {
+      g_autoptr(GInputStream) content_stream = NULL;
+      guint64 content_len;
+
+      if (!ostree_raw_file_to_content_stream (file_input, info, NULL,
+                                              &content_stream, &content_len,
+                                              cancellable, error))
+        return FALSE;
+
+      if (!ostree_repo_write_content (self->repo, NULL, content_stream, content_len,
+                                      &csum, cancellable, error))
+        return FALSE;
+    }
+  else
+    {
+      if (!ostree_checksum_file_from_input (info, NULL, file_input,
+                                            OSTREE_OBJECT_TYPE_FILE,
+                                            &csum, cancellable, error))
+        return FALSE;
+    }
+
+  checksum = ostree_checksum_from_bytes (csum);
+
+  /* Note: info was queried before we read the file, so if it changed
+     while we read it the ctime will not match on the next lookup. */
+  builder_cache_remember_file_checksum (self, info, checksum);
+
+  *out_checksum = g_steal_pointer (&checksum);
+  return TRUE;
+}
+
+/* This is like ostree_repo_write_directory_to_mtree() with
+ * OSTREE_REPO_COMMIT_MODIFIER_FLAGS_SKIP_XATTRS, except it only
+ * reads and checksums files that changed since the last stage. */
+static gboolean
+builder_cache_write_dir_to_mtree (BuilderCache      *self,
+                                  GFile             *dir,
+                                  GFileInfo         *dir_info,
+                                  OstreeMutableTree *mtree,
+                                  GCancellable      *cancellable,
+                                  GError           **error)
+{
+  g_autoptr(GVariant) dirmeta = NULL;
+  g_autoptr(GFileEnumerator) dir_enum = NULL;
+  g_autoptr(GFileInfo) child_info = NULL;
+  g_autoptr(GError) temp_error = NULL;
+  g_autofree guchar *csum = NULL;
+  g_autofree char *dirmeta_checksum = NULL;
+
+  dirmeta = ostree_create_directory_metadata (dir_info, NULL);
+  if (!ostree_repo_write_metadata (self->repo, OSTREE_OBJECT_TYPE_DIR_META, NULL,
+                                   dirmeta, &csum, cancellable, error))
+    return FALSE;
+
+  dirmeta_checksum = ostree_checksum_from_bytes (csum);
+  ostree_mutable_tree_set_metadata_checksum (mtree, dirmeta_checksum);
+
+  dir_enum = g_file_enumerate_children (dir, BUILDER_CACHE_FILE_QUERYINFO,
+                                        G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                        cancellable, error);
+  if (dir_enum == NULL)
+    return FALSE;
+
+  while ((child_info = g_file_enumerator_next_file (dir_enum, cancellable, &temp_error)))
+    {
+      const char *name = g_file_info_get_name (child_info);
+      g_autoptr(GFile) child = g_file_get_child (dir, name);
+
+      if (g_file_info_get_file_type (child_info) == G_FILE_TYPE_DIRECTORY)
+        {
+          g_autoptr(OstreeMutableTree) child_mtree = NULL;
+
+          if (!ostree_mutable_tree_ensure_dir (mtree, name, &child_mtree, error))
+            return FALSE;
+
+          if (!builder_cache_write_dir_to_mtree (self, child, child_info, child_mtree,
+                                                 cancellable, error))
+            return FALSE;
+        }
+      else
+        {
+          g_autofree char *checksum = NULL;
+
+          if (!builder_cache_checksum_file (self, child, child_info, TRUE,
+                                            &checksum, cancellable, error))
+            return FALSE;
+
+          if (!ostree_mutable_tree_replace_file (mtree, name, checksum, error))
+            return FALSE;
+        }
+
+      g_clear_object (&child_info);
+    }
+
+  if (temp_error != NULL)
+    {
+      g_propagate_error (error, g_steal_pointer (&temp_error));
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Records the checksums of a freshly checked out tree, so that the
+ * next commit does not have to read back files we just wrote. */
+static gboolean
+builder_cache_remember_checkout (BuilderCache *self,
+                                 GFile        *from_dir,
+                                 GFile        *to_dir,
+                                 GCancellable *cancellable,
+                                 GError      **error)
+{
+  g_autoptr(GFileEnumerator) dir_enum = NULL;
+  g_autoptr(GFileInfo) child_info = NULL;
+  g_autoptr(GError) temp_error = NULL;
+
+  dir_enum = g_file_enumerate_children (to_dir, BUILDER_CACHE_FILE_QUERYINFO,
+                                        G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                        cancellable, error);
+  if (dir_enum == NULL)
+    return FALSE;
+
+  while ((child_info = g_file_enumerator_next_file (dir_enum, cancellable, &temp_error)))
+    {
+      const char *name = g_file_info_get_name (child_info);
+      g_autoptr(GFile) from_child = g_file_get_child (from_dir, name);
+
+      if (g_file_info_get_file_type (child_info) == G_FILE_TYPE_DIRECTORY)
+        {
+          g_autoptr(GFile) to_child = g_file_get_child (to_dir, name);
+
+          if (!builder_cache_remember_checkout (self, from_child, to_child,
+                                                cancellable, error))
+            return FALSE;
+        }
+      else
+        {
+          builder_cache_remember_file_checksum (self, child_info,
+                                                ostree_repo_file_get_checksum (OSTREE_REPO_FILE (from_child)));
+        }
+
+      g_clear_object (&child_info);
+    }
+
+  if (temp_error != NULL)
+    {
+      g_propagate_error (error, g_steal_pointer (&temp_error));
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static gboolean
+builder_cache_add_paths_recurse (GFile        *file,
+                                 GFileInfo    *info,
+                                 const char   *path,
+                                 GPtrArray    *paths,
+                                 GCancellable *cancellable,
+                                 GError      **error)
+{
+  g_autoptr(GFileEnumerator) dir_enum = NULL;
+  g_autoptr(GFileInfo) child_info = NULL;
+  g_autoptr(GError) temp_error = NULL;
+
+  if (paths)
+    g_ptr_array_add (paths, g_strdup (path));
+
+  if (paths == NULL || g_file_info_get_file_type (info) != G_FILE_TYPE_DIRECTORY)
+    return TRUE;
+
+  dir_enum = g_file_enumerate_children (file, OSTREE_GIO_FAST_QUERYINFO,
+                                        G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                        cancellable, error);
+  if (dir_enum == NULL)
+    return FALSE;
+
+  while ((child_info = g_file_enumerator_next_file (dir_enum, cancellable, &temp_error)))
+    {
+      const char *name = g_file_info_get_name (child_info);
+      g_autoptr(GFile) child = g_file_get_child (file, name);
+      g_autofree char *child_path = g_build_filename (path, name, NULL);
+
+      if (!builder_cache_add_paths_recurse (child, child_info, child_path, paths,
+                                            cancellable, error))
+        return FALSE;
+
+      g_clear_object (&child_info);
+    }
+
+  if (temp_error != NULL)
+    {
+      g_propagate_error (error, g_steal_pointer (&temp_error));
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Compares a committed tree with a directory in the app dir. This
+ * gives the same result as ostree_diff_dirs() with
+ * OSTREE_DIFF_FLAGS_IGNORE_XATTRS, but only files whose identity
+ * changed since they were last checksummed are read. */
+static gboolean
+builder_cache_diff_dir (BuilderCache *self,
+                        GFile        *from_dir,
+                        GFile        *to_dir,
+                        const char   *relpath,
+                        GPtrArray    *added,
+                        GPtrArray    *modified,
+                        GPtrArray    *removed,
+                        GCancellable *cancellable,
+                        GError      **error)
+{
+  g_autoptr(GHashTable) from_children = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_object_unref);
+  g_autoptr(GFileEnumerator) dir_enum = NULL;
+  g_autoptr(GFileInfo) child_info = NULL;
+  g_autoptr(GError) temp_error = NULL;
+  GHashTableIter iter;
+  gpointer key, value;
+
+  dir_enum = g_file_enumerate_children (from_dir, OSTREE_GIO_FAST_QUERYINFO,
+                                        G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                        cancellable, error);
+  if (dir_enum == NULL)
+    return FALSE;
+
+  while ((child_info = g_file_enumerator_next_file (dir_enum, cancellable, &temp_error)))
+    g_hash_table_insert (from_children,
+                         g_strdup (g_file_info_get_name (child_info)),
+                         g_steal_pointer (&child_info));
+
+  if (temp_error != NULL)
+    {
+      g_propagate_error (error, g_steal_pointer (&temp_error));
+      return FALSE;
+    }
+
+  g_clear_object (&dir_enum);
+  dir_enum = g_file_enumerate_children (to_dir, BUILDER_CACHE_FILE_QUERYINFO,
+                                        G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                        cancellable, error);
+  if (dir_enum == NULL)
+    return FALSE;
+
+  while ((child_info = g_file_enumerator_next_file (dir_enum, cancellable, &temp_error)))
+    {
+      const char *name = g_file_info_get_name (child_info);
+      g_autoptr(GFile) to_child = g_file_get_child (to_dir, name);
+      g_autoptr(GFile) from_child = NULL;
+      g_autoptr(GFileInfo) from_info = NULL;
+      g_autofree char *path = NULL;
+      GFileType to_type = g_file_info_get_file_type (child_info);
+
+      if (relpath)
+        path = g_build_filename (relpath, name, NULL);
+      else
+        path = g_strdup (name);
+
+      from_info = g_hash_table_lookup (from_children, name);
+      if (from_info == NULL)
+        {
+          if (!builder_cache_add_paths_recurse (to_child, child_info, path, added,
+                                                cancellable, error))
+            return FALSE;
+
+          g_clear_object (&child_info);
+          continue;
+        }
+
+      g_object_ref (from_info);
+      g_hash_table_remove (from_children, name);
+      from_child = g_file_get_child (from_dir, name);
+
+      if (g_file_info_get_file_type (from_info) != to_type)
+        {
+          if (!builder_cache_add_paths_recurse (from_child, from_info, path, removed,
+                                                cancellable, error))
+            return FALSE;
+          if (!builder_cache_add_paths_recurse (to_child, child_info, path, added,
+                                                cancellable, error))
+            return FALSE;
+        }
+      else if (to_type == G_FILE_TYPE_DIRECTORY)
+        {
+          if (!builder_cache_diff_dir (self, from_child, to_child, path,
+                                       added, modified, removed,
+                                       cancellable, error))
+            return FALSE;
+        }
+      else if (to_type == G_FILE_TYPE_REGULAR &&
+               g_file_info_get_size (from_info) != g_file_info_get_size (child_info))
+        {
+          if (modified)
+            g_ptr_array_add (modified, g_steal_pointer (&path));
+        }
+      else
+        {
+          g_autofree char *checksum = NULL;
+
+          if (!builder_cache_checksum_file (self, to_child, child_info, FALSE,
+                                            &checksum, cancellable, error))
+            return FALSE;
+
+          if (strcmp (checksum, ostree_repo_file_get_checksum (OSTREE_REPO_FILE (from_child))) != 0 &&
+              modified)
+            g_ptr_array_add (modified, g_steal_pointer (&path));
+        }
+
+      g_clear_object (&child_info);
+    }
+
+  if (temp_error != NULL)
+    {
+      g_propagate_error (error, g_steal_pointer (&temp_error));
+      return FALSE;
+    }
+
+  g_hash_table_iter_init (&iter, from_children);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      const char *name = key;
+      GFileInfo *from_info = value;
+      g_autoptr(GFile) from_child = g_file_get_child (from_dir, name);
+      g_autofree char *path = NULL;
+
+      if (relpath)
+        path = g_build_filename (relpath, name, NULL);
+      else
+        path = g_strdup (name);
+
+      if (!builder_cache_add_paths_recurse (from_child, from_info, path, removed,
+                                            cancellable, error))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
 static gboolean
 builder_cache_checkout (BuilderCache *self, const char *commit)
 {
@@ -300,6 +770,9 @@ builder_cache_checkout (BuilderCache *self, const char *commit)
                                   NULL, NULL))
     return FALSE;
 
+  if (!builder_cache_remember_checkout (self, root, self->app_dir, NULL, NULL))
+    return FALSE;
+
   return TRUE;
 }
 
@@ -395,9 +868,9 @@ builder_cache_commit (BuilderCache *self,
                       GError      **error)
 {
   g_autofree char *current = NULL;
-  OstreeRepoCommitModifier *modifier = NULL;
 
   g_autoptr(OstreeMutableTree) mtree = NULL;
+  g_autoptr(GFileInfo) app_dir_info = NULL;
   g_autoptr(GFile) root = NULL;
   g_autofree char *commit_checksum = NULL;
   gboolean res = FALSE;
@@ -410,10 +883,14 @@ builder_cache_commit (BuilderCache *self,
 
   mtree = ostree_mutable_tree_new ();
 
-  modifier = ostree_repo_commit_modifier_new (OSTREE_REPO_COMMIT_MODIFIER_FLAGS_SKIP_XATTRS,
-                                              NULL, NULL, NULL);
-  if (!ostree_repo_write_directory_to_mtree (self->repo, self->app_dir,
-                                             mtree, modifier, NULL, error))
+  app_dir_info = g_file_query_info (self->app_dir, BUILDER_CACHE_FILE_QUERYINFO,
+                                    G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                    NULL, error);
+  if (app_dir_info == NULL)
+    goto out;
+
+  if (!builder_cache_write_dir_to_mtree (self, self->app_dir, app_dir_info,
+                                         mtree, NULL, error))
     goto out;
 
   if (!ostree_repo_write_mtree (self->repo, mtree, &root, NULL, error))
@@ -443,8 +920,6 @@ out:
       if (!ostree_repo_abort_transaction (self->repo, NULL, NULL))
         g_warning ("failed to abort transaction");
     }
-  if (modifier)
-    ostree_repo_commit_modifier_unref (modifier);
 
   return res;
 }
@@ -456,53 +931,24 @@ builder_cache_get_outstanding_changes (BuilderCache *self,
                                        GPtrArray   **removed_out,
                                        GError      **error)
 {
-  g_autoptr(GPtrArray) added = g_ptr_array_new_with_free_func (g_object_unref);
-  g_autoptr(GPtrArray) modified = g_ptr_array_new_with_free_func ((GDestroyNotify) ostree_diff_item_unref);
-  g_autoptr(GPtrArray) removed = g_ptr_array_new_with_free_func (g_object_unref);
   g_autoptr(GPtrArray) added_paths = g_ptr_array_new_with_free_func (g_free);
   g_autoptr(GPtrArray) modified_paths = g_ptr_array_new_with_free_func (g_free);
   g_autoptr(GPtrArray) removed_paths = g_ptr_array_new_with_free_func (g_free);
   g_autoptr(GFile) last_root = NULL;
-  g_autoptr(GVariant) variant = NULL;
-  int i;
 
   if (!ostree_repo_read_commit (self->repo, self->last_parent, &last_root, NULL, NULL, error))
     return FALSE;
 
-  if (!ostree_repo_load_variant (self->repo, OSTREE_OBJECT_TYPE_COMMIT, self->last_parent,
-                                 &variant, NULL))
-    return FALSE;
-
-  if (!ostree_diff_dirs (OSTREE_DIFF_FLAGS_IGNORE_XATTRS,
-                         last_root,
-                         self->app_dir,
-                         modified,
-                         removed,
-                         added,
-                         NULL, error))
+  if (!builder_cache_diff_dir (self,
+                               last_root,
+                               self->app_dir,
+                               NULL,
+                               added_out ? added_paths : NULL,
+                               modified_out ? modified_paths : NULL,
+                               removed_out ? removed_paths : NULL,
+                               NULL, error))
     return FALSE;
 
-  for (i = 0; i < added->len; i++)
-    {
-      GFile *added_file = g_ptr_array_index (added, i);
-      char *path = g_file_get_relative_path (self->app_dir, added_file);
-      g_ptr_array_add (added_paths, path);
-    }
-
-  for (i = 0; i < modified->len; i++)
-    {
-      OstreeDiffItem *modified_item = g_ptr_array_index (modified, i);
-      char *path = g_file_get_relative_path (self->app_dir, modified_item->target);
-      g_ptr_array_add (modified_paths, path);
-    }
-
-  for (i = 0; i < removed->len; i++)
-    {
-      GFile *removed_file = g_ptr_array_index (removed, i);
-      char *path = g_file_get_relative_path (self->app_dir, removed_file);
-      g_ptr_array_add (removed_paths, path);
-    }
-
   if (added_out)
     *added_out = g_steal_pointer (&added_paths);
 
@@ -45,6 +45,7 @@ struct BuilderContext
   GFile          *build_dir;
   GFile          *cache_dir;
   GFile          *ccache_dir;
+  GFile          *git_mirror_dir;
 
   BuilderOptions *options;
   gboolean        keep_build_dirs;
@@ -53,6 +54,7 @@ struct BuilderContext
   gboolean        use_ccache;
   gboolean        build_runtime;
   gboolean        separate_locales;
+  gboolean        shallow_clone;
 };
 
 typedef struct
@@ -79,6 +81,7 @@ builder_context_finalize (GObject *object)
   g_clear_object (&self->base_dir);
   g_clear_object (&self->soup_session);
   g_clear_object (&self->options);
+  g_clear_object (&self->git_mirror_dir);
   g_free (self->arch);
   g_strfreev (self->cleanup);
   g_strfreev (self->cleanup_platform);
@@ -142,6 +145,7 @@ builder_context_constructed (GObject *object)
   self->build_dir = g_file_get_child (self->state_dir, "build");
   self->cache_dir = g_file_get_child (self->state_dir, "cache");
   self->ccache_dir = g_file_get_child (self->state_dir, "ccache");
+  self->git_mirror_dir = g_file_get_child (self->state_dir, "git");
 }
 
 static void
@@ -347,6 +351,34 @@ builder_context_set_separate_locales (BuilderContext *self,
   self->separate_locales = !!separate_locales;
 }
 
+GFile *
+builder_context_get_git_mirror_dir (BuilderContext *self)
+{
+  return self->git_mirror_dir;
+}
+
+/* This lets several manifests (or several checkouts of one) share
+   the same git mirrors instead of each having its own copy. */
+void
+builder_context_set_git_mirror_dir (BuilderContext *self,
+                                    GFile          *git_mirror_dir)
+{
+  g_set_object (&self->git_mirror_dir, git_mirror_dir);
+}
+
+gboolean
+builder_context_get_shallow_clone (BuilderContext *self)
+{
+  return self->shallow_clone;
+}
+
+void
+builder_context_set_shallow_clone (BuilderContext *self,
+                                   gboolean        shallow_clone)
+{
+  self->shallow_clone = !!shallow_clone;
+}
+
 gboolean
 builder_context_enable_ccache (BuilderContext *self,
                                GError        **error)
@@ -42,6 +42,9 @@ GFile *         builder_context_get_cache_dir (BuilderContext *self);
 GFile *         builder_context_get_build_dir (BuilderContext *self);
 GFile *         builder_context_get_ccache_dir (BuilderContext *self);
 GFile *         builder_context_get_download_dir (BuilderContext *self);
+GFile *         builder_context_get_git_mirror_dir (BuilderContext *self);
+void            builder_context_set_git_mirror_dir (BuilderContext *self,
+                                                    GFile          *git_mirror_dir);
 SoupSession *   builder_context_get_soup_session (BuilderContext *self);
 const char *    builder_context_get_arch (BuilderContext *self);
 void            builder_context_set_arch (BuilderContext *self,
@@ -65,6 +68,9 @@ void            builder_context_set_build_runtime (BuilderContext *self,
 gboolean        builder_context_get_separate_locales (BuilderContext *self);
 void            builder_context_set_separate_locales (BuilderContext *self,
                                                       gboolean        separate_locales);
+gboolean        builder_context_get_shallow_clone (BuilderContext *self);
+void            builder_context_set_shallow_clone (BuilderContext *self,
+                                                   gboolean        shallow_clone);
 
 BuilderContext *builder_context_new (GFile *base_dir,
                                      GFile *app_dir);
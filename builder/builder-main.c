@@ -44,6 +44,8 @@ static gboolean opt_ccache;
 static gboolean opt_require_changes;
 static gboolean opt_keep_build_dirs;
 static gboolean opt_force_clean;
+static gboolean opt_shallow_clone;
+static char *opt_git_mirror_dir;
 static char *opt_arch;
 static char *opt_repo;
 static char *opt_subject;
@@ -70,6 +72,8 @@ static GOptionEntry entries[] = {
   { "gpg-sign", 0, 0, G_OPTION_ARG_STRING_ARRAY, &opt_key_ids, "GPG Key ID to sign the commit with", "KEY-ID"},
   { "gpg-homedir", 0, 0, G_OPTION_ARG_STRING, &opt_gpg_homedir, "GPG Homedir to use when looking for keyrings", "HOMEDIR"},
   { "force-clean", 0, 0, G_OPTION_ARG_NONE, &opt_force_clean, "Erase previous contents of DIRECTORY", NULL },
+  { "shallow-clone", 0, 0, G_OPTION_ARG_NONE, &opt_shallow_clone, "Only fetch the needed commit of git sources", NULL },
+  { "git-mirror-dir", 0, 0, G_OPTION_ARG_FILENAME, &opt_git_mirror_dir, "Share git mirrors in DIR with other builds", "DIR" },
   { NULL }
 };
 
@@ -238,6 +242,13 @@ main (int    argc,
   build_context = builder_context_new (base_dir, app_dir);
 
   builder_context_set_keep_build_dirs (build_context, opt_keep_build_dirs);
+  builder_context_set_shallow_clone (build_context, opt_shallow_clone);
+
+  if (opt_git_mirror_dir)
+    {
+      g_autoptr(GFile) git_mirror_dir = g_file_new_for_commandline_arg (opt_git_mirror_dir);
+      builder_context_set_git_mirror_dir (build_context, git_mirror_dir);
+    }
 
   if (opt_arch)
     builder_context_set_arch (build_context, opt_arch);
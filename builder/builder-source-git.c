@@ -26,6 +26,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/statfs.h>
+#include <sys/file.h>
 
 #include "builder-utils.h"
 #include "libgsystem.h"
@@ -40,6 +41,7 @@ struct BuilderSourceGit
 
   char         *url;
   char         *branch;
+  gboolean      disable_shallow_clone;
 };
 
 typedef struct
@@ -53,12 +55,17 @@ enum {
   PROP_0,
   PROP_URL,
   PROP_BRANCH,
+  PROP_DISABLE_SHALLOW_CLONE,
   LAST_PROP
 };
 
+/* Max number of submodules of a repo that are mirrored in parallel */
+#define MAX_PARALLEL_SUBMODULE_MIRRORS 4
+
 static gboolean git_mirror_repo (const char     *repo_url,
                                  gboolean        update,
                                  const char     *ref,
+                                 gboolean        shallow,
                                  BuilderContext *context,
                                  GError        **error);
 
@@ -92,6 +99,10 @@ builder_source_git_get_property (GObject    *object,
       g_value_set_string (value, self->branch);
       break;
 
+    case PROP_DISABLE_SHALLOW_CLONE:
+      g_value_set_boolean (value, self->disable_shallow_clone);
+      break;
+
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
     }
@@ -117,6 +128,10 @@ builder_source_git_set_property (GObject      *object,
       self->branch = g_value_dup_string (value);
       break;
 
+    case PROP_DISABLE_SHALLOW_CLONE:
+      self->disable_shallow_clone = g_value_get_boolean (value);
+      break;
+
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
     }
@@ -142,12 +157,11 @@ static GFile *
 git_get_mirror_dir (const char     *url,
                     BuilderContext *context)
 {
-  g_autoptr(GFile) git_dir = NULL;
+  GFile *git_dir;
   g_autofree char *filename = NULL;
   g_autofree char *git_dir_path = NULL;
 
-  git_dir = g_file_get_child (builder_context_get_state_dir (context),
-                              "git");
+  git_dir = builder_context_get_git_mirror_dir (context);
 
   git_dir_path = g_file_get_path (git_dir);
   g_mkdir_with_parents (git_dir_path, 0755);
@@ -156,6 +170,80 @@ git_get_mirror_dir (const char     *url,
   return g_file_get_child (git_dir, filename);
 }
 
+/* The mirror dir may be shared with other builds (and with other
+   threads mirroring submodules), so serialize all changes to it */
+static gboolean
+git_lock_mirror_dir (GFile        *mirror_dir,
+                     GLnxLockFile *lockfile,
+                     GError      **error)
+{
+  g_autofree char *mirror_dir_path = g_file_get_path (mirror_dir);
+  g_autofree char *lock_path = g_strconcat (mirror_dir_path, ".lock", NULL);
+
+  return glnx_make_lock_file (AT_FDCWD, lock_path, LOCK_EX, lockfile, error);
+}
+
+static gboolean
+git_is_commit_id (const char *ref)
+{
+  int i;
+
+  for (i = 0; ref[i] != 0; i++)
+    {
+      if (!g_ascii_isxdigit (ref[i]))
+        return FALSE;
+    }
+
+  return i == 40;
+}
+
+static gboolean
+git_mirror_is_shallow (GFile *mirror_dir)
+{
+  g_autoptr(GFile) shallow_file = g_file_get_child (mirror_dir, "shallow");
+
+  return g_file_query_exists (shallow_file, NULL);
+}
+
+static gboolean
+git_fetch_full (GFile   *mirror_dir,
+                GError **error)
+{
+  if (git_mirror_is_shallow (mirror_dir))
+    return git (mirror_dir, NULL, error,
+                "fetch", "-p", "--unshallow", "origin", NULL);
+
+  return git (mirror_dir, NULL, error,
+              "fetch", "-p", "origin", NULL);
+}
+
+/* Fetch only the commit that ref points to. Commit ids are stored in a
+   branch so that they survive gc and get copied into the checkout. */
+static gboolean
+git_fetch_shallow (GFile      *mirror_dir,
+                   const char *repo_url,
+                   const char *ref,
+                   GError    **error)
+{
+  g_autofree char *refspec = NULL;
+  g_autoptr(GError) my_error = NULL;
+
+  if (git_is_commit_id (ref))
+    refspec = g_strdup_printf ("+%s:refs/heads/flatpak-builder/%s", ref, ref);
+  else
+    refspec = g_strdup_printf ("+%s:%s", ref, ref);
+
+  if (git (mirror_dir, NULL, &my_error,
+           "fetch", "--depth=1", "origin", refspec, NULL))
+    return TRUE;
+
+  /* Not all servers allow fetching a commit by id, so fall back
+     to mirroring everything */
+  g_debug ("Shallow fetch of %s from %s failed: %s", ref, repo_url, my_error->message);
+
+  return git_fetch_full (mirror_dir, error);
+}
+
 static const char *
 get_branch (BuilderSourceGit *self)
 {
@@ -252,80 +340,156 @@ make_absolute_url (const char *orig_parent, const char *orig_relpath, GError **e
   return g_strconcat (parent, "/", relpath, NULL);
 }
 
+typedef struct
+{
+  char           *url;
+  char           *commit;
+  gboolean        update;
+  gboolean        shallow;
+  BuilderContext *context;
+  GError         *error;
+} GitMirrorJob;
+
+static void
+git_mirror_job_free (GitMirrorJob *job)
+{
+  g_free (job->url);
+  g_free (job->commit);
+  g_clear_error (&job->error);
+  g_free (job);
+}
+
+static void
+git_mirror_job_run (gpointer data,
+                    gpointer user_data)
+{
+  GitMirrorJob *job = data;
+  g_autoptr(GMainContext) main_context = g_main_context_new ();
+
+  /* flatpak_spawn() iterates the thread default context */
+  g_main_context_push_thread_default (main_context);
+  git_mirror_repo (job->url, job->update, job->commit, job->shallow,
+                   job->context, &job->error);
+  g_main_context_pop_thread_default (main_context);
+}
+
 static gboolean
 git_mirror_submodules (const char     *repo_url,
                        gboolean        update,
                        GFile          *mirror_dir,
                        const char     *revision,
+                       gboolean        shallow,
                        BuilderContext *context,
                        GError        **error)
 {
-  g_autofree char *mirror_dir_path = NULL;
+  g_autofree char *gitmodules = g_strconcat (revision, ":.gitmodules", NULL);
+  g_autofree char *submodule_paths = NULL;
+  g_autoptr(GPtrArray) jobs = g_ptr_array_new_with_free_func ((GDestroyNotify) git_mirror_job_free);
+  g_auto(GStrv) lines = NULL;
+  GThreadPool *pool;
+  int i;
+
+  /* Read .gitmodules and the submodule commits directly from the
+     mirror, rather than doing a full checkout of the revision. This
+     fails if there is no .gitmodules file, or no submodules in it. */
+  if (!git (mirror_dir, &submodule_paths, NULL,
+            "config", "--blob", gitmodules,
+            "--get-regexp", "^submodule\\..*\\.path$", NULL))
+    return TRUE;
+
+  lines = g_strsplit (submodule_paths, "\n", -1);
+  for (i = 0; lines[i] != NULL; i++)
+    {
+      g_autofree char *name = NULL;
+      g_autofree char *option = NULL;
+      g_autofree char *update_method = NULL;
+      g_autofree char *url = NULL;
+      g_autofree char *tree_entry = NULL;
+      g_auto(GStrv) words = NULL;
+      g_auto(GStrv) entry_words = NULL;
+      GitMirrorJob *job;
+
+      if (*lines[i] == 0)
+        continue;
+
+      /* Lines are of the form "submodule.$name.path $path" */
+      words = g_strsplit (lines[i], " ", 2);
+      if (g_strv_length (words) != 2 ||
+          !g_str_has_suffix (words[0], ".path"))
+        continue;
+
+      name = g_strndup (words[0] + strlen ("submodule."),
+                        strlen (words[0]) - strlen ("submodule.") - strlen (".path"));
+
+      /* Disabled submodules are not extracted, so don't mirror them */
+      option = g_strdup_printf ("submodule.%s.update", name);
+      if (git (mirror_dir, &update_method, NULL,
+               "config", "--blob", gitmodules, option, NULL))
+        {
+          g_strchomp (update_method);
+          if (g_strcmp0 (update_method, "none") == 0)
+            continue;
+        }
 
-  g_autoptr(GFile) checkout_dir_template = NULL;
-  g_autoptr(GFile) checkout_dir = NULL;
-  g_autofree char *checkout_dir_path = NULL;
-  g_autofree char *submodule_status = NULL;
+      g_free (option);
+      option = g_strdup_printf ("submodule.%s.url", name);
+      if (!git (mirror_dir, &url, error,
+                "config", "--blob", gitmodules, option, NULL))
+        return FALSE;
 
-  mirror_dir_path = g_file_get_path (mirror_dir);
+      /* Trim trailing whitespace */
+      g_strchomp (url);
 
-  checkout_dir_template = g_file_get_child (builder_context_get_state_dir (context),
-                                            "tmp-checkout-XXXXXX");
-  checkout_dir_path = g_file_get_path (checkout_dir_template);
+      /* Lines are of the form "160000 commit $commit\t$path" */
+      if (!git (mirror_dir, &tree_entry, error,
+                "ls-tree", revision, "--", words[1], NULL))
+        return FALSE;
 
-  if (g_mkdtemp (checkout_dir_path) == NULL)
-    {
-      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, "Can't create temporary checkout directory");
-      return FALSE;
+      entry_words = g_strsplit_set (tree_entry, " \t", 4);
+      if (g_strv_length (entry_words) < 3 ||
+          strcmp (entry_words[1], "commit") != 0)
+        continue;
+
+      job = g_new0 (GitMirrorJob, 1);
+      job->url = make_absolute_url (repo_url, url, error);
+      if (job->url == NULL)
+        {
+          git_mirror_job_free (job);
+          return FALSE;
+        }
+      job->commit = g_strdup (entry_words[2]);
+      job->update = update;
+      job->shallow = shallow;
+      job->context = context;
+      g_ptr_array_add (jobs, job);
     }
 
-  checkout_dir = g_file_new_for_path (checkout_dir_path);
+  if (jobs->len == 0)
+    return TRUE;
 
-  if (!git (NULL, NULL, error,
-            "clone", "-q", "--no-checkout", mirror_dir_path, checkout_dir_path, NULL))
+  pool = g_thread_pool_new (git_mirror_job_run, NULL,
+                            MIN (jobs->len, MAX_PARALLEL_SUBMODULE_MIRRORS),
+                            FALSE, error);
+  if (pool == NULL)
     return FALSE;
 
-  if (!git (checkout_dir, NULL, error, "checkout", "-q", "-f", revision, NULL))
-    return FALSE;
+  for (i = 0; i < jobs->len; i++)
+    g_thread_pool_push (pool, g_ptr_array_index (jobs, i), NULL);
 
-  if (!git (checkout_dir, &submodule_status, error,
-            "submodule", "status", NULL))
-    return FALSE;
+  /* Waits for all the jobs to finish */
+  g_thread_pool_free (pool, FALSE, TRUE);
 
-  if (submodule_status)
+  for (i = 0; i < jobs->len; i++)
     {
-      int i;
-      g_auto(GStrv) lines = g_strsplit (submodule_status, "\n", -1);
-      for (i = 0; lines[i] != NULL; i++)
-        {
-          g_autofree char *url = NULL;
-          g_autofree char *option = NULL;
-          g_autofree char *old = NULL;
-          g_auto(GStrv) words = NULL;
-          if (*lines[i] == 0)
-            continue;
-          words = g_strsplit (lines[i] + 1, " ", 3);
-
-          option = g_strdup_printf ("submodule.%s.url", words[1]);
-          if (!git (checkout_dir, &url, error,
-                    "config", "-f", ".gitmodules", option, NULL))
-            return FALSE;
-          /* Trim trailing whitespace */
-          g_strchomp (url);
-
-          old = url;
-          url = make_absolute_url (repo_url, old, error);
-          if (url == NULL)
-            return FALSE;
+      GitMirrorJob *job = g_ptr_array_index (jobs, i);
 
-          if (!git_mirror_repo (url, update, words[0], context, error))
-            return FALSE;
+      if (job->error)
+        {
+          g_propagate_error (error, g_steal_pointer (&job->error));
+          return FALSE;
         }
     }
 
-  if (!gs_shutil_rm_rf (checkout_dir, NULL, error))
-    return FALSE;
-
   return TRUE;
 }
 
@@ -333,14 +497,19 @@ static gboolean
 git_mirror_repo (const char     *repo_url,
                  gboolean        update,
                  const char     *ref,
+                 gboolean        shallow,
                  BuilderContext *context,
                  GError        **error)
 {
   g_autoptr(GFile) mirror_dir = NULL;
   g_autofree char *current_commit = NULL;
+  g_auto(GLnxLockFile) lock = GLNX_LOCK_FILE_INIT;
 
   mirror_dir = git_get_mirror_dir (repo_url, context);
 
+  if (!git_lock_mirror_dir (mirror_dir, &lock, error))
+    return FALSE;
+
   if (!g_file_query_exists (mirror_dir, NULL))
     {
       g_autofree char *filename = g_file_get_basename (mirror_dir);
@@ -348,31 +517,80 @@ git_mirror_repo (const char     *repo_url,
       g_autofree char *filename_tmp = g_strconcat (filename, ".clone_tmp", NULL);
       g_autoptr(GFile) mirror_dir_tmp = g_file_get_child (parent, filename_tmp);
 
-      g_print ("Cloning git repo %s\n", repo_url);
+      /* Left over from an interrupted clone */
+      if (!gs_shutil_rm_rf (mirror_dir_tmp, NULL, error))
+        return FALSE;
+
+      if (shallow)
+        {
+          g_print ("Fetching %s from git repo %s\n", ref, repo_url);
 
-      if (!git (parent, NULL, error,
-                "clone", "--mirror", repo_url,  filename_tmp, NULL) ||
-          !g_file_move (mirror_dir_tmp, mirror_dir, 0, NULL, NULL, NULL, error))
+          if (!git (parent, NULL, error,
+                    "init", "-q", "--bare", filename_tmp, NULL) ||
+              !git (mirror_dir_tmp, NULL, error,
+                    "remote", "add", "--mirror=fetch", "origin", repo_url, NULL) ||
+              !git_fetch_shallow (mirror_dir_tmp, repo_url, ref, error))
+            return FALSE;
+        }
+      else
+        {
+          g_print ("Cloning git repo %s\n", repo_url);
+
+          if (!git (parent, NULL, error,
+                    "clone", "--mirror", repo_url,  filename_tmp, NULL))
+            return FALSE;
+        }
+
+      if (!g_file_move (mirror_dir_tmp, mirror_dir, 0, NULL, NULL, NULL, error))
+        return FALSE;
+    }
+  else if (!shallow && git_mirror_is_shallow (mirror_dir))
+    {
+      g_print ("Fetching full history of git repo %s\n", repo_url);
+      if (!git_fetch_full (mirror_dir, error))
         return FALSE;
     }
   else if (update)
     {
       g_print ("Fetching git repo %s\n", repo_url);
-      if (!git (mirror_dir, NULL, error,
-                "fetch", "-p", NULL))
+      if (shallow && git_mirror_is_shallow (mirror_dir))
+        {
+          if (!git_fetch_shallow (mirror_dir, repo_url, ref, error))
+            return FALSE;
+        }
+      else if (!git_fetch_full (mirror_dir, error))
+        return FALSE;
+    }
+
+  current_commit = git_get_current_commit (mirror_dir, ref, context, NULL);
+  if (current_commit == NULL && shallow && git_mirror_is_shallow (mirror_dir))
+    {
+      /* The manifest moved to a commit we don't have yet */
+      g_print ("Fetching %s from git repo %s\n", ref, repo_url);
+      if (!git_fetch_shallow (mirror_dir, repo_url, ref, error))
         return FALSE;
     }
 
-  current_commit = git_get_current_commit (mirror_dir, ref, context, error);
+  if (current_commit == NULL)
+    current_commit = git_get_current_commit (mirror_dir, ref, context, error);
   if (current_commit == NULL)
     return FALSE;
 
-  if (!git_mirror_submodules (repo_url, update, mirror_dir, current_commit, context, error))
+  glnx_release_lock_file (&lock);
+
+  if (!git_mirror_submodules (repo_url, update, mirror_dir, current_commit, shallow, context, error))
     return FALSE;
 
   return TRUE;
 }
 
+static gboolean
+git_use_shallow_clone (BuilderSourceGit *self,
+                       BuilderContext   *context)
+{
+  return builder_context_get_shallow_clone (context) && !self->disable_shallow_clone;
+}
+
 static gboolean
 builder_source_git_download (BuilderSource  *source,
                              gboolean        update_vcs,
@@ -389,6 +607,7 @@ builder_source_git_download (BuilderSource  *source,
   if (!git_mirror_repo (url,
                         update_vcs,
                         get_branch (self),
+                        git_use_shallow_clone (self, context),
                         context,
                         error))
     return FALSE;
@@ -420,7 +639,7 @@ git_extract_submodule (const char     *repo_url,
           g_autofree char *option = NULL;
           g_autofree char *update_method = NULL;
           g_autofree char *child_relative_url = NULL;
-          g_autofree char *mirror_dir_as_url = NULL;
+          g_autofree char *mirror_dir_path = NULL;
           g_auto(GStrv) words = NULL;
           if (*lines[i] == 0)
             continue;
@@ -455,10 +674,12 @@ git_extract_submodule (const char     *repo_url,
 
           mirror_dir = git_get_mirror_dir (child_url, context);
 
-          mirror_dir_as_url = g_file_get_uri (mirror_dir);
+          /* Use a plain path rather than a file: uri, so that git
+             hardlinks the objects rather than copying them */
+          mirror_dir_path = g_file_get_path (mirror_dir);
 
           if (!git (checkout_dir, NULL, error,
-                    "config", option, mirror_dir_as_url, NULL))
+                    "config", option, mirror_dir_path, NULL))
             return FALSE;
 
           if (!git (checkout_dir, NULL, error,
@@ -497,12 +718,13 @@ builder_source_git_extract (BuilderSource  *source,
   mirror_dir_path = g_file_get_path (mirror_dir);
   dest_path = g_file_get_path (dest);
 
+  /* Don't check out the default branch just to replace it below */
   if (!git (NULL, NULL, error,
-            "clone", mirror_dir_path, dest_path, NULL))
+            "clone", "-q", "--no-checkout", mirror_dir_path, dest_path, NULL))
     return FALSE;
 
   if (!git (dest, NULL, error,
-            "checkout", get_branch (self), NULL))
+            "checkout", "-q", get_branch (self), NULL))
     return FALSE;
 
   if (!git_extract_submodule (url, dest, context, error))
@@ -603,6 +825,13 @@ builder_source_git_class_init (BuilderSourceGitClass *klass)
                                                         "",
                                                         NULL,
                                                         G_PARAM_READWRITE));
+  g_object_class_install_property (object_class,
+                                   PROP_DISABLE_SHALLOW_CLONE,
+                                   g_param_spec_boolean ("disable-shallow-clone",
+                                                         "",
+                                                         "",
+                                                         FALSE,
+                                                         G_PARAM_READWRITE));
 }
 
 static void
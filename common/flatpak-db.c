@@ -50,6 +50,18 @@ struct FlatpakDb
   GvdbTable  *app_table;
   GHashTable *app_additions;
   GHashTable *app_removals;
+
+  /* (reverse) Map value key => [ id ], see value_key().
+     This is missing in dbs written by older versions */
+  GvdbTable  *value_table;
+  GHashTable *value_additions;
+  GHashTable *value_removals;
+
+  /* Sorted names in main_table and app_table, created on first use.
+     The tables are never replaced after loading so these stay valid */
+  char      **main_names;
+  guint       n_main_names;
+  char      **app_names;
 };
 
 typedef struct
@@ -142,9 +154,14 @@ flatpak_db_finalize (GObject *object)
   g_clear_pointer (&self->gvdb, gvdb_table_free);
   g_clear_pointer (&self->main_table, gvdb_table_free);
   g_clear_pointer (&self->app_table, gvdb_table_free);
+  g_clear_pointer (&self->value_table, gvdb_table_free);
   g_clear_pointer (&self->main_updates, g_hash_table_unref);
   g_clear_pointer (&self->app_additions, g_hash_table_unref);
   g_clear_pointer (&self->app_removals, g_hash_table_unref);
+  g_clear_pointer (&self->value_additions, g_hash_table_unref);
+  g_clear_pointer (&self->value_removals, g_hash_table_unref);
+  g_clear_pointer (&self->main_names, g_strfreev);
+  g_clear_pointer (&self->app_names, g_strfreev);
 
   G_OBJECT_CLASS (flatpak_db_parent_class)->finalize (object);
 }
@@ -235,6 +252,12 @@ flatpak_db_init (FlatpakDb *self)
   self->app_removals =
     g_hash_table_new_full (g_str_hash, g_str_equal,
                            g_free, (GDestroyNotify) g_ptr_array_unref);
+  self->value_additions =
+    g_hash_table_new_full (g_str_hash, g_str_equal,
+                           g_free, (GDestroyNotify) g_ptr_array_unref);
+  self->value_removals =
+    g_hash_table_new_full (g_str_hash, g_str_equal,
+                           g_free, (GDestroyNotify) g_ptr_array_unref);
 }
 
 static gboolean
@@ -319,6 +342,9 @@ initable_init (GInitable    *initable,
                        "No app table in db");
           return FALSE;
         }
+
+      /* Optional, we fall back to scanning the main table without it */
+      self->value_table = gvdb_table_get_table (self->gvdb, "values");
     }
 
   return TRUE;
@@ -330,42 +356,138 @@ initable_iface_init (GInitableIface *initable_iface)
   initable_iface->init = initable_init;
 }
 
-/* Transfer: full */
-char **
-flatpak_db_list_ids (FlatpakDb *self)
+static char **
+get_sorted_names (GvdbTable *table,
+                  char    ***names_cache,
+                  guint     *n_names)
 {
-  GPtrArray *res;
-  GHashTableIter iter;
-  gpointer key, value;
-  int i;
+  if (*names_cache == NULL)
+    {
+      gint length;
 
-  g_return_val_if_fail (FLATPAK_IS_DB (self), NULL);
+      *names_cache = gvdb_table_get_names (table, &length);
+      qsort (*names_cache, length, sizeof (char *), cmpstringp);
+      if (n_names)
+        *n_names = length;
+    }
 
-  res = g_ptr_array_new ();
+  return *names_cache;
+}
 
-  g_hash_table_iter_init (&iter, self->main_updates);
-  while (g_hash_table_iter_next (&iter, &key, &value))
-    {
-      if (value != NULL)
-        g_ptr_array_add (res, g_strdup (key));
-    }
+/**
+ * flatpak_db_iter_init:
+ * @iter: an uninitialized #FlatpakDbIter
+ * @self: a #FlatpakDb
+ * @prefix: (nullable): only return ids starting with this
+ *
+ * Initializes @iter for iterating over the ids in @self, including any
+ * pending changes. Unlike flatpak_db_list_ids() this doesn't copy the ids,
+ * and with a @prefix only the matching range of the serialized table is
+ * looked at. The db must not be modified while iterating, and @prefix must
+ * stay valid until the iteration is finished.
+ */
+void
+flatpak_db_iter_init (FlatpakDbIter *iter,
+                      FlatpakDb     *self,
+                      const char    *prefix)
+{
+  g_return_if_fail (FLATPAK_IS_DB (self));
+
+  iter->db = self;
+  iter->prefix = prefix ? prefix : "";
+  iter->prefix_len = strlen (iter->prefix);
+  iter->in_updates = TRUE;
+  g_hash_table_iter_init (&iter->updates_iter, self->main_updates);
+  iter->table_pos = 0;
+  iter->table_end = 0;
 
   if (self->main_table)
     {
-      // TODO: can we use gvdb_table_list here???
-      g_autofree char **main_ids = gvdb_table_get_names (self->main_table, NULL);
+      char **names = get_sorted_names (self->main_table, &self->main_names, &self->n_main_names);
+      guint lo = 0, hi = self->n_main_names;
 
-      for (i = 0; main_ids[i] != NULL; i++)
+      /* Find the first name >= prefix */
+      while (lo < hi)
         {
-          char *id = main_ids[i];
+          guint mid = lo + (hi - lo) / 2;
 
-          if (g_hash_table_lookup_extended (self->main_updates, id, NULL, NULL))
-            g_free (id);
+          if (strcmp (names[mid], iter->prefix) < 0)
+            lo = mid + 1;
           else
-            g_ptr_array_add (res, id);
+            hi = mid;
+        }
+
+      iter->table_pos = lo;
+      iter->table_end = self->n_main_names;
+    }
+}
+
+/**
+ * flatpak_db_iter_next:
+ * @iter: a #FlatpakDbIter
+ * @out_id: (out) (transfer none): return location for the next id
+ *
+ * Returns: %FALSE if there are no more ids
+ */
+gboolean
+flatpak_db_iter_next (FlatpakDbIter *iter,
+                      const char   **out_id)
+{
+  FlatpakDb *self = iter->db;
+  gpointer key, value;
+
+  if (iter->in_updates)
+    {
+      while (g_hash_table_iter_next (&iter->updates_iter, &key, &value))
+        {
+          if (value != NULL && g_str_has_prefix (key, iter->prefix))
+            {
+              *out_id = key;
+              return TRUE;
+            }
+        }
+
+      iter->in_updates = FALSE;
+    }
+
+  while (iter->table_pos < iter->table_end)
+    {
+      const char *id = self->main_names[iter->table_pos++];
+
+      /* Names are sorted, so we're past the matching range */
+      if (strncmp (id, iter->prefix, iter->prefix_len) != 0)
+        {
+          iter->table_pos = iter->table_end;
+          break;
         }
+
+      /* Removed, or already returned above */
+      if (g_hash_table_contains (self->main_updates, id))
+        continue;
+
+      *out_id = id;
+      return TRUE;
     }
 
+  return FALSE;
+}
+
+/* Transfer: full */
+char **
+flatpak_db_list_ids (FlatpakDb *self)
+{
+  FlatpakDbIter iter;
+  const char *id;
+  GPtrArray *res;
+
+  g_return_val_if_fail (FLATPAK_IS_DB (self), NULL);
+
+  res = g_ptr_array_new ();
+
+  flatpak_db_iter_init (&iter, self, NULL);
+  while (flatpak_db_iter_next (&iter, &id))
+    g_ptr_array_add (res, g_strdup (id));
+
   g_ptr_array_add (res, NULL);
   return (char **) g_ptr_array_free (res, FALSE);
 }
@@ -405,8 +527,7 @@ flatpak_db_list_apps (FlatpakDb *self)
 
   if (self->app_table)
     {
-      // TODO: can we use gvdb_table_list here???
-      g_autofree char **apps = gvdb_table_get_names (self->app_table, NULL);
+      char **apps = get_sorted_names (self->app_table, &self->app_names, NULL);
 
       for (i = 0; apps[i] != NULL; i++)
         {
@@ -441,10 +562,8 @@ flatpak_db_list_apps (FlatpakDb *self)
                 }
             }
 
-          if (empty)
-            g_free (app);
-          else
-            g_ptr_array_add (res, app);
+          if (!empty)
+            g_ptr_array_add (res, g_strdup (app));
         }
     }
 
@@ -520,38 +639,105 @@ flatpak_db_lookup (FlatpakDb  *self,
   return (FlatpakDbEntry *) res;
 }
 
+/* The key used for data in the value index. Different data may in
+   theory map to the same key, so always verify the matches. */
+static char *
+value_key (GVariant *data)
+{
+  g_autoptr(GVariant) normal = g_variant_get_normal_form (data);
+  g_autoptr(GChecksum) checksum = g_checksum_new (G_CHECKSUM_SHA256);
+
+  g_checksum_update (checksum, (const guchar *) g_variant_get_type_string (normal), -1);
+  g_checksum_update (checksum, g_variant_get_data (normal), g_variant_get_size (normal));
+
+  return g_strdup (g_checksum_get_string (checksum));
+}
+
+static char *
+entry_value_key (FlatpakDbEntry *entry)
+{
+  g_autoptr(GVariant) data = NULL;
+
+  if (entry == NULL)
+    return NULL;
+
+  data = flatpak_db_entry_get_data (entry);
+  return value_key (data);
+}
+
+static void
+add_id_if_data_matches (FlatpakDb  *self,
+                        GPtrArray  *res,
+                        const char *id,
+                        GVariant   *data)
+{
+  g_autoptr(FlatpakDbEntry) entry = NULL;
+  g_autoptr(GVariant) entry_data = NULL;
+
+  if (str_ptr_array_contains (res, id))
+    return;
+
+  entry = flatpak_db_lookup (self, id);
+  if (entry == NULL)
+    return;
+
+  entry_data = flatpak_db_entry_get_data (entry);
+  if (g_variant_equal (data, entry_data))
+    g_ptr_array_add (res, g_strdup (id));
+}
+
 /* Transfer: full */
 char **
 flatpak_db_list_ids_by_value (FlatpakDb *self,
                               GVariant  *data)
 {
-  g_autofree char **ids = flatpak_db_list_ids (self);
-  int i;
+  g_autofree char *key = NULL;
+  GPtrArray *additions;
+  GPtrArray *removals;
   GPtrArray *res;
+  int i;
 
   g_return_val_if_fail (FLATPAK_IS_DB (self), NULL);
   g_return_val_if_fail (data != NULL, NULL);
 
   res = g_ptr_array_new ();
 
-  for (i = 0; ids[i] != NULL; i++)
-    {
-      char *id = ids[i];
+  key = value_key (data);
+  additions = g_hash_table_lookup (self->value_additions, key);
+  removals = g_hash_table_lookup (self->value_removals, key);
 
-      g_autoptr(FlatpakDbEntry) entry = NULL;
-      g_autoptr(GVariant) entry_data = NULL;
+  if (additions)
+    {
+      for (i = 0; i < additions->len; i++)
+        add_id_if_data_matches (self, res, g_ptr_array_index (additions, i), data);
+    }
 
-      entry = flatpak_db_lookup (self, id);
-      if (entry)
+  if (self->value_table)
+    {
+      g_autoptr(GVariant) ids_v = gvdb_table_get_value (self->value_table, key);
+      if (ids_v)
         {
-          entry_data = flatpak_db_entry_get_data (entry);
-          if (g_variant_equal (data, entry_data))
+          g_autofree const char **ids = g_variant_get_strv (ids_v, NULL);
+
+          for (i = 0; ids[i] != NULL; i++)
             {
-              g_ptr_array_add (res, id);
-              id = NULL; /* Don't free, as we return this */
+              if (removals == NULL ||
+                  !str_ptr_array_contains (removals, ids[i]))
+                add_id_if_data_matches (self, res, ids[i], data);
             }
         }
-      g_free (id);
+    }
+  else if (self->main_table)
+    {
+      /* Old db without value index, scan all the ids that were not
+         updated, as those are handled by value_additions above */
+      char **main_ids = get_sorted_names (self->main_table, &self->main_names, &self->n_main_names);
+
+      for (i = 0; main_ids[i] != NULL; i++)
+        {
+          if (!g_hash_table_contains (self->main_updates, main_ids[i]))
+            add_id_if_data_matches (self, res, main_ids[i], data);
+        }
     }
 
   g_ptr_array_add (res, NULL);
@@ -559,16 +745,17 @@ flatpak_db_list_ids_by_value (FlatpakDb *self,
 }
 
 static void
-add_app_id (FlatpakDb  *self,
-            const char *app,
-            const char *id)
+add_index_id (GHashTable *additions_ht,
+              GHashTable *removals_ht,
+              const char *key,
+              const char *id)
 {
   GPtrArray *additions;
   GPtrArray *removals;
   int i;
 
-  additions = g_hash_table_lookup (self->app_additions, app);
-  removals = g_hash_table_lookup (self->app_removals, app);
+  additions = g_hash_table_lookup (additions_ht, key);
+  removals = g_hash_table_lookup (removals_ht, key);
 
   if (removals)
     {
@@ -586,22 +773,23 @@ add_app_id (FlatpakDb  *self,
     {
       additions = g_ptr_array_new_with_free_func (g_free);
       g_ptr_array_add (additions, g_strdup (id));
-      g_hash_table_insert (self->app_additions,
-                           g_strdup (app), additions);
+      g_hash_table_insert (additions_ht,
+                           g_strdup (key), additions);
     }
 }
 
 static void
-remove_app_id (FlatpakDb  *self,
-               const char *app,
-               const char *id)
+remove_index_id (GHashTable *additions_ht,
+                 GHashTable *removals_ht,
+                 const char *key,
+                 const char *id)
 {
   GPtrArray *additions;
   GPtrArray *removals;
   int i;
 
-  additions = g_hash_table_lookup (self->app_additions, app);
-  removals = g_hash_table_lookup (self->app_removals, app);
+  additions = g_hash_table_lookup (additions_ht, key);
+  removals = g_hash_table_lookup (removals_ht, key);
 
   if (additions)
     {
@@ -619,11 +807,27 @@ remove_app_id (FlatpakDb  *self,
     {
       removals = g_ptr_array_new_with_free_func (g_free);
       g_ptr_array_add (removals, g_strdup (id));
-      g_hash_table_insert (self->app_removals,
-                           g_strdup (app), removals);
+      g_hash_table_insert (removals_ht,
+                           g_strdup (key), removals);
     }
 }
 
+static void
+add_app_id (FlatpakDb  *self,
+            const char *app,
+            const char *id)
+{
+  add_index_id (self->app_additions, self->app_removals, app, id);
+}
+
+static void
+remove_app_id (FlatpakDb  *self,
+               const char *app,
+               const char *id)
+{
+  remove_index_id (self->app_additions, self->app_removals, app, id);
+}
+
 gboolean
 flatpak_db_is_dirty (FlatpakDb *self)
 {
@@ -641,6 +845,8 @@ flatpak_db_set_entry (FlatpakDb      *self,
   g_autoptr(FlatpakDbEntry) old_entry = NULL;
   g_autofree const char **old = NULL;
   g_autofree const char **new = NULL;
+  g_autofree char *old_key = NULL;
+  g_autofree char *new_key = NULL;
   static const char *empty[] = { NULL };
   const char **a, **b;
   int ia, ib;
@@ -656,6 +862,16 @@ flatpak_db_set_entry (FlatpakDb      *self,
                        g_strdup (id),
                        flatpak_db_entry_ref (entry));
 
+  old_key = entry_value_key (old_entry);
+  new_key = entry_value_key (entry);
+  if (g_strcmp0 (old_key, new_key) != 0)
+    {
+      if (old_key)
+        remove_index_id (self->value_additions, self->value_removals, old_key, id);
+      if (new_key)
+        add_index_id (self->value_additions, self->value_removals, new_key, id);
+    }
+
   a = empty;
   b = empty;
 
@@ -718,12 +934,16 @@ flatpak_db_set_entry (FlatpakDb      *self,
 void
 flatpak_db_update (FlatpakDb *self)
 {
-  GHashTable *root, *main_h, *apps_h;
+  GHashTable *root, *main_h, *apps_h, *values_h;
+  g_autoptr(GHashTable) values = NULL;
+  GHashTableIter iter;
+  gpointer key, value;
   GBytes *new_contents;
   GvdbTable *new_gvdb;
+  FlatpakDbIter db_iter;
+  const char *id;
   int i;
 
-  g_auto(GStrv) ids = NULL;
   g_auto(GStrv) apps = NULL;
 
   g_return_if_fail (FLATPAK_IS_DB (self));
@@ -731,22 +951,60 @@ flatpak_db_update (FlatpakDb *self)
   root = gvdb_hash_table_new (NULL, NULL);
   main_h = gvdb_hash_table_new (root, "main");
   apps_h = gvdb_hash_table_new (root, "apps");
+  values_h = gvdb_hash_table_new (root, "values");
   g_hash_table_unref (main_h);
   g_hash_table_unref (apps_h);
+  g_hash_table_unref (values_h);
 
-  ids = flatpak_db_list_ids (self);
-  for (i = 0; ids[i] != 0; i++)
+  values = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                  g_free, (GDestroyNotify) g_ptr_array_unref);
+
+  /* The ids returned by the iterator stay valid until we modify the db,
+     which we don't do here */
+  flatpak_db_iter_init (&db_iter, self, NULL);
+  while (flatpak_db_iter_next (&db_iter, &id))
     {
-      g_autoptr(FlatpakDbEntry) entry = flatpak_db_lookup (self, ids[i]);
+      g_autoptr(FlatpakDbEntry) entry = flatpak_db_lookup (self, id);
       if (entry != NULL)
         {
           GvdbItem *item;
 
-          item = gvdb_hash_table_insert (main_h, ids[i]);
+          GPtrArray *value_ids;
+          char *value_key;
+
+          item = gvdb_hash_table_insert (main_h, id);
           gvdb_item_set_value (item, (GVariant *) entry);
+
+          value_key = entry_value_key (entry);
+          value_ids = g_hash_table_lookup (values, value_key);
+          if (value_ids == NULL)
+            {
+              value_ids = g_ptr_array_new ();
+              g_hash_table_insert (values, value_key, value_ids);
+            }
+          else
+            g_free (value_key);
+
+          g_ptr_array_add (value_ids, (char *) id);
         }
     }
 
+  g_hash_table_iter_init (&iter, values);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      GPtrArray *value_ids = value;
+      GVariantBuilder builder;
+      GvdbItem *item;
+      int j;
+
+      g_variant_builder_init (&builder, G_VARIANT_TYPE_STRING_ARRAY);
+      for (j = 0; j < value_ids->len; j++)
+        g_variant_builder_add (&builder, "s", g_ptr_array_index (value_ids, j));
+
+      item = gvdb_hash_table_insert (values_h, key);
+      gvdb_item_set_value (item, g_variant_builder_end (&builder));
+    }
+
   apps = flatpak_db_list_apps (self);
   for (i = 0; apps[i] != 0; i++)
     {
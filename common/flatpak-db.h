@@ -32,6 +32,18 @@ G_BEGIN_DECLS
 typedef struct FlatpakDb       FlatpakDb;
 typedef struct _FlatpakDbEntry FlatpakDbEntry;
 
+typedef struct
+{
+  /*< private >*/
+  FlatpakDb     *db;
+  const char    *prefix;
+  gsize          prefix_len;
+  gboolean       in_updates;
+  GHashTableIter updates_iter;
+  guint          table_pos;
+  guint          table_end;
+} FlatpakDbIter;
+
 #define FLATPAK_TYPE_DB (flatpak_db_get_type ())
 #define FLATPAK_DB(obj) (G_TYPE_CHECK_INSTANCE_CAST ((obj), FLATPAK_TYPE_DB, FlatpakDb))
 #define FLATPAK_IS_DB(obj) (G_TYPE_CHECK_INSTANCE_TYPE ((obj), FLATPAK_TYPE_DB))
@@ -43,6 +55,11 @@ FlatpakDb *     flatpak_db_new (const char *path,
                                 GError    **error);
 char **        flatpak_db_list_ids (FlatpakDb *self);
 char **        flatpak_db_list_apps (FlatpakDb *self);
+void           flatpak_db_iter_init (FlatpakDbIter *iter,
+                                     FlatpakDb     *self,
+                                     const char    *prefix);
+gboolean       flatpak_db_iter_next (FlatpakDbIter *iter,
+                                     const char   **out_id);
 char **        flatpak_db_list_ids_by_app (FlatpakDb  *self,
                                            const char *app);
 char **        flatpak_db_list_ids_by_value (FlatpakDb *self,
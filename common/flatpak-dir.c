@@ -67,8 +67,13 @@ struct FlatpakDir
   FlatpakSystemHelper *system_helper;
 
   GHashTable          *summary_cache;
+  /* remote name -> SummaryFetch, for summary downloads in progress */
+  GHashTable          *summary_fetches;
 
   SoupSession         *soup_session;
+
+  /* remote name -> FlatpakUpdateBatch, see flatpak_dir_begin_update_batch() */
+  GHashTable          *update_batch;
 };
 
 typedef struct
@@ -82,6 +87,10 @@ struct FlatpakDeploy
 
   GFile          *dir;
   GKeyFile       *metadata;
+  /* Overrides are loaded on demand, and only apps have them */
+  char           *app_id;
+  gboolean        load_system_overrides;
+  gboolean        overrides_loaded;
   FlatpakContext *system_overrides;
   FlatpakContext *user_overrides;
 };
@@ -111,8 +120,9 @@ flatpak_deploy_finalize (GObject *object)
 
   g_clear_object (&self->dir);
   g_clear_pointer (&self->metadata, g_key_file_unref);
-  g_clear_pointer (&self->system_overrides, g_key_file_unref);
-  g_clear_pointer (&self->user_overrides, g_key_file_unref);
+  g_free (self->app_id);
+  g_clear_pointer (&self->system_overrides, flatpak_context_free);
+  g_clear_pointer (&self->user_overrides, flatpak_context_free);
 
   G_OBJECT_CLASS (flatpak_deploy_parent_class)->finalize (object);
 }
@@ -143,10 +153,82 @@ flatpak_deploy_get_files (FlatpakDeploy *deploy)
   return g_file_get_child (deploy->dir, "files");
 }
 
+static gboolean
+flatpak_deploy_ensure_overrides (FlatpakDeploy *deploy,
+                                 GError       **error)
+{
+  if (deploy->overrides_loaded || deploy->app_id == NULL)
+    return TRUE;
+
+  /* Only load system overrides for system installed apps */
+  if (deploy->load_system_overrides)
+    {
+      deploy->system_overrides = flatpak_load_override_file (deploy->app_id, FALSE, error);
+      if (deploy->system_overrides == NULL)
+        return FALSE;
+    }
+
+  /* Always load user overrides */
+  deploy->user_overrides = flatpak_load_override_file (deploy->app_id, TRUE, error);
+  if (deploy->user_overrides == NULL)
+    return FALSE;
+
+  deploy->overrides_loaded = TRUE;
+  return TRUE;
+}
+
+static void
+append_override_stamp (GString    *key,
+                       const char *app_id,
+                       gboolean    user)
+{
+  g_autoptr(GFile) base_dir = NULL;
+  g_autofree char *path = NULL;
+  struct stat stbuf;
+
+  if (user)
+    base_dir = flatpak_get_user_base_dir_location ();
+  else
+    base_dir = flatpak_get_system_base_dir_location ();
+
+  path = g_build_filename (gs_file_get_path_cached (base_dir), "overrides", app_id, NULL);
+
+  if (stat (path, &stbuf) == 0)
+    g_string_append_printf (key, "%s:%ld.%ld:%" G_GUINT64_FORMAT ";",
+                            user ? "user" : "system",
+                            (long) stbuf.st_mtim.tv_sec, (long) stbuf.st_mtim.tv_nsec,
+                            (guint64) stbuf.st_size);
+  else
+    g_string_append_printf (key, "%s:-;", user ? "user" : "system");
+}
+
+/* Returns a string that changes whenever the overrides of the deploy
+   may have changed, without loading them */
+char *
+flatpak_deploy_get_overrides_key (FlatpakDeploy *deploy)
+{
+  GString *key = g_string_new ("");
+
+  if (deploy->app_id != NULL)
+    {
+      if (deploy->load_system_overrides)
+        append_override_stamp (key, deploy->app_id, FALSE);
+      append_override_stamp (key, deploy->app_id, TRUE);
+    }
+
+  return g_string_free (key, FALSE);
+}
+
 FlatpakContext *
-flatpak_deploy_get_overrides (FlatpakDeploy *deploy)
+flatpak_deploy_get_overrides (FlatpakDeploy *deploy,
+                              GError       **error)
 {
-  FlatpakContext *overrides = flatpak_context_new ();
+  FlatpakContext *overrides;
+
+  if (!flatpak_deploy_ensure_overrides (deploy, error))
+    return NULL;
+
+  overrides = flatpak_context_new ();
 
   if (deploy->system_overrides)
     flatpak_context_merge (overrides, deploy->system_overrides);
@@ -296,6 +378,8 @@ flatpak_dir_finalize (GObject *object)
 
   g_clear_object (&self->soup_session);
   g_clear_pointer (&self->summary_cache, g_hash_table_unref);
+  g_clear_pointer (&self->summary_fetches, g_hash_table_unref);
+  g_clear_pointer (&self->update_batch, g_hash_table_unref);
 
   G_OBJECT_CLASS (flatpak_dir_parent_class)->finalize (object);
 }
@@ -404,6 +488,12 @@ flatpak_dir_get_changed_path (FlatpakDir *self)
   return g_file_get_child (self->basedir, ".changed");
 }
 
+GFile *
+flatpak_dir_get_changes_path (FlatpakDir *self)
+{
+  return g_file_get_child (self->basedir, ".changes");
+}
+
 char *
 flatpak_dir_load_override (FlatpakDir *self,
                            const char *app_id,
@@ -547,18 +637,8 @@ flatpak_dir_load_deployed (FlatpakDir   *self,
   /* Only apps have overrides */
   if (strcmp (ref_parts[0], "app") == 0)
     {
-      /* Only load system overrides for system installed apps */
-      if (!self->user)
-        {
-          deploy->system_overrides = flatpak_load_override_file (ref_parts[1], FALSE, error);
-          if (deploy->system_overrides == NULL)
-            return NULL;
-        }
-
-      /* Always load user overrides */
-      deploy->user_overrides = flatpak_load_override_file (ref_parts[1], TRUE, error);
-      if (deploy->user_overrides == NULL)
-        return NULL;
+      deploy->app_id = g_strdup (ref_parts[1]);
+      deploy->load_system_overrides = !self->user;
     }
 
   return deploy;
@@ -920,6 +1000,283 @@ flatpak_dir_mark_changed (FlatpakDir *self,
   return TRUE;
 }
 
+/* The change journal is a text file with one "type\tname\tcommit\n"
+ * line per change. Lines are only ever appended, and the serial of a
+ * change is the offset just past its line. Readers pass the last serial
+ * they have seen to get the changes after it.
+ *
+ * Once the file grows past CHANGES_MAX_SIZE it is replaced by its last
+ * CHANGES_KEEP_SIZE bytes or so. The new file starts with a "# BASE\n"
+ * header, where BASE is the serial of the first byte after the header,
+ * so serials keep increasing across compactions. Writers hold a shared
+ * flock while appending, and the compaction an exclusive one. */
+#define CHANGES_MAX_SIZE (256 * 1024)
+#define CHANGES_KEEP_SIZE (64 * 1024)
+
+static const char *change_type_names[] = {
+  "deploy",
+  "undeploy",
+  "make-current",
+  "modify-remote",
+  "remove-remote",
+};
+
+void
+flatpak_dir_change_free (FlatpakDirChange *change)
+{
+  g_free (change->name);
+  g_free (change->commit);
+  g_free (change);
+}
+
+/* Reads the optional header of the journal, see above */
+static void
+read_changes_header (int      fd,
+                     guint64 *out_base,
+                     gsize   *out_header_len)
+{
+  char buf[32];
+  ssize_t res;
+  char *end;
+
+  *out_base = 0;
+  *out_header_len = 0;
+
+  do
+    res = pread (fd, buf, sizeof (buf) - 1, 0);
+  while (res == -1 && errno == EINTR);
+
+  if (res < 2 || buf[0] != '#' || buf[1] != ' ')
+    return;
+
+  buf[res] = 0;
+  end = strchr (buf, '\n');
+  if (end == NULL)
+    return;
+
+  *out_base = g_ascii_strtoull (buf + 2, NULL, 10);
+  *out_header_len = end - buf + 1;
+}
+
+static gboolean
+read_all_at (int     fd,
+             char   *data,
+             gsize   len,
+             off_t   offset,
+             gsize  *out_len)
+{
+  gsize pos;
+
+  for (pos = 0; pos < len; )
+    {
+      gssize res = pread (fd, data + pos, len - pos, offset + pos);
+      if (res == -1 && errno == EINTR)
+        continue;
+      if (res < 0)
+        return FALSE;
+      if (res == 0)
+        break;
+      pos += res;
+    }
+
+  *out_len = pos;
+  return TRUE;
+}
+
+/* Replaces the journal at @path by its tail, if nobody did so already */
+static void
+compact_changes (const char *path)
+{
+  glnx_fd_close int fd = -1;
+  g_autofree char *data = NULL;
+  g_autofree char *contents = NULL;
+  struct stat stbuf;
+  guint64 base;
+  gsize header_len, len, keep_start;
+  char *nl;
+
+  fd = open (path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    return;
+
+  if (flock (fd, LOCK_EX) != 0 || fstat (fd, &stbuf) != 0)
+    return;
+
+  /* Already replaced, or compacted, by someone else */
+  if (stbuf.st_nlink == 0 || stbuf.st_size <= CHANGES_MAX_SIZE)
+    return;
+
+  read_changes_header (fd, &base, &header_len);
+
+  len = CHANGES_KEEP_SIZE;
+  data = g_malloc (len + 1);
+  if (!read_all_at (fd, data, len, stbuf.st_size - len, &len))
+    return;
+  data[len] = 0;
+
+  /* Keep whole lines only */
+  nl = memchr (data, '\n', len);
+  if (nl == NULL)
+    return;
+  keep_start = stbuf.st_size - len + (nl + 1 - data);
+
+  contents = g_strdup_printf ("# %" G_GUINT64_FORMAT "\n%s",
+                              base + keep_start - header_len, nl + 1);
+  if (!g_file_set_contents (path, contents, -1, NULL))
+    g_debug ("Failed to compact %s", path);
+}
+
+/* This is only for incremental updates in clients, which can always
+   fall back to a full rescan, so failing to log is not fatal */
+void
+flatpak_dir_log_change (FlatpakDir          *self,
+                        FlatpakDirChangeType type,
+                        const char          *name,
+                        const char          *commit)
+{
+  g_autoptr(GFile) changes_file = flatpak_dir_get_changes_path (self);
+  g_autofree char *path = g_file_get_path (changes_file);
+  g_autofree char *line = NULL;
+  glnx_fd_close int fd = -1;
+  struct stat stbuf;
+  gsize len;
+  gssize res;
+
+  line = g_strdup_printf ("%s\t%s\t%s\n", change_type_names[type], name,
+                          commit ? commit : "");
+  len = strlen (line);
+
+  while (TRUE)
+    {
+      fd = open (path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+      if (fd == -1)
+        {
+          g_debug ("Can't open %s: %s", path, g_strerror (errno));
+          return;
+        }
+
+      if (flock (fd, LOCK_SH) != 0 || fstat (fd, &stbuf) != 0)
+        return;
+
+      /* The file was compacted after we opened it */
+      if (stbuf.st_nlink != 0)
+        break;
+
+      close (fd);
+      fd = -1;
+    }
+
+  /* A single O_APPEND write, so concurrent writers never interleave lines */
+  do
+    res = write (fd, line, len);
+  while (res == -1 && errno == EINTR);
+
+  if (res != len)
+    g_debug ("Failed to log change to %s", path);
+
+  if (stbuf.st_size + len > CHANGES_MAX_SIZE)
+    {
+      flock (fd, LOCK_UN);
+      compact_changes (path);
+    }
+}
+
+/* Returns the changes logged after @since, which is 0 or the serial of
+ * an earlier change. @out_cursor is set to the serial of the last
+ * change, to be passed as @since next time. Fails with
+ * G_IO_ERROR_INVALID_ARGUMENT if @since is no longer in the journal,
+ * in which case the caller has to rescan. */
+GPtrArray *
+flatpak_dir_read_changes (FlatpakDir   *self,
+                          guint64       since,
+                          guint64      *out_cursor,
+                          GCancellable *cancellable,
+                          GError      **error)
+{
+  g_autoptr(GFile) changes_file = flatpak_dir_get_changes_path (self);
+  g_autofree char *path = g_file_get_path (changes_file);
+  g_autoptr(GPtrArray) changes = NULL;
+  g_autofree char *data = NULL;
+  glnx_fd_close int fd = -1;
+  struct stat stbuf;
+  guint64 base, end;
+  gsize header_len, len, pos, line_start;
+
+  changes = g_ptr_array_new_with_free_func ((GDestroyNotify) flatpak_dir_change_free);
+
+  fd = open (path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1 && errno == ENOENT && since == 0)
+    {
+      *out_cursor = 0;
+      return g_steal_pointer (&changes);
+    }
+
+  if (fd == -1 || fstat (fd, &stbuf) != 0)
+    {
+      glnx_set_error_from_errno (error);
+      return NULL;
+    }
+
+  read_changes_header (fd, &base, &header_len);
+  end = base + stbuf.st_size - header_len;
+
+  /* 0 means everything that is still in the journal */
+  if (since == 0)
+    since = base;
+
+  if (since < base || since > end)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                   "Change serial %" G_GUINT64_FORMAT " is not in the journal", since);
+      return NULL;
+    }
+
+  len = end - since;
+  data = g_malloc (len + 1);
+  if (!read_all_at (fd, data, len, header_len + since - base, &len))
+    {
+      glnx_set_error_from_errno (error);
+      return NULL;
+    }
+  data[len] = 0;
+
+  /* Stop at the last complete line, a write may be in progress */
+  line_start = 0;
+  for (pos = 0; pos < len; pos++)
+    {
+      g_auto(GStrv) fields = NULL;
+      FlatpakDirChange *change;
+      int type;
+
+      if (data[pos] != '\n')
+        continue;
+
+      data[pos] = 0;
+      fields = g_strsplit (data + line_start, "\t", 3);
+      line_start = pos + 1;
+
+      if (g_strv_length (fields) != 3)
+        continue;
+
+      /* Skip types added by newer versions */
+      for (type = 0; type < G_N_ELEMENTS (change_type_names); type++)
+        if (strcmp (fields[0], change_type_names[type]) == 0)
+          break;
+      if (type == G_N_ELEMENTS (change_type_names))
+        continue;
+
+      change = g_new0 (FlatpakDirChange, 1);
+      change->serial = since + line_start;
+      change->type = type;
+      change->name = g_strdup (fields[1]);
+      change->commit = *fields[2] ? g_strdup (fields[2]) : NULL;
+      g_ptr_array_add (changes, change);
+    }
+
+  *out_cursor = since + line_start;
+  return g_steal_pointer (&changes);
+}
+
 gboolean
 flatpak_dir_remove_appstream (FlatpakDir   *self,
                               const char   *remote,
@@ -1156,6 +1513,7 @@ flatpak_dir_update_appstream (FlatpakDir          *self,
                                        error);
 }
 
+#ifndef HAVE_OSTREE_PULL_SUBDIRS
 /* This is a copy of ostree_repo_pull_one_dir that always disables
    static deltas if subdir is used */
 static gboolean
@@ -1189,7 +1547,74 @@ repo_pull_one_dir (OstreeRepo          *self,
   return ostree_repo_pull_with_options (self, remote_name, g_variant_builder_end (&builder),
                                         progress, cancellable, error);
 }
+#endif
+
+/* Pulls the metadata and the given subpaths of files. With a new enough
+   ostree this is a single pull, so the commit and the dirtrees are only
+   fetched once and the objects of all the subpaths are fetched together.
+   Static deltas are still disabled, as delta parts may be computed
+   against objects of the previous commit that were never pulled. */
+static gboolean
+repo_pull_subpaths (OstreeRepo          *self,
+                    const char          *remote_name,
+                    const char          *ref,
+                    char               **subpaths,
+                    OstreeRepoPullFlags  flags,
+                    OstreeAsyncProgress *progress,
+                    GCancellable        *cancellable,
+                    GError             **error)
+{
+  const char *refs[2] = { ref, NULL };
+  g_autoptr(GPtrArray) dirs = g_ptr_array_new_with_free_func (g_free);
+  int i;
+
+  g_ptr_array_add (dirs, g_strdup ("/metadata"));
+  for (i = 0; subpaths[i] != NULL; i++)
+    g_ptr_array_add (dirs, g_build_filename ("/files", subpaths[i], NULL));
+
+#ifdef HAVE_OSTREE_PULL_SUBDIRS
+  {
+    GVariantBuilder builder;
+
+    g_ptr_array_add (dirs, NULL);
+
+    g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{sv}"));
+    g_variant_builder_add (&builder, "{s@v}", "subdirs",
+                           g_variant_new_variant (g_variant_new_strv ((const char * const *) dirs->pdata, -1)));
+    g_variant_builder_add (&builder, "{s@v}", "disable-static-deltas",
+                           g_variant_new_variant (g_variant_new_boolean (TRUE)));
+    g_variant_builder_add (&builder, "{s@v}", "flags",
+                           g_variant_new_variant (g_variant_new_int32 (flags)));
+    g_variant_builder_add (&builder, "{s@v}", "refs",
+                           g_variant_new_variant (g_variant_new_strv (refs, -1)));
+
+    if (!ostree_repo_pull_with_options (self, remote_name, g_variant_builder_end (&builder),
+                                        progress, cancellable, error))
+      {
+        g_prefix_error (error, "While pulling %s from remote %s: ", ref, remote_name);
+        return FALSE;
+      }
+  }
+#else
+  for (i = 0; i < dirs->len; i++)
+    {
+      const char *dir = g_ptr_array_index (dirs, i);
+
+      if (!repo_pull_one_dir (self, remote_name,
+                              dir,
+                              (char **) refs, flags,
+                              progress,
+                              cancellable, error))
+        {
+          g_prefix_error (error, "While pulling %s from remote %s, subpath %s: ",
+                          ref, remote_name, dir);
+          return FALSE;
+        }
+    }
+#endif
 
+  return TRUE;
+}
 
 gboolean
 flatpak_dir_pull (FlatpakDir          *self,
@@ -1252,33 +1677,9 @@ flatpak_dir_pull (FlatpakDir          *self,
     }
   else
     {
-      int i;
-
-      if (!repo_pull_one_dir (repo, repository,
-                              "/metadata",
-                              (char **) refs, flags,
-                              progress,
-                              cancellable, error))
-        {
-          g_prefix_error (error, "While pulling %s from remote %s, metadata: ",
-                          ref, repository);
-          goto out;
-        }
-
-      for (i = 0; subpaths[i] != NULL; i++)
-        {
-          g_autofree char *subpath = g_build_filename ("/files", subpaths[i], NULL);
-          if (!repo_pull_one_dir (repo, repository,
-                                  subpath,
-                                  (char **) refs, flags,
-                                  progress,
-                                  cancellable, error))
-            {
-              g_prefix_error (error, "While pulling %s from remote %s, subpath %s: ",
-                              ref, repository, subpaths[i]);
-              goto out;
-            }
-        }
+      if (!repo_pull_subpaths (repo, repository, ref, subpaths, flags,
+                               progress, cancellable, error))
+        goto out;
     }
 
   ret = TRUE;
@@ -1339,70 +1740,358 @@ repo_pull_one_untrusted (OstreeRepo          *self,
                                         progress, cancellable, error);
 }
 
-gboolean
-flatpak_dir_pull_untrusted_local (FlatpakDir          *self,
-                                  const char          *src_path,
-                                  const char          *remote_name,
-                                  const char          *ref,
-                                  char               **subpaths,
-                                  OstreeAsyncProgress *progress,
-                                  GCancellable        *cancellable,
-                                  GError             **error)
+#ifndef FICLONE
+#define FICLONE _IOW (0x94, 9, int)
+#endif
+
+/* Imports a content object from a local bare-user repo by making a reflink
+ * of it, rather than copying the data as the regular pull does. The source
+ * is untrusted and may be modified at any time by its owner, so we verify
+ * the checksum of the clone before linking it into the repo. Returns FALSE
+ * if the object was not imported (it will then be pulled normally), and
+ * sets @out_unsupported if the filesystem can't do reflinks at all. */
+static gboolean
+import_object_by_reflink (OstreeRepo   *repo,
+                          int           src_dfd,
+                          const char   *checksum,
+                          gboolean     *out_unsupported,
+                          GCancellable *cancellable)
 {
+  g_autofree char *relpath = ostree_get_relative_object_path (checksum, OSTREE_OBJECT_TYPE_FILE, TRUE);
+  g_autofree char *reldir = NULL;
+  g_autofree char *tmp_path = NULL;
+  g_autofree char *meta_data = NULL;
+  g_autofree char *symlink_target = NULL;
+  g_autofree guchar *csum = NULL;
+  g_autofree char *actual_checksum = NULL;
+  glnx_fd_close int src_fd = -1;
+  glnx_fd_close int dest_fd = -1;
+  g_autoptr(GVariant) meta = NULL;
+  g_autoptr(GVariant) xattrs = NULL;
+  g_autoptr(GFileInfo) file_info = NULL;
+  g_autoptr(GInputStream) input = NULL;
+  guint32 uid, gid, mode;
+  struct stat stbuf;
+  ssize_t meta_size;
   gboolean ret = FALSE;
-  GSConsole *console = NULL;
 
-  g_autoptr(OstreeAsyncProgress) console_progress = NULL;
-  g_autoptr(GFile) path_file = g_file_new_for_path (src_path);
-  g_autoptr(GFile) summary_file = g_file_get_child (path_file, "summary");
-  g_autoptr(GFile) summary_sig_file = g_file_get_child (path_file, "summary.sig");
-  g_autofree char *url = g_file_get_uri (path_file);
-  g_autofree char *checksum = NULL;
-  gboolean gpg_verify_summary;
-  gboolean gpg_verify;
-  char *summary_data = NULL;
-  char *summary_sig_data = NULL;
-  gsize summary_data_size, summary_sig_data_size;
-  g_autoptr(GBytes) summary_bytes = NULL;
-  g_autoptr(GBytes) summary_sig_bytes = NULL;
-  g_autoptr(OstreeGpgVerifyResult) gpg_result = NULL;
-  g_autoptr(GVariant) summary = NULL;
-  g_autoptr(GVariant) old_commit = NULL;
+  src_fd = openat (src_dfd, relpath, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+  if (src_fd == -1 || fstat (src_fd, &stbuf) != 0 || !S_ISREG (stbuf.st_mode))
+    return FALSE;
 
-  if (!flatpak_dir_ensure_repo (self, cancellable, error))
+  meta_size = fgetxattr (src_fd, "user.ostreemeta", NULL, 0);
+  if (meta_size <= 0)
+    return FALSE;
+  meta_data = g_malloc (meta_size);
+  meta_size = fgetxattr (src_fd, "user.ostreemeta", meta_data, meta_size);
+  if (meta_size <= 0)
     return FALSE;
 
-  if (!ostree_repo_remote_get_gpg_verify_summary (self->repo, remote_name,
-                                                  &gpg_verify_summary, error))
+  meta = g_variant_ref_sink (g_variant_new_from_data (G_VARIANT_TYPE ("(uuua(ayay))"),
+                                                      meta_data, meta_size, FALSE,
+                                                      g_free, meta_data));
+  meta_data = NULL; /* Owned by meta now */
+
+  g_variant_get (meta, "(uuu@a(ayay))", &uid, &gid, &mode, &xattrs);
+  uid = GUINT32_FROM_BE (uid);
+  gid = GUINT32_FROM_BE (gid);
+  mode = GUINT32_FROM_BE (mode);
+
+  /* Leave anything unusual to the regular pull */
+  if (!(S_ISREG (mode) || S_ISLNK (mode)) ||
+      (mode & (S_ISUID | S_ISGID)) != 0)
     return FALSE;
 
-  if (!ostree_repo_remote_get_gpg_verify (self->repo, remote_name,
-                                          &gpg_verify, error))
+  tmp_path = g_build_filename (gs_file_get_path_cached (ostree_repo_get_path (repo)),
+                               "tmp", "reflink-XXXXXX", NULL);
+  dest_fd = g_mkstemp_full (tmp_path, O_RDWR | O_CLOEXEC, 0600);
+  if (dest_fd == -1)
     return FALSE;
 
-  if (!gpg_verify_summary || !gpg_verify)
-    return flatpak_fail (error, "Can't pull from untrusted non-gpg verified remote");
+  if (ioctl (dest_fd, FICLONE, src_fd) != 0)
+    {
+      if (errno == EOPNOTSUPP || errno == ENOTTY || errno == EXDEV || errno == EINVAL)
+        *out_unsupported = TRUE;
+      goto out;
+    }
 
-  /* We verify the summary manually before anything else to make sure
-     we've got something right before looking too hard at the repo and
-     so we can check for a downgrade before pulling and updating the
-     ref */
+  if (fstat (dest_fd, &stbuf) != 0)
+    goto out;
 
-  if (!g_file_load_contents (summary_sig_file, cancellable,
-                             &summary_sig_data, &summary_sig_data_size, NULL, NULL))
-    return flatpak_fail (error, "GPG verification enabled, but no summary signatures found");
+  file_info = g_file_info_new ();
+  g_file_info_set_attribute_uint32 (file_info, "unix::uid", uid);
+  g_file_info_set_attribute_uint32 (file_info, "unix::gid", gid);
+  g_file_info_set_attribute_uint32 (file_info, "unix::mode", mode);
 
-  summary_sig_bytes = g_bytes_new_take (summary_sig_data, summary_sig_data_size);
+  /* bare-user repos store symlinks as regular files with the target
+     as content */
+  if (S_ISLNK (mode))
+    {
+      if (stbuf.st_size <= 0 || stbuf.st_size >= PATH_MAX)
+        goto out;
 
-  if (!g_file_load_contents (summary_file, cancellable,
-                             &summary_data, &summary_data_size, NULL, NULL))
-    return flatpak_fail (error, "No summary found");
-  summary_bytes = g_bytes_new_take (summary_data, summary_data_size);
+      symlink_target = g_malloc0 (stbuf.st_size + 1);
+      if (pread (dest_fd, symlink_target, stbuf.st_size, 0) != stbuf.st_size)
+        goto out;
 
-  gpg_result = ostree_repo_verify_summary (self->repo,
-                                           remote_name,
-                                           summary_bytes,
-                                           summary_sig_bytes,
+      g_file_info_set_file_type (file_info, G_FILE_TYPE_SYMBOLIC_LINK);
+      g_file_info_set_symlink_target (file_info, symlink_target);
+    }
+  else
+    {
+      g_file_info_set_file_type (file_info, G_FILE_TYPE_REGULAR);
+      g_file_info_set_size (file_info, stbuf.st_size);
+      input = g_unix_input_stream_new (dest_fd, FALSE);
+    }
+
+  if (!ostree_checksum_file_from_input (file_info, xattrs, input,
+                                        OSTREE_OBJECT_TYPE_FILE, &csum,
+                                        cancellable, NULL))
+    goto out;
+
+  actual_checksum = ostree_checksum_from_bytes (csum);
+  if (strcmp (actual_checksum, checksum) != 0)
+    {
+      g_debug ("Corrupted object %s in local repo, not importing", checksum);
+      goto out;
+    }
+
+  if (fsetxattr (dest_fd, "user.ostreemeta",
+                 g_variant_get_data (meta), g_variant_get_size (meta), 0) != 0 ||
+      fchmod (dest_fd, S_ISLNK (mode) ? 0644 : (mode & 0777)) != 0 ||
+      fsync (dest_fd) != 0)
+    goto out;
+
+  reldir = g_path_get_dirname (relpath);
+  if (mkdirat (ostree_repo_get_dfd (repo), reldir, 0777) != 0 && errno != EEXIST)
+    goto out;
+
+  if (renameat (AT_FDCWD, tmp_path, ostree_repo_get_dfd (repo), relpath) != 0)
+    goto out;
+
+  g_clear_pointer (&tmp_path, g_free);
+  ret = TRUE;
+
+out:
+  if (tmp_path)
+    (void) unlink (tmp_path);
+
+  return ret;
+}
+
+/* Loads a metadata object from the untrusted @src_repo, and returns it
+ * only if its content matches @checksum. Sets @out_corrupt if the object
+ * exists but doesn't match. */
+static GVariant *
+load_verified_variant (OstreeRepo      *src_repo,
+                       OstreeObjectType objtype,
+                       const char      *checksum,
+                       gboolean        *out_corrupt)
+{
+  g_autoptr(GVariant) variant = NULL;
+  g_autofree char *actual_checksum = NULL;
+
+  if (!ostree_repo_load_variant (src_repo, objtype, checksum, &variant, NULL))
+    return NULL;
+
+  actual_checksum = g_compute_checksum_for_data (G_CHECKSUM_SHA256,
+                                                 g_variant_get_data (variant),
+                                                 g_variant_get_size (variant));
+  if (strcmp (actual_checksum, checksum) != 0)
+    {
+      *out_corrupt = TRUE;
+      return NULL;
+    }
+
+  return g_steal_pointer (&variant);
+}
+
+/* Adds the checksums of all the files below the dirtree @checksum to
+ * @content, verifying every dirtree on the way. Subtrees missing from
+ * @src_repo (e.g. because it only has some subpaths) are skipped.
+ * Returns FALSE if a corrupt object was found. */
+static gboolean
+collect_verified_content (OstreeRepo *src_repo,
+                          const char *checksum,
+                          GHashTable *content,
+                          int         depth)
+{
+  g_autoptr(GVariant) dirtree = NULL;
+  g_autoptr(GVariant) files = NULL;
+  g_autoptr(GVariant) dirs = NULL;
+  gboolean corrupt = FALSE;
+  gsize i, n;
+
+  if (depth > 256)
+    return FALSE;
+
+  dirtree = load_verified_variant (src_repo, OSTREE_OBJECT_TYPE_DIR_TREE,
+                                   checksum, &corrupt);
+  if (dirtree == NULL)
+    return !corrupt;
+
+  files = g_variant_get_child_value (dirtree, 0);
+  n = g_variant_n_children (files);
+  for (i = 0; i < n; i++)
+    {
+      g_autoptr(GVariant) csum = NULL;
+
+      g_variant_get_child (files, i, "(&s@ay)", NULL, &csum);
+      if (g_variant_n_children (csum) != OSTREE_SHA256_DIGEST_LEN)
+        return FALSE;
+      g_hash_table_add (content, ostree_checksum_from_bytes_v (csum));
+    }
+
+  dirs = g_variant_get_child_value (dirtree, 1);
+  n = g_variant_n_children (dirs);
+  for (i = 0; i < n; i++)
+    {
+      g_autoptr(GVariant) tree_csum = NULL;
+      g_autofree char *tree_checksum = NULL;
+
+      g_variant_get_child (dirs, i, "(&s@ay@ay)", NULL, &tree_csum, NULL);
+      if (g_variant_n_children (tree_csum) != OSTREE_SHA256_DIGEST_LEN)
+        return FALSE;
+
+      tree_checksum = ostree_checksum_from_bytes_v (tree_csum);
+      if (!collect_verified_content (src_repo, tree_checksum, content, depth + 1))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Seeds @repo with the content objects of @checksum from the local repo
+ * at @src_path, using reflinks so that the data is not written a second
+ * time. @checksum must already be trusted, i.e. come from the verified
+ * summary. Nothing is imported unless the commit and every dirtree below
+ * it match their checksums, so all imported objects are reachable from
+ * the signed commit. This is purely an optimization: whatever is not
+ * imported here, for whatever reason, is pulled normally afterwards, and
+ * the commit itself (and thus its signature) always goes through the
+ * regular pull. */
+static void
+import_objects_by_reflink (OstreeRepo   *repo,
+                           GFile        *src_path,
+                           const char   *checksum,
+                           GCancellable *cancellable)
+{
+  g_autoptr(OstreeRepo) src_repo = ostree_repo_new (src_path);
+  g_autoptr(GVariant) commit = NULL;
+  g_autoptr(GVariant) root_csum = NULL;
+  g_autoptr(GHashTable) content = NULL;
+  g_autofree char *root_checksum = NULL;
+  GHashTableIter iter;
+  gpointer key;
+  gboolean unsupported = FALSE;
+  gboolean corrupt = FALSE;
+  guint n_imported = 0;
+
+  if (!ostree_repo_open (src_repo, cancellable, NULL) ||
+      ostree_repo_get_mode (src_repo) != OSTREE_REPO_MODE_BARE_USER ||
+      ostree_repo_get_mode (repo) != OSTREE_REPO_MODE_BARE_USER)
+    return;
+
+  commit = load_verified_variant (src_repo, OSTREE_OBJECT_TYPE_COMMIT,
+                                  checksum, &corrupt);
+  if (commit == NULL)
+    return;
+
+  root_csum = g_variant_get_child_value (commit, 6);
+  if (g_variant_n_children (root_csum) != OSTREE_SHA256_DIGEST_LEN)
+    return;
+  root_checksum = ostree_checksum_from_bytes_v (root_csum);
+
+  content = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  if (!collect_verified_content (src_repo, root_checksum, content, 0))
+    {
+      g_debug ("Corrupted metadata in local repo, not importing by reflink");
+      return;
+    }
+
+  g_hash_table_iter_init (&iter, content);
+  while (!unsupported && g_hash_table_iter_next (&iter, &key, NULL))
+    {
+      const char *object_checksum = key;
+      gboolean has_object;
+
+      if (!ostree_repo_has_object (repo, OSTREE_OBJECT_TYPE_FILE, object_checksum,
+                                   &has_object, cancellable, NULL) || has_object)
+        continue;
+
+      if (import_object_by_reflink (repo, ostree_repo_get_dfd (src_repo),
+                                    object_checksum, &unsupported, cancellable))
+        n_imported++;
+    }
+
+  g_debug ("Imported %u objects by reflink%s", n_imported,
+           unsupported ? ", reflinks not supported" : "");
+}
+
+gboolean
+flatpak_dir_pull_untrusted_local (FlatpakDir          *self,
+                                  const char          *src_path,
+                                  const char          *remote_name,
+                                  const char          *ref,
+                                  char               **subpaths,
+                                  OstreeAsyncProgress *progress,
+                                  GCancellable        *cancellable,
+                                  GError             **error)
+{
+  gboolean ret = FALSE;
+  GSConsole *console = NULL;
+
+  g_autoptr(OstreeAsyncProgress) console_progress = NULL;
+  g_autoptr(GFile) path_file = g_file_new_for_path (src_path);
+  g_autoptr(GFile) summary_file = g_file_get_child (path_file, "summary");
+  g_autoptr(GFile) summary_sig_file = g_file_get_child (path_file, "summary.sig");
+  g_autofree char *url = g_file_get_uri (path_file);
+  g_autofree char *checksum = NULL;
+  gboolean gpg_verify_summary;
+  gboolean gpg_verify;
+  char *summary_data = NULL;
+  char *summary_sig_data = NULL;
+  gsize summary_data_size, summary_sig_data_size;
+  g_autoptr(GBytes) summary_bytes = NULL;
+  g_autoptr(GBytes) summary_sig_bytes = NULL;
+  g_autoptr(OstreeGpgVerifyResult) gpg_result = NULL;
+  g_autoptr(GVariant) summary = NULL;
+  g_autoptr(GVariant) old_commit = NULL;
+
+  if (!flatpak_dir_ensure_repo (self, cancellable, error))
+    return FALSE;
+
+  if (!ostree_repo_remote_get_gpg_verify_summary (self->repo, remote_name,
+                                                  &gpg_verify_summary, error))
+    return FALSE;
+
+  if (!ostree_repo_remote_get_gpg_verify (self->repo, remote_name,
+                                          &gpg_verify, error))
+    return FALSE;
+
+  if (!gpg_verify_summary || !gpg_verify)
+    return flatpak_fail (error, "Can't pull from untrusted non-gpg verified remote");
+
+  /* We verify the summary manually before anything else to make sure
+     we've got something right before looking too hard at the repo and
+     so we can check for a downgrade before pulling and updating the
+     ref */
+
+  if (!g_file_load_contents (summary_sig_file, cancellable,
+                             &summary_sig_data, &summary_sig_data_size, NULL, NULL))
+    return flatpak_fail (error, "GPG verification enabled, but no summary signatures found");
+
+  summary_sig_bytes = g_bytes_new_take (summary_sig_data, summary_sig_data_size);
+
+  if (!g_file_load_contents (summary_file, cancellable,
+                             &summary_data, &summary_data_size, NULL, NULL))
+    return flatpak_fail (error, "No summary found");
+  summary_bytes = g_bytes_new_take (summary_data, summary_data_size);
+
+  gpg_result = ostree_repo_verify_summary (self->repo,
+                                           remote_name,
+                                           summary_bytes,
+                                           summary_sig_bytes,
                                            cancellable, error);
   if (gpg_result == NULL)
     return FALSE;
@@ -1442,6 +2131,7 @@ flatpak_dir_pull_untrusted_local (FlatpakDir          *self,
         return flatpak_fail (error, "Not allowed to downgrade %s", ref);
     }
 
+  import_objects_by_reflink (self->repo, path_file, checksum, cancellable);
 
   if (progress == NULL)
     {
@@ -1578,6 +2268,8 @@ flatpak_dir_make_current_ref (FlatpakDir   *self,
         goto out;
     }
 
+  flatpak_dir_log_change (self, FLATPAK_DIR_CHANGE_MAKE_CURRENT, ref, NULL);
+
   ret = TRUE;
 
 out:
@@ -2730,6 +3422,8 @@ flatpak_dir_deploy (FlatpakDir          *self,
   if (!flatpak_dir_set_active (self, ref, checksum, cancellable, error))
     return FALSE;
 
+  flatpak_dir_log_change (self, FLATPAK_DIR_CHANGE_DEPLOY, ref, checksum);
+
   return TRUE;
 }
 
@@ -3010,6 +3704,138 @@ flatpak_dir_install (FlatpakDir          *self,
   return TRUE;
 }
 
+typedef struct
+{
+  OstreeRepo   *child_repo;
+  GLnxLockFile  child_repo_lock;
+  GPtrArray    *refs;
+} FlatpakUpdateBatch;
+
+static void
+flatpak_update_batch_free (FlatpakUpdateBatch *batch)
+{
+  if (batch->child_repo)
+    {
+      (void) glnx_shutil_rm_rf_at (AT_FDCWD,
+                                   gs_file_get_path_cached (ostree_repo_get_path (batch->child_repo)),
+                                   NULL, NULL);
+      g_object_unref (batch->child_repo);
+    }
+  glnx_release_lock_file (&batch->child_repo_lock);
+  g_ptr_array_unref (batch->refs);
+  g_free (batch);
+}
+
+static FlatpakUpdateBatch *
+flatpak_dir_get_update_batch (FlatpakDir *self,
+                              const char *remote_name,
+                              GError    **error)
+{
+  FlatpakUpdateBatch *batch;
+
+  batch = g_hash_table_lookup (self->update_batch, remote_name);
+  if (batch == NULL)
+    {
+      batch = g_new0 (FlatpakUpdateBatch, 1);
+      batch->child_repo_lock = (GLnxLockFile) GLNX_LOCK_FILE_INIT;
+      batch->refs = g_ptr_array_new_with_free_func (g_free);
+
+      batch->child_repo = flatpak_dir_create_system_child_repo (self, &batch->child_repo_lock, error);
+      if (batch->child_repo == NULL)
+        {
+          flatpak_update_batch_free (batch);
+          return NULL;
+        }
+
+      g_hash_table_insert (self->update_batch, g_strdup (remote_name), batch);
+    }
+
+  return batch;
+}
+
+/* When updating a system installation via the system helper, each update
+ * normally gets its own temporary child repo and its own Deploy call.
+ * Between these calls updates are instead pulled into one child repo per
+ * remote, and deployed with a single DeployMultiple call per remote in
+ * flatpak_dir_end_update_batch(). This is a no-op for installations that
+ * are modified directly. */
+void
+flatpak_dir_begin_update_batch (FlatpakDir *self)
+{
+  if (self->update_batch == NULL)
+    self->update_batch = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                g_free, (GDestroyNotify) flatpak_update_batch_free);
+}
+
+gboolean
+flatpak_dir_end_update_batch (FlatpakDir   *self,
+                              GCancellable *cancellable,
+                              GError      **error)
+{
+  g_autoptr(GHashTable) batches = g_steal_pointer (&self->update_batch);
+  GHashTableIter iter;
+  gpointer key, value;
+  char *empty_subpaths[] = {NULL};
+
+  if (batches == NULL)
+    return TRUE;
+
+  g_hash_table_iter_init (&iter, batches);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      const char *remote_name = key;
+      FlatpakUpdateBatch *batch = value;
+      const char *child_repo_path = gs_file_get_path_cached (ostree_repo_get_path (batch->child_repo));
+      FlatpakSystemHelper *system_helper;
+      GVariantBuilder refs_builder;
+      g_autoptr(GError) local_error = NULL;
+      int i;
+
+      if (batch->refs->len == 0)
+        continue;
+
+      system_helper = flatpak_dir_get_system_helper (self);
+
+      g_assert (system_helper != NULL);
+
+      g_variant_builder_init (&refs_builder, G_VARIANT_TYPE ("a(ssas)"));
+      for (i = 0; i < batch->refs->len; i++)
+        g_variant_builder_add (&refs_builder, "(ss^as)",
+                               g_ptr_array_index (batch->refs, i),
+                               remote_name, empty_subpaths);
+
+      if (flatpak_system_helper_call_deploy_multiple_sync (system_helper,
+                                                           child_repo_path,
+                                                           FLATPAK_HELPER_DEPLOY_FLAGS_UPDATE,
+                                                           g_variant_builder_end (&refs_builder),
+                                                           cancellable,
+                                                           &local_error))
+        continue;
+
+      if (!g_error_matches (local_error, G_DBUS_ERROR, G_DBUS_ERROR_UNKNOWN_METHOD))
+        {
+          g_propagate_error (error, g_steal_pointer (&local_error));
+          return FALSE;
+        }
+
+      /* Older system helper, deploy one by one */
+      for (i = 0; i < batch->refs->len; i++)
+        {
+          if (!flatpak_system_helper_call_deploy_sync (system_helper,
+                                                       child_repo_path,
+                                                       FLATPAK_HELPER_DEPLOY_FLAGS_UPDATE,
+                                                       g_ptr_array_index (batch->refs, i),
+                                                       remote_name,
+                                                       (const char * const *) empty_subpaths,
+                                                       cancellable,
+                                                       error))
+            return FALSE;
+        }
+    }
+
+  return TRUE;
+}
+
 gboolean
 flatpak_dir_update (FlatpakDir          *self,
                     gboolean             no_pull,
@@ -3030,6 +3856,7 @@ flatpak_dir_update (FlatpakDir          *self,
       g_autofree char *pulled_checksum = NULL;
       g_autofree char *active_checksum = NULL;
       FlatpakSystemHelper *system_helper;
+      FlatpakUpdateBatch *batch = NULL;
 
       if (no_pull)
         return flatpak_fail (error, "No-pull update not supported without root permissions");
@@ -3040,9 +3867,19 @@ flatpak_dir_update (FlatpakDir          *self,
       if (checksum_or_latest != NULL)
         return flatpak_fail (error, "Can't update to a specific commit without root permissions");
 
-      child_repo = flatpak_dir_create_system_child_repo (self, &child_repo_lock, error);
-      if (child_repo == NULL)
-        return FALSE;
+      if (self->update_batch != NULL)
+        {
+          batch = flatpak_dir_get_update_batch (self, remote_name, error);
+          if (batch == NULL)
+            return FALSE;
+          child_repo = g_object_ref (batch->child_repo);
+        }
+      else
+        {
+          child_repo = flatpak_dir_create_system_child_repo (self, &child_repo_lock, error);
+          if (child_repo == NULL)
+            return FALSE;
+        }
 
       system_helper = flatpak_dir_get_system_helper (self);
 
@@ -3059,6 +3896,11 @@ flatpak_dir_update (FlatpakDir          *self,
       active_checksum = flatpak_dir_read_active (self, ref, NULL);
       if (g_strcmp0 (active_checksum, pulled_checksum) != 0)
         {
+          if (batch != NULL)
+            {
+              g_ptr_array_add (batch->refs, g_strdup (ref));
+              return TRUE;
+            }
 
           if (!flatpak_system_helper_call_deploy_sync (system_helper,
                                                        gs_file_get_path_cached (ostree_repo_get_path (child_repo)),
@@ -3071,9 +3913,10 @@ flatpak_dir_update (FlatpakDir          *self,
             return FALSE;
         }
 
-      (void) glnx_shutil_rm_rf_at (AT_FDCWD,
-                                   gs_file_get_path_cached (ostree_repo_get_path (child_repo)),
-                                   NULL, NULL);
+      if (batch == NULL)
+        (void) glnx_shutil_rm_rf_at (AT_FDCWD,
+                                     gs_file_get_path_cached (ostree_repo_get_path (child_repo)),
+                                     NULL, NULL);
 
       return TRUE;
     }
@@ -3440,6 +4283,8 @@ flatpak_dir_undeploy (FlatpakDir   *self,
         }
     }
 
+  flatpak_dir_log_change (self, FLATPAK_DIR_CHANGE_UNDEPLOY, ref, checksum);
+
   ret = TRUE;
 out:
   return ret;
@@ -3652,6 +4497,29 @@ flatpak_dir_get_if_deployed (FlatpakDir   *self,
 
 G_LOCK_DEFINE_STATIC (cache);
 
+/* Signalled, with the cache lock held, whenever a SummaryFetch is done */
+static GCond summary_fetch_cond;
+
+typedef struct
+{
+  int       ref_count;
+  gboolean  done;
+  GBytes   *bytes;
+  GError   *error;
+} SummaryFetch;
+
+static void
+summary_fetch_unref (SummaryFetch *fetch)
+{
+  if (--fetch->ref_count > 0)
+    return;
+
+  if (fetch->bytes)
+    g_bytes_unref (fetch->bytes);
+  g_clear_error (&fetch->error);
+  g_free (fetch);
+}
+
 static void
 cached_summary_free (CachedSummary *summary)
 {
@@ -3726,6 +4594,91 @@ flatpak_dir_cache_summary (FlatpakDir  *self,
   return res;
 }
 
+/* Downloads the summary and caches it. If another thread is already
+ * downloading the summary of the same remote, this waits for it and
+ * shares its result rather than issuing another request. */
+static gboolean
+flatpak_dir_fetch_summary_once (FlatpakDir   *self,
+                                const char   *name,
+                                const char   *url,
+                                GBytes      **out_summary,
+                                GCancellable *cancellable,
+                                GError      **error)
+{
+  SummaryFetch *fetch;
+  g_autoptr(GBytes) bytes = NULL;
+  g_autoptr(GError) local_error = NULL;
+  gboolean res;
+
+  G_LOCK (cache);
+
+  if (self->summary_fetches == NULL)
+    self->summary_fetches = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                                   (GDestroyNotify) summary_fetch_unref);
+
+  while ((fetch = g_hash_table_lookup (self->summary_fetches, name)) != NULL)
+    {
+      fetch->ref_count++;
+      while (!fetch->done)
+        g_cond_wait (&summary_fetch_cond, &G_LOCK_NAME (cache));
+
+      /* A cancellation of the other fetch doesn't apply to us, so retry */
+      if (fetch->error == NULL ||
+          !g_error_matches (fetch->error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        {
+          g_debug ("Shared summary download for remote %s", name);
+          res = fetch->error == NULL;
+          if (res)
+            *out_summary = fetch->bytes ? g_bytes_ref (fetch->bytes) : NULL;
+          else
+            g_propagate_error (error, g_error_copy (fetch->error));
+          summary_fetch_unref (fetch);
+          G_UNLOCK (cache);
+          return res;
+        }
+
+      summary_fetch_unref (fetch);
+    }
+
+  fetch = g_new0 (SummaryFetch, 1);
+  fetch->ref_count = 1;
+  g_hash_table_insert (self->summary_fetches, g_strdup (name), fetch);
+  fetch->ref_count++;
+
+  G_UNLOCK (cache);
+
+  res = ostree_repo_remote_fetch_summary (self->repo, name,
+                                          &bytes, NULL,
+                                          cancellable,
+                                          &local_error);
+
+  /* Cache it before unregistering the fetch, so that no one starts a new one */
+  if (res && bytes)
+    flatpak_dir_cache_summary (self, bytes, name, url);
+
+  G_LOCK (cache);
+
+  fetch->done = TRUE;
+  if (res)
+    fetch->bytes = bytes ? g_bytes_ref (bytes) : NULL;
+  else
+    fetch->error = g_error_copy (local_error);
+  g_hash_table_remove (self->summary_fetches, name);
+  summary_fetch_unref (fetch);
+  g_cond_broadcast (&summary_fetch_cond);
+
+  G_UNLOCK (cache);
+
+  if (!res)
+    {
+      g_propagate_error (error, g_steal_pointer (&local_error));
+      return FALSE;
+    }
+
+  *out_summary = g_steal_pointer (&bytes);
+  return TRUE;
+}
+
 static gboolean
 flatpak_dir_remote_fetch_summary (FlatpakDir   *self,
                                   const char   *name,
@@ -3752,16 +4705,14 @@ flatpak_dir_remote_fetch_summary (FlatpakDir   *self,
         }
     }
 
-  if (!ostree_repo_remote_fetch_summary (self->repo, name,
-                                         out_summary, NULL,
-                                         cancellable,
-                                         error))
-    return FALSE;
+  if (is_local)
+    return ostree_repo_remote_fetch_summary (self->repo, name,
+                                             out_summary, NULL,
+                                             cancellable,
+                                             error);
 
-  if (!is_local)
-    flatpak_dir_cache_summary (self, *out_summary, name, url);
-
-  return TRUE;
+  return flatpak_dir_fetch_summary_once (self, name, url, out_summary,
+                                         cancellable, error);
 }
 
 /* This duplicates ostree_repo_list_refs so it can use flatpak_dir_remote_fetch_summary
@@ -3985,7 +4936,14 @@ flatpak_dir_new (GFile *path, gboolean user)
 FlatpakDir *
 flatpak_dir_clone (FlatpakDir *self)
 {
-  return flatpak_dir_new (self->basedir, self->user);
+  FlatpakDir *clone = flatpak_dir_new (self->basedir, self->user);
+
+  /* The soup session is threadsafe and holds no per-dir state, so
+     share it to keep reusing its connections */
+  if (self->soup_session)
+    clone->soup_session = g_object_ref (self->soup_session);
+
+  return clone;
 }
 
 FlatpakDir *
@@ -4262,6 +5220,8 @@ flatpak_dir_remove_remote (FlatpakDir   *self,
                                   cancellable, error))
     return FALSE;
 
+  flatpak_dir_log_change (self, FLATPAK_DIR_CHANGE_REMOVE_REMOTE, remote_name, NULL);
+
   if (!flatpak_dir_mark_changed (self, error))
     return FALSE;
 
@@ -4379,6 +5339,8 @@ flatpak_dir_modify_remote (FlatpakDir   *self,
                imported, (imported == 1) ? "" : "s", remote_name);
     }
 
+  flatpak_dir_log_change (self, FLATPAK_DIR_CHANGE_MODIFY_REMOTE, remote_name, NULL);
+
   if (!flatpak_dir_mark_changed (self, error))
     return FALSE;
 
@@ -4449,6 +5411,119 @@ flatpak_dir_list_remote_refs (FlatpakDir   *self,
   return TRUE;
 }
 
+/* Like looking up ref in the result of flatpak_dir_list_remote_refs(),
+   but does a binary search in the summary rather than listing all refs */
+gboolean
+flatpak_dir_lookup_remote_ref (FlatpakDir   *self,
+                               const char   *remote,
+                               const char   *ref,
+                               char        **out_checksum,
+                               GCancellable *cancellable,
+                               GError      **error)
+{
+  g_autoptr(GBytes) summary_bytes = NULL;
+  g_autoptr(GVariant) summary = NULL;
+  g_autofree char *checksum = NULL;
+
+  if (!flatpak_dir_ensure_repo (self, cancellable, error))
+    return FALSE;
+
+  if (!flatpak_dir_remote_fetch_summary (self, remote,
+                                         &summary_bytes,
+                                         cancellable, error))
+    return FALSE;
+
+  if (summary_bytes == NULL)
+    return flatpak_fail (error, "Remote refs not available; server has no summary file\n");
+
+  summary = g_variant_ref_sink (g_variant_new_from_bytes (OSTREE_SUMMARY_GVARIANT_FORMAT,
+                                                          summary_bytes, FALSE));
+
+  if (!flatpak_summary_lookup_ref (summary, ref, &checksum))
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
+                   "Reference %s doesn't exist in remote\n", ref);
+      return FALSE;
+    }
+
+  /* For noenumerate remotes, only return data for already locally
+   * available refs */
+  if (flatpak_dir_get_remote_noenumerate (self, remote))
+    {
+      g_autofree char *refspec = g_strconcat (remote, ":", ref, NULL);
+
+      if (!ostree_repo_resolve_rev (self->repo, refspec, FALSE, NULL, NULL))
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
+                       "Reference %s doesn't exist in remote\n", ref);
+          return FALSE;
+        }
+    }
+
+  if (out_checksum)
+    *out_checksum = g_steal_pointer (&checksum);
+
+  return TRUE;
+}
+
+/* Like flatpak_dir_lookup_remote_ref(), but for many refs with a single
+ * summary lookup. The returned hashtable maps each ref that exists in
+ * the remote to its commit; missing refs are not an error. */
+gboolean
+flatpak_dir_lookup_remote_refs (FlatpakDir         *self,
+                                const char         *remote,
+                                const char * const *refs,
+                                GHashTable        **out_commits,
+                                GCancellable       *cancellable,
+                                GError            **error)
+{
+  g_autoptr(GBytes) summary_bytes = NULL;
+  g_autoptr(GVariant) summary = NULL;
+  g_autoptr(GHashTable) commits = NULL;
+  gboolean noenumerate;
+  int i;
+
+  if (!flatpak_dir_ensure_repo (self, cancellable, error))
+    return FALSE;
+
+  if (!flatpak_dir_remote_fetch_summary (self, remote,
+                                         &summary_bytes,
+                                         cancellable, error))
+    return FALSE;
+
+  if (summary_bytes == NULL)
+    return flatpak_fail (error, "Remote refs not available; server has no summary file\n");
+
+  summary = g_variant_ref_sink (g_variant_new_from_bytes (OSTREE_SUMMARY_GVARIANT_FORMAT,
+                                                          summary_bytes, FALSE));
+
+  noenumerate = flatpak_dir_get_remote_noenumerate (self, remote);
+  commits = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+
+  for (i = 0; refs[i] != NULL; i++)
+    {
+      g_autofree char *checksum = NULL;
+
+      if (!flatpak_summary_lookup_ref (summary, refs[i], &checksum))
+        continue;
+
+      /* For noenumerate remotes, only return data for already locally
+       * available refs */
+      if (noenumerate)
+        {
+          g_autofree char *refspec = g_strconcat (remote, ":", refs[i], NULL);
+
+          if (!ostree_repo_resolve_rev (self->repo, refspec, FALSE, NULL, NULL))
+            continue;
+        }
+
+      g_hash_table_insert (commits, g_strdup (refs[i]), g_steal_pointer (&checksum));
+    }
+
+  *out_commits = g_steal_pointer (&commits);
+  return TRUE;
+}
+
 char *
 flatpak_dir_fetch_remote_title (FlatpakDir   *self,
                                 const char   *remote,
@@ -4498,6 +5573,9 @@ flatpak_dir_fetch_remote_title (FlatpakDir   *self,
   return g_steal_pointer (&title);
 }
 
+/* Max number of concurrent object fetches from a single remote */
+#define FETCH_METADATA_CONCURRENCY 8
+
 static void
 ensure_soup_session (FlatpakDir *self)
 {
@@ -4513,6 +5591,7 @@ ensure_soup_session (FlatpakDir *self)
                                        SOUP_SESSION_USE_THREAD_CONTEXT, TRUE,
                                        SOUP_SESSION_TIMEOUT, 60,
                                        SOUP_SESSION_IDLE_TIMEOUT, 60,
+                                       SOUP_SESSION_MAX_CONNS_PER_HOST, FETCH_METADATA_CONCURRENCY,
                                        NULL);
       http_proxy = g_getenv ("http_proxy");
       if (http_proxy)
@@ -4604,6 +5683,112 @@ flatpak_dir_load_uri (FlatpakDir   *self,
   return g_steal_pointer (&bytes);
 }
 
+/* Objects are immutable, so once fetched we keep them in the user cache
+ * dir. This is shared by all remotes, as it is keyed by checksum, so only
+ * objects that match their checksum go in there. Objects are dropped
+ * from the cache a while after they were fetched, so it doesn't grow
+ * without bounds. */
+#define REMOTE_OBJECT_CACHE_MAX_AGE (7 * 24 * 60 * 60)
+
+static GFile *
+get_remote_object_cache_file (const char *checksum,
+                              const char *type)
+{
+  g_autoptr(GFile) cache_dir = flatpak_ensure_user_cache_dir_location (NULL);
+  g_autofree char *part1 = NULL;
+  g_autofree char *part2 = NULL;
+  g_autofree char *relpath = NULL;
+
+  if (cache_dir == NULL)
+    return NULL;
+
+  part1 = g_strndup (checksum, 2);
+  part2 = g_strdup_printf ("%s.%s", checksum + 2, type);
+  relpath = g_build_filename ("remote-objects", part1, part2, NULL);
+
+  return g_file_resolve_relative_path (cache_dir, relpath);
+}
+
+/* Removes the objects that were fetched more than
+   REMOTE_OBJECT_CACHE_MAX_AGE ago. Failures are ignored. */
+static void
+prune_remote_object_cache (void)
+{
+  g_autoptr(GFile) cache_dir = flatpak_ensure_user_cache_dir_location (NULL);
+  g_autofree char *objects_path = NULL;
+  g_autoptr(GDir) objects_dir = NULL;
+  gint64 now = g_get_real_time () / G_USEC_PER_SEC;
+  const char *part1;
+
+  if (cache_dir == NULL)
+    return;
+
+  objects_path = g_build_filename (gs_file_get_path_cached (cache_dir), "remote-objects", NULL);
+  objects_dir = g_dir_open (objects_path, 0, NULL);
+  if (objects_dir == NULL)
+    return;
+
+  while ((part1 = g_dir_read_name (objects_dir)) != NULL)
+    {
+      g_autofree char *subdir_path = g_build_filename (objects_path, part1, NULL);
+      g_autoptr(GDir) subdir = g_dir_open (subdir_path, 0, NULL);
+      const char *part2;
+
+      if (subdir == NULL)
+        continue;
+
+      while ((part2 = g_dir_read_name (subdir)) != NULL)
+        {
+          g_autofree char *path = g_build_filename (subdir_path, part2, NULL);
+          struct stat stbuf;
+
+          if (stat (path, &stbuf) == 0 &&
+              now - stbuf.st_mtime > REMOTE_OBJECT_CACHE_MAX_AGE)
+            (void) unlink (path);
+        }
+
+      (void) rmdir (subdir_path);
+    }
+}
+
+static gboolean
+remote_object_is_valid (const char   *checksum,
+                        const char   *type,
+                        GBytes       *bytes,
+                        GCancellable *cancellable)
+{
+  g_autofree char *actual_checksum = NULL;
+
+  if (strcmp (type, "filez") == 0)
+    {
+      /* The checksum of content objects covers the uncompressed data
+         and file header, not what we download, so unpack it */
+      g_autoptr(GInputStream) input = g_memory_input_stream_new_from_bytes (bytes);
+      g_autoptr(GInputStream) file_input = NULL;
+      g_autoptr(GFileInfo) file_info = NULL;
+      g_autoptr(GVariant) xattrs = NULL;
+      g_autofree guchar *csum = NULL;
+
+      if (!ostree_content_stream_parse (TRUE, input, g_bytes_get_size (bytes), FALSE,
+                                        &file_input, &file_info, &xattrs,
+                                        cancellable, NULL))
+        return FALSE;
+
+      if (!ostree_checksum_file_from_input (file_info, xattrs, file_input,
+                                            OSTREE_OBJECT_TYPE_FILE, &csum,
+                                            cancellable, NULL))
+        return FALSE;
+
+      actual_checksum = ostree_checksum_from_bytes (csum);
+    }
+  else
+    {
+      actual_checksum = g_compute_checksum_for_bytes (G_CHECKSUM_SHA256, bytes);
+    }
+
+  return strcmp (actual_checksum, checksum) == 0;
+}
+
 GBytes *
 flatpak_dir_fetch_remote_object (FlatpakDir   *self,
                                  const char   *remote_name,
@@ -4616,9 +5801,20 @@ flatpak_dir_fetch_remote_object (FlatpakDir   *self,
   g_autofree char *object_url = NULL;
   g_autofree char *part1 = NULL;
   g_autofree char *part2 = NULL;
+  g_autoptr(GFile) cache_file = NULL;
+  char *cached_data;
+  gsize cached_size;
 
   g_autoptr(GBytes) bytes = NULL;
 
+  cache_file = get_remote_object_cache_file (checksum, type);
+  if (cache_file != NULL &&
+      g_file_load_contents (cache_file, cancellable, &cached_data, &cached_size, NULL, NULL))
+    {
+      g_debug ("Using cached %s object %s", type, checksum);
+      return g_bytes_new_take (cached_data, cached_size);
+    }
+
   if (!ostree_repo_remote_get_url (self->repo, remote_name, &base_url, error))
     return NULL;
 
@@ -4631,6 +5827,34 @@ flatpak_dir_fetch_remote_object (FlatpakDir   *self,
   if (bytes == NULL)
     return NULL;
 
+  if (!remote_object_is_valid (checksum, type, bytes, cancellable))
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Corrupted %s object %s", type, checksum);
+      return NULL;
+    }
+
+  if (cache_file != NULL)
+    {
+      static gsize pruned = 0;
+      g_autoptr(GFile) cache_dir = g_file_get_parent (cache_file);
+
+      /* Expire old objects once per process, the first time we add one */
+      if (g_once_init_enter (&pruned))
+        {
+          prune_remote_object_cache ();
+          g_once_init_leave (&pruned, 1);
+        }
+
+      /* This is only a cache, so failures are not fatal */
+      (void) g_file_make_directory_with_parents (cache_dir, NULL, NULL);
+      (void) g_file_replace_contents (cache_file,
+                                      g_bytes_get_data (bytes, NULL),
+                                      g_bytes_get_size (bytes),
+                                      NULL, FALSE, G_FILE_CREATE_REPLACE_DESTINATION,
+                                      NULL, NULL, NULL);
+    }
+
   return g_steal_pointer (&bytes);
 }
 
@@ -4645,10 +5869,7 @@ flatpak_dir_fetch_ref_cache (FlatpakDir   *self,
                              GError      **error)
 {
   g_autoptr(GBytes) summary_bytes = NULL;
-  g_autoptr(GVariant) extensions = NULL;
   g_autoptr(GVariant) summary = NULL;
-  g_autoptr(GVariant) cache_v = NULL;
-  g_autoptr(GVariant) cache = NULL;
   g_autoptr(GVariant) res = NULL;
 
   if (!flatpak_dir_ensure_repo (self, cancellable, error))
@@ -4666,20 +5887,10 @@ flatpak_dir_fetch_ref_cache (FlatpakDir   *self,
       return FALSE;
     }
 
-  summary = g_variant_new_from_bytes (OSTREE_SUMMARY_GVARIANT_FORMAT,
-                                      summary_bytes, FALSE);
-  extensions = g_variant_get_child_value (summary, 1);
+  summary = g_variant_ref_sink (g_variant_new_from_bytes (OSTREE_SUMMARY_GVARIANT_FORMAT,
+                                                          summary_bytes, FALSE));
 
-  cache_v = g_variant_lookup_value (extensions, "xa.cache", NULL);
-  if (cache_v == NULL)
-    {
-      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
-                   "Data not found");
-      return FALSE;
-    }
-
-  cache = g_variant_get_child_value (cache_v, 0);
-  res = g_variant_lookup_value (cache, ref, NULL);
+  res = flatpak_summary_lookup_cache (summary, ref);
   if (res == NULL)
     {
       g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
@@ -4825,3 +6036,144 @@ flatpak_dir_fetch_metadata (FlatpakDir   *self,
 
   return g_memory_output_stream_steal_as_bytes (data_stream);
 }
+
+void
+flatpak_remote_ref_info_free (FlatpakRemoteRefInfo *info)
+{
+  g_free (info->ref);
+  g_free (info->commit);
+  if (info->metadata)
+    g_bytes_unref (info->metadata);
+  g_free (info);
+}
+
+typedef struct
+{
+  FlatpakDir   *dir;
+  const char   *remote_name;
+  GCancellable *cancellable;
+  GMutex        lock;
+  GError       *error;
+} FetchMetadataData;
+
+static void
+fetch_metadata_job (gpointer data,
+                    gpointer user_data)
+{
+  FlatpakRemoteRefInfo *info = data;
+  FetchMetadataData *fetch_data = user_data;
+  g_autoptr(GError) local_error = NULL;
+
+  if (g_cancellable_is_cancelled (fetch_data->cancellable))
+    return;
+
+  info->metadata = flatpak_dir_fetch_metadata (fetch_data->dir, fetch_data->remote_name,
+                                               info->commit, fetch_data->cancellable,
+                                               &local_error);
+  if (info->metadata == NULL)
+    {
+      g_mutex_lock (&fetch_data->lock);
+      if (fetch_data->error == NULL)
+        fetch_data->error = g_steal_pointer (&local_error);
+      g_mutex_unlock (&fetch_data->lock);
+    }
+}
+
+/* Looks up the commit, sizes and metadata of many refs in a remote at
+ * once. This uses the xa.cache data in the summary when available, which
+ * needs no requests other than the (cached) summary. For refs not in
+ * xa.cache the metadata is loaded from the remote objects, with several
+ * fetches in flight at a time, and the sizes are left at 0.
+ * Refs that are not in the remote are skipped.
+ *
+ * Returns: (element-type FlatpakRemoteRefInfo): in the same order as @refs */
+GPtrArray *
+flatpak_dir_fetch_remote_refs_info (FlatpakDir         *self,
+                                    const char         *remote_name,
+                                    const char * const *refs,
+                                    GCancellable       *cancellable,
+                                    GError            **error)
+{
+  g_autoptr(GBytes) summary_bytes = NULL;
+  g_autoptr(GVariant) summary = NULL;
+  g_autoptr(GPtrArray) res = NULL;
+  g_autoptr(GPtrArray) pending = NULL;
+  int i;
+
+  if (!flatpak_dir_ensure_repo (self, cancellable, error))
+    return NULL;
+
+  if (!flatpak_dir_remote_fetch_summary (self, remote_name,
+                                         &summary_bytes,
+                                         cancellable, error))
+    return NULL;
+
+  if (summary_bytes == NULL)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Data not available; server has no summary file");
+      return NULL;
+    }
+
+  summary = g_variant_ref_sink (g_variant_new_from_bytes (OSTREE_SUMMARY_GVARIANT_FORMAT,
+                                                          summary_bytes, FALSE));
+
+  res = g_ptr_array_new_with_free_func ((GDestroyNotify) flatpak_remote_ref_info_free);
+  pending = g_ptr_array_new ();
+
+  for (i = 0; refs[i] != NULL; i++)
+    {
+      g_autoptr(GVariant) cache = NULL;
+      g_autofree char *commit = NULL;
+      FlatpakRemoteRefInfo *info;
+
+      if (!flatpak_summary_lookup_ref (summary, refs[i], &commit))
+        continue;
+
+      info = g_new0 (FlatpakRemoteRefInfo, 1);
+      info->ref = g_strdup (refs[i]);
+      info->commit = g_steal_pointer (&commit);
+      g_ptr_array_add (res, info);
+
+      cache = flatpak_summary_lookup_cache (summary, refs[i]);
+      if (cache != NULL)
+        {
+          guint64 installed_size, download_size;
+          char *metadata;
+
+          g_variant_get (cache, "(tts)", &installed_size, &download_size, &metadata);
+          info->installed_size = GUINT64_FROM_BE (installed_size);
+          info->download_size = GUINT64_FROM_BE (download_size);
+          info->metadata = g_bytes_new_take (metadata, strlen (metadata));
+        }
+      else
+        g_ptr_array_add (pending, info);
+    }
+
+  if (pending->len > 0)
+    {
+      FetchMetadataData fetch_data = { self, remote_name, cancellable };
+      GThreadPool *pool;
+
+      g_mutex_init (&fetch_data.lock);
+
+      pool = g_thread_pool_new (fetch_metadata_job, &fetch_data,
+                                FETCH_METADATA_CONCURRENCY, FALSE, NULL);
+      for (i = 0; i < pending->len; i++)
+        g_thread_pool_push (pool, g_ptr_array_index (pending, i), NULL);
+      g_thread_pool_free (pool, FALSE, TRUE);
+
+      g_mutex_clear (&fetch_data.lock);
+
+      if (fetch_data.error != NULL)
+        {
+          g_propagate_error (error, fetch_data.error);
+          return NULL;
+        }
+
+      if (g_cancellable_set_error_if_cancelled (cancellable, error))
+        return NULL;
+    }
+
+  return g_steal_pointer (&res);
+}
@@ -62,6 +62,24 @@ typedef enum {
 
 #define FLATPAK_HELPER_CONFIGURE_REMOTE_FLAGS_ALL (FLATPAK_HELPER_CONFIGURE_REMOTE_FLAGS_FORCE_REMOVE)
 
+typedef enum {
+  FLATPAK_DIR_CHANGE_DEPLOY,
+  FLATPAK_DIR_CHANGE_UNDEPLOY,
+  FLATPAK_DIR_CHANGE_MAKE_CURRENT,
+  FLATPAK_DIR_CHANGE_MODIFY_REMOTE,
+  FLATPAK_DIR_CHANGE_REMOVE_REMOTE,
+} FlatpakDirChangeType;
+
+typedef struct
+{
+  guint64              serial;
+  FlatpakDirChangeType type;
+  char                *name;   /* a ref, or a remote name */
+  char                *commit; /* for deploy/undeploy, else NULL */
+} FlatpakDirChange;
+
+void         flatpak_dir_change_free (FlatpakDirChange *change);
+
 GQuark       flatpak_dir_error_quark (void);
 
 /**
@@ -78,6 +96,8 @@ GQuark       flatpak_dir_error_quark (void);
 
 GFile *  flatpak_get_system_base_dir_location (void);
 GFile *  flatpak_get_user_base_dir_location (void);
+GFile *  flatpak_get_user_cache_dir_location (void);
+GFile *  flatpak_ensure_user_cache_dir_location (GError **error);
 
 GKeyFile *     flatpak_load_override_keyfile (const char *app_id,
                                               gboolean    user,
@@ -97,7 +117,9 @@ guint64             flatpak_deploy_data_get_installed_size (GVariant *deploy_dat
 
 GFile *        flatpak_deploy_get_dir (FlatpakDeploy *deploy);
 GFile *        flatpak_deploy_get_files (FlatpakDeploy *deploy);
-FlatpakContext *flatpak_deploy_get_overrides (FlatpakDeploy *deploy);
+FlatpakContext *flatpak_deploy_get_overrides (FlatpakDeploy *deploy,
+                                              GError       **error);
+char *         flatpak_deploy_get_overrides_key (FlatpakDeploy *deploy);
 GKeyFile *     flatpak_deploy_get_metadata (FlatpakDeploy *deploy);
 
 FlatpakDir *  flatpak_dir_new (GFile   *basedir,
@@ -111,6 +133,7 @@ void        flatpak_dir_set_no_system_helper (FlatpakDir *self,
                                               gboolean    no_system_helper);
 GFile *     flatpak_dir_get_path (FlatpakDir *self);
 GFile *     flatpak_dir_get_changed_path (FlatpakDir *self);
+GFile *     flatpak_dir_get_changes_path (FlatpakDir *self);
 GFile *     flatpak_dir_get_deploy_dir (FlatpakDir *self,
                                         const char *ref);
 GVariant *  flatpak_dir_get_deploy_data (FlatpakDir   *dir,
@@ -170,6 +193,15 @@ gboolean    flatpak_dir_ensure_repo (FlatpakDir   *self,
                                      GError      **error);
 gboolean    flatpak_dir_mark_changed (FlatpakDir *self,
                                       GError    **error);
+void        flatpak_dir_log_change (FlatpakDir          *self,
+                                    FlatpakDirChangeType type,
+                                    const char          *name,
+                                    const char          *commit);
+GPtrArray * flatpak_dir_read_changes (FlatpakDir   *self,
+                                      guint64       since,
+                                      guint64      *out_cursor,
+                                      GCancellable *cancellable,
+                                      GError      **error);
 gboolean    flatpak_dir_remove_appstream (FlatpakDir   *self,
                                           const char   *remote,
                                           GCancellable *cancellable,
@@ -276,6 +308,10 @@ gboolean   flatpak_dir_install (FlatpakDir          *self,
                                 OstreeAsyncProgress *progress,
                                 GCancellable        *cancellable,
                                 GError             **error);
+void       flatpak_dir_begin_update_batch (FlatpakDir *self);
+gboolean   flatpak_dir_end_update_batch (FlatpakDir   *self,
+                                         GCancellable *cancellable,
+                                         GError      **error);
 gboolean   flatpak_dir_update (FlatpakDir          *self,
                                gboolean             no_pull,
                                gboolean             no_deploy,
@@ -360,6 +396,18 @@ gboolean   flatpak_dir_list_remote_refs (FlatpakDir   *self,
                                          GHashTable  **refs,
                                          GCancellable *cancellable,
                                          GError      **error);
+gboolean   flatpak_dir_lookup_remote_ref (FlatpakDir   *self,
+                                          const char   *remote,
+                                          const char   *ref,
+                                          char        **out_checksum,
+                                          GCancellable *cancellable,
+                                          GError      **error);
+gboolean   flatpak_dir_lookup_remote_refs (FlatpakDir         *self,
+                                           const char         *remote,
+                                           const char * const *refs,
+                                           GHashTable        **out_commits,
+                                           GCancellable       *cancellable,
+                                           GError            **error);
 char *   flatpak_dir_fetch_remote_title (FlatpakDir   *self,
                                          const char   *remote,
                                          GCancellable *cancellable,
@@ -370,6 +418,21 @@ GBytes * flatpak_dir_fetch_remote_object (FlatpakDir   *self,
                                           const char   *type,
                                           GCancellable *cancellable,
                                           GError      **error);
+typedef struct
+{
+  char    *ref;
+  char    *commit;
+  guint64  installed_size;
+  guint64  download_size;
+  GBytes  *metadata;
+} FlatpakRemoteRefInfo;
+
+void        flatpak_remote_ref_info_free (FlatpakRemoteRefInfo *info);
+GPtrArray * flatpak_dir_fetch_remote_refs_info (FlatpakDir         *self,
+                                                const char         *remote_name,
+                                                const char * const *refs,
+                                                GCancellable       *cancellable,
+                                                GError            **error);
 GBytes * flatpak_dir_fetch_metadata (FlatpakDir   *self,
                                      const char   *remote_name,
                                      const char   *commit,
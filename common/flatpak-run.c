@@ -24,6 +24,8 @@
 #include <fcntl.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <errno.h>
+#include <signal.h>
 #include <sys/utsname.h>
 #include <sys/socket.h>
 #include <grp.h>
@@ -44,6 +46,7 @@
 #include "flatpak-proxy.h"
 #include "flatpak-utils.h"
 #include "flatpak-systemd-dbus.h"
+#include "flatpak-sandbox.h"
 
 #define DEFAULT_SHELL "/bin/sh"
 
@@ -2216,6 +2219,197 @@ compute_permissions (GKeyFile *app_metadata,
   return g_steal_pointer (&app_context);
 }
 
+/* The merged context of an app is cached per app in the user cache dir,
+ * so that we don't have to parse and validate the metadata of the app
+ * and the runtime, and the overrides, on every launch. The cache is keyed
+ * by the deploy dirs, which contain the commit ids, and the stat data of
+ * the override files.
+ */
+
+#define FLATPAK_CONTEXT_CACHE_VERSION 1
+#define FLATPAK_CONTEXT_GVARIANT_STRING "(uuuuuua{ss}asa{su}a{su}a{su})"
+#define FLATPAK_CONTEXT_CACHE_GVARIANT_FORMAT G_VARIANT_TYPE ("(s" FLATPAK_CONTEXT_GVARIANT_STRING ")")
+
+static GVariant *
+flatpak_context_to_variant (FlatpakContext *context)
+{
+  GVariantBuilder env_vars, persistent, filesystems, session_bus_policy, system_bus_policy;
+  GHashTableIter iter;
+  gpointer key, value;
+
+  g_variant_builder_init (&env_vars, G_VARIANT_TYPE ("a{ss}"));
+  g_hash_table_iter_init (&iter, context->env_vars);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    g_variant_builder_add (&env_vars, "{ss}", key, value ? value : "");
+
+  g_variant_builder_init (&persistent, G_VARIANT_TYPE ("as"));
+  g_hash_table_iter_init (&iter, context->persistent);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    g_variant_builder_add (&persistent, "s", key);
+
+  g_variant_builder_init (&filesystems, G_VARIANT_TYPE ("a{su}"));
+  g_hash_table_iter_init (&iter, context->filesystems);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    g_variant_builder_add (&filesystems, "{su}", key, GPOINTER_TO_INT (value));
+
+  g_variant_builder_init (&session_bus_policy, G_VARIANT_TYPE ("a{su}"));
+  g_hash_table_iter_init (&iter, context->session_bus_policy);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    g_variant_builder_add (&session_bus_policy, "{su}", key, GPOINTER_TO_INT (value));
+
+  g_variant_builder_init (&system_bus_policy, G_VARIANT_TYPE ("a{su}"));
+  g_hash_table_iter_init (&iter, context->system_bus_policy);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    g_variant_builder_add (&system_bus_policy, "{su}", key, GPOINTER_TO_INT (value));
+
+  return g_variant_new ("(uuuuuua{ss}asa{su}a{su}a{su})",
+                        context->shares, context->shares_valid,
+                        context->sockets, context->sockets_valid,
+                        context->devices, context->devices_valid,
+                        &env_vars, &persistent, &filesystems,
+                        &session_bus_policy, &system_bus_policy);
+}
+
+/* The variant was written by flatpak_context_to_variant(), so the names
+   in it have already been validated */
+static FlatpakContext *
+flatpak_context_from_variant (GVariant *variant)
+{
+  FlatpakContext *context = flatpak_context_new ();
+  g_autoptr(GVariantIter) env_vars = NULL;
+  g_autoptr(GVariantIter) persistent = NULL;
+  g_autoptr(GVariantIter) filesystems = NULL;
+  g_autoptr(GVariantIter) session_bus_policy = NULL;
+  g_autoptr(GVariantIter) system_bus_policy = NULL;
+  const char *key, *value;
+  guint32 mode;
+
+  g_variant_get (variant, "(uuuuuua{ss}asa{su}a{su}a{su})",
+                 &context->shares, &context->shares_valid,
+                 &context->sockets, &context->sockets_valid,
+                 &context->devices, &context->devices_valid,
+                 &env_vars, &persistent, &filesystems,
+                 &session_bus_policy, &system_bus_policy);
+
+  while (g_variant_iter_next (env_vars, "{&s&s}", &key, &value))
+    flatpak_context_set_env_var (context, key, value);
+
+  while (g_variant_iter_next (persistent, "&s", &key))
+    flatpak_context_set_persistent (context, key);
+
+  while (g_variant_iter_next (filesystems, "{&su}", &key, &mode))
+    g_hash_table_insert (context->filesystems, g_strdup (key), GINT_TO_POINTER (mode));
+
+  while (g_variant_iter_next (session_bus_policy, "{&su}", &key, &mode))
+    flatpak_context_set_session_bus_policy (context, key, mode);
+
+  while (g_variant_iter_next (system_bus_policy, "{&su}", &key, &mode))
+    flatpak_context_set_system_bus_policy (context, key, mode);
+
+  return context;
+}
+
+static GFile *
+get_context_cache_file (const char *app_id)
+{
+  g_autoptr(GFile) cache_dir = flatpak_get_user_cache_dir_location ();
+  g_autofree char *relpath = g_build_filename ("contexts", app_id, NULL);
+
+  return g_file_resolve_relative_path (cache_dir, relpath);
+}
+
+static char *
+get_context_cache_key (FlatpakDeploy *app_deploy,
+                       FlatpakDeploy *runtime_deploy)
+{
+  g_autoptr(GFile) app_dir = flatpak_deploy_get_dir (app_deploy);
+  g_autoptr(GFile) runtime_dir = flatpak_deploy_get_dir (runtime_deploy);
+  g_autofree char *overrides_key = flatpak_deploy_get_overrides_key (app_deploy);
+
+  return g_strdup_printf ("%d\n%s\n%s\n%s", FLATPAK_CONTEXT_CACHE_VERSION,
+                          gs_file_get_path_cached (app_dir),
+                          gs_file_get_path_cached (runtime_dir),
+                          overrides_key);
+}
+
+static FlatpakContext *
+load_cached_app_context (GFile      *cache_file,
+                         const char *cache_key)
+{
+  g_autoptr(GMappedFile) mfile = NULL;
+  g_autoptr(GBytes) bytes = NULL;
+  g_autoptr(GVariant) cache = NULL;
+  g_autoptr(GVariant) context = NULL;
+  const char *key;
+
+  mfile = g_mapped_file_new (gs_file_get_path_cached (cache_file), FALSE, NULL);
+  if (mfile == NULL)
+    return NULL;
+
+  bytes = g_mapped_file_get_bytes (mfile);
+  cache = g_variant_ref_sink (g_variant_new_from_bytes (FLATPAK_CONTEXT_CACHE_GVARIANT_FORMAT,
+                                                        bytes, FALSE));
+
+  g_variant_get (cache, "(&s@" FLATPAK_CONTEXT_GVARIANT_STRING ")", &key, &context);
+  if (strcmp (key, cache_key) != 0)
+    return NULL;
+
+  return flatpak_context_from_variant (context);
+}
+
+/* This is just a cache, so failing to save it is not an error */
+static void
+save_cached_app_context (GFile          *cache_file,
+                         const char     *cache_key,
+                         FlatpakContext *context)
+{
+  g_autoptr(GFile) cache_dir = g_file_get_parent (cache_file);
+  g_autoptr(GVariant) cache = NULL;
+  g_autoptr(GError) local_error = NULL;
+
+  cache = g_variant_ref_sink (g_variant_new ("(s@" FLATPAK_CONTEXT_GVARIANT_STRING ")",
+                                             cache_key,
+                                             flatpak_context_to_variant (context)));
+
+  if (!gs_file_ensure_directory (cache_dir, TRUE, NULL, &local_error) ||
+      !flatpak_variant_save (cache_file, cache, NULL, &local_error))
+    g_debug ("Failed to save context cache: %s", local_error->message);
+}
+
+/* Returns the context of the app with the runtime metadata and the
+   overrides applied */
+static FlatpakContext *
+get_app_context (const char    *app_id,
+                 FlatpakDeploy *app_deploy,
+                 GKeyFile      *metakey,
+                 FlatpakDeploy *runtime_deploy,
+                 GKeyFile      *runtime_metakey,
+                 GError       **error)
+{
+  g_autoptr(GFile) cache_file = get_context_cache_file (app_id);
+  g_autofree char *cache_key = get_context_cache_key (app_deploy, runtime_deploy);
+  g_autoptr(FlatpakContext) app_context = NULL;
+  g_autoptr(FlatpakContext) overrides = NULL;
+
+  app_context = load_cached_app_context (cache_file, cache_key);
+  if (app_context != NULL)
+    return g_steal_pointer (&app_context);
+
+  app_context = compute_permissions (metakey, runtime_metakey, error);
+  if (app_context == NULL)
+    return NULL;
+
+  overrides = flatpak_deploy_get_overrides (app_deploy, error);
+  if (overrides == NULL)
+    return NULL;
+
+  flatpak_context_merge (app_context, overrides);
+
+  save_cached_app_context (cache_file, cache_key, app_context);
+
+  return g_steal_pointer (&app_context);
+}
+
 static gboolean
 add_app_info_args (GPtrArray      *argv_array,
                    GArray         *fd_array,
@@ -2271,13 +2465,66 @@ add_app_info_args (GPtrArray      *argv_array,
   return TRUE;
 }
 
-static void
-add_monitor_path_args (GPtrArray *argv_array,
-                       char    ***envp_p)
+/* Files the session helper mirrors from the host /etc into the monitor
+ * dir. They are exposed as symlinks into /run/host/monitor, and the helper
+ * replaces them with atomic renames, so running apps pick up changes. */
+static const char *monitor_files[] = {
+  "resolv.conf",
+  "host.conf",
+  "hosts",
+  "gai.conf",
+  "localtime",
+  "timezone",
+  NULL
+};
+
+static gboolean
+monitor_dir_is_live (const char *monitor_path)
+{
+  g_autofree char *ready_path = g_build_filename (monitor_path, ".ready", NULL);
+  g_autofree char *comm_path = NULL;
+  g_autofree char *contents = NULL;
+  guint64 pid;
+
+  if (!g_file_get_contents (ready_path, &contents, NULL, NULL))
+    return FALSE;
+
+  pid = g_ascii_strtoull (contents, NULL, 10);
+  if (pid == 0)
+    return FALSE;
+
+  /* A helper that belongs to us can always be signalled */
+  if (kill ((pid_t) pid, 0) != 0)
+    return FALSE;
+
+  /* Make sure the pid was not reused by some other process after the
+   * helper died without removing the marker. The kernel truncates the
+   * command name to 15 chars. */
+  g_free (contents);
+  contents = NULL;
+  comm_path = g_strdup_printf ("/proc/%" G_GUINT64_FORMAT "/comm", pid);
+  if (!g_file_get_contents (comm_path, &contents, NULL, NULL))
+    return FALSE;
+
+  return strcmp (g_strchomp (contents), "flatpak-session") == 0;
+}
+
+static char *
+get_monitor_path (void)
 {
   g_autoptr(AutoFlatpakSessionHelper) session_helper = NULL;
   g_autofree char *monitor_path = NULL;
 
+  /* Once the session helper has populated the monitor dir it drops a
+   * marker with its pid there, so in the common case we don't need a
+   * blocking D-Bus roundtrip on each launch. Fall back to RequestMonitor,
+   * which also activates the helper, if it is not running. */
+  monitor_path = g_build_filename (g_get_user_runtime_dir (), "flatpak-monitor", NULL);
+  if (monitor_dir_is_live (monitor_path))
+    return g_steal_pointer (&monitor_path);
+
+  g_clear_pointer (&monitor_path, g_free);
+
   session_helper =
     flatpak_session_helper_proxy_new_for_bus_sync (G_BUS_TYPE_SESSION,
                                                    G_DBUS_PROXY_FLAGS_DO_NOT_LOAD_PROPERTIES | G_DBUS_PROXY_FLAGS_DO_NOT_CONNECT_SIGNALS,
@@ -2288,13 +2535,67 @@ add_monitor_path_args (GPtrArray *argv_array,
       flatpak_session_helper_call_request_monitor_sync (session_helper,
                                                         &monitor_path,
                                                         NULL, NULL))
+    return g_steal_pointer (&monitor_path);
+
+  return NULL;
+}
+
+/* Returns the names of the /etc files that are mirrored in @monitor_path,
+ * so that they are not also taken from the runtime. Older helpers don't
+ * mirror everything, and the host may not have all of these. */
+static GHashTable *
+get_mirrored_files (const char *monitor_path)
+{
+  GHashTable *mirrored = g_hash_table_new (g_str_hash, g_str_equal);
+  int i;
+
+  if (monitor_path == NULL)
+    return mirrored;
+
+  for (i = 0; monitor_files[i] != NULL; i++)
     {
+      g_autofree char *src = NULL;
+
+      /* These are always set up */
+      if (strcmp (monitor_files[i], "resolv.conf") == 0 ||
+          strcmp (monitor_files[i], "localtime") == 0)
+        continue;
+
+      src = g_build_filename (monitor_path, monitor_files[i], NULL);
+      if (g_file_test (src, G_FILE_TEST_EXISTS))
+        g_hash_table_add (mirrored, (char *) monitor_files[i]);
+    }
+
+  return mirrored;
+}
+
+static void
+add_monitor_path_args (GPtrArray  *argv_array,
+                       const char *monitor_path,
+                       GHashTable *mirrored)
+{
+  if (monitor_path != NULL)
+    {
+      GHashTableIter iter;
+      const char *name;
+
       add_args (argv_array,
                 "--bind", monitor_path, "/run/host/monitor",
                 NULL);
       add_args (argv_array,
                 "--symlink", "/run/host/monitor/localtime", "/etc/localtime",
                 NULL);
+
+      g_hash_table_iter_init (&iter, mirrored);
+      while (g_hash_table_iter_next (&iter, (gpointer *) &name, NULL))
+        {
+          g_autofree char *target = g_build_filename ("/run/host/monitor", name, NULL);
+          g_autofree char *dest = g_build_filename ("/etc", name, NULL);
+
+          add_args (argv_array,
+                    "--symlink", target, dest,
+                    NULL);
+        }
     }
   else
     {
@@ -2660,6 +2961,7 @@ flatpak_run_setup_base_argv (GPtrArray      *argv_array,
                              GFile          *runtime_files,
                              GFile          *app_id_dir,
                              const char     *arch,
+                             GHashTable     *mirrored_etc,
                              FlatpakRunFlags flags,
                              GError        **error)
 {
@@ -2750,7 +3052,8 @@ flatpak_run_setup_base_argv (GPtrArray      *argv_array,
               strcmp (dent->d_name, "group") == 0 ||
               strcmp (dent->d_name, "machine-id") == 0 ||
               strcmp (dent->d_name, "resolv.conf") == 0 ||
-              strcmp (dent->d_name, "localtime") == 0)
+              strcmp (dent->d_name, "localtime") == 0 ||
+              (mirrored_etc != NULL && g_hash_table_contains (mirrored_etc, dent->d_name)))
             continue;
 
           src = g_build_filename (gs_file_get_path_cached (etc), dent->d_name, NULL);
@@ -2859,6 +3162,26 @@ child_setup (gpointer user_data)
 }
 
 
+/* The registry is only used to find running sandboxes, so failing to
+   register is not fatal */
+static char *
+register_sandbox (const char    *app_ref,
+                  FlatpakDeploy *app_deploy,
+                  const char    *runtime_ref,
+                  int            pid)
+{
+  g_autoptr(GFile) deploy_dir = flatpak_deploy_get_dir (app_deploy);
+  g_autoptr(GError) local_error = NULL;
+  char *id;
+
+  id = flatpak_sandbox_register (app_ref, gs_file_get_path_cached (deploy_dir),
+                                 runtime_ref, pid, &local_error);
+  if (id == NULL)
+    g_debug ("Failed to register sandbox: %s", local_error->message);
+
+  return id;
+}
+
 gboolean
 flatpak_run_app (const char     *app_ref,
                  FlatpakDeploy  *app_deploy,
@@ -2888,12 +3211,13 @@ flatpak_run_app (const char     *app_ref,
   g_auto(GStrv) envp = NULL;
   g_autoptr(GPtrArray) session_bus_proxy_argv = NULL;
   g_autoptr(GPtrArray) system_bus_proxy_argv = NULL;
+  g_autoptr(GHashTable) mirrored_etc = NULL;
+  g_autofree char *monitor_path = NULL;
   const char *command = "/bin/sh";
   g_autoptr(GError) my_error = NULL;
   g_auto(GStrv) runtime_parts = NULL;
   int i;
   g_autoptr(FlatpakContext) app_context = NULL;
-  g_autoptr(FlatpakContext) overrides = NULL;
   g_auto(GStrv) app_ref_parts = NULL;
 
   app_ref_parts = flatpak_decompose_ref (app_ref, error);
@@ -2956,13 +3280,11 @@ flatpak_run_app (const char     *app_ref,
 
   runtime_metakey = flatpak_deploy_get_metadata (runtime_deploy);
 
-  app_context = compute_permissions (metakey, runtime_metakey, error);
+  app_context = get_app_context (app_ref_parts[1], app_deploy, metakey,
+                                 runtime_deploy, runtime_metakey, error);
   if (app_context == NULL)
     return FALSE;
 
-  overrides = flatpak_deploy_get_overrides (app_deploy);
-  flatpak_context_merge (app_context, overrides);
-
   if (extra_context)
     flatpak_context_merge (app_context, extra_context);
 
@@ -2984,7 +3306,10 @@ flatpak_run_app (const char     *app_ref,
             "--lock-file", "/app/.ref",
             NULL);
 
-  if (!flatpak_run_setup_base_argv (argv_array, fd_array, runtime_files, app_id_dir, app_ref_parts[2], flags, error))
+  monitor_path = get_monitor_path ();
+  mirrored_etc = get_mirrored_files (monitor_path);
+
+  if (!flatpak_run_setup_base_argv (argv_array, fd_array, runtime_files, app_id_dir, app_ref_parts[2], mirrored_etc, flags, error))
     return FALSE;
 
   if (!add_app_info_args (argv_array, fd_array, app_deploy, app_ref_parts[1], runtime_ref, app_context, error))
@@ -2996,7 +3321,7 @@ flatpak_run_app (const char     *app_ref,
   if (!flatpak_run_add_extension_args (argv_array, runtime_metakey, runtime_ref, cancellable, error))
     return FALSE;
 
-  add_monitor_path_args (argv_array, &envp);
+  add_monitor_path_args (argv_array, monitor_path, mirrored_etc);
 
   add_document_portal_args (argv_array, app_ref_parts[1]);
 
@@ -3081,19 +3406,28 @@ flatpak_run_app (const char     *app_ref,
 
   if ((flags & FLATPAK_RUN_FLAG_BACKGROUND) != 0)
     {
+      GPid child_pid;
+
       if (!g_spawn_async (NULL,
                           (char **) real_argv_array->pdata,
                           envp,
                           G_SPAWN_DEFAULT,
                           child_setup, fd_array,
-                          NULL,
+                          &child_pid,
                           error))
         return FALSE;
+
+      g_free (register_sandbox (app_ref, app_deploy, runtime_ref, child_pid));
     }
   else
     {
+      /* exec keeps our pid, so this is the pid bwrap will have */
+      g_autofree char *sandbox_id = register_sandbox (app_ref, app_deploy, runtime_ref, getpid ());
+
       if (execvpe (flatpak_get_bwrap (), (char **) real_argv_array->pdata, envp) == -1)
         {
+          if (sandbox_id)
+            flatpak_sandbox_unregister (sandbox_id);
           g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno), "Unable to start app");
           return FALSE;
         }
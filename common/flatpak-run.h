@@ -95,6 +95,7 @@ gboolean flatpak_run_setup_base_argv (GPtrArray      *argv_array,
                                       GFile          *runtime_files,
                                       GFile          *app_id_dir,
                                       const char     *arch,
+                                      GHashTable     *mirrored_etc,
                                       FlatpakRunFlags flags,
                                       GError        **error);
 gboolean flatpak_run_app (const char     *app_ref,
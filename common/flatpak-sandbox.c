@@ -0,0 +1,536 @@
+/*
+ * Copyright © 2016 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "libgsystem.h"
+#include "libglnx/libglnx.h"
+#include "lib/flatpak-error.h"
+
+#include "flatpak-sandbox.h"
+#include "flatpak-utils.h"
+
+/* The registry is a directory per sandbox, named by a random id. Each
+ * one has an "info" keyfile describing the sandbox. Nothing removes the
+ * entry when the sandbox exits, as flatpak execs bwrap, so entries whose
+ * process is gone are removed the next time the registry is listed.
+ */
+
+#define FLATPAK_SANDBOX_GROUP "Instance"
+
+static char *
+get_registry_dir (void)
+{
+  return g_build_filename (g_get_user_runtime_dir (), ".flatpak", NULL);
+}
+
+void
+flatpak_sandbox_free (FlatpakSandbox *sandbox)
+{
+  if (sandbox == NULL)
+    return;
+
+  g_free (sandbox->id);
+  g_free (sandbox->app);
+  g_free (sandbox->app_ref);
+  g_free (sandbox->app_path);
+  g_free (sandbox->commit);
+  g_free (sandbox->runtime_ref);
+  g_free (sandbox->scope);
+  g_free (sandbox);
+}
+
+/* Reads a field of /proc/PID/stat, counting from the one after the
+   command name, which may contain spaces (so 0 is the state) */
+static gboolean
+read_proc_stat_field (int      pid,
+                      int      field,
+                      guint64 *out_value)
+{
+  g_autofree char *path = g_strdup_printf ("/proc/%d/stat", pid);
+  g_autofree char *contents = NULL;
+  g_auto(GStrv) fields = NULL;
+  char *p;
+
+  if (!g_file_get_contents (path, &contents, NULL, NULL))
+    return FALSE;
+
+  p = strrchr (contents, ')');
+  if (p == NULL || p[1] != ' ')
+    return FALSE;
+
+  fields = g_strsplit (p + 2, " ", -1);
+  if (g_strv_length (fields) <= field)
+    return FALSE;
+
+  *out_value = g_ascii_strtoull (fields[field], NULL, 10);
+  return TRUE;
+}
+
+/* The start time is field 22 of stat, in clock ticks since boot */
+static gboolean
+get_start_time (int      pid,
+                guint64 *out_start_time)
+{
+  return read_proc_stat_field (pid, 19, out_start_time);
+}
+
+/* Returns a hash table from each controller (or "" for the unified
+   hierarchy) to the cgroup path of the process */
+static GHashTable *
+get_cgroups (int pid)
+{
+  g_autofree char *path = g_strdup_printf ("/proc/%d/cgroup", pid);
+  g_autofree char *contents = NULL;
+  g_autoptr(GHashTable) cgroups = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  g_auto(GStrv) lines = NULL;
+  int i, j;
+
+  if (!g_file_get_contents (path, &contents, NULL, NULL))
+    return g_steal_pointer (&cgroups);
+
+  /* Each line is hierarchy-id:controller-list:path */
+  lines = g_strsplit (contents, "\n", -1);
+  for (i = 0; lines[i] != NULL; i++)
+    {
+      g_auto(GStrv) fields = g_strsplit (lines[i], ":", 3);
+      g_auto(GStrv) controllers = NULL;
+
+      if (g_strv_length (fields) != 3)
+        continue;
+
+      /* The unified hierarchy has no controller list */
+      if (*fields[1] == 0)
+        {
+          g_hash_table_insert (cgroups, g_strdup (""), g_strdup (fields[2]));
+          continue;
+        }
+
+      controllers = g_strsplit (fields[1], ",", -1);
+      for (j = 0; controllers[j] != NULL; j++)
+        g_hash_table_insert (cgroups, g_strdup (controllers[j]), g_strdup (fields[2]));
+
+      /* cgroup v1 mounts each hierarchy at its full controller list */
+      if (strchr (fields[1], ',') != NULL)
+        g_hash_table_insert (cgroups, g_strdup (fields[1]), g_strdup (fields[2]));
+    }
+
+  return g_steal_pointer (&cgroups);
+}
+
+static char *
+get_scope (int pid)
+{
+  g_autoptr(GHashTable) cgroups = get_cgroups (pid);
+  const char *path;
+
+  path = g_hash_table_lookup (cgroups, "name=systemd");
+  if (path == NULL)
+    path = g_hash_table_lookup (cgroups, "");
+
+  if (path != NULL && g_str_has_suffix (path, ".scope"))
+    return g_path_get_basename (path);
+
+  return NULL;
+}
+
+char *
+flatpak_sandbox_register (const char *app_ref,
+                          const char *app_path,
+                          const char *runtime_ref,
+                          int         pid,
+                          GError    **error)
+{
+  g_autofree char *registry_dir = get_registry_dir ();
+  g_autofree char *id = NULL;
+  g_autofree char *instance_dir = NULL;
+  g_autofree char *info_path = NULL;
+  g_autofree char *data = NULL;
+  g_autofree char *commit = NULL;
+  g_autofree char *scope = NULL;
+  g_autoptr(GKeyFile) keyfile = NULL;
+  g_auto(GStrv) ref_parts = NULL;
+  guint64 start_time;
+  gsize len;
+
+  ref_parts = flatpak_decompose_ref (app_ref, error);
+  if (ref_parts == NULL)
+    return NULL;
+
+  if (!get_start_time (pid, &start_time))
+    {
+      flatpak_fail (error, "Can't get start time of pid %d", pid);
+      return NULL;
+    }
+
+  if (g_mkdir_with_parents (registry_dir, 0700) != 0)
+    {
+      glnx_set_error_from_errno (error);
+      return NULL;
+    }
+
+  /* Pick a random id that is not in use. It starts with a letter so
+     that it can't be mistaken for a pid, see flatpak enter. */
+  while (TRUE)
+    {
+      g_free (id);
+      g_free (instance_dir);
+
+      id = g_strdup_printf ("i%08x", g_random_int ());
+      instance_dir = g_build_filename (registry_dir, id, NULL);
+
+      if (mkdir (instance_dir, 0700) == 0)
+        break;
+
+      if (errno != EEXIST)
+        {
+          glnx_set_error_from_errno (error);
+          return NULL;
+        }
+    }
+
+  /* The deploy dir is named after the commit */
+  commit = g_path_get_basename (app_path);
+  scope = get_scope (pid);
+
+  keyfile = g_key_file_new ();
+  g_key_file_set_string (keyfile, FLATPAK_SANDBOX_GROUP, "app", ref_parts[1]);
+  g_key_file_set_string (keyfile, FLATPAK_SANDBOX_GROUP, "app-ref", app_ref);
+  g_key_file_set_string (keyfile, FLATPAK_SANDBOX_GROUP, "app-path", app_path);
+  g_key_file_set_string (keyfile, FLATPAK_SANDBOX_GROUP, "commit", commit);
+  g_key_file_set_string (keyfile, FLATPAK_SANDBOX_GROUP, "runtime", runtime_ref);
+  if (scope)
+    g_key_file_set_string (keyfile, FLATPAK_SANDBOX_GROUP, "scope", scope);
+  g_key_file_set_integer (keyfile, FLATPAK_SANDBOX_GROUP, "pid", pid);
+  g_key_file_set_uint64 (keyfile, FLATPAK_SANDBOX_GROUP, "start-time", start_time);
+  g_key_file_set_int64 (keyfile, FLATPAK_SANDBOX_GROUP, "launch-time",
+                        g_get_real_time () / G_USEC_PER_SEC);
+
+  data = g_key_file_to_data (keyfile, &len, NULL);
+  info_path = g_build_filename (instance_dir, "info", NULL);
+
+  /* Written atomically, so readers never see a partial file */
+  if (!g_file_set_contents (info_path, data, len, error))
+    {
+      flatpak_sandbox_unregister (id);
+      return NULL;
+    }
+
+  return g_steal_pointer (&id);
+}
+
+void
+flatpak_sandbox_unregister (const char *id)
+{
+  g_autofree char *registry_dir = get_registry_dir ();
+  g_autofree char *instance_dir = g_build_filename (registry_dir, id, NULL);
+
+  (void) glnx_shutil_rm_rf_at (AT_FDCWD, instance_dir, NULL, NULL);
+}
+
+static FlatpakSandbox *
+load_sandbox (const char *registry_dir,
+              const char *id)
+{
+  g_autofree char *info_path = g_build_filename (registry_dir, id, "info", NULL);
+  g_autoptr(GKeyFile) keyfile = g_key_file_new ();
+  g_autoptr(FlatpakSandbox) sandbox = NULL;
+
+  if (!g_key_file_load_from_file (keyfile, info_path, G_KEY_FILE_NONE, NULL))
+    return NULL;
+
+  sandbox = g_new0 (FlatpakSandbox, 1);
+  sandbox->id = g_strdup (id);
+  sandbox->app = g_key_file_get_string (keyfile, FLATPAK_SANDBOX_GROUP, "app", NULL);
+  sandbox->app_ref = g_key_file_get_string (keyfile, FLATPAK_SANDBOX_GROUP, "app-ref", NULL);
+  sandbox->app_path = g_key_file_get_string (keyfile, FLATPAK_SANDBOX_GROUP, "app-path", NULL);
+  sandbox->commit = g_key_file_get_string (keyfile, FLATPAK_SANDBOX_GROUP, "commit", NULL);
+  sandbox->runtime_ref = g_key_file_get_string (keyfile, FLATPAK_SANDBOX_GROUP, "runtime", NULL);
+  sandbox->scope = g_key_file_get_string (keyfile, FLATPAK_SANDBOX_GROUP, "scope", NULL);
+  sandbox->pid = g_key_file_get_integer (keyfile, FLATPAK_SANDBOX_GROUP, "pid", NULL);
+  sandbox->start_time = g_key_file_get_uint64 (keyfile, FLATPAK_SANDBOX_GROUP, "start-time", NULL);
+  sandbox->launch_time = g_key_file_get_int64 (keyfile, FLATPAK_SANDBOX_GROUP, "launch-time", NULL);
+
+  if (sandbox->app == NULL || sandbox->app_ref == NULL || sandbox->pid <= 0)
+    return NULL;
+
+  return g_steal_pointer (&sandbox);
+}
+
+gboolean
+flatpak_sandbox_is_running (FlatpakSandbox *sandbox)
+{
+  guint64 start_time;
+
+  /* If the pid was reused the start time will differ */
+  return
+    get_start_time (sandbox->pid, &start_time) &&
+    start_time == sandbox->start_time;
+}
+
+static int
+compare_by_start_time (gconstpointer a,
+                       gconstpointer b)
+{
+  const FlatpakSandbox *sa = *(const FlatpakSandbox **) a;
+  const FlatpakSandbox *sb = *(const FlatpakSandbox **) b;
+
+  if (sa->start_time < sb->start_time)
+    return -1;
+  if (sa->start_time > sb->start_time)
+    return 1;
+  return 0;
+}
+
+/* Returns the running sandboxes, oldest first, and removes the
+   entries of those that are gone */
+GPtrArray *
+flatpak_sandbox_list (void)
+{
+  g_autofree char *registry_dir = get_registry_dir ();
+  g_autoptr(GPtrArray) sandboxes = g_ptr_array_new_with_free_func ((GDestroyNotify) flatpak_sandbox_free);
+  g_autoptr(GDir) dir = NULL;
+  const char *name;
+
+  dir = g_dir_open (registry_dir, 0, NULL);
+  if (dir == NULL)
+    return g_steal_pointer (&sandboxes);
+
+  while ((name = g_dir_read_name (dir)) != NULL)
+    {
+      FlatpakSandbox *sandbox = load_sandbox (registry_dir, name);
+
+      /* Entries without info may still be being registered */
+      if (sandbox == NULL)
+        continue;
+
+      if (flatpak_sandbox_is_running (sandbox))
+        {
+          g_ptr_array_add (sandboxes, sandbox);
+        }
+      else
+        {
+          flatpak_sandbox_unregister (name);
+          flatpak_sandbox_free (sandbox);
+        }
+    }
+
+  g_ptr_array_sort (sandboxes, compare_by_start_time);
+
+  return g_steal_pointer (&sandboxes);
+}
+
+/* Finds a sandbox by instance id, or the most recently started
+   sandbox of an app */
+FlatpakSandbox *
+flatpak_sandbox_lookup (const char *app_or_id,
+                        GError    **error)
+{
+  g_autoptr(GPtrArray) sandboxes = flatpak_sandbox_list ();
+  int i;
+
+  for (i = sandboxes->len - 1; i >= 0; i--)
+    {
+      FlatpakSandbox *sandbox = g_ptr_array_index (sandboxes, i);
+
+      if (strcmp (sandbox->id, app_or_id) == 0 ||
+          strcmp (sandbox->app, app_or_id) == 0)
+        {
+          sandboxes->pdata[i] = NULL;
+          return sandbox;
+        }
+    }
+
+  g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
+               "No running sandbox for %s", app_or_id);
+  return NULL;
+}
+
+/* Returns the first process inside the namespaces of the sandbox, which
+   is the child of the bwrap process, or 0 if there is none */
+int
+flatpak_sandbox_get_child_pid (FlatpakSandbox *sandbox)
+{
+  g_autofree char *children_path = g_strdup_printf ("/proc/%d/task/%d/children",
+                                                    sandbox->pid, sandbox->pid);
+  g_autofree char *children = NULL;
+  g_autoptr(GDir) proc = NULL;
+  const char *name;
+
+  if (g_file_get_contents (children_path, &children, NULL, NULL))
+    return atoi (children);
+
+  /* No CONFIG_PROC_CHILDREN, look for a process with bwrap as parent */
+  proc = g_dir_open ("/proc", 0, NULL);
+  if (proc == NULL)
+    return 0;
+
+  while ((name = g_dir_read_name (proc)) != NULL)
+    {
+      int pid = atoi (name);
+      guint64 ppid;
+
+      if (pid > 0 &&
+          read_proc_stat_field (pid, 1, &ppid) &&
+          ppid == sandbox->pid)
+        return pid;
+    }
+
+  return 0;
+}
+
+static gboolean
+read_cgroup_file (const char *hierarchy,
+                  const char *cgroup,
+                  const char *name,
+                  char      **out_contents)
+{
+  g_autofree char *path = g_build_filename ("/sys/fs/cgroup", hierarchy, cgroup, name, NULL);
+
+  return g_file_get_contents (path, out_contents, NULL, NULL);
+}
+
+static gboolean
+read_cgroup_uint64 (const char *hierarchy,
+                    const char *cgroup,
+                    const char *name,
+                    guint64    *out_value)
+{
+  g_autofree char *contents = NULL;
+
+  if (!read_cgroup_file (hierarchy, cgroup, name, &contents))
+    return FALSE;
+
+  *out_value = g_ascii_strtoull (contents, NULL, 10);
+  return TRUE;
+}
+
+/* Looks up "KEY VALUE" lines, or "KEY=VALUE" words, and sums the values */
+static guint64
+sum_cgroup_stat (const char *contents,
+                 const char *key,
+                 char        separator)
+{
+  g_auto(GStrv) words = g_strsplit_set (contents, " \n", -1);
+  gsize key_len = strlen (key);
+  guint64 sum = 0;
+  int i;
+
+  for (i = 0; words[i] != NULL; i++)
+    {
+      if (separator == '=')
+        {
+          if (strncmp (words[i], key, key_len) == 0 && words[i][key_len] == '=')
+            sum += g_ascii_strtoull (words[i] + key_len + 1, NULL, 10);
+        }
+      else if (strcmp (words[i], key) == 0 && words[i + 1] != NULL)
+        {
+          sum += g_ascii_strtoull (words[i + 1], NULL, 10);
+        }
+    }
+
+  return sum;
+}
+
+/* Returns the cgroup of the sandbox in the hierarchy of @controller,
+ * but only if it is the scope of the sandbox. With cgroup v1 a controller
+ * that is not delegated to the scope puts it in the parent slice instead,
+ * and those counters are shared with everything else in the slice. */
+static const char *
+lookup_scope_cgroup (FlatpakSandbox *sandbox,
+                     GHashTable     *cgroups,
+                     const char     *controller)
+{
+  const char *cgroup = g_hash_table_lookup (cgroups, controller);
+  const char *basename;
+
+  if (cgroup == NULL || sandbox->scope == NULL)
+    return NULL;
+
+  basename = strrchr (cgroup, '/');
+  basename = basename ? basename + 1 : cgroup;
+  if (strcmp (basename, sandbox->scope) != 0)
+    return NULL;
+
+  return cgroup;
+}
+
+/* Reads the counters of the scope the bwrap process is in. With cgroup
+ * v2 the counters are in the unified hierarchy, with v1 each comes from
+ * the hierarchy of its controller. Sandboxes that were not started in a
+ * scope, or controllers that are not enabled for the scope, have no
+ * counters.
+ */
+void
+flatpak_sandbox_get_usage (FlatpakSandbox      *sandbox,
+                           FlatpakSandboxUsage *usage)
+{
+  g_autoptr(GHashTable) cgroups = get_cgroups (sandbox->pid);
+  const char *unified = lookup_scope_cgroup (sandbox, cgroups, "");
+  const char *cgroup;
+  g_autofree char *contents = NULL;
+
+  memset (usage, 0, sizeof (FlatpakSandboxUsage));
+
+  if (unified != NULL &&
+      read_cgroup_file ("", unified, "cpu.stat", &contents))
+    {
+      usage->has_cpu = TRUE;
+      usage->cpu_usec = sum_cgroup_stat (contents, "usage_usec", ' ');
+    }
+  else if ((cgroup = lookup_scope_cgroup (sandbox, cgroups, "cpu,cpuacct")) != NULL &&
+           read_cgroup_uint64 ("cpu,cpuacct", cgroup, "cpuacct.usage", &usage->cpu_usec))
+    {
+      usage->has_cpu = TRUE;
+      usage->cpu_usec /= 1000;
+    }
+  else if ((cgroup = lookup_scope_cgroup (sandbox, cgroups, "cpuacct")) != NULL &&
+           read_cgroup_uint64 ("cpuacct", cgroup, "cpuacct.usage", &usage->cpu_usec))
+    {
+      usage->has_cpu = TRUE;
+      usage->cpu_usec /= 1000;
+    }
+
+  if (unified != NULL &&
+      read_cgroup_uint64 ("", unified, "memory.current", &usage->memory_bytes))
+    usage->has_memory = TRUE;
+  else if ((cgroup = lookup_scope_cgroup (sandbox, cgroups, "memory")) != NULL &&
+           read_cgroup_uint64 ("memory", cgroup, "memory.usage_in_bytes", &usage->memory_bytes))
+    usage->has_memory = TRUE;
+
+  g_clear_pointer (&contents, g_free);
+  if (unified != NULL &&
+      read_cgroup_file ("", unified, "io.stat", &contents))
+    {
+      usage->has_io = TRUE;
+      usage->io_read_bytes = sum_cgroup_stat (contents, "rbytes", '=');
+      usage->io_write_bytes = sum_cgroup_stat (contents, "wbytes", '=');
+    }
+  else if ((cgroup = lookup_scope_cgroup (sandbox, cgroups, "blkio")) != NULL &&
+           read_cgroup_file ("blkio", cgroup, "blkio.throttle.io_service_bytes", &contents))
+    {
+      usage->has_io = TRUE;
+      usage->io_read_bytes = sum_cgroup_stat (contents, "Read", ' ');
+      usage->io_write_bytes = sum_cgroup_stat (contents, "Write", ' ');
+    }
+}
@@ -0,0 +1,69 @@
+/*
+ * Copyright © 2016 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __FLATPAK_SANDBOX_H__
+#define __FLATPAK_SANDBOX_H__
+
+#include "libglnx/libglnx.h"
+
+/* A sandbox started by flatpak_run_app(), as recorded in the registry
+   in $XDG_RUNTIME_DIR/.flatpak/ID/info */
+typedef struct
+{
+  char    *id;
+  char    *app;
+  char    *app_ref;
+  char    *app_path;   /* The deploy dir of the app */
+  char    *commit;
+  char    *runtime_ref;
+  char    *scope;      /* The systemd scope, if any */
+  int      pid;        /* The bwrap process outside the sandbox */
+  guint64  start_time; /* Of pid, to detect pid reuse */
+  gint64   launch_time; /* Wall clock, in seconds since the epoch */
+} FlatpakSandbox;
+
+/* Resource usage of the cgroup of a sandbox. Counters that the cgroup
+   controllers don't provide are left unset. */
+typedef struct
+{
+  gboolean has_cpu;
+  guint64  cpu_usec;
+  gboolean has_memory;
+  guint64  memory_bytes;
+  gboolean has_io;
+  guint64  io_read_bytes;
+  guint64  io_write_bytes;
+} FlatpakSandboxUsage;
+
+void            flatpak_sandbox_free (FlatpakSandbox *sandbox);
+char *          flatpak_sandbox_register (const char *app_ref,
+                                          const char *app_path,
+                                          const char *runtime_ref,
+                                          int         pid,
+                                          GError    **error);
+void            flatpak_sandbox_unregister (const char *id);
+GPtrArray *     flatpak_sandbox_list (void);
+FlatpakSandbox *flatpak_sandbox_lookup (const char *app_or_id,
+                                        GError    **error);
+gboolean        flatpak_sandbox_is_running (FlatpakSandbox *sandbox);
+int             flatpak_sandbox_get_child_pid (FlatpakSandbox *sandbox);
+void            flatpak_sandbox_get_usage (FlatpakSandbox      *sandbox,
+                                           FlatpakSandboxUsage *usage);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (FlatpakSandbox, flatpak_sandbox_free)
+
+#endif /* __FLATPAK_SANDBOX_H__ */
@@ -1286,7 +1286,8 @@ flatpak_spawn (GFile       *dir,
   if (subp == NULL)
     return FALSE;
 
-  loop = g_main_loop_new (NULL, FALSE);
+  /* Use the thread default context so this can be called from worker threads */
+  loop = g_main_loop_new (g_main_context_get_thread_default (), FALSE);
 
   data.loop = loop;
   data.refs = 1;
@@ -1563,6 +1564,33 @@ flatpak_summary_lookup_ref (GVariant *summary, const char *ref, char **out_check
   return TRUE;
 }
 
+/* Returns the (installed-size, download-size, metadata) tuple for ref
+   from the xa.cache in the summary, or NULL if there is none. */
+GVariant *
+flatpak_summary_lookup_cache (GVariant   *summary,
+                              const char *ref)
+{
+  g_autoptr(GVariant) extensions = g_variant_get_child_value (summary, 1);
+  g_autoptr(GVariant) cache_v = NULL;
+  g_autoptr(GVariant) cache = NULL;
+  g_autoptr(GVariant) entry = NULL;
+  int pos;
+
+  cache_v = g_variant_lookup_value (extensions, "xa.cache", NULL);
+  if (cache_v == NULL)
+    return NULL;
+
+  cache = g_variant_get_child_value (cache_v, 0);
+
+  /* flatpak_repo_update() always sorts the cache by ref, and it is
+     the only thing that writes it */
+  if (!flatpak_variant_bsearch_str (cache, ref, &pos))
+    return NULL;
+
+  entry = g_variant_get_child_value (cache, pos);
+  return g_variant_get_child_value (entry, 1);
+}
+
 gboolean
 flatpak_repo_set_title (OstreeRepo *repo,
                         const char *title,
@@ -1653,6 +1681,65 @@ flatpak_repo_collect_sizes (OstreeRepo   *repo,
   return _flatpak_repo_collect_sizes (repo, root, NULL, installed_size, download_size, cancellable, error);
 }
 
+typedef struct
+{
+  OstreeRepo   *repo;
+  const char   *ref;
+  GCancellable *cancellable;
+  guint64       installed_size;
+  guint64       download_size;
+  char         *metadata_contents;
+  GError       *error;
+} RefCacheJob;
+
+static void
+ref_cache_job_free (RefCacheJob *job)
+{
+  g_free (job->metadata_contents);
+  g_clear_error (&job->error);
+  g_free (job);
+}
+
+static void
+ref_cache_job_run (gpointer data,
+                   gpointer user_data)
+{
+  RefCacheJob *job = data;
+  g_autoptr(GFile) root = NULL;
+  g_autoptr(GFile) metadata = NULL;
+
+  if (!ostree_repo_read_commit (job->repo, job->ref, &root, NULL, NULL, &job->error))
+    return;
+
+  if (!flatpak_repo_collect_sizes (job->repo, root, &job->installed_size, &job->download_size,
+                                   job->cancellable, &job->error))
+    return;
+
+  metadata = g_file_get_child (root, "metadata");
+  if (!g_file_load_contents (metadata, job->cancellable, &job->metadata_contents, NULL, NULL, NULL))
+    job->metadata_contents = g_strdup ("");
+}
+
+/* Loads the summary we generated last time, if any, so that the
+   xa.cache entries of unchanged refs can be reused */
+static GVariant *
+load_old_summary (OstreeRepo   *repo,
+                  GCancellable *cancellable)
+{
+  g_autoptr(GFile) summary_file = g_file_get_child (ostree_repo_get_path (repo), "summary");
+  g_autoptr(GBytes) bytes = NULL;
+  char *contents = NULL;
+  gsize length;
+
+  if (!g_file_load_contents (summary_file, cancellable, &contents, &length, NULL, NULL))
+    return NULL;
+
+  bytes = g_bytes_new_take (contents, length);
+
+  return g_variant_ref_sink (g_variant_new_from_bytes (OSTREE_SUMMARY_GVARIANT_FORMAT,
+                                                       bytes, FALSE));
+}
+
 gboolean
 flatpak_repo_update (OstreeRepo   *repo,
                      const char  **gpg_key_ids,
@@ -1666,8 +1753,12 @@ flatpak_repo_update (OstreeRepo   *repo,
   g_autofree char *title = NULL;
 
   g_autoptr(GHashTable) refs = NULL;
+  g_autoptr(GVariant) old_summary = NULL;
+  g_autoptr(GPtrArray) jobs = NULL;
+  GThreadPool *pool = NULL;
   GList *ordered_keys = NULL;
   GList *l = NULL;
+  guint i;
 
   g_variant_builder_init (&builder, G_VARIANT_TYPE_VARDICT);
 
@@ -1686,33 +1777,75 @@ flatpak_repo_update (OstreeRepo   *repo,
   if (!ostree_repo_list_refs (repo, NULL, &refs, cancellable, error))
     return FALSE;
 
+  old_summary = load_old_summary (repo, cancellable);
+
+  /* The cache must be sorted by ref, as clients use binary search
+     to find refs in it, see flatpak_summary_lookup_cache() */
   ordered_keys = g_hash_table_get_keys (refs);
   ordered_keys = g_list_sort (ordered_keys, (GCompareFunc) strcmp);
 
+  /* Computing the sizes means traversing the entire commit, so
+     only do that for refs that changed since the last summary,
+     and do those in parallel. */
+  jobs = g_ptr_array_new_with_free_func ((GDestroyNotify) ref_cache_job_free);
+  pool = g_thread_pool_new (ref_cache_job_run, NULL,
+                            MAX (g_get_num_processors (), 1), FALSE, NULL);
+
   for (l = ordered_keys; l; l = l->next)
     {
       const char *ref = l->data;
-      g_autoptr(GFile) root = NULL;
-      g_autoptr(GFile) metadata = NULL;
-      guint64 installed_size = 0;
-      guint64 download_size = 0;
-      g_autofree char *metadata_contents = NULL;
+      const char *commit = g_hash_table_lookup (refs, ref);
+      RefCacheJob *job = g_new0 (RefCacheJob, 1);
+      g_autofree char *old_commit = NULL;
+
+      job->repo = repo;
+      job->ref = ref;
+      job->cancellable = cancellable;
+      g_ptr_array_add (jobs, job);
+
+      if (old_summary != NULL &&
+          flatpak_summary_lookup_ref (old_summary, ref, &old_commit) &&
+          g_strcmp0 (old_commit, commit) == 0)
+        {
+          g_autoptr(GVariant) old_cache = flatpak_summary_lookup_cache (old_summary, ref);
 
-      if (!ostree_repo_read_commit (repo, ref, &root, NULL, NULL, error))
-        return FALSE;
+          if (old_cache != NULL)
+            {
+              g_variant_get (old_cache, "(tts)",
+                             &job->installed_size,
+                             &job->download_size,
+                             &job->metadata_contents);
+              job->installed_size = GUINT64_FROM_BE (job->installed_size);
+              job->download_size = GUINT64_FROM_BE (job->download_size);
+              continue;
+            }
+        }
 
-      if (!flatpak_repo_collect_sizes (repo, root, &installed_size, &download_size, cancellable, error))
-        return FALSE;
+      g_thread_pool_push (pool, job, NULL);
+    }
+
+  /* Wait for all jobs to finish */
+  g_thread_pool_free (pool, FALSE, TRUE);
+  g_list_free (ordered_keys);
+
+  for (i = 0; i < jobs->len; i++)
+    {
+      RefCacheJob *job = g_ptr_array_index (jobs, i);
 
-      metadata = g_file_get_child (root, "metadata");
-      if (!g_file_load_contents (metadata, cancellable, &metadata_contents, NULL, NULL, NULL))
-        metadata_contents = g_strdup ("");
+      if (job->error)
+        {
+          g_propagate_error (error, job->error);
+          job->error = NULL;
+          g_variant_builder_clear (&builder);
+          g_variant_builder_clear (&ref_data_builder);
+          return FALSE;
+        }
 
       g_variant_builder_add (&ref_data_builder, "{s(tts)}",
-                             ref,
-                             GUINT64_TO_BE (installed_size),
-                             GUINT64_TO_BE (download_size),
-                             metadata_contents);
+                             job->ref,
+                             GUINT64_TO_BE (job->installed_size),
+                             GUINT64_TO_BE (job->download_size),
+                             job->metadata_contents);
     }
 
   g_variant_builder_add (&builder, "{sv}", "xa.cache",
@@ -1937,16 +2070,12 @@ flatpak_appstream_xml_migrate (FlatpakXml *source,
 
 static gboolean
 copy_icon (const char *id,
-           GFile      *root,
+           GFile      *icons_dir,
            GFile      *dest,
            const char *size,
            GError    **error)
 {
   g_autofree char *icon_name = g_strconcat (id, ".png", NULL);
-
-  g_autoptr(GFile) icons_dir =
-    g_file_resolve_relative_path (root,
-                                  "files/share/app-info/icons/flatpak");
   g_autoptr(GFile) size_dir = g_file_get_child (icons_dir, size);
   g_autoptr(GFile) icon_file = g_file_get_child (size_dir, icon_name);
   g_autoptr(GFile) dest_dir = g_file_get_child (dest, "icons");
@@ -1978,6 +2107,60 @@ copy_icon (const char *id,
   return TRUE;
 }
 
+/* Copies the icons of all the desktop components in appstream_root
+   from icons_dir into the icons directory in dest */
+static void
+copy_component_icons (FlatpakXml *appstream_root,
+                      GFile      *icons_dir,
+                      GFile      *dest,
+                      gboolean    verbose)
+{
+  g_autoptr(GError) my_error = NULL;
+  FlatpakXml *components = appstream_root->first_child;
+  FlatpakXml *component = components->first_child;
+
+  while (component != NULL)
+    {
+      FlatpakXml *component_id, *component_id_text_node;
+      g_autofree char *component_id_text = NULL;
+
+      if (g_strcmp0 (component->element_name, "component") != 0)
+        {
+          component = component->next_sibling;
+          continue;
+        }
+
+      component_id = flatpak_xml_find (component, "id", NULL);
+      component_id_text_node = flatpak_xml_find (component_id, NULL, NULL);
+
+      component_id_text = g_strstrip (g_strdup (component_id_text_node->text));
+      if (!g_str_has_suffix (component_id_text, ".desktop"))
+        {
+          component = component->next_sibling;
+          continue;
+        }
+
+      if (verbose)
+        g_print ("Extracting icons for component %s\n", component_id_text);
+      component_id_text[strlen (component_id_text) - strlen (".desktop")] = 0;
+
+      if (!copy_icon (component_id_text, icons_dir, dest, "64x64", &my_error))
+        {
+          if (verbose)
+            g_print ("Error copying 64x64 icon: %s\n", my_error->message);
+          g_clear_error (&my_error);
+        }
+      if (!copy_icon (component_id_text, icons_dir, dest, "128x128", &my_error))
+        {
+          if (verbose)
+            g_print ("Error copying 128x128 icon: %s\n", my_error->message);
+          g_clear_error (&my_error);
+        }
+
+      component = component->next_sibling;
+    }
+}
+
 static gboolean
 extract_appstream (OstreeRepo   *repo,
                    FlatpakXml   *appstream_root,
@@ -2028,47 +2211,10 @@ extract_appstream (OstreeRepo   *repo,
   if (flatpak_appstream_xml_migrate (xml_root, appstream_root,
                                      ref, id, keyfile))
     {
-      g_autoptr(GError) my_error = NULL;
-      FlatpakXml *components = appstream_root->first_child;
-      FlatpakXml *component = components->first_child;
-
-      while (component != NULL)
-        {
-          FlatpakXml *component_id, *component_id_text_node;
-          g_autofree char *component_id_text = NULL;
-
-          if (g_strcmp0 (component->element_name, "component") != 0)
-            {
-              component = component->next_sibling;
-              continue;
-            }
+      g_autoptr(GFile) icons_dir =
+        g_file_resolve_relative_path (root, "files/share/app-info/icons/flatpak");
 
-          component_id = flatpak_xml_find (component, "id", NULL);
-          component_id_text_node = flatpak_xml_find (component_id, NULL, NULL);
-
-          component_id_text = g_strstrip (g_strdup (component_id_text_node->text));
-          if (!g_str_has_suffix (component_id_text, ".desktop"))
-            {
-              component = component->next_sibling;
-              continue;
-            }
-
-          g_print ("Extracting icons for component %s\n", component_id_text);
-          component_id_text[strlen (component_id_text) - strlen (".desktop")] = 0;
-
-          if (!copy_icon (component_id_text, root, dest, "64x64", &my_error))
-            {
-              g_print ("Error copying 64x64 icon: %s\n", my_error->message);
-              g_clear_error (&my_error);
-            }
-          if (!copy_icon (component_id_text, root, dest, "128x128", &my_error))
-            {
-              g_print ("Error copying 128x128 icon: %s\n", my_error->message);
-              g_clear_error (&my_error);
-            }
-
-          component = component->next_sibling;
-        }
+      copy_component_icons (appstream_root, icons_dir, dest, TRUE);
     }
 
   return TRUE;
@@ -2121,6 +2267,202 @@ flatpak_appstream_xml_root_to_data (FlatpakXml *appstream_root,
   return g_memory_output_stream_steal_as_bytes (G_MEMORY_OUTPUT_STREAM (out));
 }
 
+static const char *
+component_get_bundle_ref (FlatpakXml *component)
+{
+  FlatpakXml *bundle = flatpak_xml_find (component, "bundle", NULL);
+  FlatpakXml *text;
+
+  if (bundle == NULL)
+    return NULL;
+
+  text = flatpak_xml_find (bundle, NULL, NULL);
+  return text != NULL ? text->text : NULL;
+}
+
+/* Moves all the components of source to dest */
+static void
+move_components (FlatpakXml *source,
+                 FlatpakXml *dest)
+{
+  FlatpakXml *source_components = flatpak_xml_find (source, "components", NULL);
+  FlatpakXml *dest_components = dest->first_child;
+  FlatpakXml *component, *prev_component;
+
+  if (source_components == NULL)
+    return;
+
+  component = source_components->first_child;
+  prev_component = NULL;
+  while (component != NULL)
+    {
+      FlatpakXml *next = component->next_sibling;
+
+      if (g_strcmp0 (component->element_name, "component") == 0)
+        {
+          flatpak_xml_add (dest_components,
+                           flatpak_xml_unlink (component, prev_component));
+        }
+      else
+        {
+          prev_component = component;
+        }
+
+      component = next;
+    }
+}
+
+/* Unlinks the components of source, and returns them in a hash table
+   from the ref of their bundle to an array of components. Components
+   without a bundle are left in source. */
+static GHashTable *
+steal_components_by_bundle (FlatpakXml *source)
+{
+  FlatpakXml *source_components = flatpak_xml_find (source, "components", NULL);
+  GHashTable *by_ref = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                              g_free, (GDestroyNotify) g_ptr_array_unref);
+  FlatpakXml *component, *prev_component;
+
+  if (source_components == NULL)
+    return by_ref;
+
+  component = source_components->first_child;
+  prev_component = NULL;
+  while (component != NULL)
+    {
+      FlatpakXml *next = component->next_sibling;
+      const char *ref = NULL;
+
+      if (g_strcmp0 (component->element_name, "component") == 0)
+        ref = component_get_bundle_ref (component);
+
+      if (ref != NULL)
+        {
+          GPtrArray *components = g_hash_table_lookup (by_ref, ref);
+
+          if (components == NULL)
+            {
+              components = g_ptr_array_new_with_free_func ((GDestroyNotify) flatpak_xml_free);
+              g_hash_table_insert (by_ref, g_strdup (ref), components);
+            }
+
+          g_ptr_array_add (components, flatpak_xml_unlink (component, prev_component));
+        }
+      else
+        {
+          prev_component = component;
+        }
+
+      component = next;
+    }
+
+  return by_ref;
+}
+
+/* Moves the components stolen by steal_components_by_bundle() that
+   were generated for ref to dest */
+static void
+move_bundle_components (GHashTable *by_ref,
+                        FlatpakXml *dest,
+                        const char *ref)
+{
+  FlatpakXml *dest_components = dest->first_child;
+  GPtrArray *components = g_hash_table_lookup (by_ref, ref);
+  guint i;
+
+  if (components == NULL)
+    return;
+
+  for (i = 0; i < components->len; i++)
+    flatpak_xml_add (dest_components, g_ptr_array_index (components, i));
+
+  /* dest owns them now */
+  g_ptr_array_set_free_func (components, NULL);
+  g_hash_table_remove (by_ref, ref);
+}
+
+/* Loads the appstream data and the ref -> commit map recorded in
+   the previous appstream commit for an arch */
+static GHashTable *
+load_parent_appstream (OstreeRepo   *repo,
+                       const char   *parent,
+                       FlatpakXml  **out_appstream,
+                       GFile       **out_root,
+                       GCancellable *cancellable)
+{
+  g_autoptr(GVariant) commit_v = NULL;
+  g_autoptr(GVariant) commit_metadata = NULL;
+  g_autoptr(GVariant) refs_v = NULL;
+  g_autoptr(GFile) root = NULL;
+  g_autoptr(GFile) appstream_file = NULL;
+  g_autoptr(GInputStream) in = NULL;
+  g_autoptr(FlatpakXml) appstream = NULL;
+  GHashTable *refs;
+  GVariantIter iter;
+  const char *ref, *commit;
+
+  if (!ostree_repo_load_variant (repo, OSTREE_OBJECT_TYPE_COMMIT, parent, &commit_v, NULL))
+    return NULL;
+
+  commit_metadata = g_variant_get_child_value (commit_v, 0);
+  refs_v = g_variant_lookup_value (commit_metadata, "xa.appstream-refs", G_VARIANT_TYPE ("a{ss}"));
+  if (refs_v == NULL)
+    return NULL;
+
+  if (!ostree_repo_read_commit (repo, parent, &root, NULL, cancellable, NULL))
+    return NULL;
+
+  appstream_file = g_file_get_child (root, "appstream.xml.gz");
+  in = (GInputStream *) g_file_read (appstream_file, cancellable, NULL);
+  if (in == NULL)
+    return NULL;
+
+  appstream = flatpak_xml_parse (in, TRUE, cancellable, NULL);
+  if (appstream == NULL)
+    return NULL;
+
+  refs = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  g_variant_iter_init (&iter, refs_v);
+  while (g_variant_iter_next (&iter, "{&s&s}", &ref, &commit))
+    g_hash_table_insert (refs, g_strdup (ref), g_strdup (commit));
+
+  *out_appstream = g_steal_pointer (&appstream);
+  *out_root = g_steal_pointer (&root);
+  return refs;
+}
+
+typedef struct
+{
+  OstreeRepo   *repo;
+  char         *ref;
+  char         *id;
+  GFile        *dest;
+  GCancellable *cancellable;
+  FlatpakXml   *appstream_root;
+  GError       *error;
+} AppstreamJob;
+
+static void
+appstream_job_free (AppstreamJob *job)
+{
+  g_free (job->ref);
+  g_free (job->id);
+  flatpak_xml_free (job->appstream_root);
+  g_clear_error (&job->error);
+  g_free (job);
+}
+
+static void
+appstream_job_run (gpointer data,
+                   gpointer user_data)
+{
+  AppstreamJob *job = data;
+
+  extract_appstream (job->repo, job->appstream_root,
+                     job->ref, job->id, job->dest,
+                     job->cancellable, &job->error);
+}
+
 gboolean
 flatpak_repo_generate_appstream (OstreeRepo   *repo,
                                  const char  **gpg_key_ids,
@@ -2133,7 +2475,6 @@ flatpak_repo_generate_appstream (OstreeRepo   *repo,
   GHashTableIter iter;
   gpointer key;
   gpointer value;
-  gboolean skip_commit = FALSE;
 
   arches = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
 
@@ -2163,7 +2504,6 @@ flatpak_repo_generate_appstream (OstreeRepo   *repo,
   g_hash_table_iter_init (&iter, arches);
   while (g_hash_table_iter_next (&iter, &key, &value))
     {
-      GHashTableIter iter2;
       const char *arch = key;
       g_autofree char *tmpdir = g_strdup ("/tmp/flatpak-appstream-XXXXXX");
       g_autoptr(FlatpakTempDir) tmpdir_file = NULL;
@@ -2176,7 +2516,20 @@ flatpak_repo_generate_appstream (OstreeRepo   *repo,
       g_autofree char *parent = NULL;
       g_autofree char *branch = NULL;
       g_autoptr(FlatpakXml) appstream_root = NULL;
+      g_autoptr(FlatpakXml) parent_appstream = NULL;
+      g_autoptr(GFile) parent_appstream_root = NULL;
+      g_autoptr(GFile) parent_icons_dir = NULL;
+      g_autoptr(GHashTable) parent_refs = NULL;
+      g_autoptr(GHashTable) parent_components = NULL;
+      g_autoptr(GPtrArray) jobs = NULL;
+      g_autoptr(GVariant) commit_metadata = NULL;
       g_autoptr(GBytes) xml_data = NULL;
+      GVariantBuilder refs_builder;
+      GVariantBuilder metadata_builder;
+      GThreadPool *pool;
+      GList *ordered_refs, *l;
+      gboolean skip_commit = FALSE;
+      guint i;
 
       if (g_mkdtemp_full (tmpdir, 0755) == NULL)
         return flatpak_fail (error, "Can't create temporary directory");
@@ -2185,12 +2538,52 @@ flatpak_repo_generate_appstream (OstreeRepo   *repo,
 
       appstream_root = flatpak_appstream_xml_new ();
 
-      g_hash_table_iter_init (&iter2, all_refs);
-      while (g_hash_table_iter_next (&iter2, &key, &value))
+      branch = g_strdup_printf ("appstream/%s", arch);
+
+      if (!ostree_repo_resolve_rev (repo, branch, TRUE, &parent, error))
+        return FALSE;
+
+      /* The previous appstream commit records which commit of each
+         ref it was generated from, so we only need to extract the
+         appstream data of the refs that changed since then. */
+      if (parent)
+        parent_refs = load_parent_appstream (repo, parent, &parent_appstream,
+                                             &parent_appstream_root, cancellable);
+      if (parent_refs)
         {
-          const char *ref = key;
+          parent_icons_dir = g_file_get_child (parent_appstream_root, "icons");
+          parent_components = steal_components_by_bundle (parent_appstream);
+        }
+
+      /* Create these up front, as the extraction jobs run in parallel */
+      for (i = 0; i < 2; i++)
+        {
+          g_autoptr(GFile) size_dir =
+            g_file_resolve_relative_path (G_FILE (tmpdir_file),
+                                          i == 0 ? "icons/64x64" : "icons/128x128");
+
+          if (!gs_file_ensure_directory (size_dir, TRUE, cancellable, error))
+            return FALSE;
+        }
+
+      jobs = g_ptr_array_new_with_free_func ((GDestroyNotify) appstream_job_free);
+      pool = g_thread_pool_new (appstream_job_run, NULL,
+                                MAX (g_get_num_processors (), 1), FALSE, NULL);
+
+      /* Sort the refs so that the output is stable, which allows us to
+         skip the commit below if nothing changed */
+      ordered_refs = g_hash_table_get_keys (all_refs);
+      ordered_refs = g_list_sort (ordered_refs, (GCompareFunc) strcmp);
+
+      g_variant_builder_init (&refs_builder, G_VARIANT_TYPE ("a{ss}"));
+
+      for (l = ordered_refs; l != NULL; l = l->next)
+        {
+          const char *ref = l->data;
+          const char *commit = g_hash_table_lookup (all_refs, ref);
+          const char *old_commit = NULL;
           g_auto(GStrv) split = NULL;
-          g_autoptr(GError) my_error = NULL;
+          AppstreamJob *job;
 
           split = flatpak_decompose_ref (ref, NULL);
           if (!split)
@@ -2199,13 +2592,51 @@ flatpak_repo_generate_appstream (OstreeRepo   *repo,
           if (strcmp (split[2], arch) != 0)
             continue;
 
-          if (!extract_appstream (repo, appstream_root,
-                                  ref, split[1], tmpdir_file,
-                                  cancellable, &my_error))
+          g_variant_builder_add (&refs_builder, "{ss}", ref, commit);
+
+          job = g_new0 (AppstreamJob, 1);
+          job->repo = repo;
+          job->ref = g_strdup (ref);
+          job->id = g_strdup (split[1]);
+          job->dest = G_FILE (tmpdir_file);
+          job->cancellable = cancellable;
+          job->appstream_root = flatpak_appstream_xml_new ();
+          g_ptr_array_add (jobs, job);
+
+          if (parent_refs)
+            old_commit = g_hash_table_lookup (parent_refs, ref);
+
+          if (g_strcmp0 (old_commit, commit) == 0)
             {
-              g_print ("No appstream data for %s: %s\n", ref, my_error->message);
+              move_bundle_components (parent_components, job->appstream_root, ref);
+              copy_component_icons (job->appstream_root, parent_icons_dir,
+                                    G_FILE (tmpdir_file), FALSE);
               continue;
             }
+
+          g_thread_pool_push (pool, job, NULL);
+        }
+
+      /* Wait for all jobs to finish */
+      g_thread_pool_free (pool, FALSE, TRUE);
+      g_list_free (ordered_refs);
+
+      g_variant_builder_init (&metadata_builder, G_VARIANT_TYPE_VARDICT);
+      g_variant_builder_add (&metadata_builder, "{sv}", "xa.appstream-refs",
+                             g_variant_builder_end (&refs_builder));
+      commit_metadata = g_variant_ref_sink (g_variant_builder_end (&metadata_builder));
+
+      for (i = 0; i < jobs->len; i++)
+        {
+          AppstreamJob *job = g_ptr_array_index (jobs, i);
+
+          if (job->error)
+            {
+              g_print ("No appstream data for %s: %s\n", job->ref, job->error->message);
+              continue;
+            }
+
+          move_components (job->appstream_root, appstream_root);
         }
 
       xml_data = flatpak_appstream_xml_root_to_data (appstream_root, error);
@@ -2228,11 +2659,6 @@ flatpak_repo_generate_appstream (OstreeRepo   *repo,
       if (!ostree_repo_prepare_transaction (repo, NULL, cancellable, error))
         return FALSE;
 
-      branch = g_strdup_printf ("appstream/%s", arch);
-
-      if (!ostree_repo_resolve_rev (repo, branch, TRUE, &parent, error))
-        goto out;
-
       mtree = ostree_mutable_tree_new ();
 
       modifier = ostree_repo_commit_modifier_new (OSTREE_REPO_COMMIT_MODIFIER_FLAGS_SKIP_XATTRS,
@@ -2248,26 +2674,35 @@ flatpak_repo_generate_appstream (OstreeRepo   *repo,
       /* No need to commit if nothing changed */
       if (parent)
         {
-          g_autoptr(GFile) parent_root;
+          g_autoptr(GFile) parent_root = NULL;
+          g_autoptr(GVariant) parent_commit_v = NULL;
+          g_autoptr(GVariant) parent_metadata = NULL;
 
           if (!ostree_repo_read_commit (repo, parent, &parent_root, NULL, cancellable, error))
             goto out;
 
-          if (g_file_equal (root, parent_root))
+          if (!ostree_repo_load_variant (repo, OSTREE_OBJECT_TYPE_COMMIT, parent,
+                                         &parent_commit_v, error))
+            goto out;
+
+          parent_metadata = g_variant_get_child_value (parent_commit_v, 0);
+
+          /* Also commit if only the refs changed, so that the next run
+             can reuse the data for them */
+          if (g_file_equal (root, parent_root) &&
+              g_variant_equal (parent_metadata, commit_metadata))
             skip_commit = TRUE;
         }
 
       if (!skip_commit)
         {
-          if (!ostree_repo_write_commit (repo, parent, "Update", NULL, NULL,
+          if (!ostree_repo_write_commit (repo, parent, "Update", NULL, commit_metadata,
                                          OSTREE_REPO_FILE (root),
                                          &commit_checksum, cancellable, error))
             goto out;
 
           if (gpg_key_ids)
             {
-              int i;
-
               for (i = 0; gpg_key_ids[i] != NULL; i++)
                 {
                   const char *keyid = gpg_key_ids[i];
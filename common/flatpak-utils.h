@@ -61,6 +61,8 @@ gboolean flatpak_variant_bsearch_str (GVariant   *array,
 gboolean flatpak_summary_lookup_ref (GVariant   *summary,
                                      const char *ref,
                                      char      **out_checksum);
+GVariant *flatpak_summary_lookup_cache (GVariant   *summary,
+                                        const char *ref);
 
 gboolean flatpak_has_name_prefix (const char *string,
                                   const char *name);
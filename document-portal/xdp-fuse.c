@@ -14,6 +14,9 @@
 #include <glib/gprintf.h>
 #include <gio/gio.h>
 #include <pthread.h>
+#include <sched.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
 
 #include "flatpak-portal-error.h"
 #include "xdp-fuse.h"
@@ -27,6 +30,16 @@
 #define ATTR_CACHE_TIME 60.0
 #define ENTRY_CACHE_TIME 60.0
 
+/* Added in Linux 4.2, lets us read requests from several fds, each
+   with its own processing queue */
+#ifndef FUSE_DEV_IOC_CLONE
+#define FUSE_DEV_IOC_CLONE _IOR (229, 0, uint32_t)
+#endif
+
+/* From fuse_kernel.h, large writes are left in the splice pipe */
+#define FUSE_OPCODE_WRITE 16
+#define MAX_FUSE_OPCODE 64
+
 /* We pretend that the file is hardlinked. This causes most apps to do
    a truncating overwrite, which suits us better, as we do the atomic
    rename ourselves anyway. */
@@ -105,6 +118,35 @@ static struct fuse_chan *main_ch = NULL;
 static char *mount_path = NULL;
 static pthread_t fuse_pthread = 0;
 
+typedef struct
+{
+  guint64 count;
+  gint64  total_usec;
+  gint64  max_usec;
+} XdpFuseOpStats;
+
+typedef struct
+{
+  struct fuse_chan *ch;
+  GThread          *thread;
+  pthread_t         pthread;
+  int               cpu;
+  /* Set while the thread is in its loop, protected by the workers lock */
+  gboolean          running;
+  /* Only ever contended when the stats are logged */
+  GMutex            stats_lock;
+  XdpFuseOpStats    op_stats[MAX_FUSE_OPCODE];
+} XdpFuseWorker;
+
+/* Worker 0 is the fuse mainloop thread, using main_ch */
+static XdpFuseWorker *workers = NULL;
+static int n_workers = 0;
+
+G_LOCK_DEFINE_STATIC (workers);
+
+/* Number of threads sharing main_ch if we can't clone it */
+#define N_SHARED_WORKERS 4
+
 static int
 reopen_fd (int fd, int flags)
 {
@@ -793,24 +835,24 @@ get_user_perms (const struct stat *stbuf)
 }
 
 static gboolean
-app_can_write_doc (FlatpakDbEntry *entry, const char *app_id)
+app_can_write_doc (const char *doc_id, const char *app_id)
 {
   if (app_id == NULL)
     return TRUE;
 
-  if (xdp_entry_has_permissions (entry, app_id, XDP_PERMISSION_FLAGS_WRITE))
+  if (xdp_get_doc_permissions (doc_id, app_id) & XDP_PERMISSION_FLAGS_WRITE)
     return TRUE;
 
   return FALSE;
 }
 
 static gboolean
-app_can_see_doc (FlatpakDbEntry *entry, const char *app_id)
+app_can_see_doc (const char *doc_id, const char *app_id)
 {
   if (app_id == NULL)
     return TRUE;
 
-  if (xdp_entry_has_permissions (entry, app_id, XDP_PERMISSION_FLAGS_READ))
+  if (xdp_get_doc_permissions (doc_id, app_id) & XDP_PERMISSION_FLAGS_READ)
     return TRUE;
 
   return FALSE;
@@ -878,8 +920,8 @@ xdp_inode_stat (XdpInode    *inode,
             return -1;
           }
 
-        can_see = app_can_see_doc (entry, inode->app_id);
-        can_write = app_can_write_doc (entry, inode->app_id);
+        can_see = app_can_see_doc (inode->doc_id, inode->app_id);
+        can_write = app_can_write_doc (inode->doc_id, inode->app_id);
 
         if (!can_see)
           {
@@ -983,7 +1025,7 @@ xdp_fuse_lookup (fuse_req_t  req,
     case XDP_INODE_APP_DIR:
       entry = xdp_lookup_doc (name);
       if (entry != NULL &&
-          app_can_see_doc (entry, parent_inode->app_id))
+          app_can_see_doc (name, parent_inode->app_id))
         child_inode = xdp_inode_get_dir (parent_inode->app_id, name, entry);
       break;
 
@@ -1107,7 +1149,7 @@ dirbuf_add_docs (fuse_req_t     req,
         {
           g_autoptr(FlatpakDbEntry) entry = xdp_lookup_doc (docs[i]);
           if (entry == NULL ||
-              !app_can_see_doc (entry, app_id))
+              !app_can_see_doc (docs[i], app_id))
             continue;
         }
       ino = get_dir_inode_nr (app_id, docs[i]);
@@ -1512,14 +1554,14 @@ xdp_fuse_open (fuse_req_t             req,
 
   entry = xdp_lookup_doc (inode->doc_id);
   if (entry == NULL ||
-      !app_can_see_doc (entry, inode->app_id))
+      !app_can_see_doc (inode->doc_id, inode->app_id))
     {
       g_debug ("xdp_fuse_open <- no entry error ENOENT");
       fuse_reply_err (req, ENOENT);
       return;
     }
 
-  can_write = app_can_write_doc (entry, inode->app_id);
+  can_write = app_can_write_doc (inode->doc_id, inode->app_id);
 
   open_mode = fi->flags & 3;
 
@@ -1607,14 +1649,14 @@ xdp_fuse_create (fuse_req_t             req,
       return;
     }
 
-  can_see = app_can_see_doc (entry, parent_inode->app_id);
+  can_see = app_can_see_doc (parent_inode->doc_id, parent_inode->app_id);
   if (!can_see)
     {
       fuse_reply_err (req, ENOENT);
       return;
     }
 
-  can_write = app_can_write_doc (entry, parent_inode->app_id);
+  can_write = app_can_write_doc (parent_inode->doc_id, parent_inode->app_id);
   if (!can_write)
     {
       fuse_reply_err (req, EACCES);
@@ -1696,13 +1738,30 @@ xdp_fuse_read (fuse_req_t             req,
   XdpFile *file = (gpointer) fi->fh;
   XdpInode *inode = file->inode;
   struct fuse_bufvec bufv = FUSE_BUFVEC_INIT (size);
+  glnx_fd_close int read_fd = -1;
   int fd;
+  int errsv = 0;
 
   g_debug ("xdp_fuse_real %lx %ld %ld", ino, (long) size, (long) off);
 
   g_mutex_lock (&inode->mutex);
 
+  /* Take our own reference to the file description, so that we don't
+     have to hold the mutex while splicing the data to the kernel, which
+     would serialize all readers. The fd may be closed or replaced (on
+     truncation) once we drop the lock, but the dup keeps the data we
+     read consistent. We only use it with pread, so the shared file
+     position doesn't matter. */
   fd = xdp_inode_locked_get_fd (inode);
+  if (fd != -1)
+    {
+      read_fd = fcntl (fd, F_DUPFD_CLOEXEC, 3);
+      if (read_fd == -1)
+        errsv = errno;
+    }
+
+  g_mutex_unlock (&inode->mutex);
+
   if (fd == -1)
     {
       static char c = 'x';
@@ -1712,16 +1771,18 @@ xdp_fuse_read (fuse_req_t             req,
 
       fuse_reply_data (req, &bufv, FUSE_BUF_NO_SPLICE);
     }
+  else if (read_fd == -1)
+    {
+      fuse_reply_err (req, errsv);
+    }
   else
     {
       bufv.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
-      bufv.buf[0].fd = fd;
+      bufv.buf[0].fd = read_fd;
       bufv.buf[0].pos = off;
 
       fuse_reply_data (req, &bufv, FUSE_BUF_SPLICE_MOVE);
     }
-
-  g_mutex_unlock (&inode->mutex);
 }
 
 static void
@@ -1789,14 +1850,14 @@ xdp_fuse_setattr (fuse_req_t             req,
 
   entry = xdp_lookup_doc (inode->doc_id);
   if (entry == NULL ||
-      !app_can_see_doc (entry, inode->app_id))
+      !app_can_see_doc (inode->doc_id, inode->app_id))
     {
       g_debug ("xdp_fuse_setattr <- no entry error ENOENT");
       fuse_reply_err (req, ENOENT);
       return;
     }
 
-  can_write = app_can_write_doc (entry, inode->app_id);
+  can_write = app_can_write_doc (inode->doc_id, inode->app_id);
 
   if (to_set == FUSE_SET_ATTR_SIZE)
     {
@@ -2088,8 +2149,8 @@ xdp_fuse_rename (fuse_req_t  req,
       return;
     }
 
-  can_see = app_can_see_doc (entry, parent_inode->app_id);
-  can_write = app_can_write_doc (entry, parent_inode->app_id);
+  can_see = app_can_see_doc (parent_inode->doc_id, parent_inode->app_id);
+  can_write = app_can_write_doc (parent_inode->doc_id, parent_inode->app_id);
 
   if (!can_see)
     {
@@ -2191,17 +2252,345 @@ xdp_fuse_get_mountpoint (void)
   return mount_path;
 }
 
+static const char *
+fuse_opcode_name (guint32 opcode)
+{
+  static const char *names[] = {
+    NULL, "LOOKUP", "FORGET", "GETATTR", "SETATTR", "READLINK", "SYMLINK",
+    NULL, "MKNOD", "MKDIR", "UNLINK", "RMDIR", "RENAME", "LINK", "OPEN",
+    "READ", "WRITE", "STATFS", "RELEASE", NULL, "FSYNC", "SETXATTR",
+    "GETXATTR", "LISTXATTR", "REMOVEXATTR", "FLUSH", "INIT", "OPENDIR",
+    "READDIR", "RELEASEDIR", "FSYNCDIR", "GETLK", "SETLK", "SETLKW",
+    "ACCESS", "CREATE", "INTERRUPT", "BMAP", "DESTROY", "IOCTL", "POLL",
+    "NOTIFY_REPLY", "BATCH_FORGET", "FALLOCATE",
+  };
+
+  if (opcode < G_N_ELEMENTS (names) && names[opcode] != NULL)
+    return names[opcode];
+
+  return "UNKNOWN";
+}
+
+static guint32
+fuse_buf_get_opcode (const struct fuse_buf *buf)
+{
+  /* The header is in the pipe along with the data for large writes */
+  if (buf->flags & FUSE_BUF_IS_FD)
+    return FUSE_OPCODE_WRITE;
+
+  /* struct fuse_in_header starts with the length and the opcode */
+  if (buf->size < 2 * sizeof (guint32))
+    return 0;
+
+  return ((const guint32 *) buf->mem)[1];
+}
+
+static void
+record_op_time (XdpFuseWorker *worker,
+                guint32        opcode,
+                gint64         usec)
+{
+  XdpFuseOpStats *stats;
+
+  if (opcode >= MAX_FUSE_OPCODE)
+    opcode = 0;
+
+  g_mutex_lock (&worker->stats_lock);
+  stats = &worker->op_stats[opcode];
+  stats->count++;
+  stats->total_usec += usec;
+  stats->max_usec = MAX (stats->max_usec, usec);
+  g_mutex_unlock (&worker->stats_lock);
+}
+
+static void
+log_op_stats (GLogLevelFlags log_level)
+{
+  g_autofree XdpFuseOpStats *totals = g_new0 (XdpFuseOpStats, MAX_FUSE_OPCODE);
+  guint32 i;
+  int j;
+
+  G_LOCK (workers);
+
+  for (j = 0; j < n_workers; j++)
+    {
+      XdpFuseWorker *worker = &workers[j];
+      guint64 count = 0;
+      gint64 total_usec = 0;
+
+      g_mutex_lock (&worker->stats_lock);
+      for (i = 0; i < MAX_FUSE_OPCODE; i++)
+        {
+          XdpFuseOpStats *stats = &worker->op_stats[i];
+
+          count += stats->count;
+          total_usec += stats->total_usec;
+
+          totals[i].count += stats->count;
+          totals[i].total_usec += stats->total_usec;
+          totals[i].max_usec = MAX (totals[i].max_usec, stats->max_usec);
+        }
+      g_mutex_unlock (&worker->stats_lock);
+
+      g_log (G_LOG_DOMAIN, log_level,
+             "fuse worker %d (cpu %d): %" G_GUINT64_FORMAT " requests, avg %" G_GINT64_FORMAT "us",
+             j, worker->cpu, count, count > 0 ? total_usec / (gint64) count : 0);
+    }
+
+  G_UNLOCK (workers);
+
+  for (i = 0; i < MAX_FUSE_OPCODE; i++)
+    {
+      if (totals[i].count == 0)
+        continue;
+
+      g_log (G_LOG_DOMAIN, log_level,
+             "fuse %s: %" G_GUINT64_FORMAT " requests, avg %" G_GINT64_FORMAT "us, max %" G_GINT64_FORMAT "us",
+             fuse_opcode_name (i), totals[i].count,
+             totals[i].total_usec / (gint64) totals[i].count, totals[i].max_usec);
+    }
+}
+
+/* Logs the request counts and timings so far, per worker and per
+   operation. Can be called from any thread. */
+void
+xdp_fuse_log_stats (void)
+{
+  log_op_stats (G_LOG_LEVEL_MESSAGE);
+}
+
 void
 xdp_fuse_exit (void)
 {
+  int i;
+
   if (session)
     fuse_session_exit (session);
 
+  /* Interrupt the blocking reads in all the workers that are still in
+     their loop. They can't leave it, and thus be joined, while we hold
+     the lock. */
+  G_LOCK (workers);
+  for (i = 1; i < n_workers; i++)
+    {
+      if (workers[i].running)
+        pthread_kill (workers[i].pthread, SIGHUP);
+    }
+  G_UNLOCK (workers);
+
   if (fuse_pthread)
     pthread_kill (fuse_pthread, SIGHUP);
 
   if (fuse_thread)
     g_thread_join (fuse_thread);
+
+  log_op_stats (G_LOG_LEVEL_DEBUG);
+}
+
+/* Like the default fuse_kern_chan ops, but these don't require the
+   channel to be added to the session, as a session only supports one */
+static int
+clone_chan_receive (struct fuse_chan **chp,
+                    char              *buf,
+                    size_t             size)
+{
+  ssize_t res;
+
+  res = read (fuse_chan_fd (*chp), buf, size);
+  if (res == -1)
+    {
+      int err = errno;
+
+      /* ENOENT means the operation was interrupted */
+      if (err == ENOENT || err == EINTR || err == EAGAIN)
+        return -EINTR;
+
+      /* ENODEV means we got unmounted */
+      if (err == ENODEV)
+        {
+          fuse_session_exit (session);
+          return 0;
+        }
+
+      return -err;
+    }
+
+  return res;
+}
+
+static int
+clone_chan_send (struct fuse_chan   *ch,
+                 const struct iovec  iov[],
+                 size_t              count)
+{
+  if (iov)
+    {
+      ssize_t res = writev (fuse_chan_fd (ch), iov, count);
+      if (res == -1)
+        return -errno;
+    }
+
+  return 0;
+}
+
+static void
+clone_chan_destroy (struct fuse_chan *ch)
+{
+  close (fuse_chan_fd (ch));
+}
+
+static struct fuse_chan *
+clone_chan_new (struct fuse_chan *ch)
+{
+  struct fuse_chan_ops op = {
+    .receive = clone_chan_receive,
+    .send = clone_chan_send,
+    .destroy = clone_chan_destroy,
+  };
+  uint32_t master_fd = fuse_chan_fd (ch);
+  struct fuse_chan *clone_ch;
+  int clone_fd;
+
+  clone_fd = open ("/dev/fuse", O_RDWR | O_CLOEXEC);
+  if (clone_fd == -1)
+    return NULL;
+
+  if (ioctl (clone_fd, FUSE_DEV_IOC_CLONE, &master_fd) == -1)
+    {
+      close (clone_fd);
+      return NULL;
+    }
+
+  clone_ch = fuse_chan_new (&op, clone_fd, fuse_chan_bufsize (ch), NULL);
+  if (clone_ch == NULL)
+    close (clone_fd);
+
+  return clone_ch;
+}
+
+static void
+xdp_fuse_worker_loop (XdpFuseWorker *worker)
+{
+  size_t bufsize = fuse_chan_bufsize (worker->ch);
+  g_autofree char *buf = g_malloc (bufsize);
+
+  G_LOCK (workers);
+  worker->pthread = pthread_self ();
+  worker->running = TRUE;
+  G_UNLOCK (workers);
+
+  if (worker->cpu >= 0)
+    {
+      cpu_set_t cpus;
+
+      CPU_ZERO (&cpus);
+      CPU_SET (worker->cpu, &cpus);
+      pthread_setaffinity_np (worker->pthread, sizeof (cpus), &cpus);
+    }
+
+  while (!fuse_session_exited (session))
+    {
+      struct fuse_chan *tmpch = worker->ch;
+      struct fuse_buf fbuf = {
+        .mem = buf,
+        .size = bufsize,
+      };
+      guint32 opcode;
+      gint64 start;
+      int res;
+
+      res = fuse_session_receive_buf (session, &fbuf, &tmpch);
+      if (res == -EINTR)
+        continue;
+      if (res <= 0)
+        {
+          if (res < 0)
+            fuse_session_exit (session);
+          break;
+        }
+
+      opcode = fuse_buf_get_opcode (&fbuf);
+      start = g_get_monotonic_time ();
+
+      fuse_session_process_buf (session, &fbuf, tmpch);
+
+      record_op_time (worker, opcode, g_get_monotonic_time () - start);
+    }
+
+  G_LOCK (workers);
+  worker->running = FALSE;
+  G_UNLOCK (workers);
+}
+
+static gpointer
+xdp_fuse_worker_thread (gpointer data)
+{
+  xdp_fuse_worker_loop (data);
+  return NULL;
+}
+
+/* Reads requests on one cloned /dev/fuse fd per cpu, so that they don't
+   all go through a single queue. Workers are pinned to a cpu each. */
+static void
+xdp_fuse_run_workers (void)
+{
+  int n_cpus = g_get_num_processors ();
+  int i;
+
+  /* The workers wait for this before starting their loop */
+  G_LOCK (workers);
+
+  workers = g_new0 (XdpFuseWorker, MAX (n_cpus, N_SHARED_WORKERS));
+  for (i = 0; i < MAX (n_cpus, N_SHARED_WORKERS); i++)
+    g_mutex_init (&workers[i].stats_lock);
+  workers[0].ch = main_ch;
+  workers[0].cpu = n_cpus > 1 ? 0 : -1;
+  n_workers = 1;
+
+  for (i = 1; i < n_cpus; i++)
+    {
+      XdpFuseWorker *worker = &workers[i];
+
+      worker->ch = clone_chan_new (main_ch);
+      if (worker->ch == NULL)
+        break;
+
+      worker->cpu = i;
+      worker->thread = g_thread_new ("fuse worker", xdp_fuse_worker_thread, worker);
+      n_workers++;
+    }
+
+  if (n_workers == 1)
+    {
+      /* Single cpu, or the kernel doesn't support cloning. Like
+         fuse_session_loop_mt(), have several threads read from the
+         one channel, so a slow request doesn't block the others. */
+      g_debug ("Using a single fuse channel");
+
+      workers[0].cpu = -1;
+      for (i = 1; i < N_SHARED_WORKERS; i++)
+        {
+          XdpFuseWorker *worker = &workers[i];
+
+          worker->ch = main_ch;
+          worker->cpu = -1;
+          worker->thread = g_thread_new ("fuse worker", xdp_fuse_worker_thread, worker);
+          n_workers++;
+        }
+    }
+
+  g_debug ("Using %d fuse worker threads", n_workers);
+
+  G_UNLOCK (workers);
+
+  xdp_fuse_worker_loop (&workers[0]);
+
+  for (i = 1; i < n_workers; i++)
+    {
+      g_thread_join (workers[i].thread);
+      if (workers[i].ch != main_ch)
+        fuse_chan_destroy (workers[i].ch);
+    }
 }
 
 static gpointer
@@ -2209,7 +2598,7 @@ xdp_fuse_mainloop (gpointer data)
 {
   fuse_pthread = pthread_self ();
 
-  fuse_session_loop_mt (session);
+  xdp_fuse_run_workers ();
 
   fuse_session_remove_chan (main_ch);
   fuse_session_destroy (session);
@@ -2220,7 +2609,10 @@ xdp_fuse_mainloop (gpointer data)
 gboolean
 xdp_fuse_init (GError **error)
 {
-  char *argv[] = { "xdp-fuse", "-osplice_write,splice_move,splice_read" };
+  /* Use large writes (the kernel default is a page per write request),
+     so streaming large files through the portal is not limited by
+     the number of requests */
+  char *argv[] = { "xdp-fuse", "-osplice_write,splice_move,splice_read,big_writes,max_write=131072" };
   struct fuse_args args = FUSE_ARGS_INIT (G_N_ELEMENTS (argv), argv);
   struct stat st;
   const char *mount_path;
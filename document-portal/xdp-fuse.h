@@ -3,15 +3,19 @@
 
 #include <glib.h>
 #include "flatpak-db.h"
+#include "xdp-enums.h"
 
 G_BEGIN_DECLS
 
 char **        xdp_list_apps (void);
 char **        xdp_list_docs (void);
 FlatpakDbEntry *xdp_lookup_doc (const char *doc_id);
+XdpPermissionFlags xdp_get_doc_permissions (const char *doc_id,
+                                            const char *app_id);
 
 gboolean    xdp_fuse_init (GError **error);
 void        xdp_fuse_exit (void);
+void        xdp_fuse_log_stats (void);
 const char *xdp_fuse_get_mountpoint (void);
 void        xdp_fuse_invalidate_doc_app (const char *doc_id,
                                          const char *opt_app_id);
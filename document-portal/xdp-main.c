@@ -11,6 +11,7 @@
 
 #include <gio/gio.h>
 #include <gio/gunixfdlist.h>
+#include <glib-unix.h>
 #include "xdp-dbus.h"
 #include "xdp-util.h"
 #include "flatpak-db.h"
@@ -44,6 +45,90 @@ static dev_t fuse_dev = 0;
 
 G_LOCK_DEFINE (db);
 
+/* Parsed documents, so that permission checks in the fuse code
+   don't have to look at the entry variant. Protected by the db lock,
+   and the entry for a doc must be removed whenever it changes. */
+typedef struct
+{
+  FlatpakDbEntry     *entry;
+  guint               n_apps;
+  guint              *apps; /* Interned app ids, see intern_app_id () */
+  XdpPermissionFlags *perms;
+} XdpDocInfo;
+
+static GHashTable *doc_infos; /* doc id -> XdpDocInfo */
+static GHashTable *app_ids; /* app id -> index + 1 */
+
+static void
+xdp_doc_info_free (XdpDocInfo *info)
+{
+  flatpak_db_entry_unref (info->entry);
+  g_free (info->apps);
+  g_free (info->perms);
+  g_free (info);
+}
+
+/* Call with db lock held */
+static guint
+intern_app_id (const char *app_id,
+               gboolean    create)
+{
+  guint index = GPOINTER_TO_UINT (g_hash_table_lookup (app_ids, app_id));
+
+  if (index == 0 && create)
+    {
+      index = g_hash_table_size (app_ids) + 1;
+      g_hash_table_insert (app_ids, g_strdup (app_id), GUINT_TO_POINTER (index));
+    }
+
+  return index;
+}
+
+/* Call with db lock held */
+static XdpDocInfo *
+lookup_doc_info (const char *doc_id)
+{
+  XdpDocInfo *info;
+  g_autoptr(FlatpakDbEntry) entry = NULL;
+  g_autofree const char **apps = NULL;
+  guint i;
+
+  info = g_hash_table_lookup (doc_infos, doc_id);
+  if (info != NULL)
+    return info;
+
+  entry = flatpak_db_lookup (db, doc_id);
+  if (entry == NULL)
+    return NULL;
+
+  apps = flatpak_db_entry_list_apps (entry);
+
+  info = g_new0 (XdpDocInfo, 1);
+  info->entry = g_steal_pointer (&entry);
+  info->n_apps = g_strv_length ((char **) apps);
+  info->apps = g_new (guint, info->n_apps);
+  info->perms = g_new (XdpPermissionFlags, info->n_apps);
+
+  for (i = 0; i < info->n_apps; i++)
+    {
+      info->apps[i] = intern_app_id (apps[i], TRUE);
+      info->perms[i] = xdp_entry_get_permissions (info->entry, apps[i]);
+    }
+
+  g_hash_table_insert (doc_infos, g_strdup (doc_id), info);
+
+  return info;
+}
+
+/* Call with db lock held */
+static void
+set_db_entry (const char     *doc_id,
+              FlatpakDbEntry *entry)
+{
+  flatpak_db_set_entry (db, doc_id, entry);
+  g_hash_table_remove (doc_infos, doc_id);
+}
+
 char **
 xdp_list_apps (void)
 {
@@ -61,8 +146,45 @@ xdp_list_docs (void)
 FlatpakDbEntry *
 xdp_lookup_doc (const char *doc_id)
 {
+  XdpDocInfo *info;
+
+  AUTOLOCK (db);
+
+  info = lookup_doc_info (doc_id);
+  if (info == NULL)
+    return NULL;
+
+  return flatpak_db_entry_ref (info->entry);
+}
+
+/* Returns 0 if the document doesn't exist */
+XdpPermissionFlags
+xdp_get_doc_permissions (const char *doc_id,
+                         const char *app_id)
+{
+  XdpDocInfo *info;
+  guint app, i;
+
+  if (app_id[0] == '\0')
+    return XDP_PERMISSION_FLAGS_ALL;
+
   AUTOLOCK (db);
-  return flatpak_db_lookup (db, doc_id);
+
+  info = lookup_doc_info (doc_id);
+  if (info == NULL)
+    return 0;
+
+  app = intern_app_id (app_id, FALSE);
+  if (app == 0)
+    return 0;
+
+  for (i = 0; i < info->n_apps; i++)
+    {
+      if (info->apps[i] == app)
+        return info->perms[i];
+    }
+
+  return 0;
 }
 
 static gboolean
@@ -73,11 +195,14 @@ persist_entry (FlatpakDbEntry *entry)
   return (flags & XDP_ENTRY_FLAG_TRANSIENT) == 0;
 }
 
+/* If store_batch is non-NULL the doc id is added to it instead of
+   writing the change to the permission store, see flush_store_batch() */
 static void
-do_set_permissions (FlatpakDbEntry    *entry,
-                    const char        *doc_id,
-                    const char        *app_id,
-                    XdpPermissionFlags perms)
+do_set_permissions_full (FlatpakDbEntry    *entry,
+                         const char        *doc_id,
+                         const char        *app_id,
+                         XdpPermissionFlags perms,
+                         GHashTable        *store_batch)
 {
   g_autofree const char **perms_s = xdg_unparse_permissions (perms);
 
@@ -86,9 +211,13 @@ do_set_permissions (FlatpakDbEntry    *entry,
   g_debug ("set_permissions %s %s %x", doc_id, app_id, perms);
 
   new_entry = flatpak_db_entry_set_app_permissions (entry, app_id, perms_s);
-  flatpak_db_set_entry (db, doc_id, new_entry);
+  set_db_entry (doc_id, new_entry);
 
-  if (persist_entry (new_entry))
+  if (store_batch != NULL)
+    {
+      g_hash_table_add (store_batch, g_strdup (doc_id));
+    }
+  else if (persist_entry (new_entry))
     {
       xdg_permission_store_call_set_permission (permission_store,
                                                 TABLE_NAME,
@@ -101,6 +230,67 @@ do_set_permissions (FlatpakDbEntry    *entry,
     }
 }
 
+static void
+do_set_permissions (FlatpakDbEntry    *entry,
+                    const char        *doc_id,
+                    const char        *app_id,
+                    XdpPermissionFlags perms)
+{
+  do_set_permissions_full (entry, doc_id, app_id, perms, NULL);
+}
+
+/* Writes the current state of all the docs in store_batch to the
+   permission store in a single call. Call with db lock held */
+static void
+flush_store_batch (GHashTable *store_batch)
+{
+  GVariantBuilder entries;
+  GHashTableIter iter;
+  const char *doc_id;
+  gboolean empty = TRUE;
+
+  g_variant_builder_init (&entries, G_VARIANT_TYPE ("a(sa{sas}v)"));
+
+  g_hash_table_iter_init (&iter, store_batch);
+  while (g_hash_table_iter_next (&iter, (gpointer *) &doc_id, NULL))
+    {
+      g_autoptr(FlatpakDbEntry) entry = flatpak_db_lookup (db, doc_id);
+      g_autoptr(GVariant) data = NULL;
+      g_autofree const char **apps = NULL;
+      GVariantBuilder app_permissions;
+      int i;
+
+      if (entry == NULL || !persist_entry (entry))
+        continue;
+
+      g_variant_builder_init (&app_permissions, G_VARIANT_TYPE ("a{sas}"));
+      apps = flatpak_db_entry_list_apps (entry);
+      for (i = 0; apps[i] != NULL; i++)
+        {
+          g_autofree const char **perms_s = flatpak_db_entry_list_permissions (entry, apps[i]);
+
+          g_variant_builder_add (&app_permissions, "{s^as}", apps[i], perms_s);
+        }
+
+      data = flatpak_db_entry_get_data (entry);
+      g_variant_builder_add (&entries, "(s@a{sas}v)", doc_id,
+                             g_variant_builder_end (&app_permissions), data);
+      empty = FALSE;
+    }
+
+  if (empty)
+    {
+      g_variant_builder_clear (&entries);
+      return;
+    }
+
+  xdg_permission_store_call_set_multiple (permission_store,
+                                          TABLE_NAME,
+                                          TRUE,
+                                          g_variant_builder_end (&entries),
+                                          NULL, NULL, NULL);
+}
+
 static void
 portal_grant_permissions (GDBusMethodInvocation *invocation,
                           GVariant              *parameters,
@@ -241,7 +431,7 @@ portal_delete (GDBusMethodInvocation *invocation,
 
     g_debug ("delete %s", id);
 
-    flatpak_db_set_entry (db, id, NULL);
+    set_db_entry (id, NULL);
 
     if (persist_entry (entry))
       xdg_permission_store_call_delete (permission_store, TABLE_NAME,
@@ -258,14 +448,27 @@ portal_delete (GDBusMethodInvocation *invocation,
   g_dbus_method_invocation_return_value (invocation, g_variant_new ("()"));
 }
 
-char *
-do_create_doc (struct stat *parent_st_buf, const char *path, gboolean reuse_existing, gboolean persistent)
+/* Creates a new document for path, or reuses an existing one if
+   reuse_existing is set. The apps in the NULL-terminated apps array
+   are additionally granted the corresponding permissions in perms.
+   For new documents this is all written to the permission store in
+   a single call, or the id is added to store_batch if it is non-NULL. */
+static char *
+do_create_doc_full (struct stat              *parent_st_buf,
+                    const char               *path,
+                    gboolean                  reuse_existing,
+                    gboolean                  persistent,
+                    const char              **apps,
+                    const XdpPermissionFlags *perms,
+                    GHashTable               *store_batch)
 {
   g_autoptr(GVariant) data = NULL;
   g_autoptr(FlatpakDbEntry) entry = NULL;
   g_auto(GStrv) ids = NULL;
+  GVariantBuilder app_permissions;
   char *id = NULL;
   guint32 flags = 0;
+  int i;
 
   if (!reuse_existing)
     flags |= XDP_ENTRY_FLAG_UNIQUE;
@@ -283,7 +486,21 @@ do_create_doc (struct stat *parent_st_buf, const char *path, gboolean reuse_exis
       ids = flatpak_db_list_ids_by_value (db, data);
 
       if (ids[0] != NULL)
-        return g_strdup (ids[0]);  /* Reuse pre-existing entry with same path */
+        {
+          /* Reuse pre-existing entry with same path. It is not unique
+             to the caller, so never hand out delete on it. */
+          for (i = 0; apps != NULL && apps[i] != NULL; i++)
+            {
+              g_autoptr(FlatpakDbEntry) existing = flatpak_db_lookup (db, ids[0]);
+              XdpPermissionFlags new_perms = perms[i] & ~XDP_PERMISSION_FLAGS_DELETE;
+
+              do_set_permissions_full (existing, ids[0], apps[i],
+                                       new_perms | xdp_entry_get_permissions (existing, apps[i]),
+                                       store_batch);
+            }
+
+          return g_strdup (ids[0]);
+        }
     }
 
   while (TRUE)
@@ -300,53 +517,70 @@ do_create_doc (struct stat *parent_st_buf, const char *path, gboolean reuse_exis
   g_debug ("create_doc %s", id);
 
   entry = flatpak_db_entry_new (data);
-  flatpak_db_set_entry (db, id, entry);
 
-  if (persistent)
+  g_variant_builder_init (&app_permissions, G_VARIANT_TYPE ("a{sas}"));
+  for (i = 0; apps != NULL && apps[i] != NULL; i++)
+    {
+      g_autofree const char **perms_s = xdg_unparse_permissions (perms[i]);
+      FlatpakDbEntry *new_entry;
+
+      g_debug ("set_permissions %s %s %x", id, apps[i], perms[i]);
+
+      new_entry = flatpak_db_entry_set_app_permissions (entry, apps[i], perms_s);
+      flatpak_db_entry_unref (entry);
+      entry = new_entry;
+
+      g_variant_builder_add (&app_permissions, "{s^as}", apps[i], perms_s);
+    }
+
+  set_db_entry (id, entry);
+
+  if (persistent && store_batch != NULL)
+    {
+      g_hash_table_add (store_batch, g_strdup (id));
+      g_variant_builder_clear (&app_permissions);
+    }
+  else if (persistent)
     {
       xdg_permission_store_call_set (permission_store,
                                      TABLE_NAME,
                                      TRUE,
                                      id,
-                                     g_variant_new_array (G_VARIANT_TYPE ("{sas}"), NULL, 0),
+                                     g_variant_builder_end (&app_permissions),
                                      g_variant_new_variant (data),
                                      NULL, NULL, NULL);
     }
+  else
+    {
+      g_variant_builder_clear (&app_permissions);
+    }
 
   return id;
 }
 
-static void
-portal_add (GDBusMethodInvocation *invocation,
-            GVariant              *parameters,
-            const char            *app_id)
+char *
+do_create_doc (struct stat *parent_st_buf, const char *path, gboolean reuse_existing, gboolean persistent)
+{
+  return do_create_doc_full (parent_st_buf, path, reuse_existing, persistent, NULL, NULL, NULL);
+}
+
+/* Checks that fd is an O_PATH fd for a regular file, and returns its
+   symlink-expanded path in path_buffer (of size PATH_MAX + 1) as well as
+   the stat info of the file and of its parent directory */
+static gboolean
+validate_fd (int          fd,
+             struct stat *st_buf,
+             struct stat *real_parent_st_buf,
+             char        *path_buffer,
+             GError     **error)
 {
-  GDBusMessage *message;
-  GUnixFDList *fd_list;
-  g_autofree char *id = NULL;
   g_autofree char *proc_path = NULL;
-  int fd_id, fd, fds_len, fd_flags;
+  int fd_flags;
   glnx_fd_close int dir_fd = -1;
-  const int *fds;
-  char path_buffer[PATH_MAX + 1];
   ssize_t symlink_size;
-  struct stat st_buf, real_st_buf, real_parent_st_buf;
+  struct stat real_st_buf;
   g_autofree char *dirname = NULL;
   g_autofree char *name = NULL;
-  gboolean reuse_existing, persistent;
-
-  g_variant_get (parameters, "(hbb)", &fd_id, &reuse_existing, &persistent);
-
-  message = g_dbus_method_invocation_get_message (invocation);
-  fd_list = g_dbus_message_get_unix_fd_list (message);
-
-  fd = -1;
-  if (fd_list != NULL)
-    {
-      fds = g_unix_fd_list_peek_fds (fd_list, &fds_len);
-      if (fd_id < fds_len)
-        fd = fds[fd_id];
-    }
 
   proc_path = g_strdup_printf ("/proc/self/fd/%d", fd);
 
@@ -358,17 +592,16 @@ portal_add (GDBusMethodInvocation *invocation,
       /* Must not be O_NOFOLLOW (because we want the target file) */
       ((fd_flags & O_NOFOLLOW) == O_PATH) ||
       /* Must be able to fstat */
-      fstat (fd, &st_buf) < 0 ||
+      fstat (fd, st_buf) < 0 ||
       /* Must be a regular file */
-      (st_buf.st_mode & S_IFMT) != S_IFREG ||
+      (st_buf->st_mode & S_IFMT) != S_IFREG ||
       /* Must be able to read path from /proc/self/fd */
       /* This is an absolute and (at least at open time) symlink-expanded path */
-      (symlink_size = readlink (proc_path, path_buffer, sizeof (path_buffer) - 1)) < 0)
+      (symlink_size = readlink (proc_path, path_buffer, PATH_MAX)) < 0)
     {
-      g_dbus_method_invocation_return_error (invocation,
-                                             FLATPAK_PORTAL_ERROR, FLATPAK_PORTAL_ERROR_INVALID_ARGUMENT,
-                                             "Invalid fd passed");
-      return;
+      g_set_error (error, FLATPAK_PORTAL_ERROR, FLATPAK_PORTAL_ERROR_INVALID_ARGUMENT,
+                   "Invalid fd passed");
+      return FALSE;
     }
 
   path_buffer[symlink_size] = 0;
@@ -380,15 +613,51 @@ portal_add (GDBusMethodInvocation *invocation,
   name = g_path_get_basename (path_buffer);
   dir_fd = open (dirname, O_CLOEXEC | O_PATH);
 
-  if (fstat (dir_fd, &real_parent_st_buf) < 0 ||
+  if (fstat (dir_fd, real_parent_st_buf) < 0 ||
       fstatat (dir_fd, name, &real_st_buf, AT_SYMLINK_NOFOLLOW) < 0 ||
-      st_buf.st_dev != real_st_buf.st_dev ||
-      st_buf.st_ino != real_st_buf.st_ino)
+      st_buf->st_dev != real_st_buf.st_dev ||
+      st_buf->st_ino != real_st_buf.st_ino)
     {
       /* Don't leak any info about real file path existence, etc */
-      g_dbus_method_invocation_return_error (invocation,
-                                             FLATPAK_PORTAL_ERROR, FLATPAK_PORTAL_ERROR_INVALID_ARGUMENT,
-                                             "Invalid fd passed");
+      g_set_error (error, FLATPAK_PORTAL_ERROR, FLATPAK_PORTAL_ERROR_INVALID_ARGUMENT,
+                   "Invalid fd passed");
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static void
+portal_add (GDBusMethodInvocation *invocation,
+            GVariant              *parameters,
+            const char            *app_id)
+{
+  GDBusMessage *message;
+  GUnixFDList *fd_list;
+  g_autofree char *id = NULL;
+  g_autoptr(GError) error = NULL;
+  int fd_id, fd, fds_len;
+  const int *fds;
+  char path_buffer[PATH_MAX + 1];
+  struct stat st_buf, real_parent_st_buf;
+  gboolean reuse_existing, persistent;
+
+  g_variant_get (parameters, "(hbb)", &fd_id, &reuse_existing, &persistent);
+
+  message = g_dbus_method_invocation_get_message (invocation);
+  fd_list = g_dbus_message_get_unix_fd_list (message);
+
+  fd = -1;
+  if (fd_list != NULL)
+    {
+      fds = g_unix_fd_list_peek_fds (fd_list, &fds_len);
+      if (fd_id < fds_len)
+        fd = fds[fd_id];
+    }
+
+  if (!validate_fd (fd, &st_buf, &real_parent_st_buf, path_buffer, &error))
+    {
+      g_dbus_method_invocation_return_gerror (invocation, error);
       return;
     }
 
@@ -560,6 +829,222 @@ portal_add_named (GDBusMethodInvocation *invocation,
                                          g_variant_new ("(s)", id));
 }
 
+typedef struct
+{
+  char       *id;
+  char       *path;
+  struct stat parent_st_buf;
+} XdpAddFullDoc;
+
+static void
+portal_add_full (GDBusMethodInvocation *invocation,
+                 GVariant              *parameters,
+                 const char            *app_id)
+{
+  GDBusMessage *message;
+  GUnixFDList *fd_list;
+  g_autoptr(GVariant) fds_v = NULL;
+  g_autofree const char **permissions = NULL;
+  g_autofree XdpAddFullDoc *docs = NULL;
+  g_autoptr(GPtrArray) ids = NULL;
+  g_autoptr(GError) error = NULL;
+  const char *target_app_id;
+  const char *apps[3] = { NULL };
+  XdpPermissionFlags perms[2] = { 0 };
+  XdpPermissionFlags target_perms;
+  guint32 flags;
+  gboolean reuse_existing, persistent;
+  const int *fds = NULL;
+  int fds_len = 0;
+  gsize n_docs, i;
+  int n_apps = 0;
+
+  g_variant_get (parameters, "(@ahu&s^a&s)", &fds_v, &flags, &target_app_id, &permissions);
+
+  if ((flags & ~XDP_ADD_FLAGS_FLAGS_ALL) != 0)
+    {
+      g_dbus_method_invocation_return_error (invocation, FLATPAK_PORTAL_ERROR, FLATPAK_PORTAL_ERROR_INVALID_ARGUMENT,
+                                             "Invalid flags");
+      return;
+    }
+
+  reuse_existing = (flags & XDP_ADD_FLAGS_REUSE_EXISTING) != 0;
+  persistent = (flags & XDP_ADD_FLAGS_PERSISTENT) != 0;
+  target_perms = xdp_parse_permissions (permissions);
+
+  /* A reused document is shared with everyone else who added the same
+     file, so nobody gets to delete it through this call, as with Add */
+  if (reuse_existing)
+    target_perms &= ~XDP_PERMISSION_FLAGS_DELETE;
+
+  if (target_app_id[0] != '\0' && !flatpak_is_valid_name (target_app_id))
+    {
+      g_dbus_method_invocation_return_error (invocation, FLATPAK_PORTAL_ERROR, FLATPAK_PORTAL_ERROR_INVALID_ARGUMENT,
+                                             "Invalid app name: %s", target_app_id);
+      return;
+    }
+
+  /* Sandboxed callers get the same permissions as with Add, and
+     can use GrantPermissions afterwards to pass them on */
+  if (app_id[0] != '\0' &&
+      (target_app_id[0] != '\0' || permissions[0] != NULL))
+    {
+      g_dbus_method_invocation_return_error (invocation, FLATPAK_PORTAL_ERROR, FLATPAK_PORTAL_ERROR_NOT_ALLOWED,
+                                             "Not enough permissions");
+      return;
+    }
+
+  /* The caller gets the same permissions as with Add */
+  if (app_id[0] != '\0')
+    {
+      apps[n_apps] = app_id;
+      perms[n_apps] =
+        XDP_PERMISSION_FLAGS_GRANT_PERMISSIONS |
+        XDP_PERMISSION_FLAGS_READ |
+        XDP_PERMISSION_FLAGS_WRITE;
+      /* If its a unique one its safe for the creator to
+         delete it at will */
+      if (!reuse_existing)
+        perms[n_apps] |= XDP_PERMISSION_FLAGS_DELETE;
+      n_apps++;
+    }
+  else if (target_app_id[0] != '\0')
+    {
+      apps[n_apps] = target_app_id;
+      perms[n_apps] = target_perms;
+      n_apps++;
+    }
+
+  message = g_dbus_method_invocation_get_message (invocation);
+  fd_list = g_dbus_message_get_unix_fd_list (message);
+  if (fd_list != NULL)
+    fds = g_unix_fd_list_peek_fds (fd_list, &fds_len);
+
+  n_docs = g_variant_n_children (fds_v);
+  docs = g_new0 (XdpAddFullDoc, n_docs);
+  ids = g_ptr_array_new_with_free_func (g_free);
+
+  /* Validate all the fds before taking the db lock, and look up the ids
+     of the ones on the fuse filesystem, as that takes the fuse lock */
+  for (i = 0; i < n_docs; i++)
+    {
+      char path_buffer[PATH_MAX + 1];
+      struct stat st_buf;
+      int fd_id, fd = -1;
+
+      g_variant_get_child (fds_v, i, "h", &fd_id);
+      if (fd_id < fds_len)
+        fd = fds[fd_id];
+
+      if (!validate_fd (fd, &st_buf, &docs[i].parent_st_buf, path_buffer, &error))
+        goto out;
+
+      if (st_buf.st_dev == fuse_dev)
+        {
+          docs[i].id = xdp_fuse_lookup_id_for_inode (st_buf.st_ino);
+          g_debug ("path on fuse, id %s", docs[i].id);
+
+          /* See portal_add() for why reuse_existing is required */
+          if (docs[i].id == NULL || !reuse_existing)
+            {
+              g_set_error (&error, FLATPAK_PORTAL_ERROR, FLATPAK_PORTAL_ERROR_INVALID_ARGUMENT,
+                           "Invalid fd passed");
+              goto out;
+            }
+        }
+      else
+        {
+          g_debug ("portal_add_full %s", path_buffer);
+          docs[i].path = g_strdup (path_buffer);
+        }
+    }
+
+  {
+    g_autoptr(GHashTable) store_batch = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+    AUTOLOCK (db);
+
+    /* Check the existing documents first, so we don't create any
+       documents if we're going to fail */
+    for (i = 0; i < n_docs; i++)
+      {
+        g_autoptr(FlatpakDbEntry) old_entry = NULL;
+
+        if (docs[i].path != NULL)
+          continue;
+
+        old_entry = flatpak_db_lookup (db, docs[i].id);
+        if (old_entry == NULL)
+          {
+            g_set_error (&error, FLATPAK_PORTAL_ERROR, FLATPAK_PORTAL_ERROR_INVALID_ARGUMENT,
+                         "Invalid fd passed");
+            goto out;
+          }
+
+        if (target_app_id[0] != '\0' &&
+            !xdp_entry_has_permissions (old_entry, app_id,
+                                        XDP_PERMISSION_FLAGS_GRANT_PERMISSIONS | target_perms))
+          {
+            g_set_error (&error, FLATPAK_PORTAL_ERROR, FLATPAK_PORTAL_ERROR_NOT_ALLOWED,
+                         "Not enough permissions");
+            goto out;
+          }
+      }
+
+    for (i = 0; i < n_docs; i++)
+      {
+        if (docs[i].path != NULL)
+          {
+            docs[i].id = do_create_doc_full (&docs[i].parent_st_buf, docs[i].path,
+                                             reuse_existing, persistent,
+                                             apps, perms, store_batch);
+          }
+        else if (target_app_id[0] != '\0')
+          {
+            g_autoptr(FlatpakDbEntry) entry = flatpak_db_lookup (db, docs[i].id);
+
+            do_set_permissions_full (entry, docs[i].id, target_app_id,
+                                     target_perms | xdp_entry_get_permissions (entry, target_app_id),
+                                     store_batch);
+          }
+      }
+
+    /* All the docs are written to the permission store in one go */
+    flush_store_batch (store_batch);
+  }
+
+  /* Invalidate with lock dropped to avoid deadlock */
+  for (i = 0; i < n_docs; i++)
+    {
+      if (docs[i].path != NULL)
+        xdp_fuse_invalidate_doc_app (docs[i].id, NULL);
+      if (app_id[0] != '\0')
+        xdp_fuse_invalidate_doc_app (docs[i].id, app_id);
+      if (target_app_id[0] != '\0' && strcmp (app_id, target_app_id) != 0)
+        xdp_fuse_invalidate_doc_app (docs[i].id, target_app_id);
+    }
+
+  for (i = 0; i < n_docs; i++)
+    {
+      g_ptr_array_add (ids, docs[i].id);
+      docs[i].id = NULL;
+    }
+  g_ptr_array_add (ids, NULL);
+
+  g_dbus_method_invocation_return_value (invocation,
+                                         g_variant_new ("(^as)", (char **) ids->pdata));
+
+out:
+  for (i = 0; i < n_docs; i++)
+    {
+      g_free (docs[i].id);
+      g_free (docs[i].path);
+    }
+
+  if (error)
+    g_dbus_method_invocation_return_gerror (invocation, error);
+}
+
 
 typedef void (*PortalMethod) (GDBusMethodInvocation *invocation,
                               GVariant              *parameters,
@@ -613,6 +1098,7 @@ on_bus_acquired (GDBusConnection *connection,
   g_signal_connect_swapped (helper, "handle-get-mount-point", G_CALLBACK (handle_get_mount_point), NULL);
   g_signal_connect_swapped (helper, "handle-add", G_CALLBACK (handle_method), portal_add);
   g_signal_connect_swapped (helper, "handle-add-named", G_CALLBACK (handle_method), portal_add_named);
+  g_signal_connect_swapped (helper, "handle-add-full", G_CALLBACK (handle_method), portal_add_full);
   g_signal_connect_swapped (helper, "handle-grant-permissions", G_CALLBACK (handle_method), portal_grant_permissions);
   g_signal_connect_swapped (helper, "handle-revoke-permissions", G_CALLBACK (handle_method), portal_revoke_permissions);
   g_signal_connect_swapped (helper, "handle-delete", G_CALLBACK (handle_method), portal_delete);
@@ -705,6 +1191,13 @@ exit_handler (int sig)
   g_main_loop_quit (loop);
 }
 
+static gboolean
+log_stats_handler (gpointer user_data)
+{
+  xdp_fuse_log_stats ();
+  return G_SOURCE_CONTINUE;
+}
+
 static int
 set_one_signal_handler (int    sig,
                         void (*handler)(int),
@@ -817,6 +1310,10 @@ main (int    argc,
       do_exit (2);
     }
 
+  doc_infos = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                     g_free, (GDestroyNotify) xdp_doc_info_free);
+  app_ids = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
   session_bus = g_bus_get_sync (G_BUS_TYPE_SESSION, NULL, &error);
   if (session_bus == NULL)
     {
@@ -845,6 +1342,9 @@ main (int    argc,
       set_one_signal_handler (SIGPIPE, SIG_IGN, 0) == -1)
     do_exit (5);
 
+  /* Let users see how the fuse filesystem performs without a restart */
+  g_unix_signal_add (SIGUSR1, log_stats_handler, NULL);
+
   owner_id = g_bus_own_name (G_BUS_TYPE_SESSION,
                              "org.freedesktop.portal.Documents",
                              G_BUS_NAME_OWNER_FLAGS_ALLOW_REPLACEMENT | (opt_replace ? G_BUS_NAME_OWNER_FLAGS_REPLACE : 0),
@@ -0,0 +1,316 @@
+/*
+ * Copyright © 2016 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "flatpak-utils.h"
+#include "flatpak-change-private.h"
+#include "flatpak-enum-types.h"
+
+/**
+ * SECTION:flatpak-change
+ * @Title: FlatpakChange
+ * @Short_description: Change to an installation
+ *
+ * A FlatpakChange describes one change to a #FlatpakInstallation, such
+ * as an application being deployed or a remote being modified. Use
+ * flatpak_installation_list_changes_sync() to get the changes since the
+ * last time you looked, instead of listing everything again each time
+ * the monitor from flatpak_installation_create_monitor() fires.
+ */
+
+typedef struct _FlatpakChangePrivate FlatpakChangePrivate;
+
+struct _FlatpakChangePrivate
+{
+  FlatpakChangeKind kind;
+  guint64           serial;
+  char             *name;
+  char             *commit;
+};
+
+G_DEFINE_TYPE_WITH_PRIVATE (FlatpakChange, flatpak_change, G_TYPE_OBJECT)
+
+enum {
+  PROP_0,
+
+  PROP_KIND,
+  PROP_SERIAL,
+  PROP_NAME,
+  PROP_COMMIT,
+};
+
+static void
+flatpak_change_finalize (GObject *object)
+{
+  FlatpakChange *self = FLATPAK_CHANGE (object);
+  FlatpakChangePrivate *priv = flatpak_change_get_instance_private (self);
+
+  g_free (priv->name);
+  g_free (priv->commit);
+
+  G_OBJECT_CLASS (flatpak_change_parent_class)->finalize (object);
+}
+
+static void
+flatpak_change_set_property (GObject      *object,
+                             guint         prop_id,
+                             const GValue *value,
+                             GParamSpec   *pspec)
+{
+  FlatpakChange *self = FLATPAK_CHANGE (object);
+  FlatpakChangePrivate *priv = flatpak_change_get_instance_private (self);
+
+  switch (prop_id)
+    {
+    case PROP_KIND:
+      priv->kind = g_value_get_enum (value);
+      break;
+
+    case PROP_SERIAL:
+      priv->serial = g_value_get_uint64 (value);
+      break;
+
+    case PROP_NAME:
+      g_clear_pointer (&priv->name, g_free);
+      priv->name = g_value_dup_string (value);
+      break;
+
+    case PROP_COMMIT:
+      g_clear_pointer (&priv->commit, g_free);
+      priv->commit = g_value_dup_string (value);
+      break;
+
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
+    }
+}
+
+static void
+flatpak_change_get_property (GObject    *object,
+                             guint       prop_id,
+                             GValue     *value,
+                             GParamSpec *pspec)
+{
+  FlatpakChange *self = FLATPAK_CHANGE (object);
+  FlatpakChangePrivate *priv = flatpak_change_get_instance_private (self);
+
+  switch (prop_id)
+    {
+    case PROP_KIND:
+      g_value_set_enum (value, priv->kind);
+      break;
+
+    case PROP_SERIAL:
+      g_value_set_uint64 (value, priv->serial);
+      break;
+
+    case PROP_NAME:
+      g_value_set_string (value, priv->name);
+      break;
+
+    case PROP_COMMIT:
+      g_value_set_string (value, priv->commit);
+      break;
+
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
+    }
+}
+
+static void
+flatpak_change_class_init (FlatpakChangeClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->get_property = flatpak_change_get_property;
+  object_class->set_property = flatpak_change_set_property;
+  object_class->finalize = flatpak_change_finalize;
+
+  g_object_class_install_property (object_class,
+                                   PROP_KIND,
+                                   g_param_spec_enum ("kind",
+                                                      "Kind",
+                                                      "The kind of change",
+                                                      FLATPAK_TYPE_CHANGE_KIND,
+                                                      FLATPAK_CHANGE_KIND_DEPLOYED,
+                                                      G_PARAM_READWRITE));
+  g_object_class_install_property (object_class,
+                                   PROP_SERIAL,
+                                   g_param_spec_uint64 ("serial",
+                                                        "Serial",
+                                                        "The serial number of the change",
+                                                        0, G_MAXUINT64, 0,
+                                                        G_PARAM_READWRITE));
+  g_object_class_install_property (object_class,
+                                   PROP_NAME,
+                                   g_param_spec_string ("name",
+                                                        "Name",
+                                                        "The ref or remote that changed",
+                                                        NULL,
+                                                        G_PARAM_READWRITE));
+  g_object_class_install_property (object_class,
+                                   PROP_COMMIT,
+                                   g_param_spec_string ("commit",
+                                                        "Commit",
+                                                        "The commit that was deployed or undeployed",
+                                                        NULL,
+                                                        G_PARAM_READWRITE));
+}
+
+static void
+flatpak_change_init (FlatpakChange *self)
+{
+}
+
+/**
+ * flatpak_change_get_kind:
+ * @self: a #FlatpakChange
+ *
+ * Gets the kind of change.
+ *
+ * Returns: a #FlatpakChangeKind
+ */
+FlatpakChangeKind
+flatpak_change_get_kind (FlatpakChange *self)
+{
+  FlatpakChangePrivate *priv = flatpak_change_get_instance_private (self);
+
+  return priv->kind;
+}
+
+/**
+ * flatpak_change_get_serial:
+ * @self: a #FlatpakChange
+ *
+ * Gets the serial number of the change. Serials increase with each
+ * change to the installation, and can be passed to
+ * flatpak_installation_list_changes_sync() to get the changes after
+ * this one.
+ *
+ * Returns: the serial
+ */
+guint64
+flatpak_change_get_serial (FlatpakChange *self)
+{
+  FlatpakChangePrivate *priv = flatpak_change_get_instance_private (self);
+
+  return priv->serial;
+}
+
+static gboolean
+is_remote_change (FlatpakChangePrivate *priv)
+{
+  return priv->kind == FLATPAK_CHANGE_KIND_REMOTE_MODIFIED ||
+         priv->kind == FLATPAK_CHANGE_KIND_REMOTE_REMOVED;
+}
+
+/**
+ * flatpak_change_get_ref:
+ * @self: a #FlatpakChange
+ *
+ * Gets the full ref (such as app/org.gnome.gedit/x86_64/stable) that
+ * changed, for changes to applications and runtimes.
+ *
+ * Returns: (transfer none) (nullable): the ref, or %NULL for changes to remotes
+ */
+const char *
+flatpak_change_get_ref (FlatpakChange *self)
+{
+  FlatpakChangePrivate *priv = flatpak_change_get_instance_private (self);
+
+  if (is_remote_change (priv))
+    return NULL;
+
+  return priv->name;
+}
+
+/**
+ * flatpak_change_get_commit:
+ * @self: a #FlatpakChange
+ *
+ * Gets the commit that was deployed or undeployed.
+ *
+ * Returns: (transfer none) (nullable): the commit, or %NULL for other changes
+ */
+const char *
+flatpak_change_get_commit (FlatpakChange *self)
+{
+  FlatpakChangePrivate *priv = flatpak_change_get_instance_private (self);
+
+  return priv->commit;
+}
+
+/**
+ * flatpak_change_get_remote_name:
+ * @self: a #FlatpakChange
+ *
+ * Gets the name of the remote that changed, for changes to remotes.
+ *
+ * Returns: (transfer none) (nullable): the remote name, or %NULL for changes to refs
+ */
+const char *
+flatpak_change_get_remote_name (FlatpakChange *self)
+{
+  FlatpakChangePrivate *priv = flatpak_change_get_instance_private (self);
+
+  if (!is_remote_change (priv))
+    return NULL;
+
+  return priv->name;
+}
+
+FlatpakChange *
+flatpak_change_new (FlatpakDirChange *dir_change)
+{
+  FlatpakChangeKind kind;
+
+  switch (dir_change->type)
+    {
+    case FLATPAK_DIR_CHANGE_DEPLOY:
+      kind = FLATPAK_CHANGE_KIND_DEPLOYED;
+      break;
+
+    case FLATPAK_DIR_CHANGE_UNDEPLOY:
+      kind = FLATPAK_CHANGE_KIND_UNDEPLOYED;
+      break;
+
+    case FLATPAK_DIR_CHANGE_MAKE_CURRENT:
+      kind = FLATPAK_CHANGE_KIND_MADE_CURRENT;
+      break;
+
+    case FLATPAK_DIR_CHANGE_MODIFY_REMOTE:
+      kind = FLATPAK_CHANGE_KIND_REMOTE_MODIFIED;
+      break;
+
+    case FLATPAK_DIR_CHANGE_REMOVE_REMOTE:
+      kind = FLATPAK_CHANGE_KIND_REMOTE_REMOVED;
+      break;
+
+    default:
+      g_assert_not_reached ();
+    }
+
+  return g_object_new (FLATPAK_TYPE_CHANGE,
+                       "kind", kind,
+                       "serial", dir_change->serial,
+                       "name", dir_change->name,
+                       "commit", dir_change->commit,
+                       NULL);
+}
@@ -0,0 +1,73 @@
+/*
+ * Copyright © 2016 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#if !defined(__FLATPAK_H_INSIDE__) && !defined(FLATPAK_COMPILATION)
+#error "Only <flatpak.h> can be included directly."
+#endif
+
+#ifndef __FLATPAK_CHANGE_H__
+#define __FLATPAK_CHANGE_H__
+
+typedef struct _FlatpakChange FlatpakChange;
+
+#include <glib-object.h>
+
+#define FLATPAK_TYPE_CHANGE flatpak_change_get_type ()
+#define FLATPAK_CHANGE(obj) (G_TYPE_CHECK_INSTANCE_CAST ((obj), FLATPAK_TYPE_CHANGE, FlatpakChange))
+#define FLATPAK_IS_CHANGE(obj) (G_TYPE_CHECK_INSTANCE_TYPE ((obj), FLATPAK_TYPE_CHANGE))
+
+FLATPAK_EXTERN GType flatpak_change_get_type (void);
+
+struct _FlatpakChange
+{
+  GObject parent;
+};
+
+typedef struct
+{
+  GObjectClass parent_class;
+} FlatpakChangeClass;
+
+#ifdef G_DEFINE_AUTOPTR_CLEANUP_FUNC
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (FlatpakChange, g_object_unref)
+#endif
+
+/**
+ * FlatpakChangeKind:
+ * @FLATPAK_CHANGE_KIND_DEPLOYED: A commit of a ref was deployed
+ * @FLATPAK_CHANGE_KIND_UNDEPLOYED: A commit of a ref was undeployed
+ * @FLATPAK_CHANGE_KIND_MADE_CURRENT: An application branch was made the current one
+ * @FLATPAK_CHANGE_KIND_REMOTE_MODIFIED: A remote was added or its configuration changed
+ * @FLATPAK_CHANGE_KIND_REMOTE_REMOVED: A remote was removed
+ *
+ * The kind of change that a #FlatpakChange describes.
+ */
+typedef enum {
+  FLATPAK_CHANGE_KIND_DEPLOYED,
+  FLATPAK_CHANGE_KIND_UNDEPLOYED,
+  FLATPAK_CHANGE_KIND_MADE_CURRENT,
+  FLATPAK_CHANGE_KIND_REMOTE_MODIFIED,
+  FLATPAK_CHANGE_KIND_REMOTE_REMOVED,
+} FlatpakChangeKind;
+
+FLATPAK_EXTERN FlatpakChangeKind flatpak_change_get_kind (FlatpakChange *self);
+FLATPAK_EXTERN guint64           flatpak_change_get_serial (FlatpakChange *self);
+FLATPAK_EXTERN const char *      flatpak_change_get_ref (FlatpakChange *self);
+FLATPAK_EXTERN const char *      flatpak_change_get_commit (FlatpakChange *self);
+FLATPAK_EXTERN const char *      flatpak_change_get_remote_name (FlatpakChange *self);
+
+#endif /* __FLATPAK_CHANGE_H__ */
@@ -28,6 +28,8 @@
 #include "flatpak-installed-ref-private.h"
 #include "flatpak-remote-private.h"
 #include "flatpak-remote-ref-private.h"
+#include "flatpak-change-private.h"
+#include "flatpak-instance-private.h"
 #include "flatpak-enum-types.h"
 #include "flatpak-dir.h"
 #include "flatpak-run.h"
@@ -587,6 +589,54 @@ flatpak_installation_list_installed_refs_by_kind (FlatpakInstallation *self,
   return g_steal_pointer (&refs);
 }
 
+/* Max number of remotes checked for updates at the same time */
+#define UPDATE_CHECK_CONCURRENCY 4
+
+typedef struct
+{
+  FlatpakDir   *dir;
+  GCancellable *cancellable;
+} UpdateCheckData;
+
+typedef struct
+{
+  const char *origin;
+  GPtrArray  *installed; /* FlatpakInstalledRef, all with this origin */
+  GHashTable *commits;   /* ref -> remote commit, filled in by the job */
+} OriginUpdateCheck;
+
+static void
+origin_update_check_free (OriginUpdateCheck *check)
+{
+  g_ptr_array_unref (check->installed);
+  if (check->commits)
+    g_hash_table_unref (check->commits);
+  g_free (check);
+}
+
+static void
+origin_update_check_job (gpointer data,
+                         gpointer user_data)
+{
+  OriginUpdateCheck *check = data;
+  UpdateCheckData *check_data = user_data;
+  g_autoptr(GPtrArray) full_refs = g_ptr_array_new_with_free_func (g_free);
+  g_autoptr(GError) local_error = NULL;
+  int i;
+
+  for (i = 0; i < check->installed->len; i++)
+    g_ptr_array_add (full_refs, flatpak_ref_format_ref (g_ptr_array_index (check->installed, i)));
+  g_ptr_array_add (full_refs, NULL);
+
+  /* We ignore errors here. we don't want one remote to fail us */
+  if (!flatpak_dir_lookup_remote_refs (check_data->dir, check->origin,
+                                       (const char * const *) full_refs->pdata,
+                                       &check->commits,
+                                       check_data->cancellable, &local_error))
+    g_debug ("Update: Failed to read remote %s: %s\n",
+             check->origin, local_error->message);
+}
+
 /**
  * flatpak_installation_list_installed_refs_for_update:
  * @self: a #FlatpakInstallation
@@ -606,50 +656,53 @@ flatpak_installation_list_installed_refs_for_update (FlatpakInstallation *self,
                                                      GCancellable        *cancellable,
                                                      GError             **error)
 {
+  g_autoptr(FlatpakDir) dir = flatpak_installation_get_dir (self);
   g_autoptr(GPtrArray) updates = NULL;
   g_autoptr(GPtrArray) installed = NULL;
-  g_autoptr(GPtrArray) remotes = NULL;
-  g_autoptr(GHashTable) ht = NULL;
-  int i, j;
+  g_autoptr(GHashTable) checks = NULL;
+  UpdateCheckData check_data = { dir, cancellable };
+  GHashTableIter iter;
+  gpointer value;
+  GThreadPool *pool;
+  int i;
 
-  ht = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
-  remotes = flatpak_installation_list_remotes (self, cancellable, error);
-  if (remotes == NULL)
+  installed = flatpak_installation_list_installed_refs (self, cancellable, error);
+  if (installed == NULL)
     return NULL;
 
-  for (i = 0; i < remotes->len; i++)
+  /* Only the summaries of the remotes that something is installed
+     from are needed, and only the installed refs are looked up in them */
+  checks = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+                                  (GDestroyNotify) origin_update_check_free);
+  for (i = 0; i < installed->len; i++)
     {
-      FlatpakRemote *remote = g_ptr_array_index (remotes, i);
-      g_autoptr(GPtrArray) refs = NULL;
-      g_autoptr(GError) local_error = NULL;
+      FlatpakInstalledRef *installed_ref = g_ptr_array_index (installed, i);
+      const char *origin = flatpak_installed_ref_get_origin (installed_ref);
+      OriginUpdateCheck *check;
 
-      /* We ignore errors here. we don't want one remote to fail us */
-      refs = flatpak_installation_list_remote_refs_sync (self,
-                                                         flatpak_remote_get_name (remote),
-                                                         cancellable, &local_error);
-      if (refs != NULL)
-        {
-          for (j = 0; j < refs->len; j++)
-            {
-              FlatpakRemoteRef *remote_ref = g_ptr_array_index (refs, j);
-              g_autofree char *full_ref = flatpak_ref_format_ref (FLATPAK_REF (remote_ref));
-              g_autofree char *key = g_strdup_printf ("%s:%s", flatpak_remote_get_name (remote),
-                                                      full_ref);
-
-              g_hash_table_insert (ht, g_steal_pointer (&key),
-                                   g_strdup (flatpak_ref_get_commit (FLATPAK_REF (remote_ref))));
-            }
-        }
-      else
+      if (origin == NULL)
+        continue;
+
+      check = g_hash_table_lookup (checks, origin);
+      if (check == NULL)
         {
-          g_debug ("Update: Failed to read remote %s: %s\n",
-                   flatpak_remote_get_name (remote),
-                   local_error->message);
+          check = g_new0 (OriginUpdateCheck, 1);
+          check->origin = origin;
+          check->installed = g_ptr_array_new ();
+          g_hash_table_insert (checks, (char *) origin, check);
         }
+
+      g_ptr_array_add (check->installed, installed_ref);
     }
 
-  installed = flatpak_installation_list_installed_refs (self, cancellable, error);
-  if (installed == NULL)
+  pool = g_thread_pool_new (origin_update_check_job, &check_data,
+                            UPDATE_CHECK_CONCURRENCY, FALSE, NULL);
+  g_hash_table_iter_init (&iter, checks);
+  while (g_hash_table_iter_next (&iter, NULL, &value))
+    g_thread_pool_push (pool, value, NULL);
+  g_thread_pool_free (pool, FALSE, TRUE);
+
+  if (g_cancellable_set_error_if_cancelled (cancellable, error))
     return NULL;
 
   updates = g_ptr_array_new_with_free_func (g_object_unref);
@@ -657,13 +710,23 @@ flatpak_installation_list_installed_refs_for_update (FlatpakInstallation *self,
   for (i = 0; i < installed->len; i++)
     {
       FlatpakInstalledRef *installed_ref = g_ptr_array_index (installed, i);
-      g_autofree char *full_ref = flatpak_ref_format_ref (FLATPAK_REF (installed_ref));
-      g_autofree char *key = g_strdup_printf ("%s:%s", flatpak_installed_ref_get_origin (installed_ref),
-                                              full_ref);
-      const char *remote_ref = g_hash_table_lookup (ht, key);
+      const char *origin = flatpak_installed_ref_get_origin (installed_ref);
+      OriginUpdateCheck *check;
+      g_autofree char *full_ref = NULL;
+      const char *remote_commit;
+
+      if (origin == NULL)
+        continue;
+
+      check = g_hash_table_lookup (checks, origin);
+      if (check->commits == NULL)
+        continue;
+
+      full_ref = flatpak_ref_format_ref (FLATPAK_REF (installed_ref));
+      remote_commit = g_hash_table_lookup (check->commits, full_ref);
 
-      if (remote_ref != NULL &&
-          g_strcmp0 (remote_ref,
+      if (remote_commit != NULL &&
+          g_strcmp0 (remote_commit,
                      flatpak_installed_ref_get_latest_commit (installed_ref)) != 0)
         g_ptr_array_add (updates, g_object_ref (installed_ref));
     }
@@ -1357,6 +1420,81 @@ flatpak_installation_fetch_remote_metadata_sync (FlatpakInstallation *self,
   return g_bytes_new_take (res, strlen (res));
 }
 
+static char **
+format_refs (GPtrArray *refs)
+{
+  char **res = g_new0 (char *, refs->len + 1);
+  int i;
+
+  for (i = 0; i < refs->len; i++)
+    res[i] = flatpak_ref_format_ref (g_ptr_array_index (refs, i));
+
+  return res;
+}
+
+static GPtrArray *
+fetch_remote_refs_info (FlatpakInstallation *self,
+                        const char          *remote_name,
+                        const char * const  *full_refs,
+                        GCancellable        *cancellable,
+                        GError             **error)
+{
+  g_autoptr(FlatpakDir) dir = flatpak_installation_get_dir (self);
+  g_autoptr(GPtrArray) infos = NULL;
+  g_autoptr(GPtrArray) refs = g_ptr_array_new_with_free_func (g_object_unref);
+  int i;
+
+  infos = flatpak_dir_fetch_remote_refs_info (dir, remote_name, full_refs,
+                                              cancellable, error);
+  if (infos == NULL)
+    return NULL;
+
+  for (i = 0; i < infos->len; i++)
+    {
+      FlatpakRemoteRef *ref;
+
+      ref = flatpak_remote_ref_new_from_info (g_ptr_array_index (infos, i),
+                                              remote_name);
+      if (ref)
+        g_ptr_array_add (refs, ref);
+    }
+
+  return g_steal_pointer (&refs);
+}
+
+/**
+ * flatpak_installation_fetch_remote_refs_info_sync:
+ * @self: a #FlatpakInstallation
+ * @remote_name: the name of the remote
+ * @refs: (element-type FlatpakRef): the refs to look up
+ * @cancellable: (nullable): a #GCancellable
+ * @error: return location for a #GError
+ *
+ * Looks up the commit, metadata and sizes of several refs in a remote at
+ * once. This is much faster than calling
+ * flatpak_installation_fetch_remote_metadata_sync() and
+ * flatpak_installation_fetch_remote_size_sync() for each ref.
+ *
+ * Refs that are not in the remote are left out of the result. If the
+ * remote does not publish the sizes of a ref they are reported as 0.
+ *
+ * Returns: (transfer container) (element-type FlatpakRemoteRef): a GPtrArray of
+ *   #FlatpakRemoteRef instances, or %NULL if an error occurred
+ */
+GPtrArray *
+flatpak_installation_fetch_remote_refs_info_sync (FlatpakInstallation *self,
+                                                  const char          *remote_name,
+                                                  GPtrArray           *refs,
+                                                  GCancellable        *cancellable,
+                                                  GError             **error)
+{
+  g_auto(GStrv) full_refs = format_refs (refs);
+
+  return fetch_remote_refs_info (self, remote_name,
+                                 (const char * const *) full_refs,
+                                 cancellable, error);
+}
+
 /**
  * flatpak_installation_list_remote_refs_sync:
  * @self: a #FlatpakInstallation
@@ -1431,20 +1569,12 @@ flatpak_installation_fetch_remote_ref_sync (FlatpakInstallation *self,
                                             GError             **error)
 {
   g_autoptr(FlatpakDir) dir = flatpak_installation_get_dir (self);
-  g_autoptr(GHashTable) ht = NULL;
   g_autofree char *ref = NULL;
-  const char *checksum;
+  g_autofree char *checksum = NULL;
 
   if (branch == NULL)
     branch = "master";
 
-  if (!flatpak_dir_list_remote_refs (dir,
-                                     remote_name,
-                                     &ht,
-                                     cancellable,
-                                     error))
-    return NULL;
-
   if (kind == FLATPAK_REF_KIND_APP)
     ref = flatpak_build_app_ref (name,
                                  branch,
@@ -1454,14 +1584,15 @@ flatpak_installation_fetch_remote_ref_sync (FlatpakInstallation *self,
                                      branch,
                                      arch);
 
-  checksum = g_hash_table_lookup (ht, ref);
-
-  if (checksum != NULL)
-    return flatpak_remote_ref_new (ref, checksum, remote_name);
+  if (!flatpak_dir_lookup_remote_ref (dir,
+                                      remote_name,
+                                      ref,
+                                      &checksum,
+                                      cancellable,
+                                      error))
+    return NULL;
 
-  g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
-               "Reference %s doesn't exist in remote\n", ref);
-  return NULL;
+  return flatpak_remote_ref_new (ref, checksum, remote_name);
 }
 
 static void
@@ -1549,3 +1680,1055 @@ flatpak_installation_create_monitor (FlatpakInstallation *self,
   return g_file_monitor_file (path, G_FILE_MONITOR_NONE,
                               cancellable, error);
 }
+
+/**
+ * flatpak_installation_list_changes_sync:
+ * @self: a #FlatpakInstallation
+ * @since: the serial of the last change seen, or 0
+ * @out_cursor: (out): return location for the serial to pass as @since next time
+ * @cancellable: (nullable): a #GCancellable
+ * @error: return location for a #GError
+ *
+ * Lists the changes to the installation after the change with serial
+ * @since, oldest first. Pass 0 to get all recorded changes; the
+ * returned @out_cursor can then be used to only get new changes, for
+ * instance each time the monitor from flatpak_installation_create_monitor()
+ * fires.
+ *
+ * Changes made by versions of flatpak that did not record them are
+ * missing, so clients should do a full rescan when they start, and only
+ * apply changes incrementally after that. Only the most recent changes
+ * are kept, so if @since is too old this fails with
+ * %G_IO_ERROR_INVALID_ARGUMENT, and the client has to rescan.
+ *
+ * Returns: (transfer container) (element-type FlatpakChange): a GPtrArray of
+ *   #FlatpakChange instances, or %NULL on error
+ */
+GPtrArray *
+flatpak_installation_list_changes_sync (FlatpakInstallation *self,
+                                        guint64              since,
+                                        guint64             *out_cursor,
+                                        GCancellable        *cancellable,
+                                        GError             **error)
+{
+  g_autoptr(FlatpakDir) dir = flatpak_installation_get_dir (self);
+  g_autoptr(GPtrArray) dir_changes = NULL;
+  g_autoptr(GPtrArray) changes = NULL;
+  guint64 cursor;
+  int i;
+
+  dir_changes = flatpak_dir_read_changes (dir, since, &cursor, cancellable, error);
+  if (dir_changes == NULL)
+    return NULL;
+
+  changes = g_ptr_array_new_with_free_func (g_object_unref);
+  for (i = 0; i < dir_changes->len; i++)
+    g_ptr_array_add (changes, flatpak_change_new (g_ptr_array_index (dir_changes, i)));
+
+  if (out_cursor)
+    *out_cursor = cursor;
+
+  return g_steal_pointer (&changes);
+}
+
+/**
+ * flatpak_installation_list_instances_sync:
+ * @self: a #FlatpakInstallation
+ * @cancellable: (nullable): a #GCancellable
+ * @error: return location for a #GError
+ *
+ * Lists the applications from this installation that the current user
+ * is running, in the order they were started. The resource usage of each
+ * instance is taken when it is listed; list them again to get new values.
+ *
+ * Returns: (transfer container) (element-type FlatpakInstance): a GPtrArray of
+ *   #FlatpakInstance instances, or %NULL on error
+ */
+GPtrArray *
+flatpak_installation_list_instances_sync (FlatpakInstallation *self,
+                                          GCancellable        *cancellable,
+                                          GError             **error)
+{
+  g_autoptr(FlatpakDir) dir = flatpak_installation_get_dir (self);
+  g_autoptr(GPtrArray) sandboxes = flatpak_sandbox_list ();
+  g_autoptr(GPtrArray) instances = NULL;
+  g_autofree char *prefix = NULL;
+  int i;
+
+  prefix = g_strconcat (gs_file_get_path_cached (flatpak_dir_get_path (dir)), "/", NULL);
+
+  instances = g_ptr_array_new_with_free_func (g_object_unref);
+  for (i = 0; i < sandboxes->len; i++)
+    {
+      FlatpakSandbox *sandbox = g_ptr_array_index (sandboxes, i);
+
+      if (g_cancellable_set_error_if_cancelled (cancellable, error))
+        return NULL;
+
+      if (sandbox->app_path == NULL ||
+          !g_str_has_prefix (sandbox->app_path, prefix))
+        continue;
+
+      /* The instance takes over the sandbox */
+      sandboxes->pdata[i] = NULL;
+      g_ptr_array_add (instances, flatpak_instance_new (sandbox));
+    }
+
+  return g_steal_pointer (&instances);
+}
+
+/* Asynchronous variants
+ *
+ * These all run the synchronous version in the GTask worker pool, which
+ * is shared by the whole process, so issuing many requests at once does
+ * not create a thread for each. All of them share the FlatpakDir of the
+ * installation, and thus its summary cache and soup session, and
+ * concurrent summary downloads for the same remote are merged into one
+ * (see flatpak_dir_remote_fetch_summary()).
+ */
+
+typedef struct
+{
+  FlatpakUpdateFlags      flags;
+  FlatpakRefKind          kind;
+  char                   *remote_name;
+  char                   *name;
+  char                   *arch;
+  char                   *branch;
+  FlatpakRef             *ref;
+  GFile                  *file;
+  char                  **full_refs;
+
+  /* Progress is reported in the main context of the caller */
+  FlatpakProgressCallback progress;
+  gpointer                progress_data;
+  GMainContext           *context;
+
+  /* Results that are not the return value */
+  guint64                 download_size;
+  guint64                 installed_size;
+  gboolean                changed;
+} AsyncOpData;
+
+static void
+async_op_data_free (AsyncOpData *data)
+{
+  g_free (data->remote_name);
+  g_free (data->name);
+  g_free (data->arch);
+  g_free (data->branch);
+  g_clear_object (&data->ref);
+  g_clear_object (&data->file);
+  g_strfreev (data->full_refs);
+  if (data->context)
+    g_main_context_unref (data->context);
+  g_free (data);
+}
+
+typedef struct
+{
+  GTask       *task;
+  char        *status;
+  guint        progress;
+  gboolean     estimating;
+} AsyncProgressUpdate;
+
+static gboolean
+async_progress_dispatch (gpointer user_data)
+{
+  AsyncProgressUpdate *update = user_data;
+  AsyncOpData *data = g_task_get_task_data (update->task);
+
+  data->progress (update->status, update->progress, update->estimating,
+                  data->progress_data);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+async_progress_update_free (AsyncProgressUpdate *update)
+{
+  g_object_unref (update->task);
+  g_free (update->status);
+  g_free (update);
+}
+
+static void
+async_progress_cb (const char *status,
+                   guint       progress,
+                   gboolean    estimating,
+                   gpointer    user_data)
+{
+  GTask *task = user_data;
+  AsyncOpData *data = g_task_get_task_data (task);
+  AsyncProgressUpdate *update = g_new0 (AsyncProgressUpdate, 1);
+
+  update->task = g_object_ref (task);
+  update->status = g_strdup (status);
+  update->progress = progress;
+  update->estimating = estimating;
+
+  g_main_context_invoke_full (data->context, G_PRIORITY_DEFAULT,
+                              async_progress_dispatch, update,
+                              (GDestroyNotify) async_progress_update_free);
+}
+
+static GTask *
+async_op_new (FlatpakInstallation    *self,
+              gpointer                source_tag,
+              FlatpakProgressCallback progress,
+              gpointer                progress_data,
+              GCancellable           *cancellable,
+              GAsyncReadyCallback     callback,
+              gpointer                user_data,
+              AsyncOpData           **out_data)
+{
+  GTask *task;
+  AsyncOpData *data;
+
+  data = g_new0 (AsyncOpData, 1);
+  data->progress = progress;
+  data->progress_data = progress_data;
+  data->context = g_main_context_ref_thread_default ();
+
+  task = g_task_new (self, cancellable, callback, user_data);
+  g_task_set_source_tag (task, source_tag);
+  g_task_set_task_data (task, data, (GDestroyNotify) async_op_data_free);
+
+  *out_data = data;
+  return task;
+}
+
+/* The progress callback and data to pass to the sync call. Updates are
+ * queued in the caller's context before the result, so they are all
+ * delivered before the GAsyncReadyCallback. */
+#define ASYNC_OP_PROGRESS(task, data) ((data)->progress ? async_progress_cb : NULL), (task)
+
+static void
+return_object_or_error (GTask   *task,
+                        gpointer object,
+                        GError  *error)
+{
+  if (object == NULL)
+    g_task_return_error (task, error);
+  else
+    g_task_return_pointer (task, object, g_object_unref);
+}
+
+static void
+return_array_or_error (GTask     *task,
+                       GPtrArray *array,
+                       GError    *error)
+{
+  if (array == NULL)
+    g_task_return_error (task, error);
+  else
+    g_task_return_pointer (task, array, (GDestroyNotify) g_ptr_array_unref);
+}
+
+static void
+return_boolean_or_error (GTask   *task,
+                         gboolean res,
+                         GError  *error)
+{
+  if (!res)
+    g_task_return_error (task, error);
+  else
+    g_task_return_boolean (task, TRUE);
+}
+
+static void
+install_thread (GTask        *task,
+                gpointer      source_object,
+                gpointer      task_data,
+                GCancellable *cancellable)
+{
+  AsyncOpData *data = task_data;
+  GError *error = NULL;
+  FlatpakInstalledRef *ref;
+
+  ref = flatpak_installation_install (source_object, data->remote_name,
+                                      data->kind, data->name, data->arch, data->branch,
+                                      ASYNC_OP_PROGRESS (task, data),
+                                      cancellable, &error);
+  return_object_or_error (task, ref, error);
+}
+
+/**
+ * flatpak_installation_install_async:
+ * @self: a #FlatpakInstallation
+ * @remote_name: name of the remote to use
+ * @kind: what this ref contains (an #FlatpakRefKind)
+ * @name: name of the app/runtime to fetch
+ * @arch: (nullable): which architecture to fetch (default: current architecture)
+ * @branch: (nullable): which branch to fetch (default: 'master')
+ * @progress: (nullable): progress callback
+ * @progress_data: user data passed to @progress
+ * @cancellable: (nullable): a #GCancellable
+ * @callback: the function to call when the request is done
+ * @user_data: data to pass to @callback
+ *
+ * Asynchronous version of flatpak_installation_install(). @progress is
+ * called in the thread-default main context of the caller, until @callback
+ * is called.
+ */
+void
+flatpak_installation_install_async (FlatpakInstallation    *self,
+                                    const char             *remote_name,
+                                    FlatpakRefKind          kind,
+                                    const char             *name,
+                                    const char             *arch,
+                                    const char             *branch,
+                                    FlatpakProgressCallback progress,
+                                    gpointer                progress_data,
+                                    GCancellable           *cancellable,
+                                    GAsyncReadyCallback     callback,
+                                    gpointer                user_data)
+{
+  g_autoptr(GTask) task = NULL;
+  AsyncOpData *data;
+
+  task = async_op_new (self, flatpak_installation_install_async,
+                       progress, progress_data,
+                       cancellable, callback, user_data, &data);
+  data->remote_name = g_strdup (remote_name);
+  data->kind = kind;
+  data->name = g_strdup (name);
+  data->arch = g_strdup (arch);
+  data->branch = g_strdup (branch);
+  g_task_run_in_thread (task, install_thread);
+}
+
+/**
+ * flatpak_installation_install_finish:
+ * @self: a #FlatpakInstallation
+ * @result: the #GAsyncResult passed to the callback
+ * @error: return location for a #GError
+ *
+ * Finishes a call to flatpak_installation_install_async().
+ *
+ * Returns: (transfer full): The ref for the newly installed app or %NULL on failure
+ */
+FlatpakInstalledRef *
+flatpak_installation_install_finish (FlatpakInstallation *self,
+                                     GAsyncResult        *result,
+                                     GError             **error)
+{
+  g_return_val_if_fail (g_task_is_valid (result, self), NULL);
+
+  return g_task_propagate_pointer (G_TASK (result), error);
+}
+
+static void
+update_thread (GTask        *task,
+               gpointer      source_object,
+               gpointer      task_data,
+               GCancellable *cancellable)
+{
+  AsyncOpData *data = task_data;
+  GError *error = NULL;
+  FlatpakInstalledRef *ref;
+
+  ref = flatpak_installation_update (source_object, data->flags,
+                                     data->kind, data->name, data->arch, data->branch,
+                                     ASYNC_OP_PROGRESS (task, data),
+                                     cancellable, &error);
+  return_object_or_error (task, ref, error);
+}
+
+/**
+ * flatpak_installation_update_async:
+ * @self: a #FlatpakInstallation
+ * @flags: an #FlatpakUpdateFlags variable
+ * @kind: whether this is an app or runtime
+ * @name: name of the app or runtime to update
+ * @arch: (nullable): architecture of the app or runtime to update (default: current architecture)
+ * @branch: (nullable): name of the branch of the app or runtime to update (default: master)
+ * @progress: (nullable): progress callback
+ * @progress_data: user data passed to @progress
+ * @cancellable: (nullable): a #GCancellable
+ * @callback: the function to call when the request is done
+ * @user_data: data to pass to @callback
+ *
+ * Asynchronous version of flatpak_installation_update(). @progress is
+ * called in the thread-default main context of the caller, until @callback
+ * is called.
+ */
+void
+flatpak_installation_update_async (FlatpakInstallation    *self,
+                                   FlatpakUpdateFlags      flags,
+                                   FlatpakRefKind          kind,
+                                   const char             *name,
+                                   const char             *arch,
+                                   const char             *branch,
+                                   FlatpakProgressCallback progress,
+                                   gpointer                progress_data,
+                                   GCancellable           *cancellable,
+                                   GAsyncReadyCallback     callback,
+                                   gpointer                user_data)
+{
+  g_autoptr(GTask) task = NULL;
+  AsyncOpData *data;
+
+  task = async_op_new (self, flatpak_installation_update_async,
+                       progress, progress_data,
+                       cancellable, callback, user_data, &data);
+  data->flags = flags;
+  data->kind = kind;
+  data->name = g_strdup (name);
+  data->arch = g_strdup (arch);
+  data->branch = g_strdup (branch);
+  g_task_run_in_thread (task, update_thread);
+}
+
+/**
+ * flatpak_installation_update_finish:
+ * @self: a #FlatpakInstallation
+ * @result: the #GAsyncResult passed to the callback
+ * @error: return location for a #GError
+ *
+ * Finishes a call to flatpak_installation_update_async().
+ *
+ * Returns: (transfer full): The ref for the newly updated app (or the same if no update) or %NULL on failure
+ */
+FlatpakInstalledRef *
+flatpak_installation_update_finish (FlatpakInstallation *self,
+                                    GAsyncResult        *result,
+                                    GError             **error)
+{
+  g_return_val_if_fail (g_task_is_valid (result, self), NULL);
+
+  return g_task_propagate_pointer (G_TASK (result), error);
+}
+
+static void
+install_bundle_thread (GTask        *task,
+                       gpointer      source_object,
+                       gpointer      task_data,
+                       GCancellable *cancellable)
+{
+  AsyncOpData *data = task_data;
+  GError *error = NULL;
+  FlatpakInstalledRef *ref;
+
+  ref = flatpak_installation_install_bundle (source_object, data->file,
+                                             ASYNC_OP_PROGRESS (task, data),
+                                             cancellable, &error);
+  return_object_or_error (task, ref, error);
+}
+
+/**
+ * flatpak_installation_install_bundle_async:
+ * @self: a #FlatpakInstallation
+ * @file: a #GFile that is an flatpak bundle
+ * @progress: (nullable): progress callback
+ * @progress_data: user data passed to @progress
+ * @cancellable: (nullable): a #GCancellable
+ * @callback: the function to call when the request is done
+ * @user_data: data to pass to @callback
+ *
+ * Asynchronous version of flatpak_installation_install_bundle().
+ */
+void
+flatpak_installation_install_bundle_async (FlatpakInstallation    *self,
+                                           GFile                  *file,
+                                           FlatpakProgressCallback progress,
+                                           gpointer                progress_data,
+                                           GCancellable           *cancellable,
+                                           GAsyncReadyCallback     callback,
+                                           gpointer                user_data)
+{
+  g_autoptr(GTask) task = NULL;
+  AsyncOpData *data;
+
+  task = async_op_new (self, flatpak_installation_install_bundle_async,
+                       progress, progress_data,
+                       cancellable, callback, user_data, &data);
+  data->file = g_object_ref (file);
+  g_task_run_in_thread (task, install_bundle_thread);
+}
+
+/**
+ * flatpak_installation_install_bundle_finish:
+ * @self: a #FlatpakInstallation
+ * @result: the #GAsyncResult passed to the callback
+ * @error: return location for a #GError
+ *
+ * Finishes a call to flatpak_installation_install_bundle_async().
+ *
+ * Returns: (transfer full): The ref for the newly installed app or %NULL on failure
+ */
+FlatpakInstalledRef *
+flatpak_installation_install_bundle_finish (FlatpakInstallation *self,
+                                            GAsyncResult        *result,
+                                            GError             **error)
+{
+  g_return_val_if_fail (g_task_is_valid (result, self), NULL);
+
+  return g_task_propagate_pointer (G_TASK (result), error);
+}
+
+static void
+uninstall_thread (GTask        *task,
+                  gpointer      source_object,
+                  gpointer      task_data,
+                  GCancellable *cancellable)
+{
+  AsyncOpData *data = task_data;
+  GError *error = NULL;
+  gboolean res;
+
+  res = flatpak_installation_uninstall (source_object,
+                                        data->kind, data->name, data->arch, data->branch,
+                                        ASYNC_OP_PROGRESS (task, data),
+                                        cancellable, &error);
+  return_boolean_or_error (task, res, error);
+}
+
+/**
+ * flatpak_installation_uninstall_async:
+ * @self: a #FlatpakInstallation
+ * @kind: what this ref contains (an #FlatpakRefKind)
+ * @name: name of the app or runtime to uninstall
+ * @arch: architecture of the app or runtime to uninstall
+ * @branch: name of the branch of the app or runtime to uninstall
+ * @progress: (nullable): progress callback
+ * @progress_data: user data passed to @progress
+ * @cancellable: (nullable): a #GCancellable
+ * @callback: the function to call when the request is done
+ * @user_data: data to pass to @callback
+ *
+ * Asynchronous version of flatpak_installation_uninstall().
+ */
+void
+flatpak_installation_uninstall_async (FlatpakInstallation    *self,
+                                      FlatpakRefKind          kind,
+                                      const char             *name,
+                                      const char             *arch,
+                                      const char             *branch,
+                                      FlatpakProgressCallback progress,
+                                      gpointer                progress_data,
+                                      GCancellable           *cancellable,
+                                      GAsyncReadyCallback     callback,
+                                      gpointer                user_data)
+{
+  g_autoptr(GTask) task = NULL;
+  AsyncOpData *data;
+
+  task = async_op_new (self, flatpak_installation_uninstall_async,
+                       progress, progress_data,
+                       cancellable, callback, user_data, &data);
+  data->kind = kind;
+  data->name = g_strdup (name);
+  data->arch = g_strdup (arch);
+  data->branch = g_strdup (branch);
+  g_task_run_in_thread (task, uninstall_thread);
+}
+
+/**
+ * flatpak_installation_uninstall_finish:
+ * @self: a #FlatpakInstallation
+ * @result: the #GAsyncResult passed to the callback
+ * @error: return location for a #GError
+ *
+ * Finishes a call to flatpak_installation_uninstall_async().
+ *
+ * Returns: %TRUE on success
+ */
+gboolean
+flatpak_installation_uninstall_finish (FlatpakInstallation *self,
+                                       GAsyncResult        *result,
+                                       GError             **error)
+{
+  g_return_val_if_fail (g_task_is_valid (result, self), FALSE);
+
+  return g_task_propagate_boolean (G_TASK (result), error);
+}
+
+static void
+list_installed_refs_for_update_thread (GTask        *task,
+                                       gpointer      source_object,
+                                       gpointer      task_data,
+                                       GCancellable *cancellable)
+{
+  GError *error = NULL;
+  GPtrArray *refs;
+
+  refs = flatpak_installation_list_installed_refs_for_update (source_object,
+                                                              cancellable, &error);
+  return_array_or_error (task, refs, error);
+}
+
+/**
+ * flatpak_installation_list_installed_refs_for_update_async:
+ * @self: a #FlatpakInstallation
+ * @cancellable: (nullable): a #GCancellable
+ * @callback: the function to call when the request is done
+ * @user_data: data to pass to @callback
+ *
+ * Asynchronous version of flatpak_installation_list_installed_refs_for_update().
+ */
+void
+flatpak_installation_list_installed_refs_for_update_async (FlatpakInstallation *self,
+                                                           GCancellable        *cancellable,
+                                                           GAsyncReadyCallback  callback,
+                                                           gpointer             user_data)
+{
+  g_autoptr(GTask) task = NULL;
+  AsyncOpData *data;
+
+  task = async_op_new (self, flatpak_installation_list_installed_refs_for_update_async,
+                       NULL, NULL, cancellable, callback, user_data, &data);
+  g_task_run_in_thread (task, list_installed_refs_for_update_thread);
+}
+
+/**
+ * flatpak_installation_list_installed_refs_for_update_finish:
+ * @self: a #FlatpakInstallation
+ * @result: the #GAsyncResult passed to the callback
+ * @error: return location for a #GError
+ *
+ * Finishes a call to flatpak_installation_list_installed_refs_for_update_async().
+ *
+ * Returns: (transfer container) (element-type FlatpakInstalledRef): a GPtrArray of
+ *   #FlatpakInstalledRef instances, or %NULL on error
+ */
+GPtrArray *
+flatpak_installation_list_installed_refs_for_update_finish (FlatpakInstallation *self,
+                                                            GAsyncResult        *result,
+                                                            GError             **error)
+{
+  g_return_val_if_fail (g_task_is_valid (result, self), NULL);
+
+  return g_task_propagate_pointer (G_TASK (result), error);
+}
+
+static void
+list_remote_refs_thread (GTask        *task,
+                         gpointer      source_object,
+                         gpointer      task_data,
+                         GCancellable *cancellable)
+{
+  AsyncOpData *data = task_data;
+  GError *error = NULL;
+  GPtrArray *refs;
+
+  refs = flatpak_installation_list_remote_refs_sync (source_object, data->remote_name,
+                                                     cancellable, &error);
+  return_array_or_error (task, refs, error);
+}
+
+/**
+ * flatpak_installation_list_remote_refs_async:
+ * @self: a #FlatpakInstallation
+ * @remote_name: the name of the remote
+ * @cancellable: (nullable): a #GCancellable
+ * @callback: the function to call when the request is done
+ * @user_data: data to pass to @callback
+ *
+ * Asynchronous version of flatpak_installation_list_remote_refs_sync().
+ */
+void
+flatpak_installation_list_remote_refs_async (FlatpakInstallation *self,
+                                             const char          *remote_name,
+                                             GCancellable        *cancellable,
+                                             GAsyncReadyCallback  callback,
+                                             gpointer             user_data)
+{
+  g_autoptr(GTask) task = NULL;
+  AsyncOpData *data;
+
+  task = async_op_new (self, flatpak_installation_list_remote_refs_async,
+                       NULL, NULL, cancellable, callback, user_data, &data);
+  data->remote_name = g_strdup (remote_name);
+  g_task_run_in_thread (task, list_remote_refs_thread);
+}
+
+/**
+ * flatpak_installation_list_remote_refs_finish:
+ * @self: a #FlatpakInstallation
+ * @result: the #GAsyncResult passed to the callback
+ * @error: return location for a #GError
+ *
+ * Finishes a call to flatpak_installation_list_remote_refs_async().
+ *
+ * Returns: (transfer container) (element-type FlatpakRemoteRef): a GPtrArray of
+ *   #FlatpakRemoteRef instances, or %NULL on error
+ */
+GPtrArray *
+flatpak_installation_list_remote_refs_finish (FlatpakInstallation *self,
+                                              GAsyncResult        *result,
+                                              GError             **error)
+{
+  g_return_val_if_fail (g_task_is_valid (result, self), NULL);
+
+  return g_task_propagate_pointer (G_TASK (result), error);
+}
+
+static void
+fetch_remote_ref_thread (GTask        *task,
+                         gpointer      source_object,
+                         gpointer      task_data,
+                         GCancellable *cancellable)
+{
+  AsyncOpData *data = task_data;
+  GError *error = NULL;
+  FlatpakRemoteRef *ref;
+
+  ref = flatpak_installation_fetch_remote_ref_sync (source_object, data->remote_name,
+                                                    data->kind, data->name,
+                                                    data->arch, data->branch,
+                                                    cancellable, &error);
+  return_object_or_error (task, ref, error);
+}
+
+/**
+ * flatpak_installation_fetch_remote_ref_async:
+ * @self: a #FlatpakInstallation
+ * @remote_name: the name of the remote
+ * @kind: what this ref contains (an #FlatpakRefKind)
+ * @name: name of the app/runtime to fetch
+ * @arch: (nullable): which architecture to fetch (default: current architecture)
+ * @branch: (nullable): which branch to fetch (default: 'master')
+ * @cancellable: (nullable): a #GCancellable
+ * @callback: the function to call when the request is done
+ * @user_data: data to pass to @callback
+ *
+ * Asynchronous version of flatpak_installation_fetch_remote_ref_sync().
+ */
+void
+flatpak_installation_fetch_remote_ref_async (FlatpakInstallation *self,
+                                             const char          *remote_name,
+                                             FlatpakRefKind       kind,
+                                             const char          *name,
+                                             const char          *arch,
+                                             const char          *branch,
+                                             GCancellable        *cancellable,
+                                             GAsyncReadyCallback  callback,
+                                             gpointer             user_data)
+{
+  g_autoptr(GTask) task = NULL;
+  AsyncOpData *data;
+
+  task = async_op_new (self, flatpak_installation_fetch_remote_ref_async,
+                       NULL, NULL, cancellable, callback, user_data, &data);
+  data->remote_name = g_strdup (remote_name);
+  data->kind = kind;
+  data->name = g_strdup (name);
+  data->arch = g_strdup (arch);
+  data->branch = g_strdup (branch);
+  g_task_run_in_thread (task, fetch_remote_ref_thread);
+}
+
+/**
+ * flatpak_installation_fetch_remote_ref_finish:
+ * @self: a #FlatpakInstallation
+ * @result: the #GAsyncResult passed to the callback
+ * @error: return location for a #GError
+ *
+ * Finishes a call to flatpak_installation_fetch_remote_ref_async().
+ *
+ * Returns: (transfer full): a #FlatpakRemoteRef instance, or %NULL
+ */
+FlatpakRemoteRef *
+flatpak_installation_fetch_remote_ref_finish (FlatpakInstallation *self,
+                                              GAsyncResult        *result,
+                                              GError             **error)
+{
+  g_return_val_if_fail (g_task_is_valid (result, self), NULL);
+
+  return g_task_propagate_pointer (G_TASK (result), error);
+}
+
+static void
+fetch_remote_size_thread (GTask        *task,
+                          gpointer      source_object,
+                          gpointer      task_data,
+                          GCancellable *cancellable)
+{
+  AsyncOpData *data = task_data;
+  GError *error = NULL;
+  gboolean res;
+
+  res = flatpak_installation_fetch_remote_size_sync (source_object, data->remote_name,
+                                                     data->ref,
+                                                     &data->download_size,
+                                                     &data->installed_size,
+                                                     cancellable, &error);
+  return_boolean_or_error (task, res, error);
+}
+
+/**
+ * flatpak_installation_fetch_remote_size_async:
+ * @self: a #FlatpakInstallation
+ * @remote_name: the name of the remote
+ * @ref: the ref
+ * @cancellable: (nullable): a #GCancellable
+ * @callback: the function to call when the request is done
+ * @user_data: data to pass to @callback
+ *
+ * Asynchronous version of flatpak_installation_fetch_remote_size_sync().
+ */
+void
+flatpak_installation_fetch_remote_size_async (FlatpakInstallation *self,
+                                              const char          *remote_name,
+                                              FlatpakRef          *ref,
+                                              GCancellable        *cancellable,
+                                              GAsyncReadyCallback  callback,
+                                              gpointer             user_data)
+{
+  g_autoptr(GTask) task = NULL;
+  AsyncOpData *data;
+
+  task = async_op_new (self, flatpak_installation_fetch_remote_size_async,
+                       NULL, NULL, cancellable, callback, user_data, &data);
+  data->remote_name = g_strdup (remote_name);
+  data->ref = g_object_ref (ref);
+  g_task_run_in_thread (task, fetch_remote_size_thread);
+}
+
+/**
+ * flatpak_installation_fetch_remote_size_finish:
+ * @self: a #FlatpakInstallation
+ * @result: the #GAsyncResult passed to the callback
+ * @download_size: (out): return location for the (maximum) download size
+ * @installed_size: (out): return location for the installed size
+ * @error: return location for a #GError
+ *
+ * Finishes a call to flatpak_installation_fetch_remote_size_async().
+ *
+ * Returns: %TRUE, unless an error occurred
+ */
+gboolean
+flatpak_installation_fetch_remote_size_finish (FlatpakInstallation *self,
+                                               GAsyncResult        *result,
+                                               guint64             *download_size,
+                                               guint64             *installed_size,
+                                               GError             **error)
+{
+  AsyncOpData *data;
+
+  g_return_val_if_fail (g_task_is_valid (result, self), FALSE);
+
+  if (!g_task_propagate_boolean (G_TASK (result), error))
+    return FALSE;
+
+  data = g_task_get_task_data (G_TASK (result));
+  if (download_size)
+    *download_size = data->download_size;
+  if (installed_size)
+    *installed_size = data->installed_size;
+
+  return TRUE;
+}
+
+static void
+fetch_remote_metadata_thread (GTask        *task,
+                              gpointer      source_object,
+                              gpointer      task_data,
+                              GCancellable *cancellable)
+{
+  AsyncOpData *data = task_data;
+  GError *error = NULL;
+  GBytes *metadata;
+
+  metadata = flatpak_installation_fetch_remote_metadata_sync (source_object, data->remote_name,
+                                                              data->ref,
+                                                              cancellable, &error);
+  if (metadata == NULL)
+    g_task_return_error (task, error);
+  else
+    g_task_return_pointer (task, metadata, (GDestroyNotify) g_bytes_unref);
+}
+
+/**
+ * flatpak_installation_fetch_remote_metadata_async:
+ * @self: a #FlatpakInstallation
+ * @remote_name: the name of the remote
+ * @ref: the ref
+ * @cancellable: (nullable): a #GCancellable
+ * @callback: the function to call when the request is done
+ * @user_data: data to pass to @callback
+ *
+ * Asynchronous version of flatpak_installation_fetch_remote_metadata_sync().
+ */
+void
+flatpak_installation_fetch_remote_metadata_async (FlatpakInstallation *self,
+                                                  const char          *remote_name,
+                                                  FlatpakRef          *ref,
+                                                  GCancellable        *cancellable,
+                                                  GAsyncReadyCallback  callback,
+                                                  gpointer             user_data)
+{
+  g_autoptr(GTask) task = NULL;
+  AsyncOpData *data;
+
+  task = async_op_new (self, flatpak_installation_fetch_remote_metadata_async,
+                       NULL, NULL, cancellable, callback, user_data, &data);
+  data->remote_name = g_strdup (remote_name);
+  data->ref = g_object_ref (ref);
+  g_task_run_in_thread (task, fetch_remote_metadata_thread);
+}
+
+/**
+ * flatpak_installation_fetch_remote_metadata_finish:
+ * @self: a #FlatpakInstallation
+ * @result: the #GAsyncResult passed to the callback
+ * @error: return location for a #GError
+ *
+ * Finishes a call to flatpak_installation_fetch_remote_metadata_async().
+ *
+ * Returns: (transfer full): a #GBytes containing the flatpak metadata file,
+ *   or %NULL if an error occurred
+ */
+GBytes *
+flatpak_installation_fetch_remote_metadata_finish (FlatpakInstallation *self,
+                                                   GAsyncResult        *result,
+                                                   GError             **error)
+{
+  g_return_val_if_fail (g_task_is_valid (result, self), NULL);
+
+  return g_task_propagate_pointer (G_TASK (result), error);
+}
+
+static void
+fetch_remote_refs_info_thread (GTask        *task,
+                               gpointer      source_object,
+                               gpointer      task_data,
+                               GCancellable *cancellable)
+{
+  AsyncOpData *data = task_data;
+  GError *error = NULL;
+  GPtrArray *refs;
+
+  refs = fetch_remote_refs_info (source_object, data->remote_name,
+                                 (const char * const *) data->full_refs,
+                                 cancellable, &error);
+  return_array_or_error (task, refs, error);
+}
+
+/**
+ * flatpak_installation_fetch_remote_refs_info_async:
+ * @self: a #FlatpakInstallation
+ * @remote_name: the name of the remote
+ * @refs: (element-type FlatpakRef): the refs to look up
+ * @cancellable: (nullable): a #GCancellable
+ * @callback: the function to call when the request is done
+ * @user_data: data to pass to @callback
+ *
+ * Asynchronous version of flatpak_installation_fetch_remote_refs_info_sync().
+ */
+void
+flatpak_installation_fetch_remote_refs_info_async (FlatpakInstallation *self,
+                                                   const char          *remote_name,
+                                                   GPtrArray           *refs,
+                                                   GCancellable        *cancellable,
+                                                   GAsyncReadyCallback  callback,
+                                                   gpointer             user_data)
+{
+  g_autoptr(GTask) task = NULL;
+  AsyncOpData *data;
+
+  task = async_op_new (self, flatpak_installation_fetch_remote_refs_info_async,
+                       NULL, NULL, cancellable, callback, user_data, &data);
+  data->remote_name = g_strdup (remote_name);
+  data->full_refs = format_refs (refs);
+  g_task_run_in_thread (task, fetch_remote_refs_info_thread);
+}
+
+/**
+ * flatpak_installation_fetch_remote_refs_info_finish:
+ * @self: a #FlatpakInstallation
+ * @result: the #GAsyncResult passed to the callback
+ * @error: return location for a #GError
+ *
+ * Finishes a call to flatpak_installation_fetch_remote_refs_info_async().
+ *
+ * Returns: (transfer container) (element-type FlatpakRemoteRef): a GPtrArray of
+ *   #FlatpakRemoteRef instances, or %NULL if an error occurred
+ */
+GPtrArray *
+flatpak_installation_fetch_remote_refs_info_finish (FlatpakInstallation *self,
+                                                    GAsyncResult        *result,
+                                                    GError             **error)
+{
+  g_return_val_if_fail (g_task_is_valid (result, self), NULL);
+
+  return g_task_propagate_pointer (G_TASK (result), error);
+}
+
+static void
+update_appstream_thread (GTask        *task,
+                         gpointer      source_object,
+                         gpointer      task_data,
+                         GCancellable *cancellable)
+{
+  AsyncOpData *data = task_data;
+  GError *error = NULL;
+  gboolean res;
+
+  res = flatpak_installation_update_appstream_sync (source_object, data->remote_name,
+                                                    data->arch, &data->changed,
+                                                    cancellable, &error);
+  return_boolean_or_error (task, res, error);
+}
+
+/**
+ * flatpak_installation_update_appstream_async:
+ * @self: a #FlatpakInstallation
+ * @remote_name: the name of the remote
+ * @arch: Architecture to update, or %NULL for the local machine arch
+ * @cancellable: (nullable): a #GCancellable
+ * @callback: the function to call when the request is done
+ * @user_data: data to pass to @callback
+ *
+ * Asynchronous version of flatpak_installation_update_appstream_sync().
+ */
+void
+flatpak_installation_update_appstream_async (FlatpakInstallation *self,
+                                             const char          *remote_name,
+                                             const char          *arch,
+                                             GCancellable        *cancellable,
+                                             GAsyncReadyCallback  callback,
+                                             gpointer             user_data)
+{
+  g_autoptr(GTask) task = NULL;
+  AsyncOpData *data;
+
+  task = async_op_new (self, flatpak_installation_update_appstream_async,
+                       NULL, NULL, cancellable, callback, user_data, &data);
+  data->remote_name = g_strdup (remote_name);
+  data->arch = g_strdup (arch);
+  g_task_run_in_thread (task, update_appstream_thread);
+}
+
+/**
+ * flatpak_installation_update_appstream_finish:
+ * @self: a #FlatpakInstallation
+ * @result: the #GAsyncResult passed to the callback
+ * @out_changed: (nullable): Set to %TRUE if the contents of the appstream changed, %FALSE if nothing changed
+ * @error: return location for a #GError
+ *
+ * Finishes a call to flatpak_installation_update_appstream_async().
+ *
+ * Returns: %TRUE on success, or %FALSE on error
+ */
+gboolean
+flatpak_installation_update_appstream_finish (FlatpakInstallation *self,
+                                              GAsyncResult        *result,
+                                              gboolean            *out_changed,
+                                              GError             **error)
+{
+  AsyncOpData *data;
+
+  g_return_val_if_fail (g_task_is_valid (result, self), FALSE);
+
+  if (!g_task_propagate_boolean (G_TASK (result), error))
+    return FALSE;
+
+  data = g_task_get_task_data (G_TASK (result));
+  if (out_changed)
+    *out_changed = data->changed;
+
+  return TRUE;
+}
@@ -110,6 +110,14 @@ FLATPAK_EXTERN gboolean             flatpak_installation_launch (FlatpakInstalla
 FLATPAK_EXTERN GFileMonitor        *flatpak_installation_create_monitor (FlatpakInstallation *self,
                                                                          GCancellable        *cancellable,
                                                                          GError             **error);
+FLATPAK_EXTERN GPtrArray           *flatpak_installation_list_changes_sync (FlatpakInstallation *self,
+                                                                            guint64              since,
+                                                                            guint64             *out_cursor,
+                                                                            GCancellable        *cancellable,
+                                                                            GError             **error);
+FLATPAK_EXTERN GPtrArray           *flatpak_installation_list_instances_sync (FlatpakInstallation *self,
+                                                                              GCancellable        *cancellable,
+                                                                              GError             **error);
 FLATPAK_EXTERN GPtrArray           *flatpak_installation_list_installed_refs (FlatpakInstallation *self,
                                                                               GCancellable        *cancellable,
                                                                               GError             **error);
@@ -198,6 +206,11 @@ FLATPAK_EXTERN GBytes        *   flatpak_installation_fetch_remote_metadata_sync
                                                                                   FlatpakRef          *ref,
                                                                                   GCancellable        *cancellable,
                                                                                   GError             **error);
+FLATPAK_EXTERN GPtrArray    *    flatpak_installation_fetch_remote_refs_info_sync (FlatpakInstallation *self,
+                                                                                   const char          *remote_name,
+                                                                                   GPtrArray           *refs,
+                                                                                   GCancellable        *cancellable,
+                                                                                   GError             **error);
 FLATPAK_EXTERN GPtrArray    *    flatpak_installation_list_remote_refs_sync (FlatpakInstallation *self,
                                                                              const char          *remote_name,
                                                                              GCancellable        *cancellable,
@@ -217,4 +230,122 @@ FLATPAK_EXTERN gboolean          flatpak_installation_update_appstream_sync (Fla
                                                                              GCancellable        *cancellable,
                                                                              GError             **error);
 
+FLATPAK_EXTERN void                  flatpak_installation_install_async (FlatpakInstallation    *self,
+                                                                         const char             *remote_name,
+                                                                         FlatpakRefKind          kind,
+                                                                         const char             *name,
+                                                                         const char             *arch,
+                                                                         const char             *branch,
+                                                                         FlatpakProgressCallback progress,
+                                                                         gpointer                progress_data,
+                                                                         GCancellable           *cancellable,
+                                                                         GAsyncReadyCallback     callback,
+                                                                         gpointer                user_data);
+FLATPAK_EXTERN FlatpakInstalledRef * flatpak_installation_install_finish (FlatpakInstallation *self,
+                                                                          GAsyncResult        *result,
+                                                                          GError             **error);
+FLATPAK_EXTERN void                  flatpak_installation_update_async (FlatpakInstallation    *self,
+                                                                        FlatpakUpdateFlags      flags,
+                                                                        FlatpakRefKind          kind,
+                                                                        const char             *name,
+                                                                        const char             *arch,
+                                                                        const char             *branch,
+                                                                        FlatpakProgressCallback progress,
+                                                                        gpointer                progress_data,
+                                                                        GCancellable           *cancellable,
+                                                                        GAsyncReadyCallback     callback,
+                                                                        gpointer                user_data);
+FLATPAK_EXTERN FlatpakInstalledRef * flatpak_installation_update_finish (FlatpakInstallation *self,
+                                                                         GAsyncResult        *result,
+                                                                         GError             **error);
+FLATPAK_EXTERN void                  flatpak_installation_install_bundle_async (FlatpakInstallation    *self,
+                                                                                GFile                  *file,
+                                                                                FlatpakProgressCallback progress,
+                                                                                gpointer                progress_data,
+                                                                                GCancellable           *cancellable,
+                                                                                GAsyncReadyCallback     callback,
+                                                                                gpointer                user_data);
+FLATPAK_EXTERN FlatpakInstalledRef * flatpak_installation_install_bundle_finish (FlatpakInstallation *self,
+                                                                                 GAsyncResult        *result,
+                                                                                 GError             **error);
+FLATPAK_EXTERN void                  flatpak_installation_uninstall_async (FlatpakInstallation    *self,
+                                                                           FlatpakRefKind          kind,
+                                                                           const char             *name,
+                                                                           const char             *arch,
+                                                                           const char             *branch,
+                                                                           FlatpakProgressCallback progress,
+                                                                           gpointer                progress_data,
+                                                                           GCancellable           *cancellable,
+                                                                           GAsyncReadyCallback     callback,
+                                                                           gpointer                user_data);
+FLATPAK_EXTERN gboolean              flatpak_installation_uninstall_finish (FlatpakInstallation *self,
+                                                                            GAsyncResult        *result,
+                                                                            GError             **error);
+FLATPAK_EXTERN void                  flatpak_installation_list_installed_refs_for_update_async (FlatpakInstallation *self,
+                                                                                                GCancellable        *cancellable,
+                                                                                                GAsyncReadyCallback  callback,
+                                                                                                gpointer             user_data);
+FLATPAK_EXTERN GPtrArray           * flatpak_installation_list_installed_refs_for_update_finish (FlatpakInstallation *self,
+                                                                                                 GAsyncResult        *result,
+                                                                                                 GError             **error);
+FLATPAK_EXTERN void                  flatpak_installation_list_remote_refs_async (FlatpakInstallation *self,
+                                                                                  const char          *remote_name,
+                                                                                  GCancellable        *cancellable,
+                                                                                  GAsyncReadyCallback  callback,
+                                                                                  gpointer             user_data);
+FLATPAK_EXTERN GPtrArray           * flatpak_installation_list_remote_refs_finish (FlatpakInstallation *self,
+                                                                                   GAsyncResult        *result,
+                                                                                   GError             **error);
+FLATPAK_EXTERN void                  flatpak_installation_fetch_remote_ref_async (FlatpakInstallation *self,
+                                                                                  const char          *remote_name,
+                                                                                  FlatpakRefKind       kind,
+                                                                                  const char          *name,
+                                                                                  const char          *arch,
+                                                                                  const char          *branch,
+                                                                                  GCancellable        *cancellable,
+                                                                                  GAsyncReadyCallback  callback,
+                                                                                  gpointer             user_data);
+FLATPAK_EXTERN FlatpakRemoteRef    * flatpak_installation_fetch_remote_ref_finish (FlatpakInstallation *self,
+                                                                                   GAsyncResult        *result,
+                                                                                   GError             **error);
+FLATPAK_EXTERN void                  flatpak_installation_fetch_remote_size_async (FlatpakInstallation *self,
+                                                                                   const char          *remote_name,
+                                                                                   FlatpakRef          *ref,
+                                                                                   GCancellable        *cancellable,
+                                                                                   GAsyncReadyCallback  callback,
+                                                                                   gpointer             user_data);
+FLATPAK_EXTERN gboolean              flatpak_installation_fetch_remote_size_finish (FlatpakInstallation *self,
+                                                                                    GAsyncResult        *result,
+                                                                                    guint64             *download_size,
+                                                                                    guint64             *installed_size,
+                                                                                    GError             **error);
+FLATPAK_EXTERN void                  flatpak_installation_fetch_remote_metadata_async (FlatpakInstallation *self,
+                                                                                       const char          *remote_name,
+                                                                                       FlatpakRef          *ref,
+                                                                                       GCancellable        *cancellable,
+                                                                                       GAsyncReadyCallback  callback,
+                                                                                       gpointer             user_data);
+FLATPAK_EXTERN GBytes              * flatpak_installation_fetch_remote_metadata_finish (FlatpakInstallation *self,
+                                                                                        GAsyncResult        *result,
+                                                                                        GError             **error);
+FLATPAK_EXTERN void                  flatpak_installation_fetch_remote_refs_info_async (FlatpakInstallation *self,
+                                                                                        const char          *remote_name,
+                                                                                        GPtrArray           *refs,
+                                                                                        GCancellable        *cancellable,
+                                                                                        GAsyncReadyCallback  callback,
+                                                                                        gpointer             user_data);
+FLATPAK_EXTERN GPtrArray           * flatpak_installation_fetch_remote_refs_info_finish (FlatpakInstallation *self,
+                                                                                         GAsyncResult        *result,
+                                                                                         GError             **error);
+FLATPAK_EXTERN void                  flatpak_installation_update_appstream_async (FlatpakInstallation *self,
+                                                                                  const char          *remote_name,
+                                                                                  const char          *arch,
+                                                                                  GCancellable        *cancellable,
+                                                                                  GAsyncReadyCallback  callback,
+                                                                                  gpointer             user_data);
+FLATPAK_EXTERN gboolean              flatpak_installation_update_appstream_finish (FlatpakInstallation *self,
+                                                                                   GAsyncResult        *result,
+                                                                                   gboolean            *out_changed,
+                                                                                   GError             **error);
+
 #endif /* __FLATPAK_INSTALLATION_H__ */
@@ -0,0 +1,438 @@
+/*
+ * Copyright © 2016 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "flatpak-utils.h"
+#include "flatpak-instance-private.h"
+
+/**
+ * SECTION:flatpak-instance
+ * @Title: FlatpakInstance
+ * @Short_description: Running application
+ *
+ * A FlatpakInstance refers to a sandbox started by flatpak run that was
+ * running when it was listed with flatpak_installation_list_instances_sync().
+ * Besides what was launched and when, it has the resource usage of the
+ * cgroup of the sandbox at the time it was listed.
+ *
+ * The usage counters come from the cgroup that the sandbox runs in, which
+ * is its own systemd scope if one was available at launch. Counters that
+ * the cgroup controllers of the system don't provide are 0.
+ */
+
+typedef struct _FlatpakInstancePrivate FlatpakInstancePrivate;
+
+struct _FlatpakInstancePrivate
+{
+  FlatpakSandbox     *sandbox;
+  FlatpakSandboxUsage usage;
+};
+
+G_DEFINE_TYPE_WITH_PRIVATE (FlatpakInstance, flatpak_instance, G_TYPE_OBJECT)
+
+enum {
+  PROP_0,
+
+  PROP_ID,
+  PROP_APP,
+  PROP_REF,
+  PROP_COMMIT,
+  PROP_RUNTIME,
+  PROP_SCOPE,
+  PROP_PID,
+  PROP_LAUNCH_TIME,
+};
+
+static void
+flatpak_instance_finalize (GObject *object)
+{
+  FlatpakInstance *self = FLATPAK_INSTANCE (object);
+  FlatpakInstancePrivate *priv = flatpak_instance_get_instance_private (self);
+
+  flatpak_sandbox_free (priv->sandbox);
+
+  G_OBJECT_CLASS (flatpak_instance_parent_class)->finalize (object);
+}
+
+static void
+flatpak_instance_get_property (GObject    *object,
+                               guint       prop_id,
+                               GValue     *value,
+                               GParamSpec *pspec)
+{
+  FlatpakInstance *self = FLATPAK_INSTANCE (object);
+  FlatpakInstancePrivate *priv = flatpak_instance_get_instance_private (self);
+
+  switch (prop_id)
+    {
+    case PROP_ID:
+      g_value_set_string (value, priv->sandbox->id);
+      break;
+
+    case PROP_APP:
+      g_value_set_string (value, priv->sandbox->app);
+      break;
+
+    case PROP_REF:
+      g_value_set_string (value, priv->sandbox->app_ref);
+      break;
+
+    case PROP_COMMIT:
+      g_value_set_string (value, priv->sandbox->commit);
+      break;
+
+    case PROP_RUNTIME:
+      g_value_set_string (value, priv->sandbox->runtime_ref);
+      break;
+
+    case PROP_SCOPE:
+      g_value_set_string (value, priv->sandbox->scope);
+      break;
+
+    case PROP_PID:
+      g_value_set_int (value, priv->sandbox->pid);
+      break;
+
+    case PROP_LAUNCH_TIME:
+      g_value_set_int64 (value, priv->sandbox->launch_time);
+      break;
+
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
+    }
+}
+
+static void
+flatpak_instance_class_init (FlatpakInstanceClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->get_property = flatpak_instance_get_property;
+  object_class->finalize = flatpak_instance_finalize;
+
+  g_object_class_install_property (object_class,
+                                   PROP_ID,
+                                   g_param_spec_string ("id",
+                                                        "Id",
+                                                        "The instance id",
+                                                        NULL,
+                                                        G_PARAM_READABLE));
+  g_object_class_install_property (object_class,
+                                   PROP_APP,
+                                   g_param_spec_string ("app",
+                                                        "App",
+                                                        "The application id",
+                                                        NULL,
+                                                        G_PARAM_READABLE));
+  g_object_class_install_property (object_class,
+                                   PROP_REF,
+                                   g_param_spec_string ("ref",
+                                                        "Ref",
+                                                        "The full ref of the application",
+                                                        NULL,
+                                                        G_PARAM_READABLE));
+  g_object_class_install_property (object_class,
+                                   PROP_COMMIT,
+                                   g_param_spec_string ("commit",
+                                                        "Commit",
+                                                        "The commit of the application",
+                                                        NULL,
+                                                        G_PARAM_READABLE));
+  g_object_class_install_property (object_class,
+                                   PROP_RUNTIME,
+                                   g_param_spec_string ("runtime",
+                                                        "Runtime",
+                                                        "The full ref of the runtime",
+                                                        NULL,
+                                                        G_PARAM_READABLE));
+  g_object_class_install_property (object_class,
+                                   PROP_SCOPE,
+                                   g_param_spec_string ("scope",
+                                                        "Scope",
+                                                        "The systemd scope of the sandbox",
+                                                        NULL,
+                                                        G_PARAM_READABLE));
+  g_object_class_install_property (object_class,
+                                   PROP_PID,
+                                   g_param_spec_int ("pid",
+                                                     "Pid",
+                                                     "The pid of the bwrap process",
+                                                     0, G_MAXINT, 0,
+                                                     G_PARAM_READABLE));
+  g_object_class_install_property (object_class,
+                                   PROP_LAUNCH_TIME,
+                                   g_param_spec_int64 ("launch-time",
+                                                       "Launch time",
+                                                       "When the sandbox was started, in seconds since the epoch",
+                                                       0, G_MAXINT64, 0,
+                                                       G_PARAM_READABLE));
+}
+
+static void
+flatpak_instance_init (FlatpakInstance *self)
+{
+}
+
+/**
+ * flatpak_instance_get_id:
+ * @self: a #FlatpakInstance
+ *
+ * Gets the instance id, which identifies the sandbox among all running
+ * sandboxes of the user. It can be passed to flatpak enter.
+ *
+ * Returns: (transfer none): the instance id
+ */
+const char *
+flatpak_instance_get_id (FlatpakInstance *self)
+{
+  FlatpakInstancePrivate *priv = flatpak_instance_get_instance_private (self);
+
+  return priv->sandbox->id;
+}
+
+/**
+ * flatpak_instance_get_app:
+ * @self: a #FlatpakInstance
+ *
+ * Gets the id of the application running in the sandbox.
+ *
+ * Returns: (transfer none): the application id
+ */
+const char *
+flatpak_instance_get_app (FlatpakInstance *self)
+{
+  FlatpakInstancePrivate *priv = flatpak_instance_get_instance_private (self);
+
+  return priv->sandbox->app;
+}
+
+/**
+ * flatpak_instance_get_ref:
+ * @self: a #FlatpakInstance
+ *
+ * Gets the full ref of the application, such as
+ * app/org.gnome.gedit/x86_64/stable.
+ *
+ * Returns: (transfer none): the ref
+ */
+const char *
+flatpak_instance_get_ref (FlatpakInstance *self)
+{
+  FlatpakInstancePrivate *priv = flatpak_instance_get_instance_private (self);
+
+  return priv->sandbox->app_ref;
+}
+
+/**
+ * flatpak_instance_get_commit:
+ * @self: a #FlatpakInstance
+ *
+ * Gets the commit of the application that was launched. This may differ
+ * from the installed commit if the application was updated since.
+ *
+ * Returns: (transfer none) (nullable): the commit
+ */
+const char *
+flatpak_instance_get_commit (FlatpakInstance *self)
+{
+  FlatpakInstancePrivate *priv = flatpak_instance_get_instance_private (self);
+
+  return priv->sandbox->commit;
+}
+
+/**
+ * flatpak_instance_get_runtime:
+ * @self: a #FlatpakInstance
+ *
+ * Gets the full ref of the runtime the application runs with.
+ *
+ * Returns: (transfer none) (nullable): the runtime ref
+ */
+const char *
+flatpak_instance_get_runtime (FlatpakInstance *self)
+{
+  FlatpakInstancePrivate *priv = flatpak_instance_get_instance_private (self);
+
+  return priv->sandbox->runtime_ref;
+}
+
+/**
+ * flatpak_instance_get_scope:
+ * @self: a #FlatpakInstance
+ *
+ * Gets the name of the systemd scope the sandbox was started in.
+ *
+ * Returns: (transfer none) (nullable): the scope, or %NULL if the sandbox
+ *   is not in a scope of its own
+ */
+const char *
+flatpak_instance_get_scope (FlatpakInstance *self)
+{
+  FlatpakInstancePrivate *priv = flatpak_instance_get_instance_private (self);
+
+  return priv->sandbox->scope;
+}
+
+/**
+ * flatpak_instance_get_pid:
+ * @self: a #FlatpakInstance
+ *
+ * Gets the pid of the bwrap process that set up the sandbox. It runs
+ * outside the sandbox for as long as the sandbox exists.
+ *
+ * Returns: the pid
+ */
+int
+flatpak_instance_get_pid (FlatpakInstance *self)
+{
+  FlatpakInstancePrivate *priv = flatpak_instance_get_instance_private (self);
+
+  return priv->sandbox->pid;
+}
+
+/**
+ * flatpak_instance_get_child_pid:
+ * @self: a #FlatpakInstance
+ *
+ * Gets the pid of the first process inside the sandbox, as seen from
+ * outside of it. This is looked up each time it is called.
+ *
+ * Returns: the pid, or 0 if the sandbox is gone
+ */
+int
+flatpak_instance_get_child_pid (FlatpakInstance *self)
+{
+  FlatpakInstancePrivate *priv = flatpak_instance_get_instance_private (self);
+
+  if (!flatpak_sandbox_is_running (priv->sandbox))
+    return 0;
+
+  return flatpak_sandbox_get_child_pid (priv->sandbox);
+}
+
+/**
+ * flatpak_instance_get_launch_time:
+ * @self: a #FlatpakInstance
+ *
+ * Gets the time the sandbox was started.
+ *
+ * Returns: the launch time, in seconds since the epoch
+ */
+gint64
+flatpak_instance_get_launch_time (FlatpakInstance *self)
+{
+  FlatpakInstancePrivate *priv = flatpak_instance_get_instance_private (self);
+
+  return priv->sandbox->launch_time;
+}
+
+/**
+ * flatpak_instance_is_running:
+ * @self: a #FlatpakInstance
+ *
+ * Checks whether the sandbox is still running.
+ *
+ * Returns: %TRUE if the sandbox is running
+ */
+gboolean
+flatpak_instance_is_running (FlatpakInstance *self)
+{
+  FlatpakInstancePrivate *priv = flatpak_instance_get_instance_private (self);
+
+  return flatpak_sandbox_is_running (priv->sandbox);
+}
+
+/**
+ * flatpak_instance_get_cpu_time:
+ * @self: a #FlatpakInstance
+ *
+ * Gets the CPU time used by the sandbox when it was listed.
+ *
+ * Returns: the CPU time in microseconds, or 0 if not available
+ */
+guint64
+flatpak_instance_get_cpu_time (FlatpakInstance *self)
+{
+  FlatpakInstancePrivate *priv = flatpak_instance_get_instance_private (self);
+
+  return priv->usage.cpu_usec;
+}
+
+/**
+ * flatpak_instance_get_memory_usage:
+ * @self: a #FlatpakInstance
+ *
+ * Gets the memory used by the sandbox when it was listed.
+ *
+ * Returns: the memory use in bytes, or 0 if not available
+ */
+guint64
+flatpak_instance_get_memory_usage (FlatpakInstance *self)
+{
+  FlatpakInstancePrivate *priv = flatpak_instance_get_instance_private (self);
+
+  return priv->usage.memory_bytes;
+}
+
+/**
+ * flatpak_instance_get_io_read_bytes:
+ * @self: a #FlatpakInstance
+ *
+ * Gets the number of bytes the sandbox had read from block devices when
+ * it was listed.
+ *
+ * Returns: the number of bytes, or 0 if not available
+ */
+guint64
+flatpak_instance_get_io_read_bytes (FlatpakInstance *self)
+{
+  FlatpakInstancePrivate *priv = flatpak_instance_get_instance_private (self);
+
+  return priv->usage.io_read_bytes;
+}
+
+/**
+ * flatpak_instance_get_io_write_bytes:
+ * @self: a #FlatpakInstance
+ *
+ * Gets the number of bytes the sandbox had written to block devices when
+ * it was listed.
+ *
+ * Returns: the number of bytes, or 0 if not available
+ */
+guint64
+flatpak_instance_get_io_write_bytes (FlatpakInstance *self)
+{
+  FlatpakInstancePrivate *priv = flatpak_instance_get_instance_private (self);
+
+  return priv->usage.io_write_bytes;
+}
+
+/* Takes ownership of the sandbox */
+FlatpakInstance *
+flatpak_instance_new (FlatpakSandbox *sandbox)
+{
+  FlatpakInstance *self = g_object_new (FLATPAK_TYPE_INSTANCE, NULL);
+  FlatpakInstancePrivate *priv = flatpak_instance_get_instance_private (self);
+
+  priv->sandbox = sandbox;
+  flatpak_sandbox_get_usage (sandbox, &priv->usage);
+
+  return self;
+}
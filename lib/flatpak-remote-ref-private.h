@@ -31,5 +31,7 @@
 FlatpakRemoteRef *flatpak_remote_ref_new (const char *full_ref,
                                           const char *commit,
                                           const char *remote_name);
+FlatpakRemoteRef *flatpak_remote_ref_new_from_info (FlatpakRemoteRefInfo *info,
+                                                    const char           *remote_name);
 
 #endif /* __FLATPAK_REMOTE_REF_PRIVATE_H__ */
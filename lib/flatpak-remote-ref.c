@@ -39,7 +39,10 @@ typedef struct _FlatpakRemoteRefPrivate FlatpakRemoteRefPrivate;
 
 struct _FlatpakRemoteRefPrivate
 {
-  char *remote_name;
+  char    *remote_name;
+  guint64  installed_size;
+  guint64  download_size;
+  GBytes  *metadata;
 };
 
 G_DEFINE_TYPE_WITH_PRIVATE (FlatpakRemoteRef, flatpak_remote_ref, FLATPAK_TYPE_REF)
@@ -48,6 +51,9 @@ enum {
   PROP_0,
 
   PROP_REMOTE_NAME,
+  PROP_INSTALLED_SIZE,
+  PROP_DOWNLOAD_SIZE,
+  PROP_METADATA,
 };
 
 static void
@@ -57,6 +63,8 @@ flatpak_remote_ref_finalize (GObject *object)
   FlatpakRemoteRefPrivate *priv = flatpak_remote_ref_get_instance_private (self);
 
   g_free (priv->remote_name);
+  if (priv->metadata)
+    g_bytes_unref (priv->metadata);
 
   G_OBJECT_CLASS (flatpak_remote_ref_parent_class)->finalize (object);
 }
@@ -77,6 +85,19 @@ flatpak_remote_ref_set_property (GObject      *object,
       priv->remote_name = g_value_dup_string (value);
       break;
 
+    case PROP_INSTALLED_SIZE:
+      priv->installed_size = g_value_get_uint64 (value);
+      break;
+
+    case PROP_DOWNLOAD_SIZE:
+      priv->download_size = g_value_get_uint64 (value);
+      break;
+
+    case PROP_METADATA:
+      g_clear_pointer (&priv->metadata, g_bytes_unref);
+      priv->metadata = g_value_dup_boxed (value);
+      break;
+
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
@@ -98,6 +119,18 @@ flatpak_remote_ref_get_property (GObject    *object,
       g_value_set_string (value, priv->remote_name);
       break;
 
+    case PROP_INSTALLED_SIZE:
+      g_value_set_uint64 (value, priv->installed_size);
+      break;
+
+    case PROP_DOWNLOAD_SIZE:
+      g_value_set_uint64 (value, priv->download_size);
+      break;
+
+    case PROP_METADATA:
+      g_value_set_boxed (value, priv->metadata);
+      break;
+
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
@@ -120,6 +153,27 @@ flatpak_remote_ref_class_init (FlatpakRemoteRefClass *klass)
                                                         "The name of the remote",
                                                         NULL,
                                                         G_PARAM_READWRITE));
+  g_object_class_install_property (object_class,
+                                   PROP_INSTALLED_SIZE,
+                                   g_param_spec_uint64 ("installed-size",
+                                                        "Installed Size",
+                                                        "The installed size of the ref",
+                                                        0, G_MAXUINT64, 0,
+                                                        G_PARAM_READWRITE));
+  g_object_class_install_property (object_class,
+                                   PROP_DOWNLOAD_SIZE,
+                                   g_param_spec_uint64 ("download-size",
+                                                        "Download Size",
+                                                        "The download size of the ref",
+                                                        0, G_MAXUINT64, 0,
+                                                        G_PARAM_READWRITE));
+  g_object_class_install_property (object_class,
+                                   PROP_METADATA,
+                                   g_param_spec_boxed ("metadata",
+                                                       "Metadata",
+                                                       "The metadata of the ref",
+                                                       G_TYPE_BYTES,
+                                                       G_PARAM_READWRITE));
 }
 
 static void
@@ -143,6 +197,55 @@ flatpak_remote_ref_get_remote_name (FlatpakRemoteRef *self)
   return priv->remote_name;
 }
 
+/**
+ * flatpak_remote_ref_get_installed_size:
+ * @self: a #FlatpakRemoteRef
+ *
+ * Returns the installed size of the ref, if known.
+ *
+ * Returns: the installed size, or 0 if not known
+ */
+guint64
+flatpak_remote_ref_get_installed_size (FlatpakRemoteRef *self)
+{
+  FlatpakRemoteRefPrivate *priv = flatpak_remote_ref_get_instance_private (self);
+
+  return priv->installed_size;
+}
+
+/**
+ * flatpak_remote_ref_get_download_size:
+ * @self: a #FlatpakRemoteRef
+ *
+ * Returns the download size of the ref, if known.
+ *
+ * Returns: the download size, or 0 if not known
+ */
+guint64
+flatpak_remote_ref_get_download_size (FlatpakRemoteRef *self)
+{
+  FlatpakRemoteRefPrivate *priv = flatpak_remote_ref_get_instance_private (self);
+
+  return priv->download_size;
+}
+
+/**
+ * flatpak_remote_ref_get_metadata:
+ * @self: a #FlatpakRemoteRef
+ *
+ * Returns the metadata of the ref, if it was loaded, for instance
+ * by flatpak_installation_fetch_remote_refs_info_sync().
+ *
+ * Returns: (transfer none) (nullable): a #GBytes, or %NULL
+ */
+GBytes *
+flatpak_remote_ref_get_metadata (FlatpakRemoteRef *self)
+{
+  FlatpakRemoteRefPrivate *priv = flatpak_remote_ref_get_instance_private (self);
+
+  return priv->metadata;
+}
+
 
 FlatpakRemoteRef *
 flatpak_remote_ref_new (const char *full_ref,
@@ -172,3 +275,22 @@ flatpak_remote_ref_new (const char *full_ref,
 
   return ref;
 }
+
+FlatpakRemoteRef *
+flatpak_remote_ref_new_from_info (FlatpakRemoteRefInfo *info,
+                                  const char           *remote_name)
+{
+  FlatpakRemoteRef *ref;
+
+  ref = flatpak_remote_ref_new (info->ref, info->commit, remote_name);
+  if (ref == NULL)
+    return NULL;
+
+  g_object_set (ref,
+                "installed-size", info->installed_size,
+                "download-size", info->download_size,
+                "metadata", info->metadata,
+                NULL);
+
+  return ref;
+}
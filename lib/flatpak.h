@@ -33,6 +33,8 @@
 #include <flatpak-remote-ref.h>
 #include <flatpak-bundle-ref.h>
 #include <flatpak-remote.h>
+#include <flatpak-change.h>
+#include <flatpak-instance.h>
 #include <flatpak-installation.h>
 
 #undef __FLATPAK_H_INSIDE__
@@ -28,12 +28,19 @@
 #include "xdg-permission-store.h"
 #include "flatpak-utils.h"
 
+static char **opt_transient_tables;
+
+static GOptionEntry entries[] = {
+  { "transient-table", 0, 0, G_OPTION_ARG_STRING_ARRAY, &opt_transient_tables, "Keep TABLE in memory only, can be used multiple times", "TABLE" },
+  { NULL }
+};
+
 static void
 on_bus_acquired (GDBusConnection *connection,
                  const gchar     *name,
                  gpointer         user_data)
 {
-  xdg_permission_store_start (connection);
+  xdg_permission_store_start (connection, (const char * const *) opt_transient_tables);
 }
 
 static void
@@ -57,6 +64,8 @@ main (int    argc,
 {
   guint owner_id;
   GMainLoop *loop;
+  GOptionContext *context;
+  g_autoptr(GError) error = NULL;
 
   setlocale (LC_ALL, "");
 
@@ -64,6 +73,15 @@ main (int    argc,
 
   g_set_prgname (argv[0]);
 
+  context = g_option_context_new ("- permission store");
+  g_option_context_add_main_entries (context, entries, NULL);
+  if (!g_option_context_parse (context, &argc, &argv, &error))
+    {
+      g_printerr ("option parsing failed: %s\n", error->message);
+      return 1;
+    }
+  g_option_context_free (context);
+
   flatpak_migrate_from_xdg_app ();
 
   owner_id = g_bus_own_name (G_BUS_TYPE_SESSION,
@@ -31,6 +31,13 @@
 
 GHashTable *tables = NULL;
 
+/* Writes that arrive within this many milliseconds of each other are
+   serialized and saved together, see queue_writeout() */
+#define WRITEOUT_DELAY_MS 100
+
+/* Tables that are only kept in memory */
+static char **transient_tables = NULL;
+
 typedef struct
 {
   char      *name;
@@ -38,13 +45,18 @@ typedef struct
   GList     *outstanding_writes;
   GList     *current_writes;
   gboolean   writing;
+  gboolean   transient;
+  guint      writeout_id;
 } Table;
 
 static void start_writeout (Table *table);
+static void queue_writeout (Table *table);
 
 static void
 table_free (Table *table)
 {
+  if (table->writeout_id != 0)
+    g_source_remove (table->writeout_id);
   g_free (table->name);
   g_object_unref (table->db);
   g_free (table);
@@ -61,14 +73,23 @@ lookup_table (const char            *name,
 
   g_autoptr(GError) error = NULL;
 
+  gboolean transient;
+
   table = g_hash_table_lookup (tables, name);
   if (table != NULL)
     return table;
 
-  dir = g_build_filename (g_get_user_data_dir (), "flatpak/db", NULL);
-  g_mkdir_with_parents (dir, 0755);
+  transient = transient_tables != NULL &&
+              g_strv_contains ((const char * const *) transient_tables, name);
+
+  if (!transient)
+    {
+      dir = g_build_filename (g_get_user_data_dir (), "flatpak/db", NULL);
+      g_mkdir_with_parents (dir, 0755);
+
+      path = g_build_filename (dir, name, NULL);
+    }
 
-  path = g_build_filename (dir, name, NULL);
   db = flatpak_db_new (path, FALSE, &error);
   if (db == NULL)
     {
@@ -81,6 +102,7 @@ lookup_table (const char            *name,
   table = g_new0 (Table, 1);
   table->name = g_strdup (name);
   table->db = db;
+  table->transient = transient;
 
   g_hash_table_insert (tables, table->name, table);
 
@@ -118,7 +140,30 @@ writeout_done (GObject      *source_object,
   table->writing = FALSE;
 
   if (table->outstanding_writes != NULL)
-    start_writeout (table);
+    queue_writeout (table);
+}
+
+static gboolean
+writeout_timeout_cb (gpointer user_data)
+{
+  Table *table = user_data;
+
+  table->writeout_id = 0;
+  start_writeout (table);
+
+  return G_SOURCE_REMOVE;
+}
+
+/* Rather than writing out the db for each change we wait a bit, so
+   that a burst of changes from many callers results in a single
+   serialization and file replace. */
+static void
+queue_writeout (Table *table)
+{
+  if (table->writing || table->writeout_id != 0)
+    return;
+
+  table->writeout_id = g_timeout_add (WRITEOUT_DELAY_MS, writeout_timeout_cb, table);
 }
 
 static void
@@ -138,10 +183,16 @@ static void
 ensure_writeout (Table                 *table,
                  GDBusMethodInvocation *invocation)
 {
+  if (table->transient)
+    {
+      g_dbus_method_invocation_return_value (invocation,
+                                             g_variant_new ("()"));
+      return;
+    }
+
   table->outstanding_writes = g_list_prepend (table->outstanding_writes, invocation);
 
-  if (!table->writing)
-    start_writeout (table);
+  queue_writeout (table);
 }
 
 static gboolean
@@ -291,6 +342,43 @@ handle_delete (XdgPermissionStore     *object,
   return TRUE;
 }
 
+static void
+set_entry (XdgPermissionStore *object,
+           Table              *table,
+           const gchar        *id,
+           GVariant           *app_permissions,
+           GVariant           *data)
+{
+  GVariantIter iter;
+  GVariant *child;
+
+  g_autoptr(GVariant) data_child = NULL;
+  g_autoptr(FlatpakDbEntry) new_entry = NULL;
+
+  data_child = g_variant_get_child_value (data, 0);
+  new_entry = flatpak_db_entry_new (data_child);
+
+  /* Add all the given app permissions */
+
+  g_variant_iter_init (&iter, app_permissions);
+  while ((child = g_variant_iter_next_value (&iter)))
+    {
+      g_autoptr(FlatpakDbEntry) old_entry;
+      const char *child_app_id;
+      g_autofree const char **permissions;
+
+      g_variant_get (child, "{&s^a&s}", &child_app_id, &permissions);
+
+      old_entry = new_entry;
+      new_entry = flatpak_db_entry_set_app_permissions (new_entry, child_app_id, (const char **) permissions);
+
+      g_variant_unref (child);
+    }
+
+  flatpak_db_set_entry (table->db, id, new_entry);
+  emit_changed (object, table->name, id, new_entry);
+}
+
 static gboolean
 handle_set (XdgPermissionStore     *object,
             GDBusMethodInvocation  *invocation,
@@ -301,12 +389,8 @@ handle_set (XdgPermissionStore     *object,
             GVariant               *data)
 {
   Table *table;
-  GVariantIter iter;
-  GVariant *child;
 
-  g_autoptr(GVariant) data_child = NULL;
   g_autoptr(FlatpakDbEntry) old_entry = NULL;
-  g_autoptr(FlatpakDbEntry) new_entry = NULL;
 
   table = lookup_table (table_name, invocation);
   if (table == NULL)
@@ -321,28 +405,60 @@ handle_set (XdgPermissionStore     *object,
       return TRUE;
     }
 
-  data_child = g_variant_get_child_value (data, 0);
-  new_entry = flatpak_db_entry_new (data_child);
+  set_entry (object, table, id, app_permissions, data);
 
-  /* Add all the given app permissions */
+  ensure_writeout (table, invocation);
 
-  g_variant_iter_init (&iter, app_permissions);
-  while ((child = g_variant_iter_next_value (&iter)))
-    {
-      g_autoptr(FlatpakDbEntry) old_entry;
-      const char *child_app_id;
-      g_autofree const char **permissions;
+  return TRUE;
+}
 
-      g_variant_get (child, "{&s^a&s}", &child_app_id, &permissions);
+/* Like Set for each of the entries, but with a single writeout */
+static gboolean
+handle_set_multiple (XdgPermissionStore     *object,
+                     GDBusMethodInvocation  *invocation,
+                     const gchar            *table_name,
+                     gboolean                create,
+                     GVariant               *entries)
+{
+  Table *table;
+  gsize i, n_entries;
 
-      old_entry = new_entry;
-      new_entry = flatpak_db_entry_set_app_permissions (new_entry, child_app_id, (const char **) permissions);
+  table = lookup_table (table_name, invocation);
+  if (table == NULL)
+    return TRUE;
 
-      g_variant_unref (child);
+  n_entries = g_variant_n_children (entries);
+
+  /* Check all ids first, so nothing is changed if we fail */
+  if (!create)
+    {
+      for (i = 0; i < n_entries; i++)
+        {
+          g_autoptr(FlatpakDbEntry) old_entry = NULL;
+          const char *id;
+
+          g_variant_get_child (entries, i, "(&s@a{sas}@v)", &id, NULL, NULL);
+
+          old_entry = flatpak_db_lookup (table->db, id);
+          if (old_entry == NULL)
+            {
+              g_dbus_method_invocation_return_error (invocation,
+                                                     FLATPAK_PORTAL_ERROR, FLATPAK_PORTAL_ERROR_NOT_FOUND,
+                                                     "Id %s not found", id);
+              return TRUE;
+            }
+        }
     }
 
-  flatpak_db_set_entry (table->db, id, new_entry);
-  emit_changed (object, table_name, id, new_entry);
+  for (i = 0; i < n_entries; i++)
+    {
+      g_autoptr(GVariant) app_permissions = NULL;
+      g_autoptr(GVariant) data = NULL;
+      const char *id;
+
+      g_variant_get_child (entries, i, "(&s@a{sas}@v)", &id, &app_permissions, &data);
+      set_entry (object, table, id, app_permissions, data);
+    }
 
   ensure_writeout (table, invocation);
 
@@ -437,12 +553,16 @@ handle_set_value (XdgPermissionStore     *object,
   return TRUE;
 }
 
+/* The tables in transient are kept in memory only */
 void
-xdg_permission_store_start (GDBusConnection *connection)
+xdg_permission_store_start (GDBusConnection    *connection,
+                            const char * const *transient)
 {
   XdgPermissionStore *store;
   GError *error = NULL;
 
+  transient_tables = g_strdupv ((char **) transient);
+
   tables = g_hash_table_new_full (g_str_hash, g_str_equal,
                                   g_free, (GDestroyNotify) table_free);
 
@@ -451,6 +571,7 @@ xdg_permission_store_start (GDBusConnection *connection)
   g_signal_connect (store, "handle-list", G_CALLBACK (handle_list), NULL);
   g_signal_connect (store, "handle-lookup", G_CALLBACK (handle_lookup), NULL);
   g_signal_connect (store, "handle-set", G_CALLBACK (handle_set), NULL);
+  g_signal_connect (store, "handle-set-multiple", G_CALLBACK (handle_set_multiple), NULL);
   g_signal_connect (store, "handle-set-permission", G_CALLBACK (handle_set_permission), NULL);
   g_signal_connect (store, "handle-set-value", G_CALLBACK (handle_set_value), NULL);
   g_signal_connect (store, "handle-delete", G_CALLBACK (handle_delete), NULL);
@@ -23,6 +23,7 @@
 
 #include "flatpak-dbus.h"
 
-void xdg_permission_store_start (GDBusConnection *connection);
+void xdg_permission_store_start (GDBusConnection    *connection,
+                                 const char * const *transient);
 
 #endif /* __FLATPAK_PERMISSION_STORE_H__ */
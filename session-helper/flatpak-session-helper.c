@@ -23,6 +23,7 @@
 #include <locale.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include <gio/gio.h>
 #include "flatpak-dbus.h"
 #include "flatpak-utils.h"
@@ -40,6 +41,31 @@ handle_request_monitor (FlatpakSessionHelper   *object,
   return TRUE;
 }
 
+/* flatpak run uses this to find the mirror without a D-Bus roundtrip,
+ * the pid lets it detect a stale dir left by a helper that went away.
+ * Only written once we own the name, so it never points to a helper
+ * that is about to exit because another instance is running. */
+static void
+write_ready_marker (void)
+{
+  char *path = g_build_filename (monitor_dir, ".ready", NULL);
+  char *contents = g_strdup_printf ("%d\n", (int) getpid ());
+
+  g_file_set_contents (path, contents, -1, NULL);
+
+  g_free (contents);
+  g_free (path);
+}
+
+static void
+remove_ready_marker (void)
+{
+  char *path = g_build_filename (monitor_dir, ".ready", NULL);
+
+  unlink (path);
+  g_free (path);
+}
+
 static void
 on_bus_acquired (GDBusConnection *connection,
                  const gchar     *name,
@@ -67,6 +93,7 @@ on_name_acquired (GDBusConnection *connection,
                   const gchar     *name,
                   gpointer         user_data)
 {
+  write_ready_marker ();
 }
 
 static void
@@ -77,46 +104,115 @@ on_name_lost (GDBusConnection *connection,
   exit (1);
 }
 
+/* Host files mirrored into monitor_dir. Keep in sync with monitor_files
+ * in flatpak-run.c */
+static const char *mirrored_files[] = {
+  "/etc/resolv.conf",
+  "/etc/host.conf",
+  "/etc/hosts",
+  "/etc/gai.conf",
+  "/etc/localtime",
+  "/etc/timezone",
+  NULL
+};
+
+/* Editors and package managers tend to generate a burst of events for a
+ * single change, so we wait for things to settle before copying */
+#define MIRROR_UPDATE_DELAY_MS 200
+
+typedef struct {
+  const char   *source;
+  char         *dest;
+  GFileMonitor *monitor;
+  guint         timeout_id;
+} MirroredFile;
+
 static void
-copy_file (const char *source,
-           const char *target_dir)
+copy_file (MirroredFile *file)
 {
-  char *basename = g_path_get_basename (source);
-  char *dest = g_build_filename (target_dir, basename, NULL);
   gchar *contents = NULL;
-  gsize len;
+  gchar *old_contents = NULL;
+  gsize len, old_len;
+  GError *error = NULL;
 
-  if (g_file_get_contents (source, &contents, &len, NULL))
-    g_file_set_contents (dest, contents, len, NULL);
+  if (!g_file_get_contents (file->source, &contents, &len, NULL))
+    {
+      /* Gone on the host, so drop the copy too */
+      unlink (file->dest);
+      return;
+    }
 
-  g_free (basename);
-  g_free (dest);
+  /* Don't replace an identical file, so apps that have the old one
+   * mapped and things looking at the mtime are not disturbed */
+  if (g_file_get_contents (file->dest, &old_contents, &old_len, NULL) &&
+      old_len == len && memcmp (old_contents, contents, len) == 0)
+    {
+      g_free (old_contents);
+      g_free (contents);
+      return;
+    }
+
+  /* This writes to a temporary file and renames it over the old one, so
+   * readers always see either the old or the new version, never a
+   * truncated one. */
+  if (!g_file_set_contents (file->dest, contents, len, &error))
+    {
+      g_warning ("Failed to update %s: %s", file->dest, error->message);
+      g_error_free (error);
+    }
+
+  g_free (old_contents);
   g_free (contents);
 }
 
+static gboolean
+update_file_cb (gpointer user_data)
+{
+  MirroredFile *file = user_data;
+
+  file->timeout_id = 0;
+  copy_file (file);
+
+  return G_SOURCE_REMOVE;
+}
+
 static void
 file_changed (GFileMonitor     *monitor,
               GFile            *file,
               GFile            *other_file,
               GFileMonitorEvent event_type,
-              char             *source)
+              MirroredFile     *mirrored)
 {
-  if (event_type == G_FILE_MONITOR_EVENT_CHANGES_DONE_HINT ||
-      event_type == G_FILE_MONITOR_EVENT_CREATED)
-    copy_file (source, monitor_dir);
+  if (event_type != G_FILE_MONITOR_EVENT_CHANGED &&
+      event_type != G_FILE_MONITOR_EVENT_CHANGES_DONE_HINT &&
+      event_type != G_FILE_MONITOR_EVENT_CREATED &&
+      event_type != G_FILE_MONITOR_EVENT_DELETED &&
+      event_type != G_FILE_MONITOR_EVENT_MOVED)
+    return;
+
+  if (mirrored->timeout_id != 0)
+    g_source_remove (mirrored->timeout_id);
+  mirrored->timeout_id = g_timeout_add (MIRROR_UPDATE_DELAY_MS, update_file_cb, mirrored);
 }
 
 static void
 setup_file_monitor (const char *source)
 {
   GFile *s = g_file_new_for_path (source);
-  GFileMonitor *monitor;
+  char *basename = g_path_get_basename (source);
+  MirroredFile *mirrored = g_new0 (MirroredFile, 1);
+
+  mirrored->source = source;
+  mirrored->dest = g_build_filename (monitor_dir, basename, NULL);
+
+  copy_file (mirrored);
 
-  copy_file (source, monitor_dir);
+  mirrored->monitor = g_file_monitor_file (s, G_FILE_MONITOR_NONE, NULL, NULL);
+  if (mirrored->monitor)
+    g_signal_connect (mirrored->monitor, "changed", G_CALLBACK (file_changed), mirrored);
 
-  monitor = g_file_monitor_file (s, G_FILE_MONITOR_NONE, NULL, NULL);
-  if (monitor)
-    g_signal_connect (monitor, "changed", G_CALLBACK (file_changed), (char *) source);
+  g_free (basename);
+  g_object_unref (s);
 }
 
 int
@@ -125,6 +221,7 @@ main (int    argc,
 {
   guint owner_id;
   GMainLoop *loop;
+  int i;
 
   setlocale (LC_ALL, "");
 
@@ -141,8 +238,8 @@ main (int    argc,
       exit (1);
     }
 
-  setup_file_monitor ("/etc/resolv.conf");
-  setup_file_monitor ("/etc/localtime");
+  for (i = 0; mirrored_files[i] != NULL; i++)
+    setup_file_monitor (mirrored_files[i]);
 
   owner_id = g_bus_own_name (G_BUS_TYPE_SESSION,
                              "org.freedesktop.Flatpak",
@@ -158,5 +255,7 @@ main (int    argc,
 
   g_bus_unown_name (owner_id);
 
+  remove_ready_marker ();
+
   return 0;
 }
@@ -28,6 +28,7 @@
 
 #include "flatpak-dbus.h"
 #include "flatpak-dir.h"
+#include "flatpak-utils.h"
 #include "lib/flatpak-error.h"
 
 static PolkitAuthority *authority = NULL;
@@ -116,48 +117,70 @@ schedule_idle_callback (void)
   G_UNLOCK(idle);
 }
 
-static FlatpakDir *
-dir_get_system (void)
+/* The system FlatpakDir (and its open OstreeRepo) is kept around for the
+ * lifetime of the helper instead of being recreated for each call. All uses
+ * of it are serialized by this lock, as OstreeRepo doesn't support
+ * concurrent transactions on the same object. */
+G_LOCK_DEFINE_STATIC (system_dir);
+static FlatpakDir *system_dir = NULL;
+static GFileMonitor *system_repo_config_monitor = NULL;
+static volatile gint system_dir_invalid = FALSE;
+
+static void
+system_repo_config_changed_cb (GFileMonitor     *monitor,
+                               GFile            *file,
+                               GFile            *other_file,
+                               GFileMonitorEvent event_type,
+                               gpointer          user_data)
 {
-  FlatpakDir *system = flatpak_dir_get_system ();
-  flatpak_dir_set_no_system_helper (system, TRUE);
-  return system;
+  /* Someone changed the repo config behind our back, reload it on next use.
+     This is also triggered by our own changes, which is harmless. */
+  g_atomic_int_set (&system_dir_invalid, TRUE);
 }
 
-static gboolean
-handle_deploy (FlatpakSystemHelper   *object,
-               GDBusMethodInvocation *invocation,
-               const gchar           *arg_repo_path,
-               guint32                arg_flags,
-               const gchar           *arg_ref,
-               const gchar           *arg_origin,
-               const gchar *const    *arg_subpaths)
+/* Must be called with the system_dir lock held */
+static FlatpakDir *
+dir_get_system (GError **error)
 {
-  g_autoptr(FlatpakDir) system = dir_get_system ();
-  g_autoptr(GFile) path = g_file_new_for_path (arg_repo_path);
-  g_autoptr(GError) error = NULL;
-  g_autoptr(GFile) deploy_dir = NULL;
-  gboolean is_update;
-  g_autoptr(GMainContext) main_context = NULL;
-
-  g_debug ("Deploy %s %u %s %s", arg_repo_path, arg_flags, arg_ref, arg_origin);
-
-  if ((arg_flags & ~FLATPAK_HELPER_DEPLOY_FLAGS_ALL) != 0)
+  if (g_atomic_int_compare_and_exchange (&system_dir_invalid, TRUE, FALSE))
     {
-      g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS,
-                                             "Unsupported flags enabled: 0x%x", (arg_flags & ~FLATPAK_HELPER_DEPLOY_FLAGS_ALL));
-      return TRUE;
+      g_debug ("System repo config changed, reloading");
+      g_clear_object (&system_dir);
     }
 
-  if (!g_file_query_exists (path, NULL))
+  if (system_dir == NULL)
     {
-      g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS, "Path does not exist");
-      return TRUE;
+      g_autoptr(FlatpakDir) system = flatpak_dir_get_system ();
+
+      flatpak_dir_set_no_system_helper (system, TRUE);
+
+      if (!flatpak_dir_ensure_repo (system, NULL, error))
+        return NULL;
+
+      system_dir = g_steal_pointer (&system);
     }
 
-  is_update = (arg_flags & FLATPAK_HELPER_DEPLOY_FLAGS_UPDATE) != 0;
+  return g_object_ref (system_dir);
+}
 
-  deploy_dir = flatpak_dir_get_if_deployed (system, arg_ref,
+/* Must be called with the system_dir lock held */
+static gboolean
+deploy_ref (FlatpakDir         *system,
+            const char         *repo_path,
+            guint32             flags,
+            const char         *ref,
+            const char         *origin,
+            const char * const *subpaths,
+            GError            **error)
+{
+  g_autoptr(GError) local_error = NULL;
+  g_autoptr(GFile) deploy_dir = NULL;
+  gboolean is_update;
+  g_autoptr(GMainContext) main_context = NULL;
+
+  is_update = (flags & FLATPAK_HELPER_DEPLOY_FLAGS_UPDATE) != 0;
+
+  deploy_dir = flatpak_dir_get_if_deployed (system, ref,
                                             NULL, NULL);
 
   if (deploy_dir)
@@ -166,49 +189,42 @@ handle_deploy (FlatpakSystemHelper   *object,
       if (!is_update)
         {
           /* Can't install already installed app */
-          g_dbus_method_invocation_return_error (invocation, FLATPAK_ERROR, FLATPAK_ERROR_ALREADY_INSTALLED,
-                                                 "%s is already installed", arg_ref);
-          return TRUE;
+          g_set_error (error, FLATPAK_ERROR, FLATPAK_ERROR_ALREADY_INSTALLED,
+                       "%s is already installed", ref);
+          return FALSE;
         }
 
-      real_origin = flatpak_dir_get_origin (system, arg_ref, NULL, NULL);
-      if (g_strcmp0 (real_origin, arg_origin) != 0)
+      real_origin = flatpak_dir_get_origin (system, ref, NULL, NULL);
+      if (g_strcmp0 (real_origin, origin) != 0)
         {
-          g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS,
-                                                 "Wrong origin %s for update", arg_origin);
-          return TRUE;
+          g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS,
+                       "Wrong origin %s for update", origin);
+          return FALSE;
         }
     }
   else if (!deploy_dir && is_update)
     {
       /* Can't update not installed app */
-      g_dbus_method_invocation_return_error (invocation, FLATPAK_ERROR, FLATPAK_ERROR_ALREADY_INSTALLED,
-                                             "%s is not installed", arg_ref);
-      return TRUE;
-    }
-
-  if (!flatpak_dir_ensure_repo (system, NULL, &error))
-    {
-      g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
-                                             "Can't open system repo %s", error->message);
-      return TRUE;
+      g_set_error (error, FLATPAK_ERROR, FLATPAK_ERROR_ALREADY_INSTALLED,
+                   "%s is not installed", ref);
+      return FALSE;
     }
 
   /* Work around ostree-pull spinning the default main context for the sync calls */
   main_context = g_main_context_new ();
   g_main_context_push_thread_default (main_context);
 
-  if (!flatpak_dir_pull_untrusted_local (system, arg_repo_path,
-                                         arg_origin,
-                                         arg_ref,
-                                         (char **) arg_subpaths,
+  if (!flatpak_dir_pull_untrusted_local (system, repo_path,
+                                         origin,
+                                         ref,
+                                         (char **) subpaths,
                                          NULL,
-                                         NULL, &error))
+                                         NULL, &local_error))
     {
       g_main_context_pop_thread_default (main_context);
-      g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
-                                             "Error pulling from repo: %s", error->message);
-      return TRUE;
+      g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
+                   "Error pulling from repo: %s", local_error->message);
+      return FALSE;
     }
 
   g_main_context_pop_thread_default (main_context);
@@ -216,32 +232,145 @@ handle_deploy (FlatpakSystemHelper   *object,
   if (is_update)
     {
       /* TODO: This doesn't support a custom subpath */
-      if (!flatpak_dir_deploy_update (system, arg_ref,
+      if (!flatpak_dir_deploy_update (system, ref,
                                       NULL,
-                                      NULL, &error))
+                                      NULL, &local_error))
         {
-          g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
-                                                 "Error deploying: %s", error->message);
-          return TRUE;
+          g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
+                       "Error deploying: %s", local_error->message);
+          return FALSE;
         }
     }
   else
     {
-      if (!flatpak_dir_deploy_install (system, arg_ref, arg_origin,
-                                       (char **) arg_subpaths,
-                                       NULL, &error))
+      if (!flatpak_dir_deploy_install (system, ref, origin,
+                                       (char **) subpaths,
+                                       NULL, &local_error))
         {
-          g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
-                                                 "Error deploying: %s", error->message);
-          return TRUE;
+          g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
+                       "Error deploying: %s", local_error->message);
+          return FALSE;
         }
     }
 
+  return TRUE;
+}
+
+static gboolean
+handle_deploy (FlatpakSystemHelper   *object,
+               GDBusMethodInvocation *invocation,
+               const gchar           *arg_repo_path,
+               guint32                arg_flags,
+               const gchar           *arg_ref,
+               const gchar           *arg_origin,
+               const gchar *const    *arg_subpaths)
+{
+  g_autoptr(FlatpakDir) system = NULL;
+  g_autoptr(GFile) path = g_file_new_for_path (arg_repo_path);
+  g_autoptr(GError) error = NULL;
+  AUTOLOCK (system_dir);
+
+  g_debug ("Deploy %s %u %s %s", arg_repo_path, arg_flags, arg_ref, arg_origin);
+
+  if ((arg_flags & ~FLATPAK_HELPER_DEPLOY_FLAGS_ALL) != 0)
+    {
+      g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS,
+                                             "Unsupported flags enabled: 0x%x", (arg_flags & ~FLATPAK_HELPER_DEPLOY_FLAGS_ALL));
+      return TRUE;
+    }
+
+  if (!g_file_query_exists (path, NULL))
+    {
+      g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS, "Path does not exist");
+      return TRUE;
+    }
+
+  system = dir_get_system (&error);
+  if (system == NULL)
+    {
+      g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
+                                             "Can't open system repo %s", error->message);
+      return TRUE;
+    }
+
+  if (!deploy_ref (system, arg_repo_path, arg_flags, arg_ref, arg_origin, arg_subpaths, &error))
+    {
+      g_dbus_method_invocation_return_gerror (invocation, error);
+      return TRUE;
+    }
+
   flatpak_system_helper_complete_deploy (object, invocation);
 
   return TRUE;
 }
 
+static gboolean
+handle_deploy_multiple (FlatpakSystemHelper   *object,
+                        GDBusMethodInvocation *invocation,
+                        const gchar           *arg_repo_path,
+                        guint32                arg_flags,
+                        GVariant              *arg_refs)
+{
+  g_autoptr(FlatpakDir) system = NULL;
+  g_autoptr(GFile) path = g_file_new_for_path (arg_repo_path);
+  g_autoptr(GError) error = NULL;
+  gsize i, n_refs;
+  AUTOLOCK (system_dir);
+
+  n_refs = g_variant_n_children (arg_refs);
+
+  g_debug ("DeployMultiple %s %u (%" G_GSIZE_FORMAT " refs)", arg_repo_path, arg_flags, n_refs);
+
+  if ((arg_flags & ~FLATPAK_HELPER_DEPLOY_FLAGS_ALL) != 0)
+    {
+      g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS,
+                                             "Unsupported flags enabled: 0x%x", (arg_flags & ~FLATPAK_HELPER_DEPLOY_FLAGS_ALL));
+      return TRUE;
+    }
+
+  if (n_refs == 0)
+    {
+      g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS, "No refs to deploy");
+      return TRUE;
+    }
+
+  if (!g_file_query_exists (path, NULL))
+    {
+      g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS, "Path does not exist");
+      return TRUE;
+    }
+
+  system = dir_get_system (&error);
+  if (system == NULL)
+    {
+      g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
+                                             "Can't open system repo %s", error->message);
+      return TRUE;
+    }
+
+  /* Refs are deployed in order, and we stop at the first failure. Refs
+     deployed before that stay deployed. */
+  for (i = 0; i < n_refs; i++)
+    {
+      const char *ref, *origin;
+      g_autofree const char **subpaths = NULL;
+
+      g_variant_get_child (arg_refs, i, "(&s&s^a&s)", &ref, &origin, &subpaths);
+
+      g_debug ("Deploy %s %s", ref, origin);
+
+      if (!deploy_ref (system, arg_repo_path, arg_flags, ref, origin, subpaths, &error))
+        {
+          g_dbus_method_invocation_return_gerror (invocation, error);
+          return TRUE;
+        }
+    }
+
+  flatpak_system_helper_complete_deploy_multiple (object, invocation);
+
+  return TRUE;
+}
+
 static gboolean
 handle_deploy_appstream (FlatpakSystemHelper   *object,
                          GDBusMethodInvocation *invocation,
@@ -249,11 +378,12 @@ handle_deploy_appstream (FlatpakSystemHelper   *object,
                          const gchar           *arg_origin,
                          const gchar           *arg_arch)
 {
-  g_autoptr(FlatpakDir) system = dir_get_system ();
+  g_autoptr(FlatpakDir) system = NULL;
   g_autoptr(GFile) path = g_file_new_for_path (arg_repo_path);
   g_autoptr(GError) error = NULL;
   g_autoptr(GMainContext) main_context = NULL;
   g_autofree char *branch = NULL;
+  AUTOLOCK (system_dir);
 
   g_debug ("DeployAppstream %s %s %s", arg_repo_path, arg_origin, arg_arch);
 
@@ -263,7 +393,8 @@ handle_deploy_appstream (FlatpakSystemHelper   *object,
       return TRUE;
     }
 
-  if (!flatpak_dir_ensure_repo (system, NULL, &error))
+  system = dir_get_system (&error);
+  if (system == NULL)
     {
       g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
                                              "Can't open system repo %s", error->message);
@@ -314,8 +445,9 @@ handle_uninstall (FlatpakSystemHelper *object,
                   guint arg_flags,
                   const gchar *arg_ref)
 {
-  g_autoptr(FlatpakDir) system = dir_get_system ();
+  g_autoptr(FlatpakDir) system = NULL;
   g_autoptr(GError) error = NULL;
+  AUTOLOCK (system_dir);
 
   g_debug ("Uninstall %u %s", arg_flags, arg_ref);
 
@@ -326,7 +458,8 @@ handle_uninstall (FlatpakSystemHelper *object,
       return TRUE;
     }
 
-  if (!flatpak_dir_ensure_repo (system, NULL, &error))
+  system = dir_get_system (&error);
+  if (system == NULL)
     {
       g_dbus_method_invocation_return_gerror  (invocation, error);
       return TRUE;
@@ -351,12 +484,13 @@ handle_configure_remote (FlatpakSystemHelper *object,
                          const gchar *arg_config,
                          GVariant *arg_gpg_key)
 {
-  g_autoptr(FlatpakDir) system = dir_get_system ();
+  g_autoptr(FlatpakDir) system = NULL;
   g_autoptr(GError) error = NULL;
   g_autoptr(GKeyFile) config = g_key_file_new ();
   g_autofree char *group = g_strdup_printf ("remote \"%s\"", arg_remote);
   g_autoptr(GBytes) gpg_data = NULL;
   gboolean force_remove;
+  AUTOLOCK (system_dir);
 
   g_debug ("ConfigureRemote %u %s", arg_flags, arg_remote);
 
@@ -382,7 +516,8 @@ handle_configure_remote (FlatpakSystemHelper *object,
       return TRUE;
     }
 
-  if (!flatpak_dir_ensure_repo (system, NULL, &error))
+  system = dir_get_system (&error);
+  if (system == NULL)
     {
       g_dbus_method_invocation_return_gerror  (invocation, error);
       return TRUE;
@@ -503,6 +638,95 @@ flatpak_authorize_method_handler (GDBusInterfaceSkeleton *interface,
 
       authorized = polkit_authorization_result_get_is_authorized (result);
     }
+  else if (g_strcmp0 (method_name, "DeployMultiple") == 0)
+    {
+      g_autoptr(GVariant) refs = NULL;
+      g_autoptr(GPtrArray) actions = g_ptr_array_new ();
+      GVariantIter iter;
+      const char *ref, *origin;
+      guint32 flags;
+      gboolean is_update;
+      int i;
+
+      g_variant_get_child (parameters, 1, "u", &flags);
+      refs = g_variant_get_child_value (parameters, 2);
+
+      /* With no refs there would be no action to check at all */
+      if (g_variant_n_children (refs) == 0)
+        {
+          g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS,
+                                                 "No refs to deploy");
+          return FALSE;
+        }
+
+      is_update = (flags & FLATPAK_HELPER_DEPLOY_FLAGS_UPDATE) != 0;
+
+      /* Do one check per distinct action for the whole batch, rather than
+         one per ref, so that a large update needs just a few roundtrips
+         to polkit (and a few prompts at most). */
+      g_variant_iter_init (&iter, refs);
+      while (g_variant_iter_next (&iter, "(&s&s@as)", &ref, &origin, NULL))
+        {
+          const char *ref_action;
+
+          if (g_str_has_prefix (ref, "app/"))
+            ref_action = is_update ? "org.freedesktop.Flatpak.app-update" : "org.freedesktop.Flatpak.app-install";
+          else
+            ref_action = is_update ? "org.freedesktop.Flatpak.runtime-update" : "org.freedesktop.Flatpak.runtime-install";
+
+          for (i = 0; i < actions->len; i++)
+            {
+              if (strcmp (g_ptr_array_index (actions, i), ref_action) == 0)
+                break;
+            }
+          if (i == actions->len)
+            g_ptr_array_add (actions, (char *) ref_action);
+        }
+
+      authorized = TRUE;
+      for (i = 0; authorized && i < actions->len; i++)
+        {
+          g_autoptr(GString) refs_str = g_string_new ("");
+          g_autoptr(GString) origins_str = g_string_new ("");
+          gboolean action_is_app;
+
+          action = g_ptr_array_index (actions, i);
+          action_is_app = strstr (action, ".app-") != NULL;
+
+          g_variant_iter_init (&iter, refs);
+          while (g_variant_iter_next (&iter, "(&s&s@as)", &ref, &origin, NULL))
+            {
+              if (g_str_has_prefix (ref, "app/") != action_is_app)
+                continue;
+
+              if (refs_str->len > 0)
+                g_string_append_c (refs_str, ',');
+              g_string_append (refs_str, ref);
+              if (origins_str->len > 0)
+                g_string_append_c (origins_str, ',');
+              g_string_append (origins_str, origin);
+            }
+
+          details = polkit_details_new ();
+          polkit_details_insert (details, "origins", origins_str->str);
+          polkit_details_insert (details, "refs", refs_str->str);
+
+          result = polkit_authority_check_authorization_sync (authority, subject,
+                                                              action, details,
+                                                              POLKIT_CHECK_AUTHORIZATION_FLAGS_ALLOW_USER_INTERACTION,
+                                                              NULL, &error);
+          g_clear_object (&details);
+          if (result == NULL)
+            {
+              g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
+                                                     "Authorization error: %s", error->message);
+              return FALSE;
+            }
+
+          authorized = polkit_authorization_result_get_is_authorized (result);
+          g_clear_object (&result);
+        }
+    }
   else if (g_strcmp0 (method_name, "DeployAppstream") == 0)
     {
       const char *arch, *origin;
@@ -611,6 +835,7 @@ on_bus_acquired (GDBusConnection *connection,
                                        G_DBUS_INTERFACE_SKELETON_FLAGS_HANDLE_METHOD_INVOCATIONS_IN_THREAD);
 
   g_signal_connect (helper, "handle-deploy", G_CALLBACK (handle_deploy), NULL);
+  g_signal_connect (helper, "handle-deploy-multiple", G_CALLBACK (handle_deploy_multiple), NULL);
   g_signal_connect (helper, "handle-deploy-appstream", G_CALLBACK (handle_deploy_appstream), NULL);
   g_signal_connect (helper, "handle-uninstall", G_CALLBACK (handle_uninstall), NULL);
   g_signal_connect (helper, "handle-configure-remote", G_CALLBACK (handle_configure_remote), NULL);
@@ -762,6 +987,16 @@ main (int    argc,
                           G_CALLBACK (binary_file_changed_cb), NULL);
     }
 
+  {
+    g_autoptr(GFile) base_dir = flatpak_get_system_base_dir_location ();
+    g_autoptr(GFile) repo_config = g_file_resolve_relative_path (base_dir, "repo/config");
+
+    system_repo_config_monitor = g_file_monitor_file (repo_config, G_FILE_MONITOR_NONE, NULL, NULL);
+    if (system_repo_config_monitor != NULL)
+      g_signal_connect (system_repo_config_monitor, "changed",
+                        G_CALLBACK (system_repo_config_changed_cb), NULL);
+  }
+
   flags = G_BUS_NAME_OWNER_FLAGS_ALLOW_REPLACEMENT;
   if (replace)
     flags |= G_BUS_NAME_OWNER_FLAGS_REPLACE;
@@ -0,0 +1,180 @@
+#include "config.h"
+
+#include <string.h>
+#include <sys/stat.h>
+
+#include "libglnx/libglnx.h"
+
+#include <glib.h>
+#include <gio/gio.h>
+
+#include "flatpak.h"
+
+static char *installation_dir;
+
+static FlatpakInstallation *
+open_installation (void)
+{
+  g_autoptr(GFile) path = g_file_new_for_path (installation_dir);
+  FlatpakInstallation *installation;
+  GError *error = NULL;
+
+  installation = flatpak_installation_new_for_path (path, TRUE, NULL, &error);
+  g_assert_no_error (error);
+  g_assert (installation != NULL);
+
+  return installation;
+}
+
+static void
+modify_remote (FlatpakInstallation *installation,
+               const char          *name)
+{
+  g_autoptr(FlatpakRemote) remote = flatpak_remote_new (name);
+  GError *error = NULL;
+
+  flatpak_remote_set_url (remote, "http://127.0.0.1/repo");
+  flatpak_remote_set_gpg_verify (remote, FALSE);
+  flatpak_installation_modify_remote (installation, remote, NULL, &error);
+  g_assert_no_error (error);
+}
+
+static GPtrArray *
+list_changes (FlatpakInstallation *installation,
+              guint64              since,
+              guint64             *out_cursor)
+{
+  GPtrArray *changes;
+  GError *error = NULL;
+
+  changes = flatpak_installation_list_changes_sync (installation, since, out_cursor, NULL, &error);
+  g_assert_no_error (error);
+  g_assert (changes != NULL);
+
+  return changes;
+}
+
+static void
+test_cursor (void)
+{
+  g_autoptr(FlatpakInstallation) installation = open_installation ();
+  g_autoptr(GPtrArray) changes = NULL;
+  FlatpakChange *change;
+  guint64 cursor, cursor2, cursor3;
+  GError *error = NULL;
+
+  modify_remote (installation, "changes-remote");
+
+  changes = list_changes (installation, 0, &cursor);
+  g_assert_cmpuint (changes->len, >=, 1);
+  change = g_ptr_array_index (changes, changes->len - 1);
+  g_assert_cmpint (flatpak_change_get_kind (change), ==, FLATPAK_CHANGE_KIND_REMOTE_MODIFIED);
+  g_assert_cmpstr (flatpak_change_get_remote_name (change), ==, "changes-remote");
+  g_assert_cmpuint (flatpak_change_get_serial (change), ==, cursor);
+  g_assert_cmpuint (cursor, >, 0);
+
+  /* Nothing new since the cursor */
+  g_clear_pointer (&changes, g_ptr_array_unref);
+  changes = list_changes (installation, cursor, &cursor2);
+  g_assert_cmpuint (changes->len, ==, 0);
+  g_assert_cmpuint (cursor2, ==, cursor);
+
+  /* Only the new change after it */
+  flatpak_installation_remove_remote (installation, "changes-remote", NULL, &error);
+  g_assert_no_error (error);
+
+  g_clear_pointer (&changes, g_ptr_array_unref);
+  changes = list_changes (installation, cursor, &cursor3);
+  g_assert_cmpuint (changes->len, ==, 1);
+  change = g_ptr_array_index (changes, 0);
+  g_assert_cmpint (flatpak_change_get_kind (change), ==, FLATPAK_CHANGE_KIND_REMOTE_REMOVED);
+  g_assert_cmpstr (flatpak_change_get_remote_name (change), ==, "changes-remote");
+  g_assert_cmpuint (flatpak_change_get_serial (change), ==, cursor3);
+  g_assert_cmpuint (cursor3, >, cursor);
+
+  /* A cursor from the future is rejected */
+  g_clear_pointer (&changes, g_ptr_array_unref);
+  changes = flatpak_installation_list_changes_sync (installation, cursor3 + 1000, NULL, NULL, &error);
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT);
+  g_assert (changes == NULL);
+  g_clear_error (&error);
+}
+
+static void
+test_compact (void)
+{
+  g_autoptr(FlatpakInstallation) installation = open_installation ();
+  g_autoptr(GPtrArray) changes = NULL;
+  g_autofree char *changes_path = g_build_filename (installation_dir, ".changes", NULL);
+  g_autoptr(GString) padding = g_string_new ("");
+  g_autoptr(GFileOutputStream) out = NULL;
+  g_autoptr(GFile) changes_file = g_file_new_for_path (changes_path);
+  FlatpakChange *change;
+  guint64 cursor, cursor2;
+  GError *error = NULL;
+  struct stat stbuf;
+
+  /* Unknown change types are skipped by readers, fill the journal up
+     with them so that the next change compacts it */
+  while (padding->len < 300 * 1024)
+    g_string_append (padding, "padding\tpadding\t\n");
+
+  out = g_file_append_to (changes_file, G_FILE_CREATE_NONE, NULL, &error);
+  g_assert_no_error (error);
+  g_output_stream_write_all (G_OUTPUT_STREAM (out), padding->str, padding->len, NULL, NULL, &error);
+  g_assert_no_error (error);
+  g_output_stream_close (G_OUTPUT_STREAM (out), NULL, &error);
+  g_assert_no_error (error);
+
+  changes = list_changes (installation, 0, &cursor);
+  g_assert_cmpuint (cursor, >=, padding->len);
+
+  modify_remote (installation, "compact-remote");
+
+  g_assert_cmpint (stat (changes_path, &stbuf), ==, 0);
+  g_assert_cmpint (stbuf.st_size, <, padding->len);
+
+  /* Serials go on from where they were */
+  g_clear_pointer (&changes, g_ptr_array_unref);
+  changes = list_changes (installation, cursor, &cursor2);
+  g_assert_cmpuint (changes->len, ==, 1);
+  change = g_ptr_array_index (changes, 0);
+  g_assert_cmpint (flatpak_change_get_kind (change), ==, FLATPAK_CHANGE_KIND_REMOTE_MODIFIED);
+  g_assert_cmpstr (flatpak_change_get_remote_name (change), ==, "compact-remote");
+  g_assert_cmpuint (cursor2, >, cursor);
+
+  /* Everything that is left */
+  g_clear_pointer (&changes, g_ptr_array_unref);
+  changes = list_changes (installation, 0, NULL);
+  g_assert_cmpuint (changes->len, ==, 1);
+  g_assert_cmpuint (flatpak_change_get_serial (g_ptr_array_index (changes, 0)), ==, cursor2);
+
+  /* Old cursors are gone, so the client has to rescan */
+  g_clear_pointer (&changes, g_ptr_array_unref);
+  changes = flatpak_installation_list_changes_sync (installation, 1, NULL, NULL, &error);
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT);
+  g_assert (changes == NULL);
+  g_clear_error (&error);
+}
+
+int
+main (int argc, char **argv)
+{
+  GError *error = NULL;
+  int res;
+
+  g_test_init (&argc, &argv, NULL);
+
+  installation_dir = g_dir_make_tmp ("flatpak-test-changes-XXXXXX", &error);
+  g_assert_no_error (error);
+
+  g_test_add_func ("/changes/cursor", test_cursor);
+  g_test_add_func ("/changes/compact", test_compact);
+
+  res = g_test_run ();
+
+  glnx_shutil_rm_rf_at (-1, installation_dir, NULL, NULL);
+  g_free (installation_dir);
+
+  return res;
+}
@@ -328,6 +328,129 @@ test_recursive_doc (void)
   g_assert_cmpstr (id, ==, id3);
 }
 
+/* Exports all the paths with a single AddFull call, granting app the
+   given permissions. Returns the doc ids, in the same order */
+static char **
+export_files_full (const char **paths, gboolean unique, const char *app, const char **permissions)
+{
+  g_autoptr(GUnixFDList) fd_list = g_unix_fd_list_new ();
+  g_autoptr(GVariant) reply = NULL;
+  GVariantBuilder fds;
+  GError *error = NULL;
+  guint32 flags = 2; /* persistent */
+  char **doc_ids;
+  int i;
+
+  if (!unique)
+    flags |= 1; /* reuse existing */
+
+  g_variant_builder_init (&fds, G_VARIANT_TYPE ("ah"));
+  for (i = 0; paths[i] != NULL; i++)
+    {
+      int fd, fd_id;
+
+      fd = open (paths[i], O_PATH | O_CLOEXEC);
+      g_assert (fd >= 0);
+
+      fd_id = g_unix_fd_list_append (fd_list, fd, &error);
+      g_assert_no_error (error);
+      close (fd);
+
+      g_variant_builder_add (&fds, "h", fd_id);
+    }
+
+  reply = g_dbus_connection_call_with_unix_fd_list_sync (session_bus,
+                                                         "org.freedesktop.portal.Documents",
+                                                         "/org/freedesktop/portal/documents",
+                                                         "org.freedesktop.portal.Documents",
+                                                         "AddFull",
+                                                         g_variant_new ("(@ahus^as)",
+                                                                        g_variant_builder_end (&fds),
+                                                                        flags, app, permissions),
+                                                         G_VARIANT_TYPE ("(as)"),
+                                                         G_DBUS_CALL_FLAGS_NONE,
+                                                         30000,
+                                                         fd_list, NULL,
+                                                         NULL,
+                                                         &error);
+  g_assert_no_error (error);
+  g_assert (reply != NULL);
+
+  g_variant_get (reply, "(^as)", &doc_ids);
+  g_assert_cmpuint (g_strv_length (doc_ids), ==, g_strv_length ((char **) paths));
+  return doc_ids;
+}
+
+static void
+test_add_full (void)
+{
+  const char *basenames[] = { "full-file1", "full-file2", "full-file3" };
+  const char *permissions[] = { "read", NULL };
+  const char *no_permissions[] = { NULL };
+  const char *paths[G_N_ELEMENTS (basenames) + 1] = { NULL };
+  const char *one_path[2] = { NULL };
+  g_autofree char *app_path = NULL;
+  g_auto(GStrv) ids = NULL;
+  g_auto(GStrv) ids2 = NULL;
+  g_auto(GStrv) ids3 = NULL;
+  GError *error = NULL;
+  gsize i;
+
+  if (!have_fuse)
+    {
+      g_test_skip ("this test requires FUSE");
+      return;
+    }
+
+  for (i = 0; i < G_N_ELEMENTS (basenames); i++)
+    {
+      paths[i] = g_build_filename (outdir, basenames[i], NULL);
+      g_test_queue_free ((char *) paths[i]);
+      g_file_set_contents (paths[i], basenames[i], -1, &error);
+      g_assert_no_error (error);
+    }
+
+  /* Export all the files at once, readable by App1 */
+  ids = export_files_full (paths, FALSE, "com.test.App1", permissions);
+
+  for (i = 0; i < G_N_ELEMENTS (basenames); i++)
+    {
+      gsize j;
+
+      for (j = 0; j < i; j++)
+        g_assert_cmpstr (ids[i], !=, ids[j]);
+
+      assert_doc_has_contents (ids[i], basenames[i], NULL, basenames[i]);
+      assert_doc_has_contents (ids[i], basenames[i], "com.test.App1", basenames[i]);
+      assert_doc_not_exist (ids[i], basenames[i], "com.test.App2");
+
+      /* App1 was only granted read access */
+      update_doc (ids[i], basenames[i], "com.test.App1", "changed", &error);
+      g_assert_error (error, G_FILE_ERROR, G_FILE_ERROR_ACCES);
+      g_clear_error (&error);
+    }
+
+  /* Exporting again reuses the documents, and can pass them on */
+  ids2 = export_files_full (paths, FALSE, "com.test.App2", permissions);
+  for (i = 0; i < G_N_ELEMENTS (basenames); i++)
+    {
+      g_assert_cmpstr (ids[i], ==, ids2[i]);
+      assert_doc_has_contents (ids[i], basenames[i], "com.test.App2", basenames[i]);
+    }
+
+  /* The same works for a document on the fuse filesystem */
+  app_path = make_doc_path (ids[0], basenames[0], "com.test.App1");
+  one_path[0] = app_path;
+  ids3 = export_files_full (one_path, FALSE, "", no_permissions);
+  g_assert_cmpstr (ids3[0], ==, ids[0]);
+
+  /* Unique documents are never reused */
+  g_clear_pointer (&ids3, g_strfreev);
+  one_path[0] = paths[0];
+  ids3 = export_files_full (one_path, TRUE, "", no_permissions);
+  g_assert_cmpstr (ids3[0], !=, ids[0]);
+}
+
 static void
 global_setup (void)
 {
@@ -413,6 +536,7 @@ main (int argc, char **argv)
 
   g_test_add_func ("/db/create_doc", test_create_doc);
   g_test_add_func ("/db/recursive_doc", test_recursive_doc);
+  g_test_add_func ("/db/add_full", test_add_full);
 
   global_setup ();
 
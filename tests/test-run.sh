@@ -23,7 +23,7 @@ set -euo pipefail
 
 skip_without_bwrap
 
-echo "1..7"
+echo "1..8"
 
 setup_repo
 install_repo
@@ -51,6 +51,13 @@ assert_file_has_content $FL_DIR/exports/share/applications/mimeinfo.cache x-test
 assert_has_file $FL_DIR/exports/share/icons/hicolor/icon-theme.cache
 assert_has_file $FL_DIR/exports/share/icons/hicolor/index.theme
 
+# Verify that the changes are journaled
+assert_has_file $FL_DIR/.changes
+assert_file_has_content $FL_DIR/.changes "^deploy	runtime/org.test.Platform/$ARCH/master	"
+assert_file_has_content $FL_DIR/.changes "^deploy	app/org.test.Hello/$ARCH/master	$ID$"
+assert_file_has_content $FL_DIR/.changes "^modify-remote	test-repo	$"
+assert_file_has_content $FL_DIR/.changes "^make-current	app/org.test.Hello/$ARCH/master	$"
+
 $FLATPAK list ${U} | grep org.test.Hello > /dev/null
 $FLATPAK list ${U} -d | grep org.test.Hello | grep test-repo > /dev/null
 $FLATPAK list ${U} -d | grep org.test.Hello | grep current > /dev/null
@@ -64,6 +71,7 @@ echo "ok install"
 
 run org.test.Hello > hello_out
 assert_file_has_content hello_out '^Hello world, from a sandbox$'
+assert_has_file ${XDG_DATA_HOME}/flatpak/system-cache/contexts/org.test.Hello
 
 echo "ok hello"
 
@@ -72,6 +80,24 @@ assert_file_has_content fpi '^name=org.test.Hello$'
 
 echo "ok flatpak-info"
 
+run_sh sleep 5 &
+RUN_PID=$!
+for i in $(seq 50); do
+    if ${FLATPAK} ps | grep -q org.test.Hello; then
+        break
+    fi
+    sleep 0.1
+done
+${FLATPAK} ps > ps_out
+assert_file_has_content ps_out '^i[0-9a-f]\{8\} *[0-9]\+ *org.test.Hello'
+${FLATPAK} ps --show-details > ps_details
+assert_file_has_content ps_details "org.test.Hello.*runtime/org.test.Platform/$ARCH/master"
+wait $RUN_PID
+${FLATPAK} ps > ps_out
+assert_not_file_has_content ps_out org.test.Hello
+
+echo "ok ps"
+
 run_sh readlink /proc/self/ns/net > unshared_net_ns
 ARGS="--share=network" run_sh readlink /proc/self/ns/net > shared_net_ns
 assert_not_streq `cat unshared_net_ns` `readlink /proc/self/ns/net`
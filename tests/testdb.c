@@ -346,6 +346,152 @@ test_modify (void)
   }
 }
 
+static void
+assert_ids_by_value (FlatpakDb  *db,
+                     const char *data,
+                     const char *expected_id)
+{
+  g_autoptr(GVariant) data_v = g_variant_ref_sink (g_variant_new_string (data));
+  g_auto(GStrv) ids = flatpak_db_list_ids_by_value (db, data_v);
+
+  if (expected_id == NULL)
+    {
+      g_assert (ids[0] == NULL);
+    }
+  else
+    {
+      g_assert_cmpint (g_strv_length (ids), ==, 1);
+      g_assert_cmpstr (ids[0], ==, expected_id);
+    }
+}
+
+static void
+test_values (void)
+{
+  g_autoptr(FlatpakDb) db = NULL;
+  g_autoptr(FlatpakDb) db2 = NULL;
+  GError *error = NULL;
+  char tmpfile[] = "/tmp/testdbXXXXXX";
+  int fd;
+
+  db = create_test_db (FALSE);
+
+  assert_ids_by_value (db, "foo-data", "foo");
+  assert_ids_by_value (db, "bar-data", "bar");
+  assert_ids_by_value (db, "gazonk-data", NULL);
+
+  flatpak_db_update (db);
+
+  /* Change data, both in memory and in the serialized tables */
+  {
+    g_autoptr(FlatpakDbEntry) entry1 = NULL;
+    g_autoptr(FlatpakDbEntry) entry2 = NULL;
+
+    entry1 = flatpak_db_lookup (db, "foo");
+    entry2 = flatpak_db_entry_modify_data (entry1, g_variant_new_string ("gazonk-data"));
+    flatpak_db_set_entry (db, "foo", entry2);
+    flatpak_db_set_entry (db, "bar", NULL);
+  }
+
+  assert_ids_by_value (db, "foo-data", NULL);
+  assert_ids_by_value (db, "bar-data", NULL);
+  assert_ids_by_value (db, "gazonk-data", "foo");
+
+  flatpak_db_update (db);
+
+  fd = g_mkstemp (tmpfile);
+  close (fd);
+
+  flatpak_db_set_path (db, tmpfile);
+
+  flatpak_db_save_content (db, &error);
+  g_assert_no_error (error);
+
+  db2 = flatpak_db_new (tmpfile, TRUE, &error);
+  g_assert_no_error (error);
+  g_assert (db2 != NULL);
+
+  assert_ids_by_value (db2, "foo-data", NULL);
+  assert_ids_by_value (db2, "bar-data", NULL);
+  assert_ids_by_value (db2, "gazonk-data", "foo");
+
+  unlink (tmpfile);
+}
+
+static int
+count_ids_with_prefix (FlatpakDb  *db,
+                       const char *prefix)
+{
+  FlatpakDbIter iter;
+  const char *id;
+  int n = 0;
+
+  flatpak_db_iter_init (&iter, db, prefix);
+  while (flatpak_db_iter_next (&iter, &id))
+    {
+      if (prefix)
+        g_assert (g_str_has_prefix (id, prefix));
+      n++;
+    }
+
+  return n;
+}
+
+static void
+test_iter (void)
+{
+  g_autoptr(FlatpakDb) db = NULL;
+  g_autoptr(FlatpakDb) db2 = NULL;
+  g_autoptr(FlatpakDbEntry) entry = NULL;
+  GError *error = NULL;
+  char tmpfile[] = "/tmp/testdbXXXXXX";
+  int fd;
+
+  db = create_test_db (FALSE);
+
+  g_assert_cmpint (count_ids_with_prefix (db, NULL), ==, 2);
+  g_assert_cmpint (count_ids_with_prefix (db, "fo"), ==, 1);
+  g_assert_cmpint (count_ids_with_prefix (db, "b"), ==, 1);
+  g_assert_cmpint (count_ids_with_prefix (db, "x"), ==, 0);
+
+  entry = flatpak_db_entry_new (g_variant_new_string ("foo2-data"));
+  flatpak_db_set_entry (db, "foo2", entry);
+  flatpak_db_set_entry (db, "bar2", entry);
+  flatpak_db_update (db);
+
+  fd = g_mkstemp (tmpfile);
+  close (fd);
+
+  flatpak_db_set_path (db, tmpfile);
+
+  flatpak_db_save_content (db, &error);
+  g_assert_no_error (error);
+
+  db2 = flatpak_db_new (tmpfile, TRUE, &error);
+  g_assert_no_error (error);
+  g_assert (db2 != NULL);
+
+  unlink (tmpfile);
+
+  /* All in the serialized table */
+  g_assert_cmpint (count_ids_with_prefix (db2, NULL), ==, 4);
+  g_assert_cmpint (count_ids_with_prefix (db2, "foo"), ==, 2);
+  g_assert_cmpint (count_ids_with_prefix (db2, "foo2"), ==, 1);
+  g_assert_cmpint (count_ids_with_prefix (db2, "bar"), ==, 2);
+  g_assert_cmpint (count_ids_with_prefix (db2, "c"), ==, 0);
+  g_assert_cmpint (count_ids_with_prefix (db2, "zzz"), ==, 0);
+
+  /* Pending changes are overlaid on the table */
+  flatpak_db_set_entry (db2, "foo", NULL);
+  flatpak_db_set_entry (db2, "foo3", entry);
+  flatpak_db_set_entry (db2, "bar2", entry);
+
+  g_assert_cmpint (count_ids_with_prefix (db2, NULL), ==, 4);
+  g_assert_cmpint (count_ids_with_prefix (db2, "foo"), ==, 2);
+  g_assert_cmpint (count_ids_with_prefix (db2, "foo3"), ==, 1);
+  g_assert_cmpint (count_ids_with_prefix (db2, "bar"), ==, 2);
+}
+
 int
 main (int argc, char **argv)
 {
@@ -354,6 +500,8 @@ main (int argc, char **argv)
   g_test_add_func ("/db/open", test_db_open);
   g_test_add_func ("/db/serialize", test_serialize);
   g_test_add_func ("/db/modify", test_modify);
+  g_test_add_func ("/db/values", test_values);
+  g_test_add_func ("/db/iter", test_iter);
 
   return g_test_run ();
 }